@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <float.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "server/archive.h"
+
+using namespace std;
+using namespace homepower;
+
+void ShowHelp() {
+	fprintf(stderr, "archive <cmd> <file> [options]\n");
+	fprintf(stderr, "  cmd = info     Show the blocks and columns of the archive, and the min/max of every column\n");
+	fprintf(stderr, "        cat      Write the samples to stdout, as CSV\n");
+	fprintf(stderr, "        bench    Decode the samples, and report how long it took\n");
+	fprintf(stderr, "  --from <time>        Start of the time range (inclusive)\n");
+	fprintf(stderr, "  --to <time>          End of the time range (exclusive)\n");
+	fprintf(stderr, "  --columns <a,b,...>  Only these columns (default all)\n");
+	fprintf(stderr, "  A time is seconds since the unix epoch, or local time in the form 2021-06-30 or 2021-06-30T14:00:00\n");
+}
+
+bool ParseTime(const char* s, double& t) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	int n = sscanf(s, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n >= 3) {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		t           = (double) mktime(&tm);
+		return true;
+	}
+	char* end;
+	t = strtod(s, &end);
+	return *end == 0 && end != s;
+}
+
+void Info(ArchiveReader& r, double from, double to) {
+	uint64_t samples = 0;
+	uint64_t bytes   = 0;
+	for (const auto& b : r.Blocks) {
+		samples += b.Header.Count;
+		bytes += b.DiskBytes();
+	}
+	printf("%d columns, %d second blocks\n", (int) r.Columns.size(), r.BlockSeconds);
+	printf("%d blocks, %llu samples, %llu bytes", (int) r.Blocks.size(), (unsigned long long) samples, (unsigned long long) bytes);
+	if (samples != 0)
+		printf(" (%.2f bytes per sample)", (double) bytes / (double) samples);
+	printf("\n");
+	if (r.Blocks.size() != 0) {
+		char start[64], end[64];
+		time_t ts = (time_t) r.Blocks.front().Start();
+		time_t te = (time_t) r.Blocks.back().End();
+		strftime(start, sizeof(start), "%Y-%m-%d %H:%M:%S", localtime(&ts));
+		strftime(end, sizeof(end), "%Y-%m-%d %H:%M:%S", localtime(&te));
+		printf("From %s to %s\n", start, end);
+	}
+	printf("%d samples in the journal of the open block\n", (int) r.Tail.Times.size());
+
+	// The min and max of every block are in the index, so this doesn't decode anything.
+	// Blocks that are only partly inside the range count in full.
+	vector<float> lo(r.Columns.size(), FLT_MAX);
+	vector<float> hi(r.Columns.size(), -FLT_MAX);
+	for (const auto& b : r.Blocks) {
+		if (b.End() < from || b.Start() >= to)
+			continue;
+		for (size_t i = 0; i < r.Columns.size(); i++) {
+			lo[i] = min(lo[i], b.Columns[i].Min);
+			hi[i] = max(hi[i], b.Columns[i].Max);
+		}
+	}
+	printf("%-20s %12s %12s\n", "column", "min", "max");
+	for (size_t i = 0; i < r.Columns.size(); i++)
+		printf("%-20s %12g %12g\n", r.Columns[i].c_str(), lo[i], hi[i]);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		ShowHelp();
+		return 1;
+	}
+	string cmd  = argv[1];
+	string file = argv[2];
+	double from = 0;
+	double to   = 1e18;
+	string columnList;
+	for (int i = 3; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--from" && i + 1 < argc && ParseTime(argv[i + 1], from)) {
+			i++;
+		} else if (arg == "--to" && i + 1 < argc && ParseTime(argv[i + 1], to)) {
+			i++;
+		} else if (arg == "--columns" && i + 1 < argc) {
+			columnList = argv[i + 1];
+			i++;
+		} else {
+			fprintf(stderr, "Unrecognized option %s\n", arg.c_str());
+			ShowHelp();
+			return 1;
+		}
+	}
+
+	ArchiveReader r;
+	if (!r.Open(file))
+		return 1;
+
+	vector<int> columns;
+	if (columnList == "") {
+		for (size_t i = 0; i < r.Columns.size(); i++)
+			columns.push_back((int) i);
+	} else {
+		for (size_t start = 0; start <= columnList.size();) {
+			size_t comma = columnList.find(',', start);
+			if (comma == string::npos)
+				comma = columnList.size();
+			string name = columnList.substr(start, comma - start);
+			int    c    = r.ColumnIndex(name);
+			if (c == -1) {
+				fprintf(stderr, "Unknown column %s\n", name.c_str());
+				return 1;
+			}
+			columns.push_back(c);
+			start = comma + 1;
+		}
+	}
+
+	if (cmd == "info") {
+		Info(r, from, to);
+	} else if (cmd == "cat") {
+		static char outbuf[1 << 16];
+		setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+		printf("time");
+		for (int c : columns)
+			printf(",%s", r.Columns[c].c_str());
+		printf("\n");
+		r.Read(from, to, columns, [&](const ArchiveSamples& s) {
+			for (size_t i = 0; i < s.Times.size(); i++) {
+				printf("%.3f", s.Times[i]);
+				for (size_t j = 0; j < columns.size(); j++)
+					printf(",%g", s.Values[j][i]);
+				printf("\n");
+			}
+			return true;
+		});
+	} else if (cmd == "bench") {
+		auto     start   = chrono::steady_clock::now();
+		uint64_t samples = 0;
+		double   sum     = 0; // So that the decoding can't be optimized away
+		r.Read(from, to, columns, [&](const ArchiveSamples& s) {
+			samples += s.Times.size();
+			for (const auto& v : s.Values)
+				sum += v.back();
+			return true;
+		});
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		printf("Decoded %llu samples of %d columns in %.3f seconds (%.1f million values per second, checksum %g)\n",
+		       (unsigned long long) samples, (int) columns.size(), seconds, samples * (columns.size() + 1) / seconds / 1e6, sum);
+	} else {
+		ShowHelp();
+		return 1;
+	}
+	if (r.NCorrupt != 0) {
+		fprintf(stderr, "%llu blocks were corrupt, and skipped\n", (unsigned long long) r.NCorrupt);
+		return 1;
+	}
+	return 0;
+}
@@ -1,4 +1,4 @@
--- This content is duplicated inside monitor.cpp
+-- This content is duplicated inside server/dbSchema.cpp
 -- DROP TABLE IF EXISTS readings;
 CREATE TABLE IF NOT EXISTS readings (
 	time TIMESTAMP NOT NULL PRIMARY KEY,
@@ -18,5 +18,188 @@ CREATE TABLE IF NOT EXISTS readings (
 	pvV REAL,
 	pvW REAL,
 	unknown1 REAL,
-	heavy BOOLEAN
-);
\ No newline at end of file
+	heavy BOOLEAN,
+	deficitW REAL,
+	batW REAL,
+	gridW REAL,
+	totalLoadW REAL,
+	selfConsumption REAL
+);
+CREATE TABLE IF NOT EXISTS energy (
+	time TIMESTAMP NOT NULL,
+	period TEXT NOT NULL,
+	pvWh REAL,
+	loadWh REAL,
+	batChargeWh REAL,
+	batDischargeWh REAL,
+	heavyGridWh REAL,
+	PRIMARY KEY (time, period)
+);
+CREATE TABLE IF NOT EXISTS readings_1m (
+	time TIMESTAMP NOT NULL PRIMARY KEY,
+	count INTEGER,
+	acInV_avg REAL,
+	acInV_min REAL,
+	acInV_max REAL,
+	acInV_last REAL,
+	acInHz_avg REAL,
+	acInHz_min REAL,
+	acInHz_max REAL,
+	acInHz_last REAL,
+	acOutV_avg REAL,
+	acOutV_min REAL,
+	acOutV_max REAL,
+	acOutV_last REAL,
+	acOutHz_avg REAL,
+	acOutHz_min REAL,
+	acOutHz_max REAL,
+	acOutHz_last REAL,
+	loadVA_avg REAL,
+	loadVA_min REAL,
+	loadVA_max REAL,
+	loadVA_last REAL,
+	loadW_avg REAL,
+	loadW_min REAL,
+	loadW_max REAL,
+	loadW_last REAL,
+	loadP_avg REAL,
+	loadP_min REAL,
+	loadP_max REAL,
+	loadP_last REAL,
+	batV_avg REAL,
+	batV_min REAL,
+	batV_max REAL,
+	batV_last REAL,
+	batChA_avg REAL,
+	batChA_min REAL,
+	batChA_max REAL,
+	batChA_last REAL,
+	batP_avg REAL,
+	batP_min REAL,
+	batP_max REAL,
+	batP_last REAL,
+	temp_avg REAL,
+	temp_min REAL,
+	temp_max REAL,
+	temp_last REAL,
+	pvA_avg REAL,
+	pvA_min REAL,
+	pvA_max REAL,
+	pvA_last REAL,
+	pvV_avg REAL,
+	pvV_min REAL,
+	pvV_max REAL,
+	pvV_last REAL,
+	pvW_avg REAL,
+	pvW_min REAL,
+	pvW_max REAL,
+	pvW_last REAL,
+	heavy_avg REAL,
+	heavy_min REAL,
+	heavy_max REAL,
+	heavy_last REAL,
+	deficitW_avg REAL,
+	deficitW_min REAL,
+	deficitW_max REAL,
+	deficitW_last REAL,
+	batW_avg REAL,
+	batW_min REAL,
+	batW_max REAL,
+	batW_last REAL,
+	gridW_avg REAL,
+	gridW_min REAL,
+	gridW_max REAL,
+	gridW_last REAL,
+	totalLoadW_avg REAL,
+	totalLoadW_min REAL,
+	totalLoadW_max REAL,
+	totalLoadW_last REAL,
+	selfConsumption_avg REAL,
+	selfConsumption_min REAL,
+	selfConsumption_max REAL,
+	selfConsumption_last REAL
+);
+CREATE TABLE IF NOT EXISTS readings_1h (
+	time TIMESTAMP NOT NULL PRIMARY KEY,
+	count INTEGER,
+	acInV_avg REAL,
+	acInV_min REAL,
+	acInV_max REAL,
+	acInV_last REAL,
+	acInHz_avg REAL,
+	acInHz_min REAL,
+	acInHz_max REAL,
+	acInHz_last REAL,
+	acOutV_avg REAL,
+	acOutV_min REAL,
+	acOutV_max REAL,
+	acOutV_last REAL,
+	acOutHz_avg REAL,
+	acOutHz_min REAL,
+	acOutHz_max REAL,
+	acOutHz_last REAL,
+	loadVA_avg REAL,
+	loadVA_min REAL,
+	loadVA_max REAL,
+	loadVA_last REAL,
+	loadW_avg REAL,
+	loadW_min REAL,
+	loadW_max REAL,
+	loadW_last REAL,
+	loadP_avg REAL,
+	loadP_min REAL,
+	loadP_max REAL,
+	loadP_last REAL,
+	batV_avg REAL,
+	batV_min REAL,
+	batV_max REAL,
+	batV_last REAL,
+	batChA_avg REAL,
+	batChA_min REAL,
+	batChA_max REAL,
+	batChA_last REAL,
+	batP_avg REAL,
+	batP_min REAL,
+	batP_max REAL,
+	batP_last REAL,
+	temp_avg REAL,
+	temp_min REAL,
+	temp_max REAL,
+	temp_last REAL,
+	pvA_avg REAL,
+	pvA_min REAL,
+	pvA_max REAL,
+	pvA_last REAL,
+	pvV_avg REAL,
+	pvV_min REAL,
+	pvV_max REAL,
+	pvV_last REAL,
+	pvW_avg REAL,
+	pvW_min REAL,
+	pvW_max REAL,
+	pvW_last REAL,
+	heavy_avg REAL,
+	heavy_min REAL,
+	heavy_max REAL,
+	heavy_last REAL,
+	deficitW_avg REAL,
+	deficitW_min REAL,
+	deficitW_max REAL,
+	deficitW_last REAL,
+	batW_avg REAL,
+	batW_min REAL,
+	batW_max REAL,
+	batW_last REAL,
+	gridW_avg REAL,
+	gridW_min REAL,
+	gridW_max REAL,
+	gridW_last REAL,
+	totalLoadW_avg REAL,
+	totalLoadW_min REAL,
+	totalLoadW_max REAL,
+	totalLoadW_last REAL,
+	selfConsumption_avg REAL,
+	selfConsumption_min REAL,
+	selfConsumption_max REAL,
+	selfConsumption_last REAL
+);
@@ -2,14 +2,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <string>
-#include "json.hpp"
 #include "server/inverter.h"
+#include "server/encoders.h"
 
 using namespace std;
 using namespace homepower;
 
-nlohmann::json Record_QPIGS_ToJSON(Inverter::Record_QPIGS r);
-
 void ShowHelp() {
 	fprintf(stderr, "query <device> <cmd>\n");
 	fprintf(stderr, "  example device = /dev/hidraw0 (/dev/ttyUSB0 for RS232-to-USB adapter)\n");
@@ -25,14 +23,16 @@ int main(int argc, char** argv) {
 	inv.Devices = {argv[1]};
 	string cmd  = argv[2];
 	string response;
-	auto   r = inv.Execute(cmd, response);
+	auto   r = inv.Execute(cmd, response, 0);
 	printf("%s\n", response.c_str());
 
 	// special case processing for known commands
 	if (r == homepower::Inverter::Response::OK && cmd == "QPIGS") {
 		homepower::Inverter::Record_QPIGS out;
 		if (inv.Interpret(response, out)) {
-			printf("Interpreted response:\n%s\n", Record_QPIGS_ToJSON(out).dump(4).c_str());
+			string json;
+			AppendQPIGSJSON(json, out, true);
+			printf("Interpreted response:\n%s\n", json.c_str());
 		} else {
 			printf("Failed to interpret response\n");
 		}
@@ -40,30 +40,3 @@ int main(int argc, char** argv) {
 
 	return (int) r;
 }
-
-nlohmann::json Record_QPIGS_ToJSON(Inverter::Record_QPIGS r) {
-	return nlohmann::json({
-	    {"Raw", r.Raw},
-	    {"ACInV", r.ACInV},
-	    {"ACInHz", r.ACInHz},
-	    {"ACOutV", r.ACOutV},
-	    {"ACOutHz", r.ACOutHz},
-	    {"LoadVA", r.LoadVA},
-	    {"LoadW", r.LoadW},
-	    {"LoadP", r.LoadP},
-	    {"BusV", r.BusV},
-	    {"BatV", r.BatV},
-	    {"BatChA", r.BatChA},
-	    {"BatP", r.BatP},
-	    {"Temp", r.Temp},
-	    {"PvA", r.PvA},
-	    {"PvV", r.PvV},
-	    {"PvW", r.PvW},
-	    {"Unknown1", r.Unknown1},
-	    {"Unknown2", r.Unknown2},
-	    {"Unknown3", r.Unknown3},
-	    {"Unknown4", r.Unknown4},
-	    {"Unknown5", r.Unknown5},
-	    {"Unknown6", r.Unknown6},
-	});
-}
@@ -0,0 +1,53 @@
+#include "adaptiveSampler.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+double AdaptiveSampler::Update(double t, float loadW, float acInV, float pvW, bool heavy) {
+	if (!IsEnabled()) {
+		CurrentPeriod = IdlePeriod;
+		return CurrentPeriod;
+	}
+
+	bool   active  = false;
+	double dt      = t - PrevTime;
+	double elapsed = max(t - RefTime, RateSeconds);
+	if (HasPrev && dt > 0) {
+		active = fabs(loadW - RefLoadW) > LoadWPerSecond * elapsed ||
+		         fabs(acInV - RefACInV) > ACInVPerSecond * elapsed ||
+		         fabs(pvW - RefPvW) > PvWPerSecond * elapsed ||
+		         heavy != PrevHeavy;
+	}
+	if (HasPrev && CurrentPeriod == FastPeriod && dt > 0)
+		FastSeconds += dt;
+
+	if (active) {
+		if (t - LastActivityAt > HoldSeconds)
+			NBursts++;
+		LastActivityAt = t;
+	}
+
+	double quiet = t - LastActivityAt - HoldSeconds;
+	if (quiet <= 0)
+		CurrentPeriod = FastPeriod;
+	else if (quiet >= DecaySeconds)
+		CurrentPeriod = IdlePeriod;
+	else
+		CurrentPeriod = FastPeriod + (IdlePeriod - FastPeriod) * quiet / DecaySeconds;
+
+	if (!HasPrev || t - RefTime >= RateSeconds) {
+		RefTime  = t;
+		RefLoadW = loadW;
+		RefACInV = acInV;
+		RefPvW   = pvW;
+	}
+	HasPrev   = true;
+	PrevTime  = t;
+	PrevHeavy = heavy;
+	return CurrentPeriod;
+}
+
+} // namespace homepower
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace homepower {
+
+// AdaptiveSampler chooses how long to wait before the next inverter reading.
+// At night, nothing changes, and reading the inverter every half a second just burns
+// serial bandwidth and CPU. But when a big load switches on, or the grid goes down,
+// we want readings as fast as the link can deliver them.
+// So we watch the rate of change (per second) of the load, the grid voltage, and the
+// solar power. When any of them crosses its threshold, or the heavy loads have just
+// been switched, we drop to FastPeriod. After HoldSeconds without any activity, we
+// ramp back up to IdlePeriod, linearly over DecaySeconds.
+// The rates are measured against a reference reading, which we move forward once it is
+// RateSeconds old. Until then, a change of more than one second's worth of the threshold
+// counts as activity, however short the time between readings. If we compared consecutive
+// readings instead, the threshold would shrink with the period, and at a FastPeriod of 0.1
+// seconds, ordinary noise in the load would keep a burst going forever.
+class AdaptiveSampler {
+public:
+	double FastPeriod     = 0;   // Seconds between readings when signals are changing. Zero is as fast as the link allows.
+	double IdlePeriod     = 1;   // Seconds between readings when signals are flat
+	double HoldSeconds    = 10;  // Stay at FastPeriod for this long after the last activity
+	double DecaySeconds   = 10;  // After HoldSeconds, take this long to ramp from FastPeriod to IdlePeriod
+	float  LoadWPerSecond = 500; // Rate of change of LoadW that counts as activity
+	float  ACInVPerSecond = 50;  // Rate of change of ACInV that counts as activity
+	float  PvWPerSecond   = 500; // Rate of change of PvW that counts as activity
+	double RateSeconds    = 1;   // Shortest interval over which we measure the rates of change
+
+	uint64_t NBursts     = 0; // Number of times that we've switched from flat to active
+	double   FastSeconds = 0; // Total seconds that we've spent at FastPeriod
+
+	// Feed in a new reading, and get back the period to wait until the next one
+	double Update(double t, float loadW, float acInV, float pvW, bool heavy);
+
+	double Period() const { return CurrentPeriod; }
+	bool   IsEnabled() const { return FastPeriod < IdlePeriod; }
+
+private:
+	bool   HasPrev        = false;
+	double PrevTime       = 0;
+	bool   PrevHeavy      = false;
+	double RefTime        = 0; // Time of the reference reading that the rates are measured against
+	float  RefLoadW       = 0;
+	float  RefACInV       = 0;
+	float  RefPvW         = 0;
+	double LastActivityAt = -1e30; // Time of the last reading that crossed a threshold
+	double CurrentPeriod  = 1;
+};
+
+} // namespace homepower
@@ -0,0 +1,704 @@
+// So that an archive can grow past 2GB on a 32-bit Pi
+#define _FILE_OFFSET_BITS 64
+
+#include "archive.h"
+#include "crc32.h"
+#include <sys/types.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t ArchiveMagic   = 0x48504731; // HPG1
+static const uint32_t ArchiveVersion = 1;
+static const uint32_t BlockMagic     = 0x48504231; // HPB1
+static const uint32_t JournalMagic   = 0x48504a31; // HPJ1
+static const int      ColumnNameSize = 32;         // Column names are stored in fixed size, zero padded, fields
+static const int      MaxColumns     = 1000;
+
+// The archive starts with this, followed by the name of every column
+struct ArchiveFileHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t NumColumns;
+	uint32_t BlockSeconds;
+	uint32_t Crc; // CRC of this header (with Crc zero), and the column names
+};
+
+// A journal record is a magic, the time in milliseconds, a float for every column, and a CRC of the time and the floats
+static size_t JournalRecordSize(int numColumns) {
+	return 4 + 8 + 4 * numColumns + 4;
+}
+
+static void AddJournalRecord(vector<uint8_t>& buf, int64_t ms, const float* values, int numColumns) {
+	size_t n = buf.size();
+	buf.resize(n + JournalRecordSize(numColumns));
+	uint8_t* rec = &buf[n];
+	memcpy(rec, &JournalMagic, 4);
+	memcpy(rec + 4, &ms, 8);
+	memcpy(rec + 12, values, 4 * numColumns);
+	uint32_t crc = Crc32(rec + 4, 8 + 4 * numColumns);
+	memcpy(rec + 12 + 4 * numColumns, &crc, 4);
+}
+
+static string IndexFilename(const string& filename) {
+	return filename + ".idx";
+}
+
+static string JournalFilename(const string& filename) {
+	return filename + ".journal";
+}
+
+static uint64_t FileSize(FILE* f) {
+	fseeko(f, 0, SEEK_END);
+	return (uint64_t) ftello(f);
+}
+
+static size_t ColumnTableSize(size_t numColumns) {
+	return numColumns * sizeof(ArchiveColumnInfo);
+}
+
+static uint32_t BlockHeaderCrc(const ArchiveBlockHeader& h, const ArchiveColumnInfo* columns, size_t numColumns) {
+	ArchiveBlockHeader copy = h;
+	copy.HeaderCrc          = 0;
+	return Crc32(columns, ColumnTableSize(numColumns), Crc32(&copy, sizeof(copy)));
+}
+
+uint64_t ArchiveBlock::DiskBytes() const {
+	return sizeof(ArchiveBlockHeader) + ColumnTableSize(Columns.size()) + Header.Bytes;
+}
+
+// Reads the bitstreams written by ColumnEncoder, most significant bit first
+struct BitReader {
+	const uint8_t* P;
+	const uint8_t* End;
+	uint64_t       Buf     = 0; // The next NBuf bits, at the top of Buf
+	int            NBuf    = 0;
+	bool           Overrun = false;
+
+	BitReader(const uint8_t* p, const uint8_t* end) : P(p), End(end) {}
+
+	void Refill() {
+		while (NBuf <= 56 && P != End) {
+			Buf |= (uint64_t) *P++ << (56 - NBuf);
+			NBuf += 8;
+		}
+	}
+
+	// Read n bits, where 1 <= n <= 32
+	uint32_t Get(int n) {
+		if (NBuf < n) {
+			Refill();
+			if (NBuf < n) {
+				Overrun = true;
+				return 0;
+			}
+		}
+		uint32_t v = (uint32_t) (Buf >> (64 - n));
+		Buf <<= n;
+		NBuf -= n;
+		return v;
+	}
+};
+
+static void DecodeTimes(BitReader& r, int64_t startMs, uint32_t count, double* times) {
+	int64_t ms    = startMs;
+	int64_t delta = 0;
+	times[0]      = ms * 0.001;
+	for (uint32_t i = 1; i < count; i++) {
+		int64_t dod;
+		if (r.Get(1) == 0)
+			dod = 0;
+		else if (r.Get(1) == 0)
+			dod = (int64_t) r.Get(7) - 63;
+		else if (r.Get(1) == 0)
+			dod = (int64_t) r.Get(9) - 255;
+		else if (r.Get(1) == 0)
+			dod = (int64_t) r.Get(12) - 2047;
+		else
+			dod = (int32_t) r.Get(32);
+		delta += dod;
+		ms += delta;
+		times[i] = ms * 0.001;
+	}
+}
+
+static void DecodeValues(BitReader& r, uint32_t count, float* values) {
+	uint32_t v        = r.Get(32);
+	int      leading  = 0;
+	int      trailing = 0;
+	memcpy(&values[0], &v, 4);
+	for (uint32_t i = 1; i < count; i++) {
+		if (r.Get(1) != 0) {
+			if (r.Get(1) == 0) {
+				v ^= r.Get(32 - leading - trailing) << trailing;
+			} else {
+				leading  = (int) r.Get(5);
+				int len  = (int) r.Get(5) + 1;
+				trailing = 32 - leading - len;
+				v ^= r.Get(len) << trailing;
+			}
+		}
+		memcpy(&values[i], &v, 4);
+	}
+}
+
+// Read the valid records at the start of a journal. Returns the number of bytes that they occupy.
+static uint64_t ReadJournal(FILE* f, int numColumns, const function<void(int64_t ms, const float* values)>& emit) {
+	vector<uint8_t> rec(JournalRecordSize(numColumns));
+	vector<float>   values(numColumns);
+	uint64_t        good = 0;
+	fseeko(f, 0, SEEK_SET);
+	while (fread(rec.data(), rec.size(), 1, f) == 1) {
+		uint32_t magic, crc;
+		int64_t  ms;
+		memcpy(&magic, &rec[0], 4);
+		memcpy(&crc, &rec[rec.size() - 4], 4);
+		if (magic != JournalMagic || crc != Crc32(&rec[4], rec.size() - 8))
+			break;
+		memcpy(&ms, &rec[4], 8);
+		memcpy(values.data(), &rec[12], 4 * numColumns);
+		emit(ms, values.data());
+		good += rec.size();
+	}
+	return good;
+}
+
+// Read the block header at the current position of f, and check it against the CRC
+static bool ReadBlockHeader(FILE* f, size_t numColumns, ArchiveBlock& b) {
+	b.Columns.resize(numColumns);
+	return fread(&b.Header, sizeof(b.Header), 1, f) == 1 && b.Header.Magic == BlockMagic &&
+	       fread(b.Columns.data(), ColumnTableSize(numColumns), 1, f) == 1 &&
+	       BlockHeaderCrc(b.Header, b.Columns.data(), numColumns) == b.Header.HeaderCrc;
+}
+
+bool LoadArchiveIndex(FILE* data, const std::string& filename, std::vector<std::string>& columns, int& blockSeconds,
+                      std::vector<ArchiveBlock>& blocks, uint64_t& dataEnd, bool& indexOk) {
+	columns.clear();
+	blocks.clear();
+	uint64_t          fileSize = FileSize(data);
+	ArchiveFileHeader h;
+	fseeko(data, 0, SEEK_SET);
+	if (fread(&h, sizeof(h), 1, data) != 1 || h.Magic != ArchiveMagic || h.Version != ArchiveVersion || h.NumColumns == 0 ||
+	    h.NumColumns > MaxColumns) {
+		fprintf(stderr, "%s is not an archive, or it is from a different version\n", filename.c_str());
+		return false;
+	}
+	vector<char> names(h.NumColumns * ColumnNameSize);
+	uint32_t     crc = h.Crc;
+	h.Crc            = 0;
+	if (fread(names.data(), names.size(), 1, data) != 1 || crc != Crc32(names.data(), names.size(), Crc32(&h, sizeof(h)))) {
+		fprintf(stderr, "The header of archive %s is corrupt\n", filename.c_str());
+		return false;
+	}
+	for (uint32_t i = 0; i < h.NumColumns; i++)
+		columns.push_back(string(&names[i * ColumnNameSize], strnlen(&names[i * ColumnNameSize], ColumnNameSize)));
+	blockSeconds = (int) h.BlockSeconds;
+	dataEnd      = sizeof(h) + names.size();
+
+	// Take the index for as far as it agrees with the archive
+	indexOk  = true;
+	FILE* fi = fopen(IndexFilename(filename).c_str(), "rb");
+	if (fi) {
+		ArchiveBlock b;
+		while (fread(&b.Offset, sizeof(b.Offset), 1, fi) == 1) {
+			if (!ReadBlockHeader(fi, columns.size(), b) || b.Offset != dataEnd || b.Offset + b.DiskBytes() > fileSize) {
+				indexOk = false;
+				break;
+			}
+			blocks.push_back(b);
+			dataEnd += b.DiskBytes();
+		}
+		fclose(fi);
+	}
+
+	// Scan the rest of the archive, for blocks that didn't make it into the index
+	vector<uint8_t> payload;
+	while (dataEnd < fileSize) {
+		ArchiveBlock b;
+		b.Offset = dataEnd;
+		fseeko(data, (off_t) dataEnd, SEEK_SET);
+		if (!ReadBlockHeader(data, columns.size(), b) || b.Offset + b.DiskBytes() > fileSize)
+			break;
+		payload.resize(b.Header.Bytes);
+		if (fread(payload.data(), payload.size(), 1, data) != 1 || Crc32(payload.data(), payload.size()) != b.Header.PayloadCrc)
+			break;
+		blocks.push_back(b);
+		dataEnd += b.DiskBytes();
+		indexOk = false;
+	}
+	return true;
+}
+
+void ArchiveWriter::ColumnEncoder::Put(uint32_t v, int n) {
+	Acc = (Acc << n) | (n == 32 ? v : v & ((1u << n) - 1));
+	NAcc += n;
+	while (NAcc >= 8) {
+		NAcc -= 8;
+		Bits.push_back((uint8_t) (Acc >> NAcc));
+	}
+}
+
+void ArchiveWriter::ColumnEncoder::Finish() {
+	if (NAcc != 0)
+		Bits.push_back((uint8_t) (Acc << (8 - NAcc)));
+	NAcc = 0;
+}
+
+void ArchiveWriter::ColumnEncoder::Reset() {
+	Bits.clear();
+	Acc      = 0;
+	NAcc     = 0;
+	Prev     = 0;
+	Leading  = -1;
+	Trailing = 0;
+}
+
+ArchiveWriter::~ArchiveWriter() {
+	Close();
+}
+
+bool ArchiveWriter::Open(const std::string& filename, const std::vector<std::string>& columns, int blockSeconds) {
+	Close();
+	if (columns.size() == 0 || columns.size() > MaxColumns || blockSeconds < 60 || blockSeconds > 86400) {
+		fprintf(stderr, "Invalid archive columns or block size\n");
+		return false;
+	}
+	Filename     = filename;
+	NumColumns   = (int) columns.size();
+	BlockSeconds = blockSeconds;
+	LastMs       = 0;
+	Columns.resize(NumColumns);
+	ResetBlock();
+
+	Data = fopen(filename.c_str(), "r+b");
+	if (!Data && errno == ENOENT)
+		Data = fopen(filename.c_str(), "w+b");
+	if (!Data) {
+		fprintf(stderr, "Failed to open archive %s: %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	bool indexOk = true;
+	if (FileSize(Data) == 0) {
+		ArchiveFileHeader h;
+		h.Magic        = ArchiveMagic;
+		h.Version      = ArchiveVersion;
+		h.NumColumns   = (uint32_t) NumColumns;
+		h.BlockSeconds = (uint32_t) BlockSeconds;
+		h.Crc          = 0;
+		vector<char> names(NumColumns * ColumnNameSize, 0);
+		for (int i = 0; i < NumColumns; i++)
+			strncpy(&names[i * ColumnNameSize], columns[i].c_str(), ColumnNameSize - 1);
+		h.Crc = Crc32(names.data(), names.size(), Crc32(&h, sizeof(h)));
+		fseeko(Data, 0, SEEK_SET);
+		if (fwrite(&h, sizeof(h), 1, Data) != 1 || fwrite(names.data(), names.size(), 1, Data) != 1 || fflush(Data) != 0) {
+			fprintf(stderr, "Failed to write archive %s: %s\n", filename.c_str(), strerror(errno));
+			Close();
+			return false;
+		}
+		DataSize = sizeof(h) + names.size();
+		// Any index or journal belongs to an archive that is gone
+		remove(IndexFilename(filename).c_str());
+		remove(JournalFilename(filename).c_str());
+	} else {
+		vector<string>       existing;
+		vector<ArchiveBlock> blocks;
+		if (!LoadArchiveIndex(Data, filename, existing, BlockSeconds, blocks, DataSize, indexOk)) {
+			Close();
+			return false;
+		}
+		if (existing != columns) {
+			fprintf(stderr, "Archive %s was written with different columns\n", filename.c_str());
+			Close();
+			return false;
+		}
+		uint64_t size = FileSize(Data);
+		if (size > DataSize) {
+			fprintf(stderr, "Cutting %llu bytes of a torn block off the end of archive %s\n", (unsigned long long) (size - DataSize),
+			        filename.c_str());
+			fflush(Data);
+			if (ftruncate(fileno(Data), (off_t) DataSize) != 0) {
+				fprintf(stderr, "Failed to truncate archive %s: %s\n", filename.c_str(), strerror(errno));
+				Close();
+				return false;
+			}
+		}
+		if (!indexOk) {
+			FILE* fi = fopen(IndexFilename(filename).c_str(), "wb");
+			for (size_t i = 0; fi && i < blocks.size(); i++) {
+				fwrite(&blocks[i].Offset, sizeof(blocks[i].Offset), 1, fi);
+				fwrite(&blocks[i].Header, sizeof(blocks[i].Header), 1, fi);
+				fwrite(blocks[i].Columns.data(), ColumnTableSize(NumColumns), 1, fi);
+			}
+			if (fi)
+				fclose(fi);
+		}
+		if (blocks.size() != 0)
+			LastMs = blocks.back().Header.EndMs;
+	}
+
+	Index   = fopen(IndexFilename(filename).c_str(), "ab");
+	Journal = fopen(JournalFilename(filename).c_str(), "a+b");
+	if (!Index || !Journal) {
+		fprintf(stderr, "Failed to open the index or journal of archive %s: %s\n", filename.c_str(), strerror(errno));
+		Close();
+		return false;
+	}
+	if (!ReplayJournal()) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool ArchiveWriter::ReplayJournal() {
+	vector<uint8_t> keep;
+	uint64_t        good = ReadJournal(Journal, NumColumns, [&](int64_t ms, const float* values) {
+		if (ms <= LastMs)
+			return; // Already in a sealed block
+		if (Count != 0 && ms / (BlockSeconds * 1000LL) != BlockIndex) {
+			// This can't happen, because we truncate the journal when we seal a block, but if it
+			// does, the samples at the end of the journal are the ones that belong to the open block.
+			ResetBlock();
+			keep.clear();
+		}
+		Encode(ms, values);
+		AddJournalRecord(keep, ms, values, NumColumns);
+	});
+	if (good != FileSize(Journal) || keep.size() != good) {
+		// Rewrite the journal with only the samples of the open block, and without a torn record at the end
+		if (ftruncate(fileno(Journal), 0) != 0 || (keep.size() != 0 && fwrite(keep.data(), keep.size(), 1, Journal) != 1) ||
+		    fflush(Journal) != 0) {
+			fprintf(stderr, "Failed to rewrite the journal of archive %s: %s\n", Filename.c_str(), strerror(errno));
+			return false;
+		}
+	}
+	NSamples = 0;
+	return true;
+}
+
+void ArchiveWriter::Close() {
+	if (Journal)
+		Commit();
+	if (Data)
+		fclose(Data);
+	if (Index)
+		fclose(Index);
+	if (Journal)
+		fclose(Journal);
+	Data    = nullptr;
+	Index   = nullptr;
+	Journal = nullptr;
+	Uncommitted.clear();
+}
+
+void ArchiveWriter::ResetBlock() {
+	Times.Reset();
+	for (auto& c : Columns)
+		c.Reset();
+	BlockIndex  = -1;
+	Count       = 0;
+	StartMs     = 0;
+	PrevMs      = 0;
+	PrevDeltaMs = 0;
+	Finished    = false;
+}
+
+void ArchiveWriter::Encode(int64_t ms, const float* values) {
+	if (Count == 0) {
+		BlockIndex = ms / (BlockSeconds * 1000LL);
+		StartMs    = ms;
+	} else {
+		int64_t delta = ms - PrevMs;
+		int64_t dod   = delta - PrevDeltaMs;
+		if (dod == 0) {
+			Times.Put(0, 1);
+		} else if (dod >= -63 && dod <= 64) {
+			Times.Put(2, 2);
+			Times.Put((uint32_t) (dod + 63), 7);
+		} else if (dod >= -255 && dod <= 256) {
+			Times.Put(6, 3);
+			Times.Put((uint32_t) (dod + 255), 9);
+		} else if (dod >= -2047 && dod <= 2048) {
+			Times.Put(14, 4);
+			Times.Put((uint32_t) (dod + 2047), 12);
+		} else {
+			// A block is at most a day long, so this always fits
+			Times.Put(15, 4);
+			Times.Put((uint32_t) (int32_t) dod, 32);
+		}
+		PrevDeltaMs = delta;
+	}
+	PrevMs = ms;
+
+	for (int i = 0; i < NumColumns; i++) {
+		ColumnEncoder& c = Columns[i];
+		uint32_t       v;
+		memcpy(&v, &values[i], 4);
+		if (Count == 0) {
+			c.Put(v, 32);
+			c.Min = values[i];
+			c.Max = values[i];
+		} else {
+			uint32_t x = v ^ c.Prev;
+			if (x == 0) {
+				c.Put(0, 1);
+			} else {
+				int leading  = __builtin_clz(x);
+				int trailing = __builtin_ctz(x);
+				if (c.Leading >= 0 && leading >= c.Leading && trailing >= c.Trailing) {
+					// The changed bits fit inside the window of the previous value
+					c.Put(2, 2);
+					c.Put(x >> c.Trailing, 32 - c.Leading - c.Trailing);
+				} else {
+					int len = 32 - leading - trailing;
+					c.Put(3, 2);
+					c.Put((uint32_t) leading, 5);
+					c.Put((uint32_t) (len - 1), 5);
+					c.Put(x >> trailing, len);
+					c.Leading  = leading;
+					c.Trailing = trailing;
+				}
+			}
+			c.Min = min(c.Min, values[i]);
+			c.Max = max(c.Max, values[i]);
+		}
+		c.Prev = v;
+	}
+	Count++;
+	LastMs = ms;
+	NSamples++;
+}
+
+bool ArchiveWriter::Add(double time, const float* values) {
+	if (!IsOpen())
+		return false;
+	int64_t ms = llround(time * 1000);
+	if (ms <= LastMs)
+		return true;
+	if (Count != 0 && (Finished || ms / (BlockSeconds * 1000LL) != BlockIndex) && !Seal())
+		return false;
+	Encode(ms, values);
+	AddJournalRecord(Uncommitted, ms, values, NumColumns);
+	return true;
+}
+
+bool ArchiveWriter::Commit() {
+	if (!IsOpen())
+		return false;
+	if (Uncommitted.size() == 0)
+		return true;
+	// Flush all the way to the disk, because the caller is about to forget these samples
+	if (fwrite(Uncommitted.data(), Uncommitted.size(), 1, Journal) != 1 || fflush(Journal) != 0 || fdatasync(fileno(Journal)) != 0) {
+		fprintf(stderr, "Failed to write the journal of archive %s: %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	Uncommitted.clear();
+	return true;
+}
+
+bool ArchiveWriter::Seal() {
+	if (!IsOpen())
+		return false;
+	if (Count == 0)
+		return true;
+
+	ArchiveBlock b;
+	b.Offset = DataSize;
+	b.Columns.resize(NumColumns);
+	Times.Finish();
+	Finished       = true;
+	uint32_t bytes = (uint32_t) Times.Bits.size();
+	for (int i = 0; i < NumColumns; i++) {
+		Columns[i].Finish();
+		b.Columns[i].Min    = Columns[i].Min;
+		b.Columns[i].Max    = Columns[i].Max;
+		b.Columns[i].Offset = bytes;
+		bytes += (uint32_t) Columns[i].Bits.size();
+	}
+	vector<uint8_t> buf;
+	buf.reserve(sizeof(ArchiveBlockHeader) + ColumnTableSize(NumColumns) + bytes);
+	buf.resize(sizeof(ArchiveBlockHeader) + ColumnTableSize(NumColumns));
+	buf.insert(buf.end(), Times.Bits.begin(), Times.Bits.end());
+	for (const auto& c : Columns)
+		buf.insert(buf.end(), c.Bits.begin(), c.Bits.end());
+
+	ArchiveBlockHeader& h = b.Header;
+	memset(&h, 0, sizeof(h));
+	h.Magic      = BlockMagic;
+	h.Count      = Count;
+	h.StartMs    = StartMs;
+	h.EndMs      = PrevMs;
+	h.Bytes      = bytes;
+	h.PayloadCrc = Crc32(&buf[buf.size() - bytes], bytes);
+	h.HeaderCrc  = BlockHeaderCrc(h, b.Columns.data(), NumColumns);
+	memcpy(&buf[0], &h, sizeof(h));
+	memcpy(&buf[sizeof(h)], b.Columns.data(), ColumnTableSize(NumColumns));
+
+	fseeko(Data, (off_t) DataSize, SEEK_SET);
+	if (fwrite(buf.data(), buf.size(), 1, Data) != 1 || fflush(Data) != 0 || fdatasync(fileno(Data)) != 0) {
+		fprintf(stderr, "Failed to write to archive %s: %s\n", Filename.c_str(), strerror(errno));
+		// Cut off whatever we managed to write, so that the next attempt goes in the same place.
+		// If that fails too, the next Open will find the torn block, and cut it off.
+		// Our bitstreams are now padded, so the next sample must go into a new block (see Finished).
+		if (ftruncate(fileno(Data), (off_t) DataSize) != 0)
+			fprintf(stderr, "Failed to truncate archive %s: %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	DataSize += buf.size();
+	NSealed++;
+	NBytes += buf.size();
+
+	// If we crash before the index is written, the next Open rebuilds it. If we crash before the
+	// journal is truncated, the next Open ignores the samples in it that are already in the archive.
+	fwrite(&b.Offset, sizeof(b.Offset), 1, Index);
+	fwrite(buf.data(), sizeof(h) + ColumnTableSize(NumColumns), 1, Index);
+	fflush(Index);
+	fflush(Journal);
+	if (ftruncate(fileno(Journal), 0) != 0)
+		fprintf(stderr, "Failed to truncate the journal of archive %s: %s\n", Filename.c_str(), strerror(errno));
+	Uncommitted.clear();
+	ResetBlock();
+	return true;
+}
+
+void ArchiveWriter::PrintStats(FILE* f) {
+	fprintf(f, "Archive: %llu samples added, %llu blocks sealed, %llu bytes written\n", (unsigned long long) NSamples,
+	        (unsigned long long) NSealed, (unsigned long long) NBytes);
+	NSamples = 0;
+	NSealed  = 0;
+	NBytes   = 0;
+}
+
+ArchiveReader::~ArchiveReader() {
+	Close();
+}
+
+bool ArchiveReader::Open(const std::string& filename) {
+	Close();
+	Data = fopen(filename.c_str(), "rb");
+	if (!Data) {
+		fprintf(stderr, "Failed to open archive %s: %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	uint64_t dataEnd;
+	bool     indexOk;
+	if (!LoadArchiveIndex(Data, filename, Columns, BlockSeconds, Blocks, dataEnd, indexOk)) {
+		Close();
+		return false;
+	}
+
+	// Pick up the samples of the open block
+	int64_t lastMs = Blocks.size() == 0 ? 0 : Blocks.back().Header.EndMs;
+	Tail.Times.clear();
+	Tail.Values.assign(Columns.size(), vector<float>());
+	FILE* journal = fopen(JournalFilename(filename).c_str(), "rb");
+	if (journal) {
+		ReadJournal(journal, (int) Columns.size(), [&](int64_t ms, const float* values) {
+			if (ms <= lastMs)
+				return;
+			Tail.Times.push_back(ms * 0.001);
+			for (size_t i = 0; i < Columns.size(); i++)
+				Tail.Values[i].push_back(values[i]);
+			lastMs = ms;
+		});
+		fclose(journal);
+	}
+	return true;
+}
+
+void ArchiveReader::Close() {
+	if (Data)
+		fclose(Data);
+	Data = nullptr;
+	Columns.clear();
+	Blocks.clear();
+	Tail = ArchiveSamples();
+}
+
+int ArchiveReader::ColumnIndex(const std::string& name) const {
+	for (size_t i = 0; i < Columns.size(); i++) {
+		if (Columns[i] == name)
+			return (int) i;
+	}
+	return -1;
+}
+
+bool ArchiveReader::ReadBlock(size_t i, const std::vector<int>& columns, ArchiveSamples& s) {
+	const ArchiveBlock& b = Blocks[i];
+	uint32_t            n = b.Header.Count;
+	s.Times.resize(n);
+	s.Values.resize(columns.size());
+	Payload.resize(b.Header.Bytes);
+	fseeko(Data, (off_t) (b.Offset + sizeof(ArchiveBlockHeader) + ColumnTableSize(Columns.size())), SEEK_SET);
+	if (fread(Payload.data(), Payload.size(), 1, Data) != 1 || Crc32(Payload.data(), Payload.size()) != b.Header.PayloadCrc) {
+		NCorrupt++;
+		return false;
+	}
+
+	const uint8_t* p = Payload.data();
+	BitReader      tr(p, p + b.Columns[0].Offset);
+	DecodeTimes(tr, b.Header.StartMs, n, s.Times.data());
+	bool ok = !tr.Overrun;
+	for (size_t j = 0; j < columns.size(); j++) {
+		int      c   = columns[j];
+		uint32_t end = c + 1 < (int) Columns.size() ? b.Columns[c + 1].Offset : b.Header.Bytes;
+		if (b.Columns[c].Offset > end || end > b.Header.Bytes) {
+			ok = false;
+			break;
+		}
+		BitReader vr(p + b.Columns[c].Offset, p + end);
+		s.Values[j].resize(n);
+		DecodeValues(vr, n, s.Values[j].data());
+		ok = ok && !vr.Overrun;
+	}
+	if (!ok)
+		NCorrupt++;
+	return ok;
+}
+
+// Keep only the samples of s with start <= time < end
+static void Trim(ArchiveSamples& s, double start, double end) {
+	size_t first = lower_bound(s.Times.begin(), s.Times.end(), start) - s.Times.begin();
+	size_t last  = lower_bound(s.Times.begin(), s.Times.end(), end) - s.Times.begin();
+	if (first == 0 && last == s.Times.size())
+		return;
+	s.Times.erase(s.Times.begin() + last, s.Times.end());
+	s.Times.erase(s.Times.begin(), s.Times.begin() + first);
+	for (auto& v : s.Values) {
+		v.erase(v.begin() + last, v.end());
+		v.erase(v.begin(), v.begin() + first);
+	}
+}
+
+void ArchiveReader::Read(double start, double end, const std::vector<int>& columns, const std::function<bool(const ArchiveSamples& s)>& emit) {
+	// Find the first block that ends at or after start
+	size_t i = lower_bound(Blocks.begin(), Blocks.end(), start, [](const ArchiveBlock& b, double t) { return b.End() < t; }) - Blocks.begin();
+	ArchiveSamples s;
+	for (; i < Blocks.size() && Blocks[i].Start() < end; i++) {
+		if (!ReadBlock(i, columns, s))
+			continue;
+		if (Blocks[i].Start() < start || Blocks[i].End() >= end)
+			Trim(s, start, end);
+		if (s.Times.size() != 0 && !emit(s))
+			return;
+	}
+
+	if (Tail.Times.size() != 0) {
+		s.Times = Tail.Times;
+		s.Values.resize(columns.size());
+		for (size_t j = 0; j < columns.size(); j++)
+			s.Values[j] = Tail.Values[columns[j]];
+		Trim(s, start, end);
+		if (s.Times.size() != 0)
+			emit(s);
+	}
+}
+
+} // namespace homepower
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace homepower {
+
+// Every block in an archive starts with this, followed by an ArchiveColumnInfo for every column,
+// followed by Bytes of payload. Like our state files, we don't worry about endianness.
+struct ArchiveBlockHeader {
+	uint32_t Magic;      // HPB1
+	uint32_t Count;      // Number of samples in the block
+	int64_t  StartMs;    // Time of the first sample, in milliseconds since the unix epoch
+	int64_t  EndMs;      // Time of the last sample
+	uint32_t Bytes;      // Size of the payload
+	uint32_t PayloadCrc; // CRC of the payload
+	uint32_t HeaderCrc;  // CRC of this header (with HeaderCrc zero), and the column table that follows it
+	uint32_t Reserved;
+};
+
+struct ArchiveColumnInfo {
+	float    Min;
+	float    Max;
+	uint32_t Offset; // Byte offset of the column's bitstream in the payload. The timestamps come first, at offset zero.
+};
+
+// A block, as we know it from the index
+struct ArchiveBlock {
+	uint64_t                       Offset; // Of the block's header in the archive file
+	ArchiveBlockHeader             Header;
+	std::vector<ArchiveColumnInfo> Columns;
+
+	double   Start() const { return Header.StartMs * 0.001; }
+	double   End() const { return Header.EndMs * 0.001; }
+	uint64_t DiskBytes() const; // Header, column table, and payload
+};
+
+// A run of decoded samples. Values[i] holds the values of the i'th requested column.
+struct ArchiveSamples {
+	std::vector<double>             Times;
+	std::vector<std::vector<float>> Values;
+};
+
+// The archive is an append-only file of compressed readings, for keeping years of full resolution
+// history in much less space than a row per reading in a DB (typically a few bytes per reading,
+// instead of over a hundred).
+//
+// The file is a header with the names of the columns, followed by blocks. Every block holds the
+// samples of one fixed-duration slice of time (BlockSeconds, aligned to UTC). Inside a block, the
+// data is stored column by column, with the compression of Facebook's Gorilla paper:
+// - Timestamps (in milliseconds) are stored as the delta of the delta from the previous sample.
+//   Readings arrive at a steady rate, so this is usually a handful of bits.
+// - Every float is XORed with the previous value in its column. Unchanged values cost one bit, and
+//   a value that changes a little only stores the bits that differ.
+// A block is written once, when a sample arrives that belongs to the next block, so until then,
+// the samples of the open block live in RAM, and in a small journal file, which we append to on
+// every Commit, and truncate when the block is sealed. Everything on disk is covered by CRCs, and
+// a torn write at the end of the archive is detected and cut off when the writer reopens it.
+//
+// Alongside the archive, we keep an index file, which is a copy of every block's header, with the
+// min and max of every column. A reader loads the index, and only touches the blocks that overlap
+// the time range that it wants. The index can always be rebuilt from the archive, so if it's
+// missing or short (eg we crashed between writing a block and its index entry), we scan the archive.
+class ArchiveWriter {
+public:
+	uint64_t NSealed  = 0; // Blocks written since the last PrintStats
+	uint64_t NSamples = 0; // Samples added since the last PrintStats
+	uint64_t NBytes   = 0; // Bytes of blocks written since the last PrintStats
+
+	~ArchiveWriter();
+
+	// Open or create an archive. An existing archive must have the same columns. blockSeconds only
+	// matters when the archive is created, and must be between 60 and 86400.
+	bool Open(const std::string& filename, const std::vector<std::string>& columns, int blockSeconds = 3600);
+
+	// Close the archive. The open block stays in the journal, and is picked up by the next Open.
+	void Close();
+
+	bool IsOpen() const { return Data != nullptr; }
+
+	// Add a sample, with a value for every column. Samples that are not newer than LastTime are ignored.
+	// If the sample belongs to a later block than the open block, the open block is sealed first.
+	bool Add(double time, const float* values);
+
+	// Make the samples added since the last Commit durable, by appending them to the journal
+	bool Commit();
+
+	// Write the open block to the archive, even though its time is not up
+	bool Seal();
+
+	double LastTime() const { return LastMs * 0.001; } // Time of the newest sample, or zero if we have none
+	void   PrintStats(FILE* f);                         // Print and reset our counters
+
+private:
+	// A column of the open block, as it's being encoded
+	struct ColumnEncoder {
+		std::vector<uint8_t> Bits;
+		uint64_t             Acc      = 0; // Bits that don't yet make up a whole byte
+		int                  NAcc     = 0;
+		uint32_t             Prev     = 0; // Previous value
+		int                  Leading  = -1;
+		int                  Trailing = 0;
+		float                Min      = 0;
+		float                Max      = 0;
+
+		void Put(uint32_t v, int n); // Append the low n bits of v, where 1 <= n <= 32
+		void Finish();               // Pad to a whole byte
+		void Reset();
+	};
+
+	std::string                Filename;
+	FILE*                      Data         = nullptr;
+	FILE*                      Index        = nullptr;
+	FILE*                      Journal      = nullptr;
+	int                        BlockSeconds = 3600;
+	int                        NumColumns   = 0;
+	uint64_t                   DataSize     = 0;  // Bytes of sealed blocks and header in the archive
+	int64_t                    LastMs       = 0;  // Newest sample, sealed or open
+	int64_t                    BlockIndex   = -1; // Open block, as a multiple of BlockSeconds since the unix epoch
+	uint32_t                   Count        = 0;  // Samples in the open block
+	int64_t                    StartMs      = 0;  // First sample of the open block
+	int64_t                    PrevMs       = 0;
+	int64_t                    PrevDeltaMs  = 0;
+	bool                       Finished     = false; // The bitstreams of the open block have been padded by a failed Seal
+	ColumnEncoder              Times;
+	std::vector<ColumnEncoder> Columns;
+	std::vector<uint8_t>       Uncommitted; // Journal records of the samples added since the last Commit
+
+	void Encode(int64_t ms, const float* values);
+	void ResetBlock();
+	bool ReplayJournal();
+};
+
+// ArchiveReader reads an archive written by ArchiveWriter, including the samples that are still in
+// the journal of the open block.
+class ArchiveReader {
+public:
+	std::vector<std::string>  Columns;
+	int                       BlockSeconds = 0;
+	std::vector<ArchiveBlock> Blocks;           // Sealed blocks, in order of time
+	ArchiveSamples            Tail;             // Samples of the open block, from the journal, with all columns
+	uint64_t                  NCorrupt     = 0; // Blocks that failed their CRC check
+
+	~ArchiveReader();
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	// Index of the column with the given name, or -1
+	int ColumnIndex(const std::string& name) const;
+
+	// Decode the samples with start <= time < end, in order of time, and hand them to 'emit', one
+	// block at a time. 'columns' are the indices of the columns to decode, and the order of
+	// ArchiveSamples::Values. Blocks that are corrupt are skipped, and counted in NCorrupt.
+	// 'emit' can return false to stop early.
+	void Read(double start, double end, const std::vector<int>& columns, const std::function<bool(const ArchiveSamples& s)>& emit);
+
+	// Decode all the samples of one block
+	bool ReadBlock(size_t i, const std::vector<int>& columns, ArchiveSamples& s);
+
+private:
+	FILE*                Data = nullptr;
+	std::vector<uint8_t> Payload;
+};
+
+// Read the header of an archive, and find its blocks, from the index if we can, and by scanning
+// the archive if we can't. 'dataEnd' is the end of the last intact block. 'indexOk' is false if
+// the index is missing blocks. This is the part of opening an archive that the reader and writer
+// have in common.
+bool LoadArchiveIndex(FILE* data, const std::string& filename, std::vector<std::string>& columns, int& blockSeconds,
+                      std::vector<ArchiveBlock>& blocks, uint64_t& dataEnd, bool& indexOk);
+
+} // namespace homepower
@@ -0,0 +1,44 @@
+#include "archiveSink.h"
+#include "compressor.h"
+
+using namespace std;
+
+namespace homepower {
+
+ArchiveSink::ArchiveSink(const std::string& filename) : Filename(filename) {
+}
+
+std::vector<std::string> ArchiveSink::ColumnNames() {
+	vector<string> names;
+	for (int i = 0; i < ReadingCompressor::NumFields; i++)
+		names.push_back(ReadingCompressor::FieldName(i));
+	return names;
+}
+
+// The archive only holds readings, so the energy buckets and rollup rows are not written
+bool ArchiveSink::Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>&, const std::vector<RollupRow>&) {
+	if (!Writer.IsOpen() && !Writer.Open(Filename, ColumnNames()))
+		return false;
+	float values[ReadingCompressor::NumFields];
+	for (uint32_t i = 0; i < records.Size(); i++) {
+		const auto& r = records.Peek(i);
+		for (int j = 0; j < ReadingCompressor::NumFields; j++)
+			values[j] = ReadingCompressor::FieldValue(r, j);
+		if (!Writer.Add(r.Time, values)) {
+			// Reopen the archive on the next attempt, which cuts off anything that we left half written
+			Writer.Close();
+			return false;
+		}
+	}
+	if (!Writer.Commit()) {
+		Writer.Close();
+		return false;
+	}
+	return true;
+}
+
+void ArchiveSink::PrintStats(FILE* f) {
+	Writer.PrintStats(f);
+}
+
+} // namespace homepower
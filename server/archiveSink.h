@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "sink.h"
+#include "archive.h"
+
+namespace homepower {
+
+// ArchiveSink writes readings to a compressed archive (see ArchiveWriter), with the columns of the
+// 'readings' table. This is for keeping years of full resolution history on an SD card, which is
+// too much for SQLite. Like CsvSink, we don't write energy buckets or rollup rows.
+// The archive ignores readings that are not newer than the last one that it has, so a spool replay
+// can't add duplicates.
+class ArchiveSink : public Sink {
+public:
+	ArchiveSink(const std::string& filename);
+
+	const char* Name() const override { return "archive"; }
+	bool        Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) override;
+	void        PrintStats(FILE* f) override;
+
+	// The names of the archive's columns
+	static std::vector<std::string> ColumnNames();
+
+private:
+	std::string   Filename;
+	ArchiveWriter Writer;
+};
+
+} // namespace homepower
@@ -0,0 +1,174 @@
+#include "compressor.h"
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+struct CompressedField {
+	const char*     Name;
+	float Reading::*Field; // nullptr for heavy, which is a bool
+	float           MaxError;
+};
+
+// The columns of 'readings' (see HOMEPOWER_READINGS_COLUMNS), and default errors that are too small to see on a graph
+static const CompressedField Fields[ReadingCompressor::NumFields] = {
+#define COMPRESSED_REAL(column, member, maxError) {#column, &Reading::member, maxError},
+#define COMPRESSED_BOOL(column, member) {#column, nullptr, 0},
+    HOMEPOWER_READINGS_COLUMNS(COMPRESSED_REAL, COMPRESSED_BOOL)
+#undef COMPRESSED_REAL
+#undef COMPRESSED_BOOL
+};
+
+ReadingCompressor::ReadingCompressor() {
+	for (int i = 0; i < NumFields; i++)
+		MaxError[i] = Fields[i].MaxError;
+}
+
+const char* ReadingCompressor::FieldName(int i) {
+	return Fields[i].Name;
+}
+
+float ReadingCompressor::FieldValue(const Reading& r, int i) {
+	if (Fields[i].Field == nullptr)
+		return r.Heavy ? 1 : 0;
+	return r.*Fields[i].Field;
+}
+
+const char* ReadingCompressor::ModeName(CompressionModes mode) {
+	switch (mode) {
+	case CompressionModes::None: return "none";
+	case CompressionModes::Deadband: return "deadband";
+	case CompressionModes::SwingingDoor: return "sdt";
+	}
+	return "";
+}
+
+CompressionModes ReadingCompressor::ParseMode(const std::string& mode, bool& ok) {
+	ok = true;
+	if (mode == "none")
+		return CompressionModes::None;
+	if (mode == "deadband")
+		return CompressionModes::Deadband;
+	if (mode == "sdt")
+		return CompressionModes::SwingingDoor;
+	ok = false;
+	return CompressionModes::None;
+}
+
+bool ReadingCompressor::SetMaxError(const std::string& field, float maxError) {
+	for (int i = 0; i < NumFields; i++) {
+		if (field == Fields[i].Name) {
+			MaxError[i] = maxError;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ReadingCompressor::ParseMaxErrors(const std::string& settings) {
+	size_t start = 0;
+	while (start < settings.size()) {
+		size_t end = settings.find(',', start);
+		if (end == string::npos)
+			end = settings.size();
+		string item = settings.substr(start, end - start);
+		size_t eq   = item.find('=');
+		if (eq == string::npos || !SetMaxError(item.substr(0, eq), (float) atof(item.c_str() + eq + 1)))
+			return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+void ReadingCompressor::Keep(const Reading& r, std::vector<Reading>& keep) {
+	keep.push_back(r);
+	NOut++;
+	Anchor     = r;
+	HaveAnchor = true;
+	for (int i = 0; i < NumFields; i++) {
+		Lo[i] = -INFINITY;
+		Hi[i] = INFINITY;
+	}
+}
+
+// Returns true if the line from Anchor to r passes within MaxError of every reading since Anchor
+bool ReadingCompressor::Fits(const Reading& r) const {
+	double dt = r.Time - Anchor.Time;
+	if (dt <= 0 || dt > MaxGapSeconds)
+		return false;
+	for (int i = 0; i < NumFields; i++) {
+		double slope = (FieldValue(r, i) - FieldValue(Anchor, i)) / dt;
+		if (slope < Lo[i] || slope > Hi[i])
+			return false;
+	}
+	return true;
+}
+
+// Narrow the doors, so that the line to any future reading must also pass within MaxError of r
+void ReadingCompressor::Narrow(const Reading& r) {
+	double dt = r.Time - Anchor.Time;
+	for (int i = 0; i < NumFields; i++) {
+		double a = FieldValue(Anchor, i);
+		double v = FieldValue(r, i);
+		Lo[i]    = max(Lo[i], (v - MaxError[i] - a) / dt);
+		Hi[i]    = min(Hi[i], (v + MaxError[i] - a) / dt);
+	}
+}
+
+void ReadingCompressor::Add(const Reading& r, std::vector<Reading>& keep) {
+	NIn++;
+	if (Mode == CompressionModes::None || !HaveAnchor) {
+		Keep(r, keep);
+		return;
+	}
+
+	if (Mode == CompressionModes::Deadband) {
+		bool moved = r.Time - Anchor.Time > MaxGapSeconds || r.Time <= Anchor.Time;
+		for (int i = 0; i < NumFields && !moved; i++)
+			moved = fabs(FieldValue(r, i) - FieldValue(Anchor, i)) > MaxError[i];
+		if (moved) {
+			Keep(r, keep);
+			HavePrev = false;
+		} else {
+			Prev     = r;
+			HavePrev = true;
+		}
+		return;
+	}
+
+	if (HavePrev && Fits(r)) {
+		Narrow(r);
+		Prev = r;
+		return;
+	}
+	// The door has closed, so Prev is the last reading that we can reach with a straight line from Anchor
+	if (HavePrev)
+		Keep(Prev, keep);
+	HavePrev = false;
+	if (!Fits(r)) {
+		// Too long since Anchor, or the clock went backwards
+		Keep(r, keep);
+		return;
+	}
+	Narrow(r);
+	Prev     = r;
+	HavePrev = true;
+}
+
+void ReadingCompressor::Flush(std::vector<Reading>& keep) {
+	if (HavePrev)
+		Keep(Prev, keep);
+	HavePrev = false;
+}
+
+void ReadingCompressor::PrintStats(FILE* f) {
+	fprintf(f, "Compression (%s): %llu readings in, %llu kept, ratio %.1f\n", ModeName(Mode), (unsigned long long) NIn,
+	        (unsigned long long) NOut, Ratio());
+	NIn  = 0;
+	NOut = 0;
+}
+
+} // namespace homepower
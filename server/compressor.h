@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "reading.h"
+
+namespace homepower {
+
+enum class CompressionModes {
+	None,         // Keep every reading
+	Deadband,     // Keep a reading when any field has moved by more than its MaxError since the last kept reading
+	SwingingDoor, // Keep a reading when a straight line from the last kept reading can no longer pass within MaxError of every reading since
+};
+
+// ReadingCompressor sits between the monitor and the sinks, and drops the readings that don't tell
+// us anything new. Most fields (eg ACOutV, ACOutHz, BusV, Temp) hardly move from one reading to the
+// next, so a few rows per minute describe them as well as one row per second does.
+// Every field has a MaxError, and a dropped reading can always be reconstructed from the kept ones,
+// to within MaxError of every field:
+// - Deadband: hold the value of the most recent kept reading (a step graph).
+// - SwingingDoor: draw a straight line between the kept readings on either side (Grafana's normal
+//   line graph). This typically keeps far fewer readings than deadband, because it follows ramps.
+// Since the DB stores whole rows, we run the swinging door for all fields at once: the doors of every
+// field pivot on the same kept reading, and as soon as any field's door closes, we keep the reading
+// before it. Our doors are checked against the exact line to each candidate reading, so the error
+// bound holds for every dropped reading, and not only approximately, as in the textbook algorithm.
+// A reading is kept at least every MaxGapSeconds, so that the DB shows that we're alive, even when
+// nothing moves.
+class ReadingCompressor {
+public:
+	static const int NumFields = NumReadingsColumns; // The columns of 'readings', other than time
+
+	CompressionModes Mode          = CompressionModes::None; // None keeps every reading
+	double           MaxGapSeconds = 300;                    // Always keep a reading at least this often
+	float            MaxError[NumFields];                    // Maximum reconstruction error of each field, in the field's units
+	uint64_t         NIn           = 0;                      // Readings added since the last PrintStats
+	uint64_t         NOut          = 0;                      // Readings kept since the last PrintStats
+
+	ReadingCompressor();
+
+	// Add a reading. Readings that must be kept are appended to 'keep'. With SwingingDoor, the kept
+	// reading is usually the one before r, because we only know that we need it once r arrives.
+	void Add(const Reading& r, std::vector<Reading>& keep);
+
+	// Keep the most recent reading, if we haven't already. Call this before shutting down.
+	void Flush(std::vector<Reading>& keep);
+
+	// Set MaxError of the field with the given name (see FieldName). Returns false if there is no such field.
+	bool SetMaxError(const std::string& field, float maxError);
+
+	// Parse settings of the form "loadW=10,batV=0.05"
+	bool ParseMaxErrors(const std::string& settings);
+
+	double Ratio() const { return NOut == 0 ? 1 : (double) NIn / (double) NOut; } // Readings in per reading kept
+	void   PrintStats(FILE* f);                                                    // Print and reset NIn and NOut
+
+	static const char*      FieldName(int i);
+	static float            FieldValue(const Reading& r, int i);
+	static const char*      ModeName(CompressionModes mode);
+	static CompressionModes ParseMode(const std::string& mode, bool& ok);
+
+private:
+	bool    HaveAnchor = false;
+	bool    HavePrev   = false;
+	Reading Anchor;          // Most recent kept reading
+	Reading Prev;            // Most recent reading, if it hasn't been kept
+	double  Lo[NumFields];   // Lowest slope from Anchor that passes within MaxError of every reading after Anchor, up to Prev
+	double  Hi[NumFields];   // Highest such slope
+
+	void Keep(const Reading& r, std::vector<Reading>& keep);
+	bool Fits(const Reading& r) const;
+	void Narrow(const Reading& r);
+};
+
+} // namespace homepower
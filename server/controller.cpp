@@ -3,6 +3,7 @@
 #include "../bcm2835/bcm2835.h"
 #include "controller.h"
 #include "monitor.h"
+#include "timeUtils.h"
 
 using namespace std;
 
@@ -89,6 +90,8 @@ bool Controller::Start() {
 		return false;
 	}
 
+	Monitor->SetOverloadCallback([this](const Reading& r) { TripHeavyLoads(r); });
+
 	MustExit = false;
 	Thread   = thread([&]() {
 		fprintf(stderr, "Controller started\n");
@@ -104,6 +107,7 @@ bool Controller::Start() {
 }
 
 void Controller::Stop() {
+	Monitor->SetOverloadCallback(nullptr);
 	MustExit = true;
 	Thread.join();
 }
@@ -161,10 +165,27 @@ void Controller::SetHeavyLoadState(HeavyLoadState m, bool forceWrite) {
 	if (CurrentHeavyLoadState == m && !forceWrite)
 		return;
 
+	if (m == HeavyLoadState::Inverter && Trip.Pending() != 0) {
+		// The monitor has just seen an overload, and we haven't acknowledged it yet
+		fprintf(stderr, "Not switching heavy loads to inverter, because an overload trip is pending\n");
+		return;
+	}
+
 	fprintf(stderr, "Set heavy load state to %s\n", HeavyLoadStateToString(m));
 	if (!EnableGpio)
 		fprintf(stderr, "EnableGpio = false, so not changing GPIO state\n");
 
+	Trip.Claim();
+	WriteHeavyLoadPins(m);
+	Trip.Release();
+
+	CurrentHeavyLoadState = m;
+}
+
+// Write the GPIO pins of the heavy load contactors. The caller must have claimed the actuator.
+// Returns the wall time at which the heavy loads were disconnected from the inverter (or 0 if m is Inverter),
+// so that the overload trip can measure its latency.
+double Controller::WriteHeavyLoadPins(HeavyLoadState m) {
 	// Ideally, we'd use a switchover device that can do zero crossing,
 	// which means the switch waits until the AC signal crosses over 0 voltage.
 	// Since we can't control that, what we do is impose an extra delay
@@ -175,6 +196,7 @@ void Controller::SetHeavyLoadState(HeavyLoadState m, bool forceWrite) {
 	pause.tv_sec  = 0;
 	pause.tv_nsec = SwitchSleepMilliseconds * 1000 * 1000;
 
+	double offInverterAt = 0;
 	if (m == HeavyLoadState::Inverter) {
 		if (EnableGpio) {
 			bcm2835_gpio_clr(GpioPinGrid);
@@ -188,6 +210,7 @@ void Controller::SetHeavyLoadState(HeavyLoadState m, bool forceWrite) {
 		if (EnableGpio) {
 			bcm2835_gpio_clr(GpioPinInverter);
 		}
+		offInverterAt = WallTime();
 		nanosleep(&pause, nullptr);
 		if (EnableGpio) {
 			bcm2835_gpio_set(GpioPinGrid);
@@ -198,16 +221,81 @@ void Controller::SetHeavyLoadState(HeavyLoadState m, bool forceWrite) {
 			bcm2835_gpio_clr(GpioPinInverter);
 			bcm2835_gpio_clr(GpioPinGrid);
 		}
+		offInverterAt              = WallTime();
 		Monitor->IsHeavyOnInverter = false;
 	}
+	return offInverterAt;
+}
 
-	CurrentHeavyLoadState = m;
+// TripHeavyLoads is the overload fast path. The monitor calls it on its own thread, as soon as
+// a reading shows an overload while the heavy loads are on the inverter, so that we don't wait
+// up to 100ms for our own loop to notice IsOutputOverloaded or IsBatteryOverloaded, and then
+// make all of its other decisions first.
+// We latch a request, and if nobody else is busy with the GPIO pins, we switch the heavy loads
+// off right here. Switching off is just two GPIO writes, without the pause between contactors
+// that a switch to the grid needs, so we never sleep or block the monitor thread. We don't take
+// HeavyLoadLock either.
+// Run() still has the final say. It acknowledges the request on its next iteration, brings
+// CurrentHeavyLoadState up to date, moves the heavy loads to the grid if we have it, and does
+// the switch itself if we didn't get to.
+void Controller::TripHeavyLoads(const Reading& r) {
+	int64_t readingAt = (int64_t) (r.Time * 1e6);
+	if (!Trip.Request(readingAt))
+		return; // A trip is already pending
+	if (!Trip.TryClaim())
+		return; // The controller is busy switching, and it will see our request when it's done
+
+	double offInverterAt = WriteHeavyLoadPins(HeavyLoadState::Off);
+	Trip.Tripped((int) HeavyLoadState::Off, (int64_t) (offInverterAt * 1e6) - readingAt);
+	Trip.Release();
+}
+
+void Controller::AcknowledgeTrip(time_t now) {
+	int64_t readingAt = Trip.Pending();
+	if (readingAt == 0)
+		return;
+
+	lock_guard<mutex> lock(HeavyLoadLock);
+	Trip.Claim();
+	HeavyLoadState target    = Monitor->HasGridPower ? HeavyLoadState::Grid : HeavyLoadState::Off;
+	const char*    by        = "fast path";
+	int64_t        latency   = 0;
+	int            trippedTo = Trip.TakeTripped(latency);
+	if (trippedTo != -1) {
+		CurrentHeavyLoadState = (HeavyLoadState) trippedTo;
+		if (target != CurrentHeavyLoadState) {
+			// The fast path only switched the heavy loads off, so now we put them on the grid
+			WriteHeavyLoadPins(target);
+			CurrentHeavyLoadState = target;
+		}
+	} else if (CurrentHeavyLoadState == HeavyLoadState::Inverter) {
+		// The fast path found the actuator busy, so we do the switch ourselves
+		double offInverterAt  = WriteHeavyLoadPins(target);
+		CurrentHeavyLoadState = target;
+		latency               = (int64_t) (offInverterAt * 1e6) - readingAt;
+		by                    = "controller";
+	} else {
+		// The heavy loads were already off the inverter by the time the trip was requested
+		by = nullptr;
+	}
+	Trip.Release();
+	Trip.Acknowledge(readingAt);
+
+	if (by) {
+		HeavyCooloff.SignalAlarm(now);
+		TripLatencies.Add((double) latency / 1e6);
+		fprintf(stderr, "Overload: heavy loads moved to %s by the %s, %.1f ms after the reading\n",
+		        HeavyLoadStateToString(CurrentHeavyLoadState), by, (double) latency / 1000);
+		TripLatencies.Print(stderr, "Overload trip latency");
+	}
 }
 
 void Controller::Run() {
 	auto lastStatus    = 0;
 	auto lastChargeMsg = 0;
 	while (!MustExit) {
+		AcknowledgeTrip(time(nullptr));
+
 		time_t         now               = time(nullptr);
 		auto           nowP              = Now();
 		HeavyLoadState desiredHeavyState = HeavyLoadState::Grid;
@@ -219,6 +307,7 @@ void Controller::Run() {
 		bool  hasGridPower   = Monitor->HasGridPower;
 		float avgSolarW      = Monitor->AvgSolarW;
 		float avgLoadW       = Monitor->AvgLoadW;
+		float avgTotalLoadW  = Monitor->AvgTotalLoadW;
 		float heavyLoadW     = Monitor->HeavyLoadWatts; // This is an estimate that is only updated when we switch heavy loads on and off.
 
 		HeavyLoadLock.lock();
@@ -297,18 +386,18 @@ void Controller::Run() {
 			if (heavyState != HeavyLoadState::Inverter)
 				loadFactor = 1.1f;
 
-			// Compute an estimate of the total loads, including heavy loads.
+			// Estimate of the total loads, including heavy loads.
 			// If the heavy loads are currently on the inverter, then we don't need to guess, as the total is simply
-			// the load watts that we observe. But if the heavy loads are switched off, or are on the grid, then we
-			// must add in our estimate of the heavy load circuit to compute the total load.
-			float estimatedTotalLoadW = avgLoadW;
-			if (heavyState != HeavyLoadState::Inverter)
-				estimatedTotalLoadW += heavyLoadW;
+			// the load watts that we observe. But if the heavy loads are switched off, or are on the grid, then
+			// the monitor adds in our estimate of the heavy load circuit (see Reading::EstimatedTotalLoadW).
+			float estimatedTotalLoadW = avgTotalLoadW;
 
 			bool solarExceedsLoads = avgSolarW > estimatedTotalLoadW * loadFactor;
 
 			// This doesn't work. At night it just cycles between Inverter and Grid, quite often.
 			// This is the end for me, for hackish optimization. Time to build a real predictor!
+			// The first step of that predictor is Monitor::ExpectedWh(), which gives us the solar
+			// and load that we can expect over the next few hours, from our time-of-day profile.
 			//bool haveExcessBattery = batteryP > softBatteryGoal + 5.0f;
 
 			// This is a grace factor added so that we can do things like run a washing machine in the morning,
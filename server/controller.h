@@ -8,10 +8,12 @@
 
 #include "commands.h"
 #include "controllerUtils.h"
+#include "histogram.h"
 
 namespace homepower {
 
 class Monitor;
+struct Reading;
 
 enum class HeavyLoadMode {
 	AlwaysOn,    // Always keep heavy loads on (but power them from grid if we have no solar)
@@ -90,6 +92,10 @@ private:
 	time_t              LastHardSwitch             = 0; // Time when we last changed modes because battery was lower than hard limit
 	std::atomic<time_t> StormModeUntil;                 // Remain in storm mode until this time
 
+	// Overload trip fast path (see TripHeavyLoads)
+	TripLatch Trip;
+	Histogram TripLatencies; // Reading to GPIO latency of every trip. Only touched by the controller thread.
+
 	// The following 3 arrays are parallel
 	TimePoint MinChargeTimePoints[MaxNMinChargePoints];
 	float     MinChargeSoft[MaxNMinChargePoints];
@@ -102,6 +108,9 @@ private:
 
 	void      Run();
 	TimePoint Now();
+	void      TripHeavyLoads(const Reading& r);
+	void      AcknowledgeTrip(time_t now);
+	double    WriteHeavyLoadPins(HeavyLoadState m);
 };
 
 } // namespace homepower
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdint.h>
 #include <time.h>
 
 #include "monitorUtils.h"
@@ -122,4 +125,62 @@ struct Cooloff {
 	}
 };
 
+// TripLatch is the handshake between the overload fast path, which runs on the monitor thread,
+// and the controller thread, which has the final say over the heavy loads.
+// The fast path latches a trip request, and then tries to claim the actuator (our GPIO pins).
+// It never waits: if the controller holds the actuator, the request stays latched, and the
+// controller does the switch itself when it acknowledges the request. A request is only
+// cleared by Acknowledge, so a trip that arrives while the actuator is claimed is never lost.
+class TripLatch {
+public:
+	TripLatch() : RequestedAt(0), ActuatorBusy(false), TrippedTo(-1), LatencyMicros(0) {}
+
+	// Latch a trip, for the reading at readingAt (microseconds). Returns false if a trip is already pending.
+	bool Request(int64_t readingAt) {
+		int64_t none = 0;
+		return RequestedAt.compare_exchange_strong(none, readingAt);
+	}
+
+	// Time of the reading of the pending trip, or 0 if there is no trip pending
+	int64_t Pending() const { return RequestedAt; }
+
+	// Clear the pending trip, if it is still the one for the reading at readingAt
+	void Acknowledge(int64_t readingAt) { RequestedAt.compare_exchange_strong(readingAt, 0); }
+
+	// Claim the actuator without waiting. Returns false if somebody else holds it.
+	bool TryClaim() {
+		bool busy = false;
+		return ActuatorBusy.compare_exchange_strong(busy, true);
+	}
+
+	// Claim the actuator, spinning until it is free. The fast path only holds it for a few GPIO writes.
+	void Claim() {
+		while (ActuatorBusy.exchange(true))
+			std::this_thread::yield();
+	}
+
+	void Release() { ActuatorBusy = false; }
+
+	// Called by the fast path, while it holds the actuator, once it has switched the heavy loads to 'state'
+	void Tripped(int state, int64_t latencyMicros) {
+		LatencyMicros = latencyMicros;
+		TrippedTo     = state;
+	}
+
+	// Called by the controller, while it holds the actuator. Returns the state that the fast path
+	// switched to (and its latency), or -1 if the fast path didn't get to switch.
+	int TakeTripped(int64_t& latencyMicros) {
+		int state = TrippedTo.exchange(-1);
+		if (state != -1)
+			latencyMicros = LatencyMicros;
+		return state;
+	}
+
+private:
+	std::atomic<int64_t> RequestedAt;   // Wall time (microseconds) of the reading that asked for a trip, or 0 if there is no trip pending
+	std::atomic<bool>    ActuatorBusy;  // Claimed by whichever thread is writing to the GPIO pins
+	std::atomic<int>     TrippedTo;     // State that the fast path switched to, or -1 if it didn't get to switch
+	std::atomic<int64_t> LatencyMicros; // Time from the reading to the heavy loads leaving the inverter, of the fast path's last trip
+};
+
 } // namespace homepower
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace homepower {
+
+struct Crc32Table {
+	uint32_t T[256];
+	Crc32Table() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			T[i] = c;
+		}
+	}
+};
+
+// Standard CRC-32 (IEEE 802.3, as used by zlib), for checksumming the things that we write to disk.
+// To checksum data in pieces, pass the result of the previous call as 'crc'.
+inline uint32_t Crc32(const void* data, size_t len, uint32_t crc = 0) {
+	static const Crc32Table table;
+	const uint8_t*          p = (const uint8_t*) data;
+	crc                       = ~crc;
+	while (len-- != 0)
+		crc = table.T[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+} // namespace homepower
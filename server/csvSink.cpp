@@ -0,0 +1,102 @@
+#include "csvSink.h"
+#include "dbSchema.h"
+#include "encoders.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace homepower {
+
+CsvSink::CsvSink(const std::string& filename) : Filename(filename) {
+}
+
+CsvSink::~CsvSink() {
+	Close();
+}
+
+bool CsvSink::Open() {
+	F = fopen(Filename.c_str(), "a+");
+	if (!F) {
+		fprintf(stderr, "Failed to open %s: %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	fseek(F, 0, SEEK_END);
+	long size = ftell(F);
+
+	// Read the tail of the file, which is long enough to hold the last two lines
+	char   buf[2 * MaxReadingCSVBytes + 1];
+	long   start = size > (long) sizeof(buf) - 1 ? size - (long) sizeof(buf) + 1 : 0;
+	size_t n     = 0;
+	if (size != 0) {
+		fseek(F, start, SEEK_SET);
+		n = fread(buf, 1, sizeof(buf) - 1, F);
+	}
+
+	// A failed Write may have left a partial line at the end. Cut it off, so that the next line isn't glued onto it.
+	while (n != 0 && buf[n - 1] != '\n')
+		n--;
+	if (start + (long) n != size) {
+		fprintf(stderr, "Removing a partial line from the end of %s\n", Filename.c_str());
+		if (ftruncate(fileno(F), start + (long) n) != 0) {
+			fprintf(stderr, "Failed to truncate %s: %s\n", Filename.c_str(), strerror(errno));
+			Close();
+			return false;
+		}
+		size = start + (long) n;
+	}
+	fseek(F, 0, SEEK_END);
+	if (size == 0) {
+		fprintf(F, "%s\n", ReadingsColumnNames);
+		return fflush(F) == 0;
+	}
+
+	// Find the time of the last line
+	buf[n] = 0;
+	while (n != 0 && buf[n - 1] == '\n')
+		buf[--n] = 0;
+	char* last = strrchr(buf, '\n');
+	LastTime   = atof(last ? last + 1 : buf);
+	return true;
+}
+
+void CsvSink::Close() {
+	if (F)
+		fclose(F);
+	F = nullptr;
+}
+
+// A CSV file only holds readings, so the energy buckets and rollup rows are not written
+bool CsvSink::Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>&, const std::vector<RollupRow>&) {
+	if (!F && !Open())
+		return false;
+	Buf.resize(records.Size() * MaxReadingCSVBytes);
+	char*    p    = Buf.data();
+	uint32_t rows = 0;
+	for (uint32_t i = 0; i < records.Size(); i++) {
+		const auto& r = records.Peek(i);
+		if (r.Time <= LastTime)
+			continue;
+		p        = EncodeReadingCSV(p, r);
+		LastTime = r.Time;
+		rows++;
+	}
+	size_t n = p - Buf.data();
+	if ((n != 0 && fwrite(Buf.data(), n, 1, F) != 1) || fflush(F) != 0) {
+		fprintf(stderr, "Failed to write to %s: %s\n", Filename.c_str(), strerror(errno));
+		// We may have written a partial line, so the time of the last line is not to be trusted
+		Close();
+		return false;
+	}
+	NRows += rows;
+	return true;
+}
+
+void CsvSink::PrintStats(FILE* f) {
+	fprintf(f, "CSV: %llu readings written to %s\n", (unsigned long long) NRows, Filename.c_str());
+	NRows = 0;
+}
+
+} // namespace homepower
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "sink.h"
+
+namespace homepower {
+
+// CsvSink appends readings to a CSV file, with a header line, and the columns of the 'readings' table.
+// This is for people who don't want to run a DB at all, or who want a plain text copy of the readings
+// to pull into a spreadsheet. Energy buckets and rollup rows are not written, because they can be
+// computed from the readings.
+// A spool replay after a crash can hand us readings that we already have, so we remember the time
+// of the last line in the file, and skip anything that is not newer than it.
+// A failed write can leave a partial line at the end of the file, which we cut off when we reopen it.
+class CsvSink : public Sink {
+public:
+	CsvSink(const std::string& filename);
+	~CsvSink();
+
+	const char* Name() const override { return "csv"; }
+	bool        Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) override;
+	void        PrintStats(FILE* f) override;
+
+private:
+	std::string       Filename;
+	FILE*             F        = nullptr;
+	double            LastTime = 0; // Time of the last reading in the file
+	uint64_t          NRows    = 0; // Readings written since the last PrintStats
+	std::vector<char> Buf;          // The lines of the batch that we're writing
+
+	bool Open();
+	void Close();
+};
+
+} // namespace homepower
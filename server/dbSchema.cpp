@@ -0,0 +1,85 @@
+#include "dbSchema.h"
+#include "fields.h"
+#include "rollup.h"
+
+using namespace std;
+
+namespace homepower {
+
+// This content is duplicated inside dbcreate.sql (TestEncoders checks that they agree).
+// The columns of 'readings' are kept apart, because SQLiteSink creates a table with these columns for every day.
+// They come from HOMEPOWER_READINGS_COLUMNS, and are pasted together at compile time.
+#define DDL_REAL(column, member, maxError) ",\n\t" #column " REAL"
+#define DDL_BOOL(column, member) ",\n\t" #column " BOOLEAN"
+const char* ReadingsColumnsSQL = "(\n\ttime TIMESTAMP NOT NULL PRIMARY KEY" HOMEPOWER_READINGS_COLUMNS(DDL_REAL, DDL_BOOL) "\n)";
+#undef DDL_REAL
+#undef DDL_BOOL
+
+const char* CreateEnergySQL = R"(
+CREATE TABLE IF NOT EXISTS energy (
+	time TIMESTAMP NOT NULL,
+	period TEXT NOT NULL,
+	pvWh REAL,
+	loadWh REAL,
+	batChargeWh REAL,
+	batDischargeWh REAL,
+	heavyGridWh REAL,
+	PRIMARY KEY (time, period)
+);
+)";
+
+#define COLUMN_NAME(column, ...) "," #column
+#define COLUMN_PLACEHOLDER(column, ...) ",?"
+const char* ReadingsColumnNames  = "time" HOMEPOWER_READINGS_COLUMNS(COLUMN_NAME, COLUMN_NAME);
+const char* ReadingsPlaceholders = "?" HOMEPOWER_READINGS_COLUMNS(COLUMN_PLACEHOLDER, COLUMN_PLACEHOLDER);
+#undef COLUMN_NAME
+#undef COLUMN_PLACEHOLDER
+
+std::string CreateReadingsSQL(const std::string& table) {
+	return "CREATE TABLE IF NOT EXISTS " + table + " " + ReadingsColumnsSQL;
+}
+
+static const char* RollupStats[] = {"avg", "min", "max", "last"};
+
+std::string CreateRollupSQL(const std::string& table) {
+	string sql = "CREATE TABLE IF NOT EXISTS " + table + " (\n\ttime TIMESTAMP NOT NULL PRIMARY KEY,\n\tcount INTEGER";
+	for (int i = 0; i < RollupRow::NumColumns; i++) {
+		for (const char* stat : RollupStats)
+			sql += string(",\n\t") + Rollup::ColumnName(i) + "_" + stat + " REAL";
+	}
+	sql += "\n)";
+	return sql;
+}
+
+std::string RollupColumnNames() {
+	string names = "time,count";
+	for (int i = 0; i < RollupRow::NumColumns; i++) {
+		for (const char* stat : RollupStats)
+			names += string(",") + Rollup::ColumnName(i) + "_" + stat;
+	}
+	return names;
+}
+
+std::string RollupUpsertClause() {
+	string sql = " ON CONFLICT(time) DO UPDATE SET count = excluded.count";
+	for (int i = 0; i < RollupRow::NumColumns; i++) {
+		for (const char* stat : RollupStats) {
+			string name = string(Rollup::ColumnName(i)) + "_" + stat;
+			sql += ", " + name + " = excluded." + name;
+		}
+	}
+	return sql;
+}
+
+// Columns that were added to 'readings' after it was first created.
+// CREATE TABLE IF NOT EXISTS won't add these to an existing table, so we add them ourselves.
+const char* ReadingsAddedColumns[] = {
+    "deficitW",
+    "batW",
+    "gridW",
+    "totalLoadW",
+    "selfConsumption",
+};
+const int NumReadingsAddedColumns = sizeof(ReadingsAddedColumns) / sizeof(ReadingsAddedColumns[0]);
+
+} // namespace homepower
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+namespace homepower {
+
+// The parenthesized column definitions of 'readings', and the CREATE TABLE statement of 'energy'.
+// This content is duplicated inside dbcreate.sql
+extern const char* ReadingsColumnsSQL;
+extern const char* CreateEnergySQL;
+
+// CREATE TABLE IF NOT EXISTS statement for a table with the columns of 'readings'
+std::string CreateReadingsSQL(const std::string& table);
+
+// Comma separated names of every column of 'readings'
+extern const char* ReadingsColumnNames;
+
+// "?,?,...", with a parameter for every column of 'readings'
+extern const char* ReadingsPlaceholders;
+
+// CREATE TABLE IF NOT EXISTS statement for a rollup table (readings_1m or readings_1h).
+// Every column of readings that we summarize has an _avg, _min, _max and _last column.
+// This content is duplicated inside dbcreate.sql
+std::string CreateRollupSQL(const std::string& table);
+
+// Comma separated names of every column of a rollup table, in the order of the CREATE TABLE statement
+std::string RollupColumnNames();
+
+// ON CONFLICT clause that overwrites an existing rollup row. A bucket can be written twice, if it was
+// backfilled from 'readings' before the live copy of it closed, in which case the live copy wins.
+std::string RollupUpsertClause();
+
+// Columns that were added to 'readings' after it was first created.
+// CREATE TABLE IF NOT EXISTS won't add these to an existing table, so we add them ourselves.
+extern const char* ReadingsAddedColumns[];
+extern const int   NumReadingsAddedColumns;
+
+} // namespace homepower
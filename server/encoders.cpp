@@ -0,0 +1,76 @@
+#include "encoders.h"
+#include <string.h>
+
+namespace homepower {
+
+char* EncodeReadingCSV(char* p, const Reading& r) {
+	p = FormatFixed3(p, r.Time);
+#define CSV_REAL(column, member, maxError) \
+	*p++ = ',';                            \
+	p    = FormatFloat(p, r.member);
+#define CSV_BOOL(column, member) \
+	*p++ = ',';                  \
+	*p++ = r.member ? '1' : '0';
+	HOMEPOWER_READINGS_COLUMNS(CSV_REAL, CSV_BOOL)
+#undef CSV_REAL
+#undef CSV_BOOL
+	*p++ = '\n';
+	return p;
+}
+
+// The longest key, plus its quotes and colon, and the separator before it
+static const size_t MaxJSONKeyBytes = 32;
+
+size_t MaxQPIGSJSONBytes(const Inverter::Record_QPIGS& r) {
+	size_t n = 4 + MaxJSONKeyBytes + r.Raw.size() * 6 + 2;
+#define JSON_MAX_NUM(member) n += MaxJSONKeyBytes + MaxFormatNumberBytes;
+#define JSON_MAX_TEXT(member) n += MaxJSONKeyBytes + r.member.size() * 6 + 2;
+	HOMEPOWER_QPIGS_FIELDS(JSON_MAX_NUM, JSON_MAX_TEXT)
+#undef JSON_MAX_NUM
+#undef JSON_MAX_TEXT
+	return n;
+}
+
+// Write the separator before a key, and the key. If pretty is true, the colon is followed by a space.
+static char* JSONKey(char* p, const char* sep, size_t sepLen, const char* key, size_t keyLen, bool pretty) {
+	memcpy(p, sep, sepLen);
+	p += sepLen;
+	*p++ = '"';
+	memcpy(p, key, keyLen);
+	p += keyLen;
+	*p++ = '"';
+	*p++ = ':';
+	if (pretty)
+		*p++ = ' ';
+	return p;
+}
+
+char* EncodeQPIGSJSON(char* p, const Inverter::Record_QPIGS& r, bool pretty) {
+	const char* first  = pretty ? "{\n    " : "{";
+	const char* next   = pretty ? ",\n    " : ",";
+	size_t      sepLen = pretty ? 6 : 1;
+	p                  = JSONKey(p, first, sepLen, "Raw", 3, pretty);
+	p                  = FormatJSONString(p, r.Raw.data(), r.Raw.size());
+#define JSON_NUM(member)                                                 \
+	p = JSONKey(p, next, sepLen, #member, sizeof(#member) - 1, pretty); \
+	p = FormatJSONNumber(p, r.member);
+#define JSON_TEXT(member)                                                \
+	p = JSONKey(p, next, sepLen, #member, sizeof(#member) - 1, pretty); \
+	p = FormatJSONString(p, r.member.data(), r.member.size());
+	HOMEPOWER_QPIGS_FIELDS(JSON_NUM, JSON_TEXT)
+#undef JSON_NUM
+#undef JSON_TEXT
+	if (pretty)
+		*p++ = '\n';
+	*p++ = '}';
+	return p;
+}
+
+void AppendQPIGSJSON(std::string& s, const Inverter::Record_QPIGS& r, bool pretty) {
+	size_t n = s.size();
+	s.resize(n + MaxQPIGSJSONBytes(r));
+	char* end = EncodeQPIGSJSON(&s[n], r, pretty);
+	s.resize(end - s.data());
+}
+
+} // namespace homepower
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+#include "reading.h"
+#include "fastFormat.h"
+
+namespace homepower {
+
+// Text encoders of our records, generated from the field lists in fields.h.
+// They write into a buffer that the caller has reserved, using the functions of fastFormat.h,
+// instead of printf and string concatenation, because the CSV sink runs them for every reading,
+// on a Pi.
+
+// Upper bound on the size of a line written by EncodeReadingCSV
+static const size_t MaxReadingCSVBytes = (NumReadingsColumns + 1) * (MaxFormatNumberBytes + 1) + 1;
+
+// Write r as a line of CSV, with the columns of ReadingsColumnNames, and a trailing newline
+char* EncodeReadingCSV(char* p, const Reading& r);
+
+// Upper bound on the size of EncodeQPIGSJSON's output for r
+size_t MaxQPIGSJSONBytes(const Inverter::Record_QPIGS& r);
+
+// Write r as a JSON object, with Raw, and the fields of the QPIGS response.
+// If pretty is true, every field is on a line of its own.
+char* EncodeQPIGSJSON(char* p, const Inverter::Record_QPIGS& r, bool pretty);
+
+// Append EncodeQPIGSJSON's output to s
+void AppendQPIGSJSON(std::string& s, const Inverter::Record_QPIGS& r, bool pretty);
+
+} // namespace homepower
@@ -0,0 +1,165 @@
+#include "energy.h"
+#include "stateFile.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+const char* EnergyPeriodToString(EnergyPeriod p) {
+	switch (p) {
+	case EnergyPeriod::Hour: return "hour";
+	case EnergyPeriod::Day: return "day";
+	}
+	return "INVALID";
+}
+
+void EnergyTotals::Integrate(const EnergyPower& a, const EnergyPower& b, double seconds) {
+	double hours = seconds / 3600.0;
+	PvWh += 0.5 * (a.PvW + b.PvW) * hours;
+	LoadWh += 0.5 * (a.LoadW + b.LoadW) * hours;
+	BatChargeWh += 0.5 * (a.BatChargeW + b.BatChargeW) * hours;
+	BatDischargeWh += 0.5 * (a.BatDischargeW + b.BatDischargeW) * hours;
+	HeavyGridWh += 0.5 * (a.HeavyGridW + b.HeavyGridW) * hours;
+}
+
+static EnergyPower Lerp(const EnergyPower& a, const EnergyPower& b, float alpha) {
+	EnergyPower p;
+	p.PvW           = a.PvW + (b.PvW - a.PvW) * alpha;
+	p.LoadW         = a.LoadW + (b.LoadW - a.LoadW) * alpha;
+	p.BatChargeW    = a.BatChargeW + (b.BatChargeW - a.BatChargeW) * alpha;
+	p.BatDischargeW = a.BatDischargeW + (b.BatDischargeW - a.BatDischargeW) * alpha;
+	p.HeavyGridW    = a.HeavyGridW + (b.HeavyGridW - a.HeavyGridW) * alpha;
+	return p;
+}
+
+// We align hours to local time, for the sake of timezones that are not a whole number of hours from UTC
+time_t EnergyCounter::StartOfHour(time_t t) {
+	tm lt;
+	localtime_r(&t, &lt);
+	time_t local = t + lt.tm_gmtoff;
+	return t - (local % 3600);
+}
+
+time_t EnergyCounter::StartOfDay(time_t t) {
+	tm lt;
+	localtime_r(&t, &lt);
+	lt.tm_hour  = 0;
+	lt.tm_min   = 0;
+	lt.tm_sec   = 0;
+	lt.tm_isdst = -1;
+	return mktime(&lt);
+}
+
+void EnergyCounter::StartDay(time_t t) {
+	DayStart = StartOfDay(t);
+	// Days can be 23 or 25 hours long, when daylight saving starts or ends
+	DayEnd = StartOfDay(DayStart + 26 * 3600);
+}
+
+void EnergyCounter::Add(double t, const EnergyPower& p, std::vector<EnergyBucket>& closed) {
+	if (HourStart == 0) {
+		HourStart = StartOfHour((time_t) t);
+		StartDay((time_t) t);
+	}
+
+	if (HaveLast && t > LastTime && t - LastTime <= MaxGapSeconds) {
+		// Split the interval at hour and day boundaries
+		double      t0 = LastTime;
+		EnergyPower p0 = Last;
+		while (true) {
+			time_t boundary = std::min(HourStart + 3600, DayEnd);
+			if (t <= (double) boundary) {
+				Integrate(t0, p0, t, p);
+				break;
+			}
+			EnergyPower pb = Lerp(Last, p, (float) (((double) boundary - LastTime) / (t - LastTime)));
+			Integrate(t0, p0, (double) boundary, pb);
+			Roll(boundary, closed);
+			t0 = (double) boundary;
+			p0 = pb;
+		}
+	}
+	Roll((time_t) t, closed);
+
+	HaveLast = true;
+	LastTime = t;
+	Last     = p;
+}
+
+void EnergyCounter::Integrate(double t0, const EnergyPower& p0, double t1, const EnergyPower& p1) {
+	Hour.Integrate(p0, p1, t1 - t0);
+	Day.Integrate(p0, p1, t1 - t0);
+}
+
+// If t is in a new hour or day, then close the current bucket(s)
+void EnergyCounter::Roll(time_t t, std::vector<EnergyBucket>& closed) {
+	bool hourEnded = t >= HourStart + 3600;
+	bool dayEnded  = t >= DayEnd;
+	if (!hourEnded && !dayEnded)
+		return;
+
+	if (hourEnded)
+		closed.push_back({HourStart, EnergyPeriod::Hour, Hour});
+	// The running total for the day is emitted at the end of every hour
+	closed.push_back({DayStart, EnergyPeriod::Day, Day});
+
+	if (hourEnded) {
+		Hour      = EnergyTotals();
+		HourStart = StartOfHour(t);
+	}
+	if (dayEnded) {
+		Day = EnergyTotals();
+		StartDay(t);
+	}
+}
+
+// On-disk format of EnergyCounter
+struct EnergyState {
+	int64_t      HourStart;
+	int64_t      DayStart;
+	double       LastTime;
+	uint32_t     HaveLast;
+	uint32_t     Padding;
+	EnergyTotals Hour;
+	EnergyTotals Day;
+	EnergyPower  Last;
+	uint32_t     Padding2;
+};
+
+static const uint32_t EnergyStateMagic   = 0x48504531; // HPE1
+static const uint32_t EnergyStateVersion = 3;
+
+bool EnergyCounter::Save(const std::string& filename) const {
+	EnergyState s = {};
+	s.HourStart   = HourStart;
+	s.DayStart    = DayStart;
+	s.LastTime    = LastTime;
+	s.HaveLast    = HaveLast ? 1 : 0;
+	s.Hour        = Hour;
+	s.Day         = Day;
+	s.Last        = Last;
+	return SaveStateFile(filename, EnergyStateMagic, EnergyStateVersion, &s, sizeof(s));
+}
+
+bool EnergyCounter::Load(const std::string& filename, time_t now, std::vector<EnergyBucket>& closed) {
+	EnergyState s;
+	if (!LoadStateFile(filename, EnergyStateMagic, EnergyStateVersion, &s, sizeof(s)))
+		return false;
+
+	HourStart = (time_t) s.HourStart;
+	StartDay((time_t) s.DayStart);
+	LastTime = s.LastTime;
+	HaveLast = s.HaveLast != 0;
+	Hour     = s.Hour;
+	Day      = s.Day;
+	Last     = s.Last;
+
+	// Close whatever has ended while we were down
+	Roll(now, closed);
+	return true;
+}
+
+} // namespace homepower
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+namespace homepower {
+
+// Instantaneous power flows, in watts
+struct EnergyPower {
+	float PvW           = 0;
+	float LoadW         = 0;
+	float BatChargeW    = 0;
+	float BatDischargeW = 0;
+	float HeavyGridW    = 0; // Estimated power drawn by heavy loads while they are on the grid
+};
+
+// Accumulated energy, in watt-hours
+struct EnergyTotals {
+	double PvWh           = 0;
+	double LoadWh         = 0;
+	double BatChargeWh    = 0;
+	double BatDischargeWh = 0;
+	double HeavyGridWh    = 0;
+
+	void Integrate(const EnergyPower& a, const EnergyPower& b, double seconds);
+};
+
+enum class EnergyPeriod {
+	Hour,
+	Day,
+};
+
+const char* EnergyPeriodToString(EnergyPeriod p);
+
+// An hour or a day of energy totals. Day buckets are emitted every hour, with the
+// running total for the day, so consumers must treat them as upserts.
+struct EnergyBucket {
+	time_t       Start;
+	EnergyPeriod Period;
+	EnergyTotals Totals;
+};
+
+// EnergyCounter integrates power into energy as samples arrive, so that we don't need
+// to scan all of the raw readings to figure out how many kWh we used today.
+// We use the trapezoidal rule over the actual spacing between samples. When an interval
+// straddles an hour boundary, it is split at the boundary, using the linearly interpolated
+// power at that moment.
+class EnergyCounter {
+public:
+	double MaxGapSeconds = 60; // Don't integrate across gaps longer than this (eg when we can't talk to the inverter)
+
+	EnergyTotals Hour;          // Current hour
+	EnergyTotals Day;           // Current day (local time)
+	time_t       HourStart = 0; // Start of the current hour
+	time_t       DayStart  = 0; // Start of the current day
+
+	// Add a sample. Any buckets that are closed by this sample are appended to 'closed'.
+	void Add(double t, const EnergyPower& p, std::vector<EnergyBucket>& closed);
+
+	// Persist our state, so that a restart doesn't lose the current hour and day.
+	bool Save(const std::string& filename) const;
+
+	// Load state written by Save. If the saved hour or day have already ended, then
+	// they are appended to 'closed', in case they never made it to the database.
+	bool Load(const std::string& filename, time_t now, std::vector<EnergyBucket>& closed);
+
+	static time_t StartOfHour(time_t t);
+	static time_t StartOfDay(time_t t); // Local time
+
+private:
+	bool        HaveLast = false;
+	double      LastTime = 0;
+	time_t      DayEnd   = 0; // Start of the next day
+	EnergyPower Last;
+
+	void StartDay(time_t t);
+	void Integrate(double t0, const EnergyPower& p0, double t1, const EnergyPower& p1);
+	void Roll(time_t t, std::vector<EnergyBucket>& closed);
+};
+
+} // namespace homepower
@@ -0,0 +1,147 @@
+#include "fastFormat.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+namespace homepower {
+
+static const double Pow10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+
+// Write the decimal digits of v, which must be positive
+static char* FormatDigits(char* p, uint64_t v) {
+	char  tmp[20];
+	char* t = tmp + sizeof(tmp);
+	do {
+		*--t = (char) ('0' + v % 10);
+		v /= 10;
+	} while (v != 0);
+	size_t n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+// Write the integer and fraction of scaled / 10^decimals. If trim is true, drop trailing zeros of the fraction.
+static char* FormatScaled(char* p, uint64_t scaled, int decimals, bool trim) {
+	uint64_t div  = (uint64_t) Pow10[decimals];
+	uint64_t frac = scaled % div;
+	p             = FormatDigits(p, scaled / div);
+	if (decimals == 0 || (trim && frac == 0))
+		return p;
+	int n = decimals;
+	if (trim) {
+		while (frac % 10 == 0) {
+			frac /= 10;
+			n--;
+		}
+	}
+	*p++ = '.';
+	for (int i = n - 1; i >= 0; i--) {
+		p[i] = (char) ('0' + frac % 10);
+		frac /= 10;
+	}
+	return p + n;
+}
+
+// Round a * scale to the nearest integer, with ties to even, like printf does. printf rounds the exact
+// decimal value of a, so if the product a * scale was rounded, and that rounding could have moved it
+// across a halfway point, we return false, and leave it to printf.
+static bool RoundScaled(double a, double scale, uint64_t& out) {
+	double x   = a * scale;
+	double err = fma(a, scale, -x); // The exact product is x + err
+	double r   = rint(x);
+	if (err != 0 && fabs(fabs(x - r) - 0.5) <= fabs(err))
+		return false;
+	out = (uint64_t) r;
+	return true;
+}
+
+char* FormatFloat(char* p, double v) {
+	if (v == 0) {
+		// Preserve the sign of -0, like printf
+		if (signbit(v))
+			*p++ = '-';
+		*p++ = '0';
+		return p;
+	}
+	double a = fabs(v);
+	// %g switches to exponent notation outside of this range, and we leave that to printf
+	if (!(a >= 1e-4 && a < 999999.5))
+		return p + snprintf(p, MaxFormatNumberBytes, "%g", v);
+
+	// Find the exponent, so that we can round to 6 significant digits
+	int e = 0;
+	if (a >= 1) {
+		while (e < 5 && a >= Pow10[e + 1])
+			e++;
+	} else {
+		while (a * Pow10[-e] < 1)
+			e--;
+	}
+	int      decimals = 5 - e; // Between 0 and 9
+	uint64_t scaled   = 0;
+	if (!RoundScaled(a, Pow10[decimals], scaled))
+		return p + snprintf(p, MaxFormatNumberBytes, "%g", v);
+	if (scaled >= 1000000 && decimals > 0) {
+		// Rounding carried into another digit (eg 9.999999 -> 10.0000)
+		decimals--;
+		scaled = (scaled + 5) / 10;
+	}
+	if (v < 0)
+		*p++ = '-';
+	return FormatScaled(p, scaled, decimals, true);
+}
+
+char* FormatFixed3(char* p, double v) {
+	double a = fabs(v);
+	if (!(a < 1e15))
+		return p + snprintf(p, MaxFormatNumberBytes, "%.6g", v);
+	uint64_t scaled = 0;
+	if (!RoundScaled(a, 1000, scaled))
+		return p + snprintf(p, MaxFormatNumberBytes, "%.3f", v);
+	if (signbit(v))
+		*p++ = '-';
+	return FormatScaled(p, scaled, 3, false);
+}
+
+char* FormatInt(char* p, int64_t v) {
+	if (v < 0) {
+		*p++ = '-';
+		return FormatDigits(p, 0 - (uint64_t) v);
+	}
+	return FormatDigits(p, (uint64_t) v);
+}
+
+char* FormatJSONNumber(char* p, double v) {
+	if (!isfinite(v)) {
+		memcpy(p, "null", 4);
+		return p + 4;
+	}
+	return FormatFloat(p, v);
+}
+
+char* FormatJSONString(char* p, const char* s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	*p++                    = '"';
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) s[i];
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = (char) c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			// The raw responses from the inverter end with a binary CRC and a carriage return,
+			// which are not valid UTF-8, so we escape them as if they were Latin-1
+			*p++ = '\\';
+			*p++ = 'u';
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		} else {
+			*p++ = (char) c;
+		}
+	}
+	*p++ = '"';
+	return p;
+}
+
+} // namespace homepower
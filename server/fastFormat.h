@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace homepower {
+
+// Fast replacements for the printf formats that we use to encode readings as text.
+// Each one writes to p, which must have room for the result, and returns the end of what it wrote.
+// Nothing is null terminated.
+
+static const int MaxFormatNumberBytes = 24; // Upper bound on what the number functions write
+
+char* FormatFloat(char* p, double v);  // The same as printf's %g (6 significant digits, without trailing zeros)
+char* FormatFixed3(char* p, double v); // The same as printf's %.3f, which we use for times. |v| >= 1e15 is written as %.6g.
+char* FormatInt(char* p, int64_t v);
+char* FormatJSONNumber(char* p, double v); // Like FormatFloat, but NaN and infinity are written as null, because JSON can't represent them
+
+// Write s as a quoted JSON string. Writes at most 6 * len + 2 bytes.
+char* FormatJSONString(char* p, const char* s, size_t len);
+
+} // namespace homepower
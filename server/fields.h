@@ -0,0 +1,75 @@
+#pragma once
+
+// The one place where the fields of a QPIGS record, and the columns of 'readings', are listed.
+// Everything that has to walk over the fields (the record struct, the QPIGS parser, the SQL DDL and
+// INSERT statements, the SQLite and Postgres writers, the CSV and JSON encoders, and the compressor)
+// is generated from these lists, with X-macros, so adding a field is a one line change here
+// (plus the ALTER TABLE in ReadingsAddedColumns, and dbcreate.sql, if it's a new column).
+
+// The fields of a QPIGS response, in the order that the inverter sends them. For example:
+// (000.0 00.0 228.2 50.0 0346 0337 011 429 27.00 000 095 0038 01.3 248.1 00.00 00001 10010000 00 00 00336 010
+// NUM(member) is a number, stored as a float. TEXT(member) is stored as a string.
+// Unknown1 is similar to PvW on Bernie's inverter.
+// Unknown2 is the battery discharge current, according to the protocol document (see ComputeDerived).
+#define HOMEPOWER_QPIGS_FIELDS(NUM, TEXT) \
+	NUM(ACInV)                            \
+	NUM(ACInHz)                           \
+	NUM(ACOutV)                           \
+	NUM(ACOutHz)                          \
+	NUM(LoadVA)                           \
+	NUM(LoadW)                            \
+	NUM(LoadP)                            \
+	NUM(BusV)                             \
+	NUM(BatV)                             \
+	NUM(BatChA)                           \
+	NUM(BatP)                             \
+	NUM(Temp)                             \
+	NUM(PvA)                              \
+	NUM(PvV)                              \
+	NUM(Unknown1)                         \
+	NUM(Unknown2)                         \
+	TEXT(Unknown3)                        \
+	TEXT(Unknown4)                        \
+	TEXT(Unknown5)                        \
+	NUM(PvW)                              \
+	TEXT(Unknown6)
+
+// The columns of 'readings', after time, in the order of the CREATE TABLE statement.
+// REAL(column, member, maxError) is a REAL column, from the float member of Reading. maxError is the
+// default error that ReadingCompressor may introduce, which is small enough not to show on a graph.
+// BOOL(column, member) is a BOOLEAN column, from a bool member of Reading.
+#define HOMEPOWER_READINGS_COLUMNS(REAL, BOOL)     \
+	REAL(acInV, ACInV, 2)                          \
+	REAL(acInHz, ACInHz, 0.1f)                     \
+	REAL(acOutV, ACOutV, 2)                        \
+	REAL(acOutHz, ACOutHz, 0.1f)                   \
+	REAL(loadVA, LoadVA, 20)                       \
+	REAL(loadW, LoadW, 20)                         \
+	REAL(loadP, LoadP, 1)                          \
+	REAL(busV, BusV, 2)                            \
+	REAL(batV, BatV, 0.1f)                         \
+	REAL(batChA, BatChA, 1)                        \
+	REAL(batP, BatP, 1)                            \
+	REAL(temp, Temp, 1)                            \
+	REAL(pvA, PvA, 0.5f)                           \
+	REAL(pvV, PvV, 2)                              \
+	REAL(pvW, PvW, 20)                             \
+	REAL(unknown1, Unknown1, 1)                    \
+	BOOL(heavy, Heavy)                             \
+	REAL(deficitW, DeficitW, 20)                   \
+	REAL(batW, BatW, 20)                           \
+	REAL(gridW, GridW, 20)                         \
+	REAL(totalLoadW, EstimatedTotalLoadW, 20)      \
+	REAL(selfConsumption, SelfConsumption, 0.02f)
+
+namespace homepower {
+
+#define HOMEPOWER_COUNT_1(...) +1
+
+// Number of columns of 'readings', excluding time
+static const int NumReadingsColumns = 0 HOMEPOWER_READINGS_COLUMNS(HOMEPOWER_COUNT_1, HOMEPOWER_COUNT_1);
+
+// Number of fields in a QPIGS response
+static const int NumQPIGSFields = 0 HOMEPOWER_QPIGS_FIELDS(HOMEPOWER_COUNT_1, HOMEPOWER_COUNT_1);
+
+} // namespace homepower
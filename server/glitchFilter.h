@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+namespace homepower {
+
+// GlitchFilter is a streaming Hampel filter.
+// The inverter occasionally reports a garbage value (usually zero) for a single sample.
+// We used to defend against this by taking the maximum over a long window, but that
+// delays our reaction to a real drop by the length of the window.
+// Instead, we compare every sample against the median of the most recent Window samples
+// (including itself). If it is further than NSigma robust standard deviations from that
+// median, then it's rejected, and the median is returned instead.
+// Because the window includes the new sample, a real level change gets through as soon
+// as it makes up the majority of the window. With Window = 5, that is on the 3rd sample,
+// and glitches that last 1 or 2 samples are rejected.
+//
+// We keep a sorted copy of the window, so finding the median is O(1), and an insertion
+// is a binary search followed by a shift of at most Window floats. Computing the MAD is
+// O(Window), but our windows are so small that this is cheaper than a tree would be.
+class GlitchFilter {
+public:
+	static const int MaxWindow = 15;
+
+	std::string Name;             // Used for logging
+	int         Window       = 5; // Number of samples in the median window. Must be odd, and at most MaxWindow.
+	float       NSigma       = 3; // Reject samples further than this many robust standard deviations from the median
+	float       MinDeviation = 0; // Never reject samples that are closer than this to the median. Needed for flat signals, where the MAD is zero.
+	uint64_t    NSamples     = 0; // Number of samples seen
+	uint64_t    NRejected    = 0; // Number of samples rejected as outliers
+	float       LastRejected = 0; // Most recent value that we rejected
+
+	GlitchFilter(const char* name = "", int window = 5, float minDeviation = 0, float nSigma = 3) {
+		Configure(name, window, minDeviation, nSigma);
+	}
+
+	void Configure(const char* name, int window, float minDeviation, float nSigma = 3) {
+		Name         = name;
+		Window       = std::max(1, std::min(window | 1, (int) MaxWindow));
+		MinDeviation = minDeviation;
+		NSigma       = nSigma;
+		N            = 0;
+		Pos          = 0;
+	}
+
+	// Returns the filtered value of v
+	float Filter(float v) {
+		NSamples++;
+		if (N == Window)
+			Remove(Raw[Pos]);
+		Insert(v);
+		Raw[Pos] = v;
+		Pos      = (Pos + 1) % Window;
+
+		// Until the window has filled up, we have nothing to compare against
+		if (N < Window)
+			return v;
+
+		float median = Sorted[N / 2];
+		float dev    = fabsf(v - median);
+		if (dev <= MinDeviation)
+			return v;
+
+		// 1.4826 scales the MAD to the standard deviation of normally distributed data
+		float threshold = NSigma * 1.4826f * MAD(median);
+		if (dev <= threshold)
+			return v;
+
+		NRejected++;
+		LastRejected = v;
+		return median;
+	}
+
+private:
+	float Raw[MaxWindow];    // Ring of the most recent samples, in arrival order
+	float Sorted[MaxWindow]; // The same samples, sorted
+	int   N   = 0;           // Number of samples in Sorted
+	int   Pos = 0;           // Next position in Raw
+
+	void Insert(float v) {
+		int i = (int) (std::upper_bound(Sorted, Sorted + N, v) - Sorted);
+		memmove(Sorted + i + 1, Sorted + i, (N - i) * sizeof(float));
+		Sorted[i] = v;
+		N++;
+	}
+
+	void Remove(float v) {
+		int i = (int) (std::lower_bound(Sorted, Sorted + N, v) - Sorted);
+		memmove(Sorted + i, Sorted + i + 1, (N - i - 1) * sizeof(float));
+		N--;
+	}
+
+	// Median absolute deviation from 'median'.
+	// Sorted is sorted, so the absolute deviations are sorted if we walk outwards
+	// from the median in both directions, like a merge.
+	float MAD(float median) const {
+		int   lo = N / 2 - 1;
+		int   hi = N / 2 + 1;
+		float d  = 0; // Sorted[N/2] itself has a deviation of zero
+		for (int k = 0; k < N / 2; k++) {
+			float dlo = lo >= 0 ? median - Sorted[lo] : INFINITY;
+			float dhi = hi < N ? Sorted[hi] - median : INFINITY;
+			if (dlo <= dhi) {
+				d = dlo;
+				lo--;
+			} else {
+				d = dhi;
+				hi++;
+			}
+		}
+		return d;
+	}
+};
+
+} // namespace homepower
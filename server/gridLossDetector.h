@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace homepower {
+
+// GridLossDetector decides whether the grid is on, from the stream of ACInV readings.
+// When the grid goes down, we want to know as soon as possible, so that the heavy loads
+// don't sit on a dead grid circuit and then switch hard when the grid comes back.
+// But the inverter occasionally reports zero grid voltage for a single sample, and we
+// must not react to those blips.
+// So the first low reading only makes us suspicious. The monitor then re-polls the
+// inverter immediately, instead of waiting for its next sample time, and if that reading
+// is also low, we declare the grid lost. That's two round trips to the inverter, which is
+// well under a second.
+// There's no rush to declare the grid restored, so we wait for RestoreSamples consecutive
+// good readings, which also gives any switch-on spike time to subside.
+class GridLossDetector {
+public:
+	enum class States {
+		On,      // Grid is on
+		Suspect, // Grid is on, but the most recent reading was low
+		Off,     // Grid is off
+	};
+
+	float Threshold      = 200; // Grid voltage below this is considered "grid off"
+	int   LossSamples    = 2;   // Number of consecutive low readings before we declare the grid lost
+	int   RestoreSamples = 3;   // Number of consecutive good readings before we declare the grid restored
+
+	States   State          = States::On;
+	uint64_t NLosses        = 0; // Number of times that we've declared the grid lost
+	uint64_t NBlips         = 0; // Number of suspicious readings that turned out to be blips
+	double   FirstLowAt     = 0; // Time of the first low reading of the current (or most recent) loss
+	double   LossDetectedAt = 0; // Time of the reading that confirmed the most recent loss
+
+	// Add a reading. Returns true if the grid state has just changed.
+	bool Add(double t, float acInV) {
+		bool low = acInV < Threshold;
+		if (low)
+			Highs = 0;
+		else
+			Highs++;
+
+		switch (State) {
+		case States::On:
+			if (low) {
+				FirstLowAt = t;
+				Lows       = 1;
+				State      = Lows >= LossSamples ? States::Off : States::Suspect;
+			}
+			break;
+		case States::Suspect:
+			if (low) {
+				Lows++;
+				if (Lows >= LossSamples)
+					State = States::Off;
+			} else {
+				NBlips++;
+				State = States::On;
+			}
+			break;
+		case States::Off:
+			if (Highs >= RestoreSamples) {
+				State = States::On;
+				return true;
+			}
+			return false;
+		}
+
+		if (State == States::Off) {
+			NLosses++;
+			LossDetectedAt = t;
+			return true;
+		}
+		return false;
+	}
+
+	bool HasGrid() const { return State != States::Off; }
+
+	// True if we've seen a low reading, and the caller should re-poll immediately to confirm it
+	bool WantRePoll() const { return State == States::Suspect; }
+
+private:
+	int Lows  = 0; // Consecutive low readings
+	int Highs = 0; // Consecutive good readings
+};
+
+} // namespace homepower
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+namespace homepower {
+
+// Histogram of timings (sample periods, latencies, etc), with logarithmically spaced bins,
+// so that we get the same relative precision at 1 millisecond as at 1 second.
+// Values below the first bin go into the first bin, and values above the last bin go into the
+// last bin, but Min and Max are exact.
+// Adding a value costs a log(), and the memory is fixed, so this can live forever.
+class Histogram {
+public:
+	static const int MaxBins = 64;
+
+	uint64_t Count = 0;
+	double   Sum   = 0;
+	double   Min   = DBL_MAX;
+	double   Max   = -DBL_MAX;
+
+	Histogram(double minValue = 0.001, double maxValue = 10, int nBins = 40) {
+		Initialize(minValue, maxValue, nBins);
+	}
+
+	// Bins are spaced logarithmically between minValue and maxValue, which must be positive
+	void Initialize(double minValue, double maxValue, int nBins) {
+		NBins    = std::max(2, std::min(nBins, (int) MaxBins));
+		MinValue = minValue;
+		LogMin   = log(minValue);
+		LogStep  = (log(maxValue) - LogMin) / (NBins - 1);
+		Reset();
+	}
+
+	void Reset() {
+		Count = 0;
+		Sum   = 0;
+		Min   = DBL_MAX;
+		Max   = -DBL_MAX;
+		for (int i = 0; i < NBins; i++)
+			Bins[i] = 0;
+	}
+
+	void Add(double v) {
+		int bin = 0;
+		if (v > MinValue)
+			bin = std::min((int) ceil((log(v) - LogMin) / LogStep), NBins - 1);
+		Bins[bin]++;
+		Count++;
+		Sum += v;
+		Min = std::min(Min, v);
+		Max = std::max(Max, v);
+	}
+
+	double Mean() const { return Count == 0 ? 0 : Sum / (double) Count; }
+
+	// Returns the upper edge of the bin that contains quantile p (0..1), clamped to Min and Max.
+	// The last bin has no upper edge, so it returns Max.
+	double Quantile(double p) const {
+		if (Count == 0)
+			return 0;
+		uint64_t rank = (uint64_t) ceil(p * (double) Count);
+		uint64_t seen = 0;
+		for (int i = 0; i < NBins; i++) {
+			seen += Bins[i];
+			if (seen >= std::max(rank, (uint64_t) 1))
+				return i == NBins - 1 ? Max : std::max(Min, std::min(Max, UpperEdge(i)));
+		}
+		return Max;
+	}
+
+	// Print a one line summary. Values are multiplied by scale, so you can store seconds and print milliseconds.
+	void Print(FILE* f, const char* name, double scale = 1000, const char* unit = "ms") const {
+		fprintf(f, "%s: n %llu, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, min %.1f, max %.1f %s\n", name, (unsigned long long) Count,
+		        Mean() * scale, Quantile(0.5) * scale, Quantile(0.9) * scale, Quantile(0.99) * scale,
+		        Count == 0 ? 0 : Min * scale, Count == 0 ? 0 : Max * scale, unit);
+	}
+
+	double UpperEdge(int bin) const { return exp(LogMin + bin * LogStep); }
+
+private:
+	int      NBins    = 0;
+	double   MinValue = 0;
+	double   LogMin   = 0;
+	double   LogStep  = 0;
+	uint64_t Bins[MaxBins];
+};
+
+} // namespace homepower
@@ -0,0 +1,135 @@
+#include "historyFile.h"
+#include "crc32.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <float.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t HistoryFileMagic   = 0x48504831; // HPH1
+static const uint32_t HistoryFileVersion = 2;          // Version 1 stored Time as whole seconds
+
+HistoryFile::~HistoryFile() {
+	Close();
+}
+
+bool HistoryFile::Open(const std::string& filename, const std::vector<SeriesDef>& series) {
+	Close();
+
+	uint32_t layoutHash = 0;
+	uint32_t totalSlots = 0;
+	Offset.clear();
+	Slots.clear();
+	for (const auto& s : series) {
+		layoutHash = Crc32(s.Name.c_str(), s.Name.size() + 1, layoutHash);
+		layoutHash = Crc32(&s.Slots, sizeof(s.Slots), layoutHash);
+		Offset.push_back(totalSlots);
+		Slots.push_back(s.Slots);
+		totalSlots += s.Slots;
+	}
+	Cursor.assign(series.size(), 0);
+
+	size_t size = sizeof(Header) + (size_t) totalSlots * sizeof(Slot);
+
+	FD = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (FD == -1) {
+		fprintf(stderr, "Unable to open history file '%s' (errno=%d %s)\n", filename.c_str(), errno, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	bool        sizeOK = fstat(FD, &st) == 0 && (size_t) st.st_size == size;
+	if (!sizeOK && ftruncate(FD, size) != 0) {
+		fprintf(stderr, "Unable to resize history file '%s' (errno=%d %s)\n", filename.c_str(), errno, strerror(errno));
+		Close();
+		return false;
+	}
+	void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "Unable to map history file '%s' (errno=%d %s)\n", filename.c_str(), errno, strerror(errno));
+		Close();
+		return false;
+	}
+	Map      = (uint8_t*) m;
+	MapSize  = size;
+	Filename = filename;
+
+	Header* h = (Header*) Map;
+	if (!sizeOK || h->Magic != HistoryFileMagic || h->Version != HistoryFileVersion || h->LayoutHash != layoutHash || h->NSeries != series.size()) {
+		fprintf(stderr, "History file '%s' is new or has a different layout. Starting with empty history.\n", filename.c_str());
+		memset(Map, 0, MapSize);
+		h->Magic      = HistoryFileMagic;
+		h->Version    = HistoryFileVersion;
+		h->LayoutHash = layoutHash;
+		h->NSeries    = (uint32_t) series.size();
+	}
+	return true;
+}
+
+void HistoryFile::Close() {
+	if (Map)
+		munmap(Map, MapSize);
+	if (FD != -1)
+		close(FD);
+	Map     = nullptr;
+	MapSize = 0;
+	FD      = -1;
+}
+
+HistoryFile::Slot* HistoryFile::SlotPtr(size_t series, uint32_t i) {
+	return (Slot*) (Map + sizeof(Header)) + Offset[series] + i;
+}
+
+// The series number is mixed into the checksum, so that a slot can't be mistaken
+// for a slot of a different series, if the layout changes without the hash changing.
+uint32_t HistoryFile::SlotCheck(size_t series, double time, float value) {
+	uint32_t s   = (uint32_t) series;
+	uint32_t crc = Crc32(&s, sizeof(s));
+	crc          = Crc32(&time, sizeof(time), crc);
+	return Crc32(&value, sizeof(value), crc);
+}
+
+void HistoryFile::Write(size_t series, const History& h) {
+	if (!Map || Slots[series] == 0)
+		return;
+	Slot* s  = SlotPtr(series, Cursor[series]);
+	s->Time  = h.Time;
+	s->Value = h.Value;
+	s->Check = SlotCheck(series, s->Time, s->Value);
+	Cursor[series]++;
+	if (Cursor[series] == Slots[series])
+		Cursor[series] = 0;
+}
+
+uint32_t HistoryFile::Restore(size_t series, double minTime, double maxTime, RingBuffer<History>& out) {
+	if (!Map)
+		return 0;
+	vector<History> valid;
+	double          newest    = -DBL_MAX;
+	uint32_t        newestIdx = 0;
+	for (uint32_t i = 0; i < Slots[series]; i++) {
+		const Slot* s = SlotPtr(series, i);
+		if (s->Check != SlotCheck(series, s->Time, s->Value) || s->Time < minTime || s->Time > maxTime)
+			continue;
+		valid.push_back({s->Time, s->Value});
+		if (s->Time >= newest) {
+			newest    = s->Time;
+			newestIdx = i;
+		}
+	}
+	// Continue writing after the newest sample, so that we overwrite the oldest ones first
+	if (valid.size() != 0)
+		Cursor[series] = (newestIdx + 1) % Slots[series];
+
+	stable_sort(valid.begin(), valid.end(), [](const History& a, const History& b) { return a.Time < b.Time; });
+	out.AddRange(valid.data(), valid.size());
+	return (uint32_t) valid.size();
+}
+
+} // namespace homepower
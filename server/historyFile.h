@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ringbuffer.h"
+#include "monitorUtils.h"
+
+namespace homepower {
+
+// HistoryFile mirrors our History ring buffers into a memory-mapped file, so that
+// after a restart we can pick up where we left off, instead of waiting 10 minutes
+// for our averages to fill up again.
+// Every slot carries its own checksum, so we don't need to checksum the whole file
+// on every write. If we crash halfway through writing a slot, then we lose only that
+// one sample.
+// We don't msync. If the file is on a ramdisk then there's nothing to sync, and if it's
+// on flash, then we're happy to let the kernel decide when to write back dirty pages.
+// The only thing we need to survive is our own process dying.
+class HistoryFile {
+public:
+	struct SeriesDef {
+		std::string Name;
+		uint32_t    Slots; // Number of samples that we keep on disk
+	};
+
+	~HistoryFile();
+
+	// Open or create the file. If the file exists, but was created with a different
+	// set of series, then it is wiped.
+	bool Open(const std::string& filename, const std::vector<SeriesDef>& series);
+	void Close();
+	bool IsOpen() const { return Map != nullptr; }
+
+	// Append a sample to the given series
+	void Write(size_t series, const History& h);
+
+	// Load all valid samples with minTime <= Time <= maxTime into 'out', oldest first.
+	// Returns the number of samples loaded.
+	uint32_t Restore(size_t series, double minTime, double maxTime, RingBuffer<History>& out);
+
+private:
+	struct Header {
+		uint32_t Magic;
+		uint32_t Version;
+		uint32_t LayoutHash; // Hash of the series names and sizes
+		uint32_t NSeries;
+	};
+
+	struct Slot {
+		double   Time;
+		float    Value;
+		uint32_t Check;
+	};
+
+	std::string           Filename;
+	int                   FD      = -1;
+	uint8_t*              Map     = nullptr;
+	size_t                MapSize = 0;
+	std::vector<uint32_t> Offset; // Index of first slot of each series
+	std::vector<uint32_t> Slots;  // Number of slots in each series
+	std::vector<uint32_t> Cursor; // Next slot to write, in each series
+
+	Slot*           SlotPtr(size_t series, uint32_t i);
+	static uint32_t SlotCheck(size_t series, double time, float value);
+};
+
+} // namespace homepower
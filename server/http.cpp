@@ -1,9 +1,41 @@
 #include "../phttp/phttp.h"
+#include "../json.hpp"
 #include "controller.h"
+#include "monitor.h"
 
 namespace homepower {
 
-bool RunHttpServer(Controller& controller) {
+static nlohmann::json ReadingToJSON(const Reading& r) {
+	return nlohmann::json({
+	    {"Time", r.Time},
+	    {"ACInV", r.ACInV},
+	    {"ACInHz", r.ACInHz},
+	    {"ACOutV", r.ACOutV},
+	    {"ACOutHz", r.ACOutHz},
+	    {"LoadVA", r.LoadVA},
+	    {"LoadW", r.LoadW},
+	    {"LoadP", r.LoadP},
+	    {"BatP", r.BatP},
+	    {"BatChA", r.BatChA},
+	    {"BusV", r.BusV},
+	    {"BatV", r.BatV},
+	    {"Temp", r.Temp},
+	    {"PvA", r.PvA},
+	    {"PvV", r.PvV},
+	    {"PvW", r.PvW},
+	    {"Heavy", r.Heavy},
+	    {"DeficitW", r.DeficitW},
+	    {"BatChargeW", r.BatChargeW},
+	    {"BatDischargeW", r.BatDischargeW},
+	    {"BatW", r.BatW},
+	    {"HeavyGridW", r.HeavyGridW},
+	    {"GridW", r.GridW},
+	    {"EstimatedTotalLoadW", r.EstimatedTotalLoadW},
+	    {"SelfConsumption", r.SelfConsumption},
+	});
+}
+
+bool RunHttpServer(Controller& controller, Monitor& monitor) {
 	phttp::Server server;
 	return server.ListenAndRun("0.0.0.0", 8080, [&](phttp::Response& w, phttp::RequestPtr r) {
 		if (r->Method == "POST") {
@@ -32,6 +64,14 @@ bool RunHttpServer(Controller& controller) {
 				return;
 			}
 			w.SetStatusAndBody(200, "OK");
+		} else if (r->Method == "GET" && r->Path == "/reading") {
+			// The most recent reading, including the values that we derive from it
+			Reading reading;
+			if (!monitor.LatestReading(reading)) {
+				w.SetStatusAndBody(503, "No readings yet");
+				return;
+			}
+			w.SetStatusAndBody(200, ReadingToJSON(reading).dump(4));
 		} else {
 			w.SetStatusAndBody(404, "Unknown request");
 		}
@@ -3,7 +3,8 @@
 namespace homepower {
 
 class Controller;
+class Monitor;
 
-bool RunHttpServer(Controller& controller);
+bool RunHttpServer(Controller& controller, Monitor& monitor);
 
 } // namespace homepower
\ No newline at end of file
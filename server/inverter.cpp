@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string>
 #include <termios.h>
+#include <poll.h>
 #include <time.h>
 #include "inverter.h"
+#include "timeUtils.h"
 
 /*
 
@@ -136,7 +139,8 @@ double GetTime() {
 	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
 }
 
-Inverter::Response RecvMsg(int fd, double timeout, string& msg) {
+// On success, completedAt is the wall clock time when the final byte of the message arrived
+Inverter::Response RecvMsg(int fd, double timeout, string& msg, double& completedAt) {
 	char               buf[1024];
 	auto               start   = GetTime();
 	Inverter::Response lastErr = Inverter::Response::FailRecvTooShort;
@@ -150,8 +154,10 @@ Inverter::Response RecvMsg(int fd, double timeout, string& msg) {
 			//printf("read %d bytes\n", n);
 			msg.append((const char*) buf, n);
 			lastErr = ValidateResponse(msg);
-			if (lastErr == Inverter::Response::OK)
+			if (lastErr == Inverter::Response::OK) {
+				completedAt = WallTime();
 				return lastErr;
+			}
 		}
 		/*
 		if (n == 0 && msg.size() > 100) {
@@ -177,7 +183,14 @@ Inverter::Response RecvMsg(int fd, double timeout, string& msg) {
 		*/
 		if (GetTime() - start > timeout)
 			return lastErr;
-		usleep(20000);
+		// Wait for more data. We used to sleep for 20ms here, but that added up to 20ms of
+		// latency, and the same amount of jitter to our timestamps.
+		pollfd p  = {};
+		p.fd      = fd;
+		p.events  = POLLIN;
+		int ready = poll(&p, 1, 20);
+		if (ready < 0 || (p.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+			usleep(20000);
 	}
 }
 
@@ -185,57 +198,88 @@ Inverter::~Inverter() {
 	Close();
 }
 
+// Parse a number from the QPIGS response, such as "0346", "27.00", or "-01.3".
+// This is much faster than strtod, and gives the same result, because a decimal with at most 15
+// digits, divided by an exact power of 10, is correctly rounded. Anything else goes to strtod.
+static bool ParseQPIGSNumber(const char* s, size_t len, float& v) {
+	static const double Pow10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+	const char*         p       = s;
+	const char*         end     = s + len;
+	bool                neg     = p != end && *p == '-';
+	if (p != end && (*p == '-' || *p == '+'))
+		p++;
+	int64_t m        = 0;
+	int     digits   = 0;
+	int     decimals = -1;
+	for (; p != end && digits <= 15; p++) {
+		if (*p >= '0' && *p <= '9') {
+			m = m * 10 + (*p - '0');
+			digits++;
+			if (decimals >= 0)
+				decimals++;
+		} else if (*p == '.' && decimals < 0) {
+			decimals = 0;
+		} else {
+			break;
+		}
+	}
+	if (p == end && digits != 0 && digits <= 15) {
+		double d = decimals > 0 ? (double) m / Pow10[decimals] : (double) m;
+		v        = (float) (neg ? -d : d);
+		return true;
+	}
+	// Like the sscanf that we used to use, accept anything that starts with a number
+	char*  e;
+	double d = strtod(s, &e);
+	v        = (float) d;
+	return e != s;
+}
+
 // Interpret a known command
 bool Inverter::Interpret(const std::string& resp, Record_QPIGS& out) {
 	// (000.0  00.0    228.2   50.0     0346    0337   011    429   27.00  000     095   0038  01.3  248.1  00.00  00001   10010000  00  00  00336       010
 	//  AcInV  AcInHz  AcOutV  AcOutHz  LoadVA  LoadW  Load%  BusV  BatV   BatChA  Bat%  Temp  PvA   PvV                                     PvW
-	double acInV   = 0;
-	double acInHz  = 0;
-	double acOutV  = 0;
-	double acOutHz = 0;
-	double loadVA  = 0;
-	double loadW   = 0;
-	double loadP   = 0;
-	double busV    = 0;
-	double batV    = 0;
-	double batChA  = 0;
-	double batP    = 0;
-	double temp    = 0;
-	double pvA     = 0;
-	double pvV     = 0;
-	double pvW     = 0;
-	double n[1]    = {0};
-	char   s[5][40];
-	int    tok = sscanf(resp.c_str() + 1, "%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %s %s %s %s %lf %s",
-	                    &acInV, &acInHz, &acOutV, &acOutHz, &loadVA, &loadW, &loadP, &busV, &batV, &batChA, &batP, &temp, &pvA, &pvV,
-	                    n + 0, (char*) (s + 0), (char*) (s + 1), (char*) (s + 2), (char*) (s + 3), &pvW, (char*) (s + 4));
-	if (tok == 21) {
-		out.Raw      = resp;
-		out.Time     = time(nullptr);
-		out.ACInV    = acInV;
-		out.ACInHz   = acInHz;
-		out.ACOutV   = acOutV;
-		out.ACOutHz  = acOutHz;
-		out.LoadVA   = loadVA;
-		out.LoadW    = loadW;
-		out.LoadP    = loadP;
-		out.BusV     = busV;
-		out.BatP     = batP;
-		out.BatChA   = batChA;
-		out.BatV     = batV;
-		out.Temp     = temp;
-		out.PvA      = pvA;
-		out.PvV      = pvV;
-		out.PvW      = pvW;
-		out.Unknown1 = n[0];
-		out.Unknown2 = s[0];
-		out.Unknown3 = s[1];
-		out.Unknown4 = s[2];
-		out.Unknown5 = s[3];
-		out.Unknown6 = s[4];
-		return true;
+	// The fields are listed in HOMEPOWER_QPIGS_FIELDS. Extra fields at the end are ignored.
+	const char* tokens[NumQPIGSFields];
+	size_t      lengths[NumQPIGSFields];
+	const char* p = resp.c_str() + 1; // Skip the "("
+	int         n = 0;
+	for (; n < NumQPIGSFields; n++) {
+		while (*p == ' ')
+			p++;
+		tokens[n] = p;
+		while ((unsigned char) *p > ' ')
+			p++;
+		lengths[n] = p - tokens[n];
+		if (lengths[n] == 0)
+			return false;
 	}
-	return false;
+
+	// Parse all the numbers before touching 'out', so that it's unchanged if we fail
+	float nums[NumQPIGSFields];
+	int   i = 0;
+#define QPIGS_PARSE_NUM(member)                                 \
+	if (!ParseQPIGSNumber(tokens[i], lengths[i], nums[i])) \
+		return false;                                          \
+	i++;
+#define QPIGS_PARSE_TEXT(member) i++;
+	HOMEPOWER_QPIGS_FIELDS(QPIGS_PARSE_NUM, QPIGS_PARSE_TEXT)
+#undef QPIGS_PARSE_NUM
+#undef QPIGS_PARSE_TEXT
+
+	out.Raw  = resp;
+	out.Time = LastResponseTime;
+	i        = 0;
+#define QPIGS_SET_NUM(member) \
+	out.member = nums[i];    \
+	i++;
+#define QPIGS_SET_TEXT(member)                    \
+	out.member.assign(tokens[i], lengths[i]); \
+	i++;
+	HOMEPOWER_QPIGS_FIELDS(QPIGS_SET_NUM, QPIGS_SET_TEXT)
+#undef QPIGS_SET_NUM
+#undef QPIGS_SET_TEXT
+	return true;
 }
 
 bool Inverter::Interpret(const std::string& resp, InverterModel& out) {
@@ -284,7 +328,9 @@ bool Inverter::Open() {
 	LastOpenFailErr     = 0;
 
 	// If this looks like an RS232-to-USB adapter, then set the serial port parameters
+	SecondsPerByte = 0;
 	if (device.find("ttyUSB") != -1) {
+		SecondsPerByte = 10.0 / 2400.0; // 8N1 is 10 bits per byte
 		// 2400 is the only speed that seems to work
 		speed_t baud = B2400;
 
@@ -355,6 +401,7 @@ Inverter::Response Inverter::Execute(string cmd, std::string& response, int maxR
 				break;
 		}
 		fclose(f);
+		LastResponseTime = WallTime();
 		return Response::OK;
 	}
 
@@ -375,8 +422,12 @@ Inverter::Response Inverter::Execute(string cmd, std::string& response, int maxR
 
 		res = Response::DontUnderstand;
 		if (SendMsg(FD, cmd)) {
-			res = RecvMsg(FD, RecvTimeout, response);
+			double completedAt = 0;
+			res                = RecvMsg(FD, RecvTimeout, response, completedAt);
 			if (res == Response::OK) {
+				// The inverter sampled its state before it started sending, so our timestamp is the
+				// moment that the response started arriving, not when it finished.
+				LastResponseTime = completedAt - SecondsPerByte * (double) response.size();
 				if (response == "(ACK") {
 					res = Response::OK;
 					break;
@@ -3,6 +3,8 @@
 #include <vector>
 #include <string>
 
+#include "fields.h"
+
 namespace homepower {
 
 enum class InverterModel {
@@ -34,31 +36,16 @@ public:
 		NAK              = 7,
 	};
 
+	// The fields of the response are listed in HOMEPOWER_QPIGS_FIELDS (see fields.h)
 	struct Record_QPIGS {
-		time_t      Time;
+		double      Time; // Seconds since unix epoch (see LastResponseTime)
 		std::string Raw;
-		float       ACInV;
-		float       ACInHz;
-		float       ACOutV;
-		float       ACOutHz;
-		float       LoadVA;
-		float       LoadW;
-		float       LoadP;
-		float       BatP;
-		float       BatChA;
-		float       BusV;
-		float       BatV;
-		float       Temp;
-		float       PvA;
-		float       PvV;
-		float       PvW;
-		float       Unknown1; // Similar to PvW on Bernie's inverter
-		std::string Unknown2;
-		std::string Unknown3;
-		std::string Unknown4;
-		std::string Unknown5;
-		std::string Unknown6;
-		bool        Heavy; // Not read from inverter. This is actually our own state - whether or not heavy loads are on the inverter
+#define QPIGS_NUM(member) float member;
+#define QPIGS_TEXT(member) std::string member;
+		HOMEPOWER_QPIGS_FIELDS(QPIGS_NUM, QPIGS_TEXT)
+#undef QPIGS_NUM
+#undef QPIGS_TEXT
+		bool Heavy; // Not read from inverter. This is actually our own state - whether or not heavy loads are on the inverter
 	};
 
 	std::vector<std::string> Devices           = {"/dev/hidraw0"}; // Name of devices to use, such as /dev/hidraw0 or /dev/ttyUSB0. Multiple can be specified for redundancy.
@@ -67,6 +54,7 @@ public:
 	double                   RecvTimeout       = 2;                // Max timeout I've seen in practice is 1.5 seconds, on a raspberry Pi 1
 	std::string              DebugResponseFile = "";               // If not empty, then we don't actually talk to inverter, but read QPIGS response from this text file (this is for debugging/developing offline)
 	std::string              UsbRestartScript  = "";               // Script that is invoked when USB port seems to be dead
+	double                   LastResponseTime  = 0;                // Wall clock time (seconds since unix epoch) when the most recent response started arriving
 
 	~Inverter();
 	bool Open();
@@ -89,6 +77,7 @@ private:
 	int    LastOpenFailErr     = 0;
 	int    UsbRestartFailCount = 0; // Number of times that USB restart script has failed
 	time_t LastUsbRestartAt    = 0;
+	double SecondsPerByte      = 0; // Time to transmit one byte over a serial link. Zero for USB HID devices, which deliver a whole report at once.
 
 	std::string RawToPrintable(const std::string& raw);
 	void        RestartUsbAuto();
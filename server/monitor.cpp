@@ -1,6 +1,13 @@
 #include "monitor.h"
+#include "stateFile.h"
+#include "timeUtils.h"
+#include "sqliteSink.h"
+#include "postgresSink.h"
+#include "csvSink.h"
+#include "archiveSink.h"
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <float.h>
 #include <algorithm>
 
@@ -8,6 +15,9 @@ using namespace std;
 
 namespace homepower {
 
+static const uint32_t QuantileStateMagic   = 0x48505131; // HPQ1
+static const uint32_t QuantileStateVersion = 1;
+
 // trim space from end
 static string TrimSpace(const string& s) {
 	string x = s;
@@ -33,32 +43,91 @@ Monitor::Monitor() {
 	BatteryV            = 0;
 	BatteryP            = 0;
 	AvgLoadW            = 0;
+	AvgTotalLoadW       = 0;
+
+	// 0.01 to 10 seconds, in steps of 11%
+	SamplePeriods.Initialize(0.01, 10, 64);
+
+	Quantiles.LoadW.Reset({0.5f, 0.95f, 0.99f});
+	Quantiles.SolarW.Reset({0.5f, 0.95f, 0.99f});
+}
 
-	// If DBQueue is full, and we can't talk to the DB, then we drop records.
-	// A record is 272 bytes, so 256 * 275 = about 64kb
-	DBQueue.Initialize(256);
+// This is called by Start, once the sample period has been configured
+void Monitor::AddSeries() {
+	Series.Period = min(SamplePeriod, SecondsBetweenSamples);
 
 	// On a Raspberry Pi 1, it takes 0.222 milliseconds to compute an average over 4096 samples.
 	// On a Raspberry Pi 1, it takes 0.038 milliseconds to compute an average over 1024 samples.
 
-	// We want 5 minutes of history, so if we sample once every 2 seconds, then that is
-	// 30 * 5 = 150. Rounded up to next power of 2, we get 256.
-	// For LoadW and SolarW we want even more history, so we do 512 for them.
-	// Screw it, might as well do 512 for all of them.
-	SolarVHistory.Initialize(512);
-	LoadWHistory.Initialize(512);
-	DeficitWHistory.Initialize(512);
-	SolarWHistory.Initialize(512);
-	GridVHistory.Initialize(512);
-	BatPHistory.Initialize(512);
-	BatVHistory.Initialize(512);
+	// The capacities below are the minimum. SeriesStore raises them to fit the longest window of
+	// each series at our sample period, so a short --period doesn't shorten the windows.
+	// Readings from a burst of fast sampling (see AdaptiveSampler) are averaged down to this period.
+	// Glitch filters with a window of 5 reject glitches that are 1 or 2 samples long.
+	// The minimum deviations are large enough that ordinary movement never trips the filter,
+	// even when the signal has been perfectly flat for a while.
+	typedef Reading R;
+	SeriesSolarV   = Series.Add("SolarV", 256, [](const R& r) { return r.PvV; }, {60}, 5, 20);
+	SeriesSolarW   = Series.Add("SolarW", 1024, [](const R& r) { return r.PvW; }, {5 * 60});
+	SeriesLoadW    = Series.Add("LoadW", 1024, [](const R& r) { return r.LoadW; }, {3, 6, 5 * 60});
+	SeriesDeficitW = Series.Add("DeficitW", 512, [](const R& r) { return r.DeficitW; }, {5, 15, 60, 2 * 60});
+	SeriesGridV    = Series.Add("GridV", 64, [](const R& r) { return r.ACInV; }, {}, 5, 20);
+	SeriesBatV     = Series.Add("BatV", 64, [](const R& r) { return r.BatV; }, {}, 5, 2);
+	SeriesBatP     = Series.Add("BatP", 2048, [](const R& r) { return r.BatP; }, {10 * 60}, 5, 5);
+	SeriesTotalW   = Series.Add("TotalLoadW", 1024, [](const R& r) { return r.EstimatedTotalLoadW; }, {5 * 60});
+	Series.Add("ACOutV", 256, [](const R& r) { return r.ACOutV; }, {60});
+	Series.Add("BusV", 256, [](const R& r) { return r.BusV; }, {60});
+	Series.Add("Temp", 256, [](const R& r) { return r.Temp; }, {60});
+	Series.Add("BatChA", 256, [](const R& r) { return r.BatChA; }, {60});
+	Series.Add("LoadVA", 256, [](const R& r) { return r.LoadVA; }, {60});
 }
 
 void Monitor::Start() {
+	AddSeries();
+
 	InverterModel model = InverterModel::Unknown;
 	Inverter.ExecuteT("QMN", model, 10);
 	printf("Inverter model: %s\n", InverterModelDescribe(model));
 
+	OpenHistoryFile();
+
+	AddConfiguredSinks();
+	for (const auto& s : Sinks)
+		printf("Writing readings to %s\n", s->GetSink()->Name());
+
+	if (EnergyFilename != "") {
+		vector<EnergyBucket> closed;
+		if (Energy.Load(EnergyFilename, time(nullptr), closed))
+			printf("Restored energy counters from %s\n", EnergyFilename.c_str());
+		for (auto& s : Sinks)
+			s->Add(closed);
+	}
+
+	if (RollupsFilename != "") {
+		vector<RollupRow> closed;
+		if (Rollups.Load(RollupsFilename, time(nullptr), closed))
+			printf("Restored rollups from %s\n", RollupsFilename.c_str());
+		for (auto& s : Sinks)
+			s->Add(closed);
+	}
+
+	if (QuantilesFilename != "") {
+		lock_guard<mutex> lock(QuantileLock);
+		if (LoadStateFile(QuantilesFilename, QuantileStateMagic, QuantileStateVersion, &Quantiles, sizeof(Quantiles)))
+			printf("Restored load and solar quantiles from %s\n", QuantilesFilename.c_str());
+	}
+
+	if (ProfileFilename != "") {
+		lock_guard<mutex> lock(ProfileLock);
+		if (Profile.Load(ProfileFilename))
+			printf("Restored time-of-day profile from %s\n", ProfileFilename.c_str());
+	}
+
+	if (CyclesFilename != "" && BatteryCycles.Load(CyclesFilename))
+		printf("Restored battery cycle counter from %s\n", CyclesFilename.c_str());
+
+	if (AppliancesFilename != "" && Appliances.Load(AppliancesFilename))
+		printf("Restored appliance signatures from %s\n", AppliancesFilename.c_str());
+
 	Thread = thread([&]() {
 		printf("Monitor started\n");
 		Run();
@@ -81,20 +150,46 @@ bool Monitor::RunInverterCmd(std::string cmd) {
 	return true;
 }
 
+// The heavy load deltas live inside Run(), so they're not part of Series, but we
+// still want them to survive a restart, because they take a long time to accumulate.
+// They are the last series in the file, and are restored by Run().
+static const uint32_t HeavyLoadDeltasSize = 32;
+
+void Monitor::OpenHistoryFile() {
+	if (HistoryFilename == "")
+		return;
+	vector<HistoryFile::SeriesDef> defs;
+	for (size_t i = 0; i < Series.Size(); i++)
+		defs.push_back({Series.Get(i).Name, Series.Get(i).Samples.Capacity()});
+	defs.push_back({"HeavyLoadDeltas", HeavyLoadDeltasSize - 1});
+	if (!HistoryStore.Open(HistoryFilename, defs))
+		return;
+
+	time_t now = time(nullptr);
+	for (size_t i = 0; i < Series.Size(); i++) {
+		uint32_t n = HistoryStore.Restore(i, now - HistoryMaxAgeSeconds, now, Series.Get(i).Samples);
+		Series.Reload(i);
+		if (i == 0)
+			printf("Restored %u samples per series from %s\n", n, HistoryFilename.c_str());
+	}
+}
+
 void Monitor::Run() {
-	// Launch DB commit on a separate thread
-	auto dbThreadFunc = [this]() -> void {
-		this->DBThread();
-	};
-	auto dbThread = std::thread(dbThreadFunc);
+	// Every sink writes on its own thread, so that if a DB host goes down, we don't stall the
+	// monitoring, or the other sinks.
+	for (auto& s : Sinks)
+		s->Start();
 
 	// Recent readings
 	RingBuffer<Inverter::Record_QPIGS> recent;
 	recent.Initialize(64);
 
-	// Measured delta between heavy loads off and on (values in here are always positive)
+	// Measured delta between heavy loads off and on, and adjustments from the step detector (values in here are never negative)
 	RingBuffer<History> heavyLoadDeltas;
-	heavyLoadDeltas.Initialize(32);
+	heavyLoadDeltas.Initialize(HeavyLoadDeltasSize);
+	size_t heavyLoadDeltasSeries = Series.Size();
+	time_t startTime             = time(nullptr);
+	HistoryStore.Restore(heavyLoadDeltasSeries, startTime - HistoryMaxAgeSeconds, startTime, heavyLoadDeltas);
 
 	// We do the estimation of heavy load deltas in this function, to avoid storing
 	// the 'recent' and 'heavyLoadDeltas' in the class. The reason why we don't want them
@@ -102,65 +197,91 @@ void Monitor::Run() {
 	// want to introduce another mutex for no reason. In addition, it would be confusing it
 	// have records in the DBQueue, and then another ring buffer for 'recent'.
 
-	auto lastSaveTime = 0;
+	GridLoss.Threshold = (float) GridVoltageThreshold;
+
+	// We sleep until absolute deadlines, so that the time spent talking to the inverter doesn't
+	// stretch our sample period. Save times are measured against the start of each tick, with
+	// half a period of slack, so that a tick that starts a few microseconds early isn't skipped.
+	// The sample period is chosen by Sampler, and it can be much shorter than SecondsBetweenSamples.
+	// The readings in between saves are averaged, so the DB, and our per-sample statistics
+	// (quantiles and profile), see a uniform rate regardless. Energy and battery cycles are
+	// integrated over every reading, because more readings only make them more accurate.
+	Sampler.FastPeriod = FastSamplePeriod;
+	Sampler.IdlePeriod = min(SamplePeriod, SecondsBetweenSamples);
+	SampleDeadline.Start(Sampler.IdlePeriod);
+	ReadingAverage  toSave;
+	vector<Reading> toStore; // Output of Compressor
+	double          lastTickAt = 0;
+	double          nextSaveAt = 0;
 	while (!MustExit) {
-		bool                   saveReading = time(nullptr) - lastSaveTime >= SecondsBetweenSamples;
-		bool                   readOK      = false;
-		Inverter::Record_QPIGS record;
+		double tickAt = MonotonicTime();
+		if (lastTickAt != 0)
+			SamplePeriods.Add(tickAt - lastTickAt);
+		lastTickAt          = tickAt;
+		bool    saveReading = tickAt + SampleDeadline.Period / 2 >= nextSaveAt;
+		bool    readOK      = false;
+		Reading record;
 		for (int attempt = 0; attempt < 3 && !MustExit; attempt++) {
-			// Read the inverter data, and save it to the DB queue if saveReading is true.
-			// Also update the bulk of our stats, except the heavy load estimation, which we a few lines down.
-			readOK = ReadInverterStats(saveReading, &record);
+			// Read the inverter data, and update the bulk of our stats, except the heavy load estimation,
+			// which we do a few lines down.
+			readOK = ReadInverterStats(&record);
 			if (readOK)
 				break;
 		}
+		if (readOK) {
+			toSave.Add(record);
+			SampleDeadline.Period = Sampler.Update(record.Time, record.LoadW, record.ACInV, record.PvW, record.Heavy);
+		}
 		if (readOK && saveReading) {
-			lastSaveTime = time(nullptr);
+			Reading avg = toSave.Get();
+			toSave.Reset();
+			// The rollups see every reading, but the sinks only see the ones that the compressor keeps
+			toStore.clear();
+			Compressor.Add(avg, toStore);
+			for (const auto& k : toStore) {
+				for (auto& s : Sinks)
+					s->Add(k);
+			}
+			UpdateRollups(avg);
+			UpdateQuantiles(avg);
+			UpdateProfile(avg);
+			nextSaveAt += SecondsBetweenSamples;
+			if (nextSaveAt < tickAt)
+				nextSaveAt = tickAt + SecondsBetweenSamples;
 		}
 		if (readOK) {
 			recent.Add(record);
+			uint32_t oldHead = heavyLoadDeltas.Head;
 			AnalyzeRecentReadings(recent, heavyLoadDeltas);
+			UpdateAppliances(record, heavyLoadDeltas);
+			if (heavyLoadDeltas.Head != oldHead)
+				HistoryStore.Write(heavyLoadDeltasSeries, heavyLoadDeltas.Peek(heavyLoadDeltas.Size() - 1));
 		}
-		HeavyLoadWatts = EstimateHeavyLoadWatts(time(nullptr), heavyLoadDeltas);
-		usleep(500 * 1000);
-	};
-
-	dbThread.join();
-}
-
-// DBThread runs on a separate thread to the monitor system, so that if our DB
-// host goes down, we don't stall the monitoring.
-void Monitor::DBThread() {
-	// Our own queue. The ring buffer will automatically eat into it's tail
-	// if it gets too full, so we don't need to do anything special if
-	// we run out of private buffer space. The ring buffer will just drop
-	// the oldest samples.
-	RingBuffer<Inverter::Record_QPIGS> privateQueue;
-	privateQueue.Initialize(256);
-
-	while (!MustExit) {
-		// Suck records out of 'DBQueue', and move them into our private queue.
-		DBQueueLock.lock();
-		while (DBQueue.Size() != 0) {
-			privateQueue.Add(DBQueue.Next());
+		HeavyLoadWatts = EstimateHeavyLoadWatts(WallTime(), heavyLoadDeltas);
+		if (readOK) {
+			UpdateEnergy(record);
+			UpdateBatteryCycles(record);
 		}
-		DBQueueLock.unlock();
+		PrintSeriesStats(time(nullptr));
+		// Confirm a suspected grid loss straight away
+		if (!(readOK && GridLoss.WantRePoll()) && !SampleDeadline.Wait())
+			sleep(1); // Don't spin if we can't sleep until the deadline
+	}
 
-		// As soon as we have enough samples (or we have just one sample, and we've just booted up), send records to the DB
-		if (privateQueue.Size() >= SampleWriteInterval || (privateQueue.Size() >= 1 && !HasWrittenToDB)) {
-			if (CommitReadings(privateQueue)) {
-				privateQueue.Clear();
-			}
-		}
-		sleep(1);
+	toStore.clear();
+	Compressor.Flush(toStore);
+	for (auto& s : Sinks) {
+		for (const auto& k : toStore)
+			s->Add(k);
+		s->Stop();
 	}
 }
 
-bool Monitor::ReadInverterStats(bool saveReading, Inverter::Record_QPIGS* outRecord) {
+bool Monitor::ReadInverterStats(Reading* outRecord) {
 	//printf("Reading QPIGS %f\n", (double) clock() / (double) CLOCKS_PER_SEC);
-	Inverter::Record_QPIGS record;
-	lock_guard<mutex>      lock(InverterLock);
-	auto                   res = Inverter.ExecuteT("QPIGS", record, 0);
+	Reading           record;
+	lock_guard<mutex> lock(InverterLock);
+	auto              res = Inverter.ExecuteT<Inverter::Record_QPIGS>("QPIGS", record, 0);
 	//printf("Reading QPIGS %f done\n", (double) clock() / (double) CLOCKS_PER_SEC);
 	if (res != Inverter::Response::OK) {
 		// Don't repeatedly show the same message, otherwise we end up spamming the logs,
@@ -174,11 +295,14 @@ bool Monitor::ReadInverterStats(bool saveReading, Inverter::Record_QPIGS* outRec
 	}
 	LastReadStatsError = "";
 	record.Heavy       = IsHeavyOnInverter;
-	if (saveReading) {
-		DBQueueLock.lock();
-		DBQueue.Add(record);
-		DBQueueLock.unlock();
+
+	// HeavyLoadWatts and HasGridPower are from the previous reading, but they change slowly
+	ComputeDerived(record, HeavyLoadWatts, HasGridPower);
+	{
+		lock_guard<mutex> lock(LatestLock);
+		Latest = record;
 	}
+
 	UpdateStats(record);
 	if (outRecord) {
 		*outRecord = record;
@@ -190,33 +314,28 @@ bool Monitor::ReadInverterStats(bool saveReading, Inverter::Record_QPIGS* outRec
 // about once every two weeks or so. Initially, I would trust BatP's instantanous
 // reading, but when it drops to zero for a single sample, then our controller
 // freaks out and switches to charge mode.
-void Monitor::UpdateStats(const Inverter::Record_QPIGS& r) {
+// After that, I used the maximum over a 15 to 30 second window, but that delays our
+// reaction to a genuine drop by the length of the window. Now we run the readings
+// that matter through a GlitchFilter, which rejects 1 or 2 sample glitches, but lets
+// genuine changes through on the 3rd sample.
+void Monitor::UpdateStats(const Reading& r) {
 	IsInitialized = true;
 
-	time_t now = time(nullptr);
-
-	GridVHistory.Add({now, r.ACInV});
-	SolarVHistory.Add({now, r.PvV});
-	BatPHistory.Add({now, r.BatP});
-	BatVHistory.Add({now, r.BatV});
-
-	AvgSolarV = Average(now - 60, SolarVHistory);
-
-	LoadWHistory.Add({now, r.LoadW});
-	DeficitWHistory.Add({now, std::max(0.0f, r.LoadW - r.PvW)});
-
-	SolarWHistory.Add({now, r.PvW});
-
-	float filteredSolarV = Maximum(now - 15, SolarVHistory);
-	float filteredBatP   = Maximum(now - 30, BatPHistory);
-	float filteredBatV   = Maximum(now - 30, BatVHistory);
+	// During a burst of fast sampling, Series averages the readings down to its own period
+	if (Series.Update(r.Time, r)) {
+		// Every series has just received one new sample, so mirror that to disk
+		for (size_t i = 0; i < Series.Size(); i++) {
+			const auto& hist = Series.Get(i).Samples;
+			HistoryStore.Write(i, hist.Peek(hist.Size() - 1));
+		}
+	}
 
 	// These numbers are roughly drawn from my Voltronic 5.6kw MKS 4 inverter (aka MKS IV),
 	// but tweaked to be more conservative.
 	bool outputOverload = false;
-	if (Average(now - 6, LoadWHistory) > (float) InverterSustainedW * 0.97f) {
+	if (Series.Average(SeriesLoadW, 6) > (float) InverterSustainedW * 0.97f) {
 		outputOverload = true;
-	} else if (Average(now - 3, LoadWHistory) > (float) InverterSustainedW * 1.1f) {
+	} else if (Series.Average(SeriesLoadW, 3) > (float) InverterSustainedW * 1.1f) {
 		outputOverload = true;
 	} else if (r.LoadW > (float) InverterSustainedW * 1.5f) {
 		outputOverload = true;
@@ -224,179 +343,295 @@ void Monitor::UpdateStats(const Inverter::Record_QPIGS& r) {
 
 	IsOutputOverloaded = outputOverload;
 
-	//printf("Output:  %4.0f %4.0f %4.0f vs %4.0f %4.0f %4.0f, Overloaded: %s\n", Average(now - 10, LoadWHistory), Average(now - 5, LoadWHistory), r.LoadW,
+	//printf("Output:  %4.0f %4.0f %4.0f vs %4.0f %4.0f %4.0f, Overloaded: %s\n", Series.Average(SeriesLoadW, 6), Series.Average(SeriesLoadW, 3), r.LoadW,
 	//       (float) InverterSustainedW * 0.97f, (float) InverterSustainedW * 1.3f, (float) InverterSustainedW * 1.7f, outputOverload ? "yes" : "no");
 
 	// These numbers are drawn from my Pylontech UP5000 battery, with a discharge C of about 0.5
 	bool batteryOverloaded = false;
-	if (Average(now - 2 * 60, DeficitWHistory) > (float) BatteryWh * 0.5f) {
+	if (Series.Average(SeriesDeficitW, 2 * 60) > (float) BatteryWh * 0.5f) {
 		batteryOverloaded = true;
-	} else if (Average(now - 60, DeficitWHistory) > (float) BatteryWh * 0.9f) {
+	} else if (Series.Average(SeriesDeficitW, 60) > (float) BatteryWh * 0.9f) {
 		batteryOverloaded = true;
-	} else if (Average(now - 15, DeficitWHistory) > (float) BatteryWh * 1.2f) {
+	} else if (Series.Average(SeriesDeficitW, 15) > (float) BatteryWh * 1.2f) {
 		batteryOverloaded = true;
-	} else if (Average(now - 5, DeficitWHistory) > (float) BatteryWh * 1.5f) {
+	} else if (Series.Average(SeriesDeficitW, 5) > (float) BatteryWh * 1.5f) {
 		batteryOverloaded = true;
 	}
 
 	IsBatteryOverloaded = batteryOverloaded;
 
-	//printf("Battery: %4.0f %4.0f %4.0f vs %4.0f %4.0f %4.0f, Overloaded: %s\n", Average(now - 4 * 60, DeficitWHistory), Average(now - 60, DeficitWHistory), Average(now - 15, DeficitWHistory),
+	// Don't wait for the controller's loop to notice the overload
+	if ((outputOverload || batteryOverloaded) && IsHeavyOnInverter) {
+		lock_guard<mutex> lock(OverloadCallbackLock);
+		if (OverloadCallback)
+			OverloadCallback(r);
+	}
+
+	//printf("Battery: %4.0f %4.0f %4.0f vs %4.0f %4.0f %4.0f, Overloaded: %s\n", Series.Average(SeriesDeficitW, 2 * 60), Series.Average(SeriesDeficitW, 60), Series.Average(SeriesDeficitW, 15),
 	//       (float) BatteryWh * 0.5f, (float) BatteryWh * 0.9f, (float) BatteryWh * 1.5f, batteryOverloaded ? "yes" : "no");
 
 	// Every now and then the inverter reports zero voltage from the grid for just a single
-	// sample, and we don't want those blips to cause us to change state.
-	HasGridPower = (float) Maximum(now - 5, GridVHistory) > (float) GridVoltageThreshold;
-
-	SolarV      = filteredSolarV;
-	BatteryV    = filteredBatV;
-	BatteryP    = filteredBatP;
-	AvgSolarW   = Average(now - 5 * 60, SolarWHistory);
-	AvgLoadW    = Average(now - 5 * 60, LoadWHistory);
-	AvgBatteryP = Average(now - 10 * 60, BatPHistory);
-	MinBatteryP = Minimum(now - 10 * 60, BatPHistory);
+	// sample, and we don't want those blips to cause us to change state. GridLoss rejects
+	// them, but it declares a genuine loss on the second low reading, which the monitor loop
+	// fetches immediately, instead of waiting for the next sample time.
+	if (GridLoss.Add(r.Time, r.ACInV)) {
+		if (GridLoss.HasGrid())
+			fprintf(stderr, "Grid restored\n");
+		else
+			fprintf(stderr, "Grid lost. Confirmed %.0f ms after the first low reading\n", (GridLoss.LossDetectedAt - GridLoss.FirstLowAt) * 1000);
+	}
+	HasGridPower = GridLoss.HasGrid();
+
+	SolarV        = Series.Last(SeriesSolarV);
+	BatteryV      = Series.Last(SeriesBatV);
+	BatteryP      = Series.Last(SeriesBatP);
+	AvgSolarV     = Series.Average(SeriesSolarV, 60);
+	AvgSolarW     = Series.Average(SeriesSolarW, 5 * 60);
+	AvgLoadW      = Series.Average(SeriesLoadW, 5 * 60);
+	AvgTotalLoadW = Series.Average(SeriesTotalW, 5 * 60);
+	AvgBatteryP   = Series.Average(SeriesBatP, 10 * 60);
+	MinBatteryP   = Series.Minimum(SeriesBatP, 10 * 60);
 
 	//if (!HasGridPower)
 	//	printf("Don't have grid power %f, %f\n", r.ACInHz, (float) GridVoltageThreshold);
 }
 
-static void AddDbl(string& s, double v, bool comma = true) {
-	char buf[100];
-	sprintf(buf, "%.3f", v);
-	s += buf;
-	if (comma)
-		s += ",";
+void Monitor::UpdateEnergy(const Reading& r) {
+	EnergyPower p;
+	p.PvW           = r.PvW;
+	p.LoadW         = r.LoadW;
+	p.BatChargeW    = r.BatChargeW;
+	p.BatDischargeW = r.BatDischargeW;
+	p.HeavyGridW    = r.HeavyGridW;
+
+	vector<EnergyBucket> closed;
+	Energy.Add(r.Time, p, closed);
+	if (closed.size() != 0) {
+		for (auto& s : Sinks)
+			s->Add(closed);
+	}
+
+	time_t now = time(nullptr);
+	if (EnergyFilename != "" && (closed.size() != 0 || now - LastEnergySaveAt >= 60)) {
+		LastEnergySaveAt = now;
+		if (!Energy.Save(EnergyFilename))
+			fprintf(stderr, "Failed to save energy counters to %s\n", EnergyFilename.c_str());
+	}
+}
+
+float Monitor::LoadQuantile(int hour, float p) {
+	lock_guard<mutex> lock(QuantileLock);
+	return Quantiles.LoadW.Quantile(hour, p);
 }
 
-static void AddBool(string& s, bool v, bool comma = true) {
-	char buf[100];
-	sprintf(buf, "%s", v ? "true" : "false");
-	s += buf;
-	if (comma)
-		s += ",";
+float Monitor::SolarQuantile(int hour, float p) {
+	lock_guard<mutex> lock(QuantileLock);
+	return Quantiles.SolarW.Quantile(hour, p);
 }
 
-// This content is duplicated inside dbcreate.sql
-const char* CreateSchemaSQL = R"(
-CREATE TABLE IF NOT EXISTS readings (
-	time TIMESTAMP NOT NULL PRIMARY KEY,
-	acInV REAL,
-	acInHz REAL,
-	acOutV REAL,
-	acOutHz REAL,
-	loadVA REAL,
-	loadW REAL,
-	loadP REAL,
-	busV REAL,
-	batV REAL,
-	batChA REAL,
-	batP REAL,
-	temp REAL,
-	pvA REAL,
-	pvV REAL,
-	pvW REAL,
-	unknown1 REAL,
-	heavy BOOLEAN
-);
-)";
-
-bool Monitor::CommitReadings(RingBuffer<Inverter::Record_QPIGS>& records) {
-	if (records.Size() == 0)
-		return true;
-
-	if (DBMode == DBModes::SQLite && SQLiteFilename == "/dev/null")
-		return true;
-
-	bool postgres = DBMode == DBModes::Postgres;
-
-	string create = CreateSchemaSQL;
-	std::replace(create.begin(), create.end(), '\n', ' ');
-
-	string sql;
-
-	if (postgres) {
-		sql += "SET LOCAL synchronous_commit TO OFF; ";
-		if (!HasWrittenToDB)
-			sql += create;
-	} else {
-		time_t now = time(nullptr);
-		if (!HasWrittenToDB)
-			sql += create + " ";
-		// We assume that our SQLite DB is on a ramdisk, so we limit it's size
-		sql += "DELETE FROM readings WHERE time < ";
-		AddDbl(sql, now - 30 * 24 * 3600, false);
-		sql += "; ";
-	}
-	sql += "INSERT INTO readings (";
-	sql += "time,";
-	sql += "acInV,";
-	sql += "acInHz,";
-	sql += "acOutV,";
-	sql += "acOutHz,";
-	sql += "loadW,";
-	sql += "loadVA,";
-	sql += "loadP,";
-	sql += "batChA,";
-	sql += "batV,";
-	sql += "batP,";
-	sql += "temp,";
-	sql += "pvV,";
-	sql += "pvA,";
-	sql += "pvW,";
-	sql += "unknown1,";
-	sql += "heavy";
-	sql += ") VALUES ";
-	uint32_t nRecords = records.Size();
-	for (size_t i = 0; i < nRecords; i++) {
-		const auto& r = records.Peek(i);
-		sql += "(";
-		if (postgres) {
-			sql += "to_timestamp(";
-			AddDbl(sql, r.Time, false);
-			sql += ") AT TIME ZONE 'UTC',";
-		} else {
-			AddDbl(sql, r.Time);
+// A sketch update is about 50 float operations, so we feed every reading in, and the
+// quantiles converge after a few days.
+// The sketches are saved every 10 minutes. Losing the last few minutes after a crash is
+// irrelevant, because the quantiles are accumulated over months.
+void Monitor::UpdateQuantiles(const Reading& r) {
+	time_t t = (time_t) r.Time;
+	tm     lt;
+	localtime_r(&t, &lt);
+	{
+		lock_guard<mutex> lock(QuantileLock);
+		Quantiles.LoadW.Add(lt.tm_hour, Series.Last(SeriesLoadW));
+		Quantiles.SolarW.Add(lt.tm_hour, Series.Last(SeriesSolarW));
+	}
+
+	time_t now = time(nullptr);
+	if (QuantilesFilename != "" && now - LastQuantileSaveAt >= 10 * 60) {
+		LastQuantileSaveAt = now;
+		QuantileState copy;
+		{
+			lock_guard<mutex> lock(QuantileLock);
+			copy = Quantiles;
 		}
-		AddDbl(sql, r.ACInV);
-		AddDbl(sql, r.ACInHz);
-		AddDbl(sql, r.ACOutV);
-		AddDbl(sql, r.ACOutHz);
-		AddDbl(sql, r.LoadW);
-		AddDbl(sql, r.LoadVA);
-		AddDbl(sql, r.LoadP);
-		AddDbl(sql, r.BatChA);
-		AddDbl(sql, r.BatV);
-		AddDbl(sql, r.BatP);
-		AddDbl(sql, r.Temp);
-		AddDbl(sql, r.PvV);
-		AddDbl(sql, r.PvA);
-		AddDbl(sql, r.PvW);
-		AddDbl(sql, r.Unknown1);
-		AddBool(sql, r.Heavy, false);
-		sql += ")";
-		if (i != nRecords - 1)
-			sql += ",";
-	}
-	// This happens every now and then.. maybe due to rounding error on the seconds.. I'm not actually sure.
-	sql += " ON CONFLICT(time) DO NOTHING";
-	//printf("Send:\n%s\n", sql.c_str());
-	string cmd;
-	if (postgres) {
-		cmd = "PGPASSWORD=" + PostgresPassword +
-		      " psql " +
-		      " --host " + PostgresHost +
-		      " --username " + PostgresUsername +
-		      " --dbname " + PostgresDB +
-		      " --port " + PostgresPort +
-		      " --command \"" + sql + "\"";
-	} else {
-		cmd = "sqlite3 \"" + SQLiteFilename + "\" \"" + sql + "\"";
-	}
-	bool dbWriteOK = system(cmd.c_str()) == 0;
-	if (dbWriteOK) {
-		HasWrittenToDB = true;
-	}
-	return dbWriteOK;
+		if (!SaveStateFile(QuantilesFilename, QuantileStateMagic, QuantileStateVersion, &copy, sizeof(copy)))
+			fprintf(stderr, "Failed to save quantiles to %s\n", QuantilesFilename.c_str());
+	}
+}
+
+// The rollups see the same readings as the sinks, so that their averages are over a uniform sample rate.
+// Rows are sent to the sinks as soon as their bucket closes, and the open buckets are saved every 10 minutes.
+void Monitor::UpdateRollups(const Reading& r) {
+	vector<RollupRow> closed;
+	Rollups.Add(r, closed);
+	if (closed.size() != 0) {
+		for (auto& s : Sinks)
+			s->Add(closed);
+	}
+
+	time_t now = time(nullptr);
+	if (RollupsFilename != "" && now - LastRollupSaveAt >= 10 * 60) {
+		LastRollupSaveAt = now;
+		if (!Rollups.Save(RollupsFilename))
+			fprintf(stderr, "Failed to save rollups to %s\n", RollupsFilename.c_str());
+	}
+}
+
+void Monitor::SetOverloadCallback(std::function<void(const Reading& r)> callback) {
+	lock_guard<mutex> lock(OverloadCallbackLock);
+	OverloadCallback = callback;
+}
+
+bool Monitor::LatestReading(Reading& r) {
+	if (!IsInitialized)
+		return false;
+	lock_guard<mutex> lock(LatestLock);
+	r = Latest;
+	return true;
+}
+
+double Monitor::ExpectedWh(ProfileSeries series, double hours) {
+	lock_guard<mutex> lock(ProfileLock);
+	return Profile.ExpectedWh(series, time(nullptr), hours);
+}
+
+// The profile is folded once every 5 minutes, and we save it a little after that.
+// Like the quantiles, losing a few minutes after a crash doesn't matter.
+void Monitor::UpdateProfile(const Reading& r) {
+	float values[ProfileModel::NumSeries];
+	values[(int) ProfileSeries::LoadW]  = Series.Last(SeriesLoadW);
+	values[(int) ProfileSeries::PvW]    = Series.Last(SeriesSolarW);
+	values[(int) ProfileSeries::HeavyW] = HeavyLoadWatts;
+
+	time_t now = time(nullptr);
+	bool   save;
+	{
+		lock_guard<mutex> lock(ProfileLock);
+		Profile.Add((time_t) r.Time, values);
+		save = ProfileFilename != "" && now - LastProfileSaveAt >= 10 * 60;
+		if (save && !Profile.Save(ProfileFilename))
+			fprintf(stderr, "Failed to save time-of-day profile to %s\n", ProfileFilename.c_str());
+	}
+	if (save)
+		LastProfileSaveAt = now;
+}
+
+// AnalyzeRecentReadings measures the heavy load circuit when we switch it between the grid and
+// the inverter. But while the heavy loads are on the inverter, their appliances switch on and
+// off by themselves (eg an aircon's compressor), and our measurement goes stale. So when the
+// step detector sees an appliance that it believes is on the heavy load circuit, we adjust our
+// estimate by the size of its step.
+void Monitor::UpdateAppliances(const Reading& r, RingBuffer<History>& heavyLoadDeltas) {
+	if (Appliances.Add(r.Time, r.LoadW, r.Heavy)) {
+		const auto& step = Appliances.LastStep();
+		if (!step.Relay && r.Heavy && Appliances.IsHeavyAppliance(step.Signature)) {
+			heavyLoadDeltas.Add({step.Time, max(0.0f, HeavyLoadWatts + step.DeltaW)});
+		}
+	}
+
+	time_t now = time(nullptr);
+	if (AppliancesFilename != "" && now - LastAppliancesSaveAt >= 10 * 60) {
+		LastAppliancesSaveAt = now;
+		if (!Appliances.Save(AppliancesFilename))
+			fprintf(stderr, "Failed to save appliance signatures to %s\n", AppliancesFilename.c_str());
+	}
+}
+
+// We count cycles on the glitch-filtered SOC, because a single glitch to zero
+// would otherwise look like a full discharge cycle.
+void Monitor::UpdateBatteryCycles(const Reading& r) {
+	if (BatteryCycles.Add((time_t) r.Time, Series.Last(SeriesBatP))) {
+		const auto& c = BatteryCycles.Get();
+		fprintf(stderr, "Battery did %.2f equivalent full cycles yesterday (%.1f cycles of any depth)\n", c.PrevDayEFC, c.PrevDayCycles);
+		BatteryCycles.Print(stderr);
+	}
+
+	time_t now = time(nullptr);
+	if (CyclesFilename != "" && now - LastCyclesSaveAt >= 10 * 60) {
+		LastCyclesSaveAt = now;
+		if (!BatteryCycles.Save(CyclesFilename))
+			fprintf(stderr, "Failed to save battery cycle counter to %s\n", CyclesFilename.c_str());
+	}
+}
+
+// Print a table of load and solar quantiles for every hour of the day, for sizing decisions
+void Monitor::PrintQuantiles() {
+	lock_guard<mutex> lock(QuantileLock);
+	fprintf(stderr, "Hour   Load p50   p95   p99   Solar p50   p95   p99\n");
+	for (int h = 0; h < 24; h++) {
+		const auto& load  = Quantiles.LoadW.Hours[h];
+		const auto& solar = Quantiles.SolarW.Hours[h];
+		fprintf(stderr, "%4d %10.0f %5.0f %5.0f %11.0f %5.0f %5.0f\n", h,
+		        load.Quantile(0.5f), load.Quantile(0.95f), load.Quantile(0.99f),
+		        solar.Quantile(0.5f), solar.Quantile(0.95f), solar.Quantile(0.99f));
+	}
+}
+
+// Glitches are rare, so we only bother printing a summary once an hour, and only if something happened.
+// The memory and CPU usage of our series is printed once a day.
+void Monitor::PrintSeriesStats(time_t now) {
+	if (now - LastSeriesStatsAt >= 24 * 60 * 60) {
+		LastSeriesStatsAt = now;
+		Series.PrintStats(stderr);
+		PrintQuantiles();
+		SamplePeriods.Print(stderr, "Sample period");
+		fprintf(stderr, "Missed %llu of %llu sample deadlines\n", (unsigned long long) SampleDeadline.Missed,
+		        (unsigned long long) SampleDeadline.Ticks);
+		SamplePeriods.Reset();
+		Appliances.Print(stderr);
+		fprintf(stderr, "Grid: %llu losses, %llu low readings rejected as blips\n", (unsigned long long) GridLoss.NLosses,
+		        (unsigned long long) GridLoss.NBlips);
+		if (Sampler.IsEnabled())
+			fprintf(stderr, "Adaptive sampling: %llu bursts of activity, %.0f seconds at the fast rate\n",
+			        (unsigned long long) Sampler.NBursts, Sampler.FastSeconds);
+		if (Compressor.Mode != CompressionModes::None)
+			Compressor.PrintStats(stderr);
+	}
+
+	if (now - LastFilterStatsAt < 60 * 60)
+		return;
+	LastFilterStatsAt = now;
+	uint64_t total    = 0;
+	for (size_t i = 0; i < Series.Size(); i++)
+		total += Series.Get(i).Filter.NRejected;
+	if (total == LastFilterStatsTotal)
+		return;
+	LastFilterStatsTotal = total;
+	for (size_t i = 0; i < Series.Size(); i++) {
+		const auto& f = Series.Get(i).Filter;
+		if (f.NRejected != 0)
+			fprintf(stderr, "Glitch filter %s rejected %llu of %llu samples (last rejected value %.1f)\n",
+			        f.Name.c_str(), (unsigned long long) f.NRejected, (unsigned long long) f.NSamples, f.LastRejected);
+	}
+}
+
+void Monitor::AddSink(std::unique_ptr<Sink> sink) {
+	unique_ptr<SinkWorker> w(new SinkWorker(std::move(sink)));
+	w->MinBatchSize     = min(SampleWriteInterval, w->MaxBatchSize);
+	w->DailyWriteBudget = DailyWriteBudget;
+	if (SpoolDirectory != "" && IsVolatileDirectory(SpoolDirectory)) {
+		// A spool in RAM is lost on the reboot or power cut that it's supposed to protect us from
+		fprintf(stderr, "Not spooling readings to %s, because it is on tmpfs or ramfs. Use --spool with a directory on persistent storage.\n",
+		        SpoolDirectory.c_str());
+		SpoolDirectory = "";
+	}
+	if (SpoolDirectory != "")
+		w->SpoolDirectory = SpoolDirectory + "/" + w->GetSink()->Name();
+	Sinks.push_back(std::move(w));
+}
+
+void Monitor::AddConfiguredSinks() {
+	if (SQLiteFilename != "" && SQLiteFilename != "/dev/null") {
+		unique_ptr<SQLiteSink> sink(new SQLiteSink());
+		sink->Configure(SQLiteFilename);
+		AddSink(std::move(sink));
+	}
+	if (UsePostgres) {
+		unique_ptr<PostgresSink> sink(new PostgresSink());
+		sink->Configure(PostgresHost, PostgresPort, PostgresDB, PostgresUsername, PostgresPassword);
+		AddSink(std::move(sink));
+	}
+	if (CsvFilename != "")
+		AddSink(unique_ptr<Sink>(new CsvSink(CsvFilename)));
+	if (ArchiveFilename != "")
+		AddSink(unique_ptr<Sink>(new ArchiveSink(ArchiveFilename)));
 }
 
 } // namespace homepower
\ No newline at end of file
@@ -5,27 +5,41 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <functional>
+#include <memory>
 #include <time.h>
 
 #include "commands.h"
 #include "inverter.h"
 #include "ringbuffer.h"
 #include "monitorUtils.h"
+#include "historyFile.h"
+#include "seriesStore.h"
+#include "energy.h"
+#include "quantileSketch.h"
+#include "profileModel.h"
+#include "rainflow.h"
+#include "histogram.h"
+#include "adaptiveSampler.h"
+#include "gridLossDetector.h"
+#include "stepDetector.h"
+#include "sink.h"
+#include "rollup.h"
+#include "compressor.h"
+#include "timeUtils.h"
 
 namespace homepower {
 
-enum class DBModes {
-	Postgres,
-	SQLite,
-};
-
 class Monitor {
 public:
-	int                SampleWriteInterval   = 12;   // Write to database once every N samples (can be rate-limited to improve SSD endurance).
-	int                SecondsBetweenSamples = 1;    // Record data every N seconds
+	int                SampleWriteInterval   = 12;   // Write to database at least N samples at a time (can be raised to improve SSD endurance). Batches grow when writes are slow.
+	uint64_t           DailyWriteBudget      = 0;    // Bytes per day that each sink aims to write to its storage, for flash endurance. Zero for no budget.
+	double             SamplePeriod          = 1;    // Read the inverter every N seconds when signals are flat. Never slower than SecondsBetweenSamples.
+	double             FastSamplePeriod      = 0;    // Read the inverter every N seconds when signals are changing. Zero is as fast as the link allows. Set equal to SamplePeriod to disable adaptive sampling.
+	double             SecondsBetweenSamples = 1;    // Record data every N seconds. Can be less than 1.
 	int                InverterSustainedW    = 5600; // Rated sustained output power of inverter
 	int                BatteryWh             = 4800; // Size of battery in watt-hours size of battery
-	int                GridVoltageThreshold  = 200;  // Grid voltage below this is considered "grid off"
+	int                GridVoltageThreshold  = 200;  // Grid voltage below this is considered "grid off" (see GridLossDetector)
 	std::atomic<bool>  IsInitialized;                // Set to true once we've made our first successful reading
 	std::atomic<bool>  IsOutputOverloaded;           // Signalled when inverter usage is higher than OverloadThresholdWatts
 	std::atomic<bool>  IsBatteryOverloaded;          // Signalled when we are drawing too much power from the battery
@@ -39,21 +53,36 @@ public:
 	std::atomic<float> AvgBatteryP;                  // Average battery charge percentage (0..100) over last 10 minutes.
 	std::atomic<float> MinBatteryP;                  // Minimum battery charge percentage (0..100) over last 10 minutes. The 10 minutes is important for BMS equalization at 100% SOC.
 	std::atomic<float> HeavyLoadWatts;               // Estimated wattage load on the heavy load circuit alone.
+	std::atomic<float> AvgTotalLoadW;                // Average of Reading::EstimatedTotalLoadW over last 5 minutes
 
 	std::atomic<bool> IsHeavyOnInverter; // Set by Controller - true when heavy loads are on the inverter
 
 	std::mutex          InverterLock; // This is held whenever talking to the Inverter
 	homepower::Inverter Inverter;     // You must hold InverterLock when talking to Inverter
 
-	DBModes DBMode = DBModes::SQLite; // Which database to write to
+	std::string SQLiteFilename  = "/mnt/ramdisk/readings.sqlite"; // Write to this SQLite DB. Empty or /dev/null to disable.
+	std::string CsvFilename     = "";                             // Append readings to this CSV file. Empty to disable.
+	std::string ArchiveFilename = "";                             // Append readings to this compressed archive (see ArchiveWriter). Empty to disable.
+	ReadingCompressor Compressor; // Drops the readings that don't tell the sinks anything new. Configure before Start.
+
+	std::string SpoolDirectory = "/var/lib/homepower/spool"; // Readings that a sink fails to write are spooled in a directory per sink in here, until it comes back. Must be on persistent storage (see Spool). Empty to disable.
+
+	std::string HistoryFilename      = "/mnt/ramdisk/history.bin"; // Memory-mapped copy of our recent history, so that we can restart without warming up again. Empty to disable.
+	int         HistoryMaxAgeSeconds = 60 * 60;                    // On startup, only restore history that is at most this old
 
-	std::string SQLiteFilename = "/mnt/ramdisk/readings.sqlite"; // When DBMode is SQLite, then we write to this sqlite DB
+	std::string EnergyFilename     = "/mnt/ramdisk/energy.bin";     // Persisted state of the hourly and daily energy counters. Empty to disable.
+	std::string QuantilesFilename  = "/mnt/ramdisk/quantiles.bin";  // Persisted load and solar quantiles for every hour of the day. Empty to disable.
+	std::string ProfileFilename    = "/mnt/ramdisk/profile.bin";    // Persisted time-of-day profile of load, solar, and heavy loads. Empty to disable.
+	std::string CyclesFilename     = "/mnt/ramdisk/cycles.bin";     // Persisted battery cycle counter. Empty to disable.
+	std::string AppliancesFilename = "/mnt/ramdisk/appliances.bin"; // Persisted table of appliances learned by the step detector. Empty to disable.
+	std::string RollupsFilename    = "/mnt/ramdisk/rollups.bin";    // Persisted state of the 1 minute and 1 hour rollups that are not yet complete. Empty to disable.
 
-	std::string PostgresHost     = "localhost"; // When DBMode is Postgres, hostname
-	std::string PostgresPort     = "5432";      // When DBMode is Postgres, port
-	std::string PostgresDB       = "power";     // When DBMode is Postgres, db name
-	std::string PostgresUsername = "pi";        // When DBMode is Postgres, username
-	std::string PostgresPassword = "homepower"; // When DBMode is Postgres, password
+	bool        UsePostgres      = false;       // Write to Postgres
+	std::string PostgresHost     = "localhost"; // When UsePostgres, hostname
+	std::string PostgresPort     = "5432";      // When UsePostgres, port
+	std::string PostgresDB       = "power";     // When UsePostgres, db name
+	std::string PostgresUsername = "pi";        // When UsePostgres, username
+	std::string PostgresPassword = "homepower"; // When UsePostgres, password
 
 	Monitor();
 	void Start();
@@ -62,26 +91,95 @@ public:
 	// Execute a command that does not produce any output besides "(ACK",
 	bool RunInverterCmd(std::string cmd);
 
+	// Estimated quantile p (eg 0.95) of load or solar watts during the given hour of the local day (0..23),
+	// over all the days that we've seen. p should be 0.5, 0.95, or 0.99, otherwise we interpolate.
+	// This is cheap enough to call from the controller loop.
+	float LoadQuantile(int hour, float p);
+	float SolarQuantile(int hour, float p);
+
+	// Expected watt-hours of solar, load, or heavy load, from now until 'hours' from now, according
+	// to our time-of-day profile. This is O(1), so the controller can call it every cycle.
+	double ExpectedWh(ProfileSeries series, double hours);
+
+	// Returns the most recent reading, with its derived metrics. Returns false if we haven't read anything yet.
+	bool LatestReading(Reading& r);
+
+	// Register a function that is called on the monitor thread, straight after a reading shows an
+	// output or battery overload while the heavy loads are on the inverter. It holds up the sampling
+	// loop, so it must be quick, and it must not block.
+	// Pass nullptr to unregister. Once this returns, the previous function is no longer running.
+	void SetOverloadCallback(std::function<void(const Reading& r)> callback);
+
+	// Register a sink for our readings, energy buckets, and rollup rows. It gets its own thread
+	// and queue (see SinkWorker). Start registers the sinks that are configured above, and any
+	// others must be registered before Start.
+	void AddSink(std::unique_ptr<Sink> sink);
+
 private:
-	std::mutex                         DBQueueLock;     // Guards access to DBQueue
-	RingBuffer<Inverter::Record_QPIGS> DBQueue;         // Records queued to be written into DB. Guarded by DBQueueLock
-	RingBuffer<History>                SolarVHistory;   // Solar voltage
-	RingBuffer<History>                LoadWHistory;    // Watts output by inverter
-	RingBuffer<History>                DeficitWHistory; // Watts that we needed to draw from the battery or the grid to meet load. This is LoadWatt - SolarWatt
-	RingBuffer<History>                SolarWHistory;   // Watts of solar power generated (could be going to battery or loads)
-	RingBuffer<History>                GridVHistory;    // Grid voltage (for detecting if grid is live or not)
-	RingBuffer<History>                BatVHistory;     // Battery voltage charge
-	RingBuffer<History>                BatPHistory;     // Battery percentage charge
-	std::thread                        Thread;
-	std::atomic<bool>                  MustExit;
-	bool                               HasWrittenToDB = false;
-	std::string                        LastReadStatsError;
+	// Watts of load and solar, for every hour of the day. This is saved as-is to QuantilesFilename.
+	struct QuantileState {
+		HourlyQuantiles LoadW;
+		HourlyQuantiles SolarW;
+	};
+
+	std::mutex                            OverloadCallbackLock; // Guards OverloadCallback. Only contended when registering.
+	std::function<void(const Reading& r)> OverloadCallback;     // See SetOverloadCallback
+
+	std::vector<std::unique_ptr<SinkWorker>> Sinks; // Registered before Start, and never changed after that
+
+	std::mutex                LatestLock;               // Guards Latest
+	Reading                   Latest;                   // Most recent reading. Guarded by LatestLock
+	EnergyCounter             Energy;                   // Only touched by the monitor thread
+	time_t                    LastEnergySaveAt     = 0; // Last time that we saved Energy to EnergyFilename
+	std::mutex                QuantileLock;             // Guards Quantiles
+	QuantileState             Quantiles;                // Guarded by QuantileLock
+	time_t                    LastQuantileSaveAt   = 0; // Last time that we saved Quantiles to QuantilesFilename
+	std::mutex                ProfileLock;              // Guards Profile
+	ProfileModel              Profile;                  // Guarded by ProfileLock
+	time_t                    LastProfileSaveAt    = 0; // Last time that we saved Profile to ProfileFilename
+	RainflowCounter           BatteryCycles;            // Only touched by the monitor thread
+	time_t                    LastCyclesSaveAt     = 0; // Last time that we saved BatteryCycles to CyclesFilename
+	StepDetector              Appliances;               // Only touched by the monitor thread
+	time_t                    LastAppliancesSaveAt = 0; // Last time that we saved Appliances to AppliancesFilename
+	GridLossDetector          GridLoss;                 // Decides HasGridPower. Only touched by the monitor thread
+	AdaptiveSampler           Sampler;                  // Chooses SampleDeadline.Period. Only touched by the monitor thread
+	Deadline                  SampleDeadline;           // Drives the sampling loop. Only touched by the monitor thread
+	Histogram                 SamplePeriods;            // Achieved time between the start of consecutive readings, since the last daily print
+	SeriesStore               Series;                   // History of every field that we keep. Only touched by the monitor thread.
+	HistoryFile               HistoryStore;             // Persistent mirror of Series, and the heavy load deltas
+	std::thread               Thread;
+	std::atomic<bool>         MustExit;
+	Rollup                    Rollups;                  // Only touched by the monitor thread
+	time_t                    LastRollupSaveAt     = 0; // Last time that we saved Rollups to RollupsFilename
+	time_t                    LastFilterStatsAt    = 0; // Last time that we printed glitch filter stats
+	uint64_t                  LastFilterStatsTotal = 0; // Total number of rejections at LastFilterStatsAt
+	time_t                    LastSeriesStatsAt    = 0; // Last time that we printed the memory and CPU usage of Series
+	std::string               LastReadStatsError;
+
+	// Indices into Series, for the series that we make decisions on
+	int SeriesSolarV   = 0; // Solar voltage
+	int SeriesSolarW   = 0; // Watts of solar power generated (could be going to battery or loads)
+	int SeriesLoadW    = 0; // Watts output by inverter
+	int SeriesDeficitW = 0; // Watts that we needed to draw from the battery or the grid to meet load. This is LoadWatt - SolarWatt
+	int SeriesGridV    = 0; // Grid voltage (for detecting if grid is live or not)
+	int SeriesBatV     = 0; // Battery voltage
+	int SeriesBatP     = 0; // Battery percentage charge
+	int SeriesTotalW   = 0; // Estimated total load, including heavy loads that are not on the inverter
 
+	void AddSeries();
+	void OpenHistoryFile();
 	void Run();
-	void DBThread();
-	bool ReadInverterStats(bool saveReading, Inverter::Record_QPIGS* r);
-	void UpdateStats(const Inverter::Record_QPIGS& r);
-	bool CommitReadings(RingBuffer<Inverter::Record_QPIGS>& records);
+	bool ReadInverterStats(Reading* r);
+	void UpdateStats(const Reading& r);
+	void PrintSeriesStats(time_t now);
+	void UpdateEnergy(const Reading& r);
+	void UpdateQuantiles(const Reading& r);
+	void UpdateProfile(const Reading& r);
+	void UpdateBatteryCycles(const Reading& r);
+	void UpdateAppliances(const Reading& r, RingBuffer<History>& heavyLoadDeltas);
+	void PrintQuantiles();
+	void UpdateRollups(const Reading& r);
+	void AddConfiguredSinks();
 };
 
 } // namespace homepower
\ No newline at end of file
@@ -60,7 +60,7 @@ void AnalyzeRecentReadings(RingBuffer<Inverter::Record_QPIGS>& records, RingBuff
 // Given a buffer of delta measurements, estimate the heavy load wattage.
 // The buffer may contain any number of samples, including zero.
 // Also, the most recent samples may be very far in the past.
-float EstimateHeavyLoadWatts(time_t now, const RingBuffer<History>& deltas) {
+float EstimateHeavyLoadWatts(double now, const RingBuffer<History>& deltas) {
 	const int maxHistorySeconds = 60 * 60; // don't look further back than 60 minutes
 	if (deltas.Size() == 0) {
 		return 0;
@@ -90,7 +90,7 @@ float EstimateHeavyLoadWatts(time_t now, const RingBuffer<History>& deltas) {
 	i--;
 
 	// For how many seconds have we observed the same (or more) heavy load wattage?
-	int secondsOfSame = last.Time - deltas.Peek(n - i).Time;
+	int secondsOfSame = (int) (last.Time - deltas.Peek(n - i).Time);
 
 	// If we have no history to look back on, then assume that the present
 	// observation will hold for the next 2 minutes.
@@ -11,12 +11,12 @@
 namespace homepower {
 
 struct History {
-	time_t Time;
+	double Time; // Seconds since unix epoch
 	float  Value;
 };
 
 // Return the average value from the history buffer, going no further back than afterTime
-inline double Average(time_t afterTime, const RingBuffer<History>& history) {
+inline double Average(double afterTime, const RingBuffer<History>& history) {
 	double   sum      = 0;
 	unsigned nsamples = 0;
 	uint32_t idx      = history.Size() - 1;
@@ -34,14 +34,14 @@ inline double Average(time_t afterTime, const RingBuffer<History>& history) {
 }
 
 // Returns the time of the oldest sample in the buffer, or 0 if empty
-inline time_t OldestTime(const RingBuffer<History>& history) {
+inline double OldestTime(const RingBuffer<History>& history) {
 	if (history.Size() == 0)
 		return 0;
 	return history.Peek(0).Time;
 }
 
 // Return the average value from the history buffer, in the time range minTime to maxTime
-inline double Average(time_t minTime, time_t maxTime, const RingBuffer<History>& history) {
+inline double Average(double minTime, double maxTime, const RingBuffer<History>& history) {
 	double   sum      = 0;
 	unsigned nsamples = 0;
 	uint32_t idx      = history.Size() - 1;
@@ -60,7 +60,7 @@ inline double Average(time_t minTime, time_t maxTime, const RingBuffer<History>&
 	return nsamples == 0 ? 0 : sum / (double) nsamples;
 }
 
-inline float Minimum(time_t afterTime, const RingBuffer<History>& history) {
+inline float Minimum(double afterTime, const RingBuffer<History>& history) {
 	float    minv = FLT_MAX;
 	uint32_t idx  = history.Size() - 1;
 	while (true) {
@@ -75,7 +75,7 @@ inline float Minimum(time_t afterTime, const RingBuffer<History>& history) {
 	return minv;
 }
 
-inline float Maximum(time_t afterTime, const RingBuffer<History>& history) {
+inline float Maximum(double afterTime, const RingBuffer<History>& history) {
 	float    maxv = -FLT_MAX;
 	uint32_t idx  = history.Size() - 1;
 	while (true) {
@@ -100,6 +100,6 @@ T Clamp(T v, T vmin, T vmax) {
 }
 
 void  AnalyzeRecentReadings(RingBuffer<Inverter::Record_QPIGS>& records, RingBuffer<History>& heavyLoadDeltas);
-float EstimateHeavyLoadWatts(time_t now, const RingBuffer<History>& deltas);
+float EstimateHeavyLoadWatts(double now, const RingBuffer<History>& deltas);
 
 } // namespace homepower
@@ -0,0 +1,268 @@
+#include "postgresSink.h"
+#include "dbSchema.h"
+#include "timeUtils.h"
+#include <libpq-fe.h>
+#include <endian.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+// Including time
+static const int NumReadingColumns = 1 + NumReadingsColumns;
+
+// Postgres timestamps are microseconds since 2000-01-01
+static const int64_t PostgresEpochMillis = 946684800000LL;
+
+PostgresSink::PostgresSink() {
+	TransactionTime.Initialize(0.0001, 10, 51);
+	CommitTime.Initialize(0.0001, 10, 51);
+}
+
+PostgresSink::~PostgresSink() {
+	Close();
+}
+
+void PostgresSink::Configure(const std::string& host, const std::string& port, const std::string& db, const std::string& user, const std::string& password) {
+	Host     = host;
+	Port     = port;
+	DB       = db;
+	User     = user;
+	Password = password;
+}
+
+bool PostgresSink::Open(const std::string& host, const std::string& port, const std::string& db, const std::string& user, const std::string& password) {
+	Configure(host, port, db, user, password);
+	if (Conn)
+		return true;
+	return Connect();
+}
+
+bool PostgresSink::Connect() {
+	if (MonotonicTime() < RetryAt)
+		return false;
+
+	// The password never goes near a command line, or the environment of a child process
+	const char* keys[]   = {"host", "port", "dbname", "user", "password", "connect_timeout", "application_name", nullptr};
+	const char* values[] = {Host.c_str(), Port.c_str(), DB.c_str(), User.c_str(), Password.c_str(), "10", "homepower", nullptr};
+	Conn                 = PQconnectdbParams(keys, values, 0);
+	if (PQstatus(Conn) != CONNECTION_OK) {
+		fprintf(stderr, "Failed to connect to Postgres %s:%s: %s", Host.c_str(), Port.c_str(), PQerrorMessage(Conn));
+		Fail();
+		return false;
+	}
+
+	// We write a batch every few seconds, so there's no point waiting for the WAL flush on every commit.
+	// A crash of the DB host can lose the last few batches, but it can't corrupt the DB.
+	bool ok = Exec("SET synchronous_commit TO OFF") && Exec(CreateReadingsSQL("readings").c_str()) && Exec(CreateEnergySQL);
+	for (int i = 0; i < Rollup::NumTiers && ok; i++)
+		ok = Exec(CreateRollupSQL(Rollup::TableName(Rollup::TierSeconds[i])).c_str());
+	for (int i = 0; i < NumReadingsAddedColumns && ok; i++) {
+		string sql = string("ALTER TABLE readings ADD COLUMN IF NOT EXISTS ") + ReadingsAddedColumns[i] + " REAL";
+		ok         = Exec(sql.c_str());
+	}
+	// COPY can't skip rows that conflict with existing rows, so we COPY into this table first
+	ok = ok && Exec("CREATE TEMP TABLE readings_batch (LIKE readings) ON COMMIT DELETE ROWS");
+	if (!ok) {
+		Fail();
+		return false;
+	}
+	Backoff = 0;
+	NConnects++;
+	return true;
+}
+
+void PostgresSink::Close() {
+	if (Conn)
+		PQfinish(Conn);
+	Conn = nullptr;
+}
+
+void PostgresSink::Fail() {
+	Close();
+	NFailures++;
+	Backoff = Backoff == 0 ? MinBackoffSeconds : min(Backoff * 2, MaxBackoffSeconds);
+	RetryAt = MonotonicTime() + Backoff;
+}
+
+bool PostgresSink::Exec(const char* sql) {
+	PGresult* res = PQexec(Conn, sql);
+	auto      st  = PQresultStatus(res);
+	bool      ok  = st == PGRES_COMMAND_OK || st == PGRES_TUPLES_OK;
+	if (!ok)
+		fprintf(stderr, "Postgres error: %s", PQresultErrorMessage(res));
+	PQclear(res);
+	return ok;
+}
+
+bool PostgresSink::Copy(const std::string& sql, const std::string& data) {
+	PGresult* res = PQexec(Conn, sql.c_str());
+	bool      ok  = PQresultStatus(res) == PGRES_COPY_IN;
+	if (!ok)
+		fprintf(stderr, "Postgres error: %s", PQresultErrorMessage(res));
+	PQclear(res);
+	if (!ok)
+		return false;
+
+	if (PQputCopyData(Conn, data.data(), (int) data.size()) != 1 || PQputCopyEnd(Conn, nullptr) != 1) {
+		fprintf(stderr, "Postgres error during COPY: %s", PQerrorMessage(Conn));
+		return false;
+	}
+	while ((res = PQgetResult(Conn)) != nullptr) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			fprintf(stderr, "Postgres error during COPY: %s", PQresultErrorMessage(res));
+			ok = false;
+		}
+		PQclear(res);
+	}
+	return ok;
+}
+
+static void Put16(string& buf, int16_t v) {
+	uint16_t x = htobe16((uint16_t) v);
+	buf.append((const char*) &x, 2);
+}
+
+static void Put32(string& buf, int32_t v) {
+	uint32_t x = htobe32((uint32_t) v);
+	buf.append((const char*) &x, 4);
+}
+
+static void Put64(string& buf, int64_t v) {
+	uint64_t x = htobe64((uint64_t) v);
+	buf.append((const char*) &x, 8);
+}
+
+// A REAL column is a 4 byte IEEE float
+static void PutReal(string& buf, float v) {
+	int32_t x;
+	memcpy(&x, &v, 4);
+	Put32(buf, 4);
+	Put32(buf, x);
+}
+
+void PostgresSink::EncodeReadings(const RingBuffer<Reading>& records, std::string& buf) {
+	buf.clear();
+	// Every row is a field count, and a length and value for every column (8 bytes for time, 4 for the rest)
+	buf.reserve(19 + records.Size() * (2 + 12 + NumReadingsColumns * 8) + 2);
+	buf.append("PGCOPY\n\377\r\n\0", 11);
+	Put32(buf, 0); // flags
+	Put32(buf, 0); // header extension length
+	for (uint32_t i = 0; i < records.Size(); i++) {
+		const auto& r = records.Peek(i);
+		Put16(buf, NumReadingColumns);
+		// Times are written with millisecond precision
+		Put32(buf, 8);
+		Put64(buf, ((int64_t) llround(r.Time * 1000) - PostgresEpochMillis) * 1000);
+#define COPY_REAL(column, member, maxError) PutReal(buf, r.member);
+#define COPY_BOOL(column, member) \
+	Put32(buf, 1);                \
+	buf += (char) (r.member ? 1 : 0);
+		HOMEPOWER_READINGS_COLUMNS(COPY_REAL, COPY_BOOL)
+#undef COPY_REAL
+#undef COPY_BOOL
+	}
+	Put16(buf, -1);
+}
+
+// Energy buckets can be written many times (the day buckets are updated every hour), so this is an upsert.
+// There are only a handful of them per batch, so we don't bother with COPY.
+static void AddEnergySQL(string& sql, const vector<EnergyBucket>& energy) {
+	sql += "INSERT INTO energy (time,period,pvWh,loadWh,batChargeWh,batDischargeWh,heavyGridWh) VALUES ";
+	for (size_t i = 0; i < energy.size(); i++) {
+		const auto& e = energy[i];
+		char        buf[300];
+		snprintf(buf, sizeof(buf), "%s(to_timestamp(%lld) AT TIME ZONE 'UTC','%s',%.3f,%.3f,%.3f,%.3f,%.3f)", i == 0 ? "" : ",",
+		         (long long) e.Start, EnergyPeriodToString(e.Period), e.Totals.PvWh, e.Totals.LoadWh, e.Totals.BatChargeWh,
+		         e.Totals.BatDischargeWh, e.Totals.HeavyGridWh);
+		sql += buf;
+	}
+	sql += " ON CONFLICT(time, period) DO UPDATE SET pvWh = excluded.pvWh, loadWh = excluded.loadWh, batChargeWh = excluded.batChargeWh,";
+	sql += " batDischargeWh = excluded.batDischargeWh, heavyGridWh = excluded.heavyGridWh";
+}
+
+// There are only a few rollup rows per batch, so these are also plain upserts
+static void AddRollupSQL(string& sql, const char* table, const vector<RollupRow>& rollups, int seconds) {
+	bool first = true;
+	for (const auto& row : rollups) {
+		if (row.Seconds != seconds)
+			continue;
+		if (first)
+			sql += string("INSERT INTO ") + table + " (" + RollupColumnNames() + ") VALUES ";
+		char buf[100];
+		snprintf(buf, sizeof(buf), "%s(to_timestamp(%lld) AT TIME ZONE 'UTC',%d", first ? "" : ",", (long long) row.Start, (int) row.Count);
+		sql += buf;
+		for (int i = 0; i < RollupRow::NumColumns; i++) {
+			const auto& c = row.Columns[i];
+			snprintf(buf, sizeof(buf), ",%.9g,%.9g,%.9g,%.9g", c.Avg, c.Min, c.Max, c.Last);
+			sql += buf;
+		}
+		sql += ")";
+		first = false;
+	}
+	if (!first)
+		sql += RollupUpsertClause() + ";";
+}
+
+bool PostgresSink::Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) {
+	if (records.Size() == 0 && energy.size() == 0 && rollups.size() == 0)
+		return true;
+	if (Conn && PQstatus(Conn) != CONNECTION_OK)
+		Close();
+	if (!Conn && !Connect())
+		return false;
+
+	double start = MonotonicTime();
+	bool   ok    = Exec("BEGIN");
+	if (ok && records.Size() != 0) {
+		EncodeReadings(records, CopyBuf);
+		ok = Copy(string("COPY readings_batch (") + ReadingsColumnNames + ") FROM STDIN (FORMAT binary)", CopyBuf);
+		if (ok) {
+			string sql = string("INSERT INTO readings (") + ReadingsColumnNames + ") SELECT " + ReadingsColumnNames + " FROM readings_batch";
+			// This used to happen every now and then, when two readings landed in the same second.
+			// Our timestamps now have millisecond precision, but we keep this as a safety net.
+			sql += " ON CONFLICT(time) DO NOTHING";
+			ok = Exec(sql.c_str());
+		}
+	}
+	if (ok && energy.size() != 0) {
+		string sql;
+		AddEnergySQL(sql, energy);
+		ok = Exec(sql.c_str());
+	}
+	if (ok && rollups.size() != 0) {
+		string sql;
+		for (int i = 0; i < Rollup::NumTiers; i++)
+			AddRollupSQL(sql, Rollup::TableName(Rollup::TierSeconds[i]), rollups, Rollup::TierSeconds[i]);
+		ok = sql.empty() || Exec(sql.c_str());
+	}
+
+	double commitStart = MonotonicTime();
+	if (!ok || !Exec("COMMIT")) {
+		// Closing the connection aborts the transaction
+		Fail();
+		return false;
+	}
+	double end = MonotonicTime();
+	TransactionTime.Add(end - start);
+	CommitTime.Add(end - commitStart);
+	NRows += records.Size();
+	return true;
+}
+
+void PostgresSink::PrintStats(FILE* f) {
+	fprintf(f, "Postgres: %llu readings written, %llu connections, %llu failures\n", (unsigned long long) NRows,
+	        (unsigned long long) NConnects, (unsigned long long) NFailures);
+	TransactionTime.Print(f, "Postgres transaction");
+	CommitTime.Print(f, "Postgres commit");
+	TransactionTime.Reset();
+	CommitTime.Reset();
+	NRows     = 0;
+	NConnects = 0;
+	NFailures = 0;
+}
+
+} // namespace homepower
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "sink.h"
+
+struct pg_conn;
+
+namespace homepower {
+
+// PostgresSink writes readings and energy buckets into a Postgres database, using libpq.
+// We used to run psql for every batch, which meant a new TCP connection, authentication, and
+// a new backend process every time, and it put the password on a command line where anybody
+// could see it with ps. Instead, we keep one connection open for the life of the process.
+// Readings are streamed with a binary COPY into a temporary table, and moved from there into
+// 'readings' with a single INSERT ... ON CONFLICT DO NOTHING, so a batch costs a handful of round
+// trips, regardless of its size.
+// If the connection fails, we close it, and wait before reconnecting. The wait doubles after
+// every failure, up to MaxBackoffSeconds, so that a dead DB host doesn't have us spinning on
+// connect timeouts.
+// This is only used by the thread of its SinkWorker.
+class PostgresSink : public Sink {
+public:
+	double    MinBackoffSeconds = 1;  // Wait this long before reconnecting after the first failure
+	double    MaxBackoffSeconds = 60; // Never wait longer than this before reconnecting
+	Histogram TransactionTime;        // Seconds per call to Write, from BEGIN to COMMIT
+	Histogram CommitTime;             // Seconds spent in COMMIT alone
+	uint64_t  NRows     = 0;          // Readings written since the last PrintStats
+	uint64_t  NConnects = 0;          // Successful connections since the last PrintStats
+	uint64_t  NFailures = 0;          // Failed connections or transactions since the last PrintStats
+
+	PostgresSink();
+	~PostgresSink();
+
+	// Remember the connection parameters, without connecting. Write connects when it needs to.
+	// An empty password means libpq will look in PGPASSWORD and ~/.pgpass.
+	void Configure(const std::string& host, const std::string& port, const std::string& db, const std::string& user, const std::string& password);
+
+	// Connect to the DB, unless we're still backing off after a failure
+	bool Open(const std::string& host, const std::string& port, const std::string& db, const std::string& user, const std::string& password);
+	void Close();
+	const char* Name() const override { return "postgres"; }
+	bool IsOpen() const { return Conn != nullptr; }
+
+	// Write a batch of readings, energy buckets, and rollup rows in one transaction. Reconnects if necessary.
+	bool Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) override;
+
+	// Print the latency histograms and counters, and reset them
+	void PrintStats(FILE* f) override;
+
+	// Encode readings in the binary COPY format, with the columns in the order that Write copies them
+	static void EncodeReadings(const RingBuffer<Reading>& records, std::string& buf);
+
+private:
+	std::string Host;
+	std::string Port;
+	std::string DB;
+	std::string User;
+	std::string Password;
+	pg_conn*    Conn    = nullptr;
+	double      RetryAt = 0; // MonotonicTime when we may next try to connect
+	double      Backoff = 0; // Seconds that we waited after the most recent failure
+	std::string CopyBuf;     // Reused between batches, to avoid reallocating
+
+	bool Connect();
+	void Fail();
+	bool Exec(const char* sql);
+	bool Copy(const std::string& sql, const std::string& data);
+};
+
+} // namespace homepower
@@ -0,0 +1,119 @@
+#include "profileModel.h"
+#include "stateFile.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t ProfileStateMagic   = 0x48505031; // HPP1
+static const uint32_t ProfileStateVersion = 1;
+
+ProfileModel::ProfileModel() {
+	S = State();
+	for (int w = 0; w < 2; w++) {
+		for (int s = 0; s < NumSeries; s++)
+			UpdatePrefix(w, s);
+	}
+}
+
+int ProfileModel::SlotOf(time_t t, bool& weekend) {
+	tm lt;
+	localtime_r(&t, &lt);
+	weekend = lt.tm_wday == 0 || lt.tm_wday == 6;
+	return (lt.tm_hour * 3600 + lt.tm_min * 60 + lt.tm_sec) / SlotSeconds;
+}
+
+void ProfileModel::Add(time_t t, const float (&values)[NumSeries]) {
+	time_t slotStart = t - (t % SlotSeconds);
+	if (slotStart != (time_t) S.CurSlotStart) {
+		Fold();
+		S.CurSlotStart = slotStart;
+		S.CurFirst     = t;
+		S.CurCount     = 0;
+		for (int s = 0; s < NumSeries; s++)
+			S.CurSum[s] = 0;
+	}
+	for (int s = 0; s < NumSeries; s++)
+		S.CurSum[s] += values[s];
+	S.CurLast = t;
+	S.CurCount++;
+}
+
+// Fold the current slot into our model.
+// If we only saw a small part of the slot (eg we were restarted), then we discard it,
+// because it's not representative of the whole slot.
+void ProfileModel::Fold() {
+	if (S.CurCount == 0 || S.CurLast - S.CurFirst < SlotSeconds / 2)
+		return;
+	bool weekend;
+	int  slot = SlotOf((time_t) S.CurFirst, weekend);
+	for (int s = 0; s < NumSeries; s++) {
+		ProfileSlot& p     = S.Slots[weekend][s][slot];
+		float        avg   = (float) (S.CurSum[s] / S.CurCount);
+		float        alpha = max(Alpha, 1.0f / (float) (p.NDays + 1));
+		float        delta = avg - p.Mean;
+		// Incremental form of the exponentially weighted variance (Finch, 2009)
+		p.Mean += alpha * delta;
+		p.Var = (1 - alpha) * (p.Var + alpha * delta * delta);
+		p.NDays++;
+		UpdatePrefix(weekend, s);
+	}
+}
+
+void ProfileModel::UpdatePrefix(int weekend, int series) {
+	double* prefix = Prefix[weekend][series];
+	prefix[0]      = 0;
+	for (int i = 0; i < SlotsPerDay; i++)
+		prefix[i + 1] = prefix[i] + S.Slots[weekend][series][i].Mean;
+}
+
+// Sum of the means of slots first .. first+count-1, which must not extend past the end of the day
+double ProfileModel::SumSlots(int weekend, int series, int first, int count) const {
+	return Prefix[weekend][series][first + count] - Prefix[weekend][series][first];
+}
+
+double ProfileModel::ExpectedWh(ProfileSeries series, time_t now, double hours) const {
+	int    s         = (int) series;
+	int    remaining = (int) ceil(hours * 3600 / SlotSeconds);
+	double sumW      = 0;
+	bool   weekend;
+	int    slot = SlotOf(now, weekend);
+	tm     day;
+	localtime_r(&now, &day);
+	while (remaining > 0) {
+		int n = min(remaining, SlotsPerDay - slot);
+		sumW += SumSlots(weekend, s, slot, n);
+		remaining -= n;
+		// Move on to midnight of the next day
+		day.tm_mday++;
+		day.tm_hour  = 0;
+		day.tm_min   = 0;
+		day.tm_sec   = 0;
+		day.tm_isdst = -1;
+		time_t t     = mktime(&day);
+		slot         = SlotOf(t, weekend);
+	}
+	return sumW * SlotSeconds / 3600.0;
+}
+
+const ProfileSlot& ProfileModel::Slot(bool weekend, ProfileSeries series, int slot) const {
+	return S.Slots[weekend][(int) series][slot];
+}
+
+bool ProfileModel::Save(const std::string& filename) const {
+	return SaveStateFile(filename, ProfileStateMagic, ProfileStateVersion, &S, sizeof(S));
+}
+
+bool ProfileModel::Load(const std::string& filename) {
+	if (!LoadStateFile(filename, ProfileStateMagic, ProfileStateVersion, &S, sizeof(S)))
+		return false;
+	for (int w = 0; w < 2; w++) {
+		for (int s = 0; s < NumSeries; s++)
+			UpdatePrefix(w, s);
+	}
+	return true;
+}
+
+} // namespace homepower
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace homepower {
+
+enum class ProfileSeries {
+	LoadW,  // Watts output by the inverter
+	PvW,    // Watts of solar power
+	HeavyW, // Estimated watts of the heavy load circuit
+	COUNT,
+};
+
+// Statistics of one 5 minute slot of the day, over many days
+struct ProfileSlot {
+	float    Mean  = 0; // Exponentially weighted mean of the average watts during this slot
+	float    Var   = 0; // Exponentially weighted variance of the average watts during this slot
+	uint32_t NDays = 0; // Number of days that have contributed to this slot
+};
+
+// ProfileModel learns what a typical day looks like, so that we can predict how
+// much solar power we'll get, and how much power we'll use, over the next few hours.
+// The day is divided into 5 minute slots (in local time), and weekdays are kept
+// separate from weekends.
+// While a slot is current, we accumulate the sum of its samples. When it ends, its
+// average is folded into the slot's exponentially weighted mean and variance. So an
+// update is O(1), and a day's worth of samples has the same weight, regardless of
+// how often we sample.
+// We maintain prefix sums over the slot means, so that the energy expected over
+// any span of time is O(1) to compute.
+class ProfileModel {
+public:
+	static const int SlotSeconds = 5 * 60;
+	static const int SlotsPerDay = 24 * 60 * 60 / SlotSeconds;
+	static const int NumSeries   = (int) ProfileSeries::COUNT;
+
+	float Alpha = 0.1f; // Weight of a new day, once we've seen 1/Alpha days. Before that, all days are weighted equally.
+
+	ProfileModel();
+
+	// Add a sample of each of the series, in the order of ProfileSeries
+	void Add(time_t t, const float (&values)[NumSeries]);
+
+	// Returns the expected watt-hours of the series between 'now' and 'now + hours'.
+	// The current slot is counted from its start, so the result is rounded up to whole slots.
+	double ExpectedWh(ProfileSeries series, time_t now, double hours) const;
+
+	const ProfileSlot& Slot(bool weekend, ProfileSeries series, int slot) const;
+
+	bool Save(const std::string& filename) const;
+	bool Load(const std::string& filename);
+
+	// Returns the slot that t falls into, and whether it is a weekend
+	static int SlotOf(time_t t, bool& weekend);
+
+private:
+	// This is everything that we persist
+	struct State {
+		ProfileSlot Slots[2][NumSeries][SlotsPerDay]; // [weekend][series][slot]
+		int64_t     CurSlotStart;                     // Start time of the slot that we're accumulating
+		int64_t     CurFirst;                         // Time of first sample in current slot
+		int64_t     CurLast;                          // Time of last sample in current slot
+		double      CurSum[NumSeries];                // Sum of samples in current slot
+		uint32_t    CurCount;                         // Number of samples in current slot
+		uint32_t    Padding;
+	};
+	State  S;
+	double Prefix[2][NumSeries][SlotsPerDay + 1]; // Prefix[w][s][i] is the sum of the means of slots 0..i-1
+
+	void   Fold();
+	void   UpdatePrefix(int weekend, int series);
+	double SumSlots(int weekend, int series, int first, int count) const;
+};
+
+} // namespace homepower
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <initializer_list>
+
+namespace homepower {
+
+// QuantileSketch estimates a handful of quantiles of a stream, in constant memory,
+// using the extended P² algorithm (Jain & Chlamtac, with Raatikainen's extension to
+// multiple quantiles).
+// For every quantile that you ask for, we track a marker at that quantile, and a marker
+// half way between it and its neighbours, plus the min and max. Each marker stores an
+// estimate of the value at its quantile (its height), and its position in the sorted
+// stream. When a new sample arrives, the positions are bumped, and any marker that has
+// drifted by more than one position from where it ought to be is nudged towards its
+// ideal position, adjusting its height with a piecewise parabolic fit.
+// An update is O(number of markers), and a query is a scan over the markers.
+//
+// This is a plain old struct, so that arrays of them can be written straight to disk.
+struct QuantileSketch {
+	static const int MaxQuantiles = 4;
+	static const int MaxMarkers   = 2 * MaxQuantiles + 3;
+
+	int      NMarkers = 0;
+	uint64_t Count    = 0;            // Number of samples seen
+	float    P[MaxMarkers];           // Quantile of each marker
+	float    Height[MaxMarkers];      // Estimated value at each marker (or the raw samples, until we've seen NMarkers of them)
+	double   Pos[MaxMarkers];         // Actual position of each marker (1-based)
+	double   DesiredPos[MaxMarkers];  // Ideal position of each marker
+
+	// Quantiles must be sorted, and between 0 and 1 (exclusive)
+	void Reset(std::initializer_list<float> quantiles) {
+		Reset(quantiles.begin(), (int) quantiles.size());
+	}
+
+	void Reset(const float* quantiles, int n) {
+		n        = std::min(n, (int) MaxQuantiles);
+		NMarkers = 2 * n + 3;
+		Count    = 0;
+		P[0]     = 0;
+		for (int i = 0; i < n; i++) {
+			float prev   = i == 0 ? 0 : quantiles[i - 1];
+			P[2 * i + 1] = (prev + quantiles[i]) / 2;
+			P[2 * i + 2] = quantiles[i];
+		}
+		P[NMarkers - 2] = (quantiles[n - 1] + 1) / 2;
+		P[NMarkers - 1] = 1;
+		for (int i = 0; i < NMarkers; i++) {
+			Height[i]     = 0;
+			Pos[i]        = i + 1;
+			DesiredPos[i] = 1 + (NMarkers - 1) * (double) P[i];
+		}
+	}
+
+	void Add(float x) {
+		if (Count < (uint64_t) NMarkers) {
+			// Insertion sort of the first NMarkers samples
+			int i = (int) Count;
+			for (; i > 0 && Height[i - 1] > x; i--)
+				Height[i] = Height[i - 1];
+			Height[i] = x;
+			Count++;
+			return;
+		}
+		Count++;
+
+		int k;
+		if (x < Height[0]) {
+			Height[0] = x;
+			k         = 0;
+		} else if (x >= Height[NMarkers - 1]) {
+			Height[NMarkers - 1] = x;
+			k                    = NMarkers - 2;
+		} else {
+			k = (int) (std::upper_bound(Height, Height + NMarkers, x) - Height) - 1;
+		}
+		for (int i = k + 1; i < NMarkers; i++)
+			Pos[i] += 1;
+		for (int i = 0; i < NMarkers; i++)
+			DesiredPos[i] += P[i];
+
+		for (int i = 1; i < NMarkers - 1; i++) {
+			double d = DesiredPos[i] - Pos[i];
+			if ((d >= 1 && Pos[i + 1] - Pos[i] > 1) || (d <= -1 && Pos[i - 1] - Pos[i] < -1)) {
+				int    s = d > 0 ? 1 : -1;
+				double h = Parabolic(i, s);
+				if (h <= Height[i - 1] || h >= Height[i + 1])
+					h = Height[i] + s * (Height[i + s] - Height[i]) / (Pos[i + s] - Pos[i]);
+				Height[i] = (float) h;
+				Pos[i] += s;
+			}
+		}
+	}
+
+	// Returns the estimated value at quantile p (0..1).
+	// If p is not one of the quantiles that we're tracking, we interpolate between markers.
+	float Quantile(float p) const {
+		if (Count == 0)
+			return 0;
+		if (Count <= (uint64_t) NMarkers) {
+			// We still have all the samples, sorted
+			int i = (int) (p * (float) (Count - 1) + 0.5f);
+			return Height[std::max(0, std::min(i, (int) Count - 1))];
+		}
+		if (p <= P[0])
+			return Height[0];
+		for (int i = 1; i < NMarkers; i++) {
+			if (p <= P[i]) {
+				float t = (p - P[i - 1]) / (P[i] - P[i - 1]);
+				return Height[i - 1] + t * (Height[i] - Height[i - 1]);
+			}
+		}
+		return Height[NMarkers - 1];
+	}
+
+	float Min() const { return Count == 0 ? 0 : Height[0]; }
+	float Max() const { return Count == 0 ? 0 : Height[std::min((int) Count, NMarkers) - 1]; }
+
+private:
+	double Parabolic(int i, int s) const {
+		double n0 = Pos[i - 1], n1 = Pos[i], n2 = Pos[i + 1];
+		double q0 = Height[i - 1], q1 = Height[i], q2 = Height[i + 1];
+		return q1 + s / (n2 - n0) * ((n1 - n0 + s) * (q2 - q1) / (n2 - n1) + (n2 - n1 - s) * (q1 - q0) / (n1 - n0));
+	}
+};
+
+// One QuantileSketch for every hour of the (local) day
+struct HourlyQuantiles {
+	QuantileSketch Hours[24];
+
+	void Reset(std::initializer_list<float> quantiles) {
+		for (int h = 0; h < 24; h++)
+			Hours[h].Reset(quantiles);
+	}
+
+	void  Add(int hour, float x) { Hours[hour].Add(x); }
+	float Quantile(int hour, float p) const { return Hours[hour].Quantile(p); }
+};
+
+} // namespace homepower
@@ -0,0 +1,116 @@
+#include "rainflow.h"
+#include "stateFile.h"
+#include "energy.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t RainflowStateMagic   = 0x48505231; // HPR1
+static const uint32_t RainflowStateVersion = 1;
+
+RainflowCounter::RainflowCounter() {
+	S = State();
+}
+
+bool RainflowCounter::Add(time_t t, float soc) {
+	bool dayEnded = false;
+	if (S.DayStart == 0) {
+		S.DayStart = EnergyCounter::StartOfDay(t);
+	} else if (t >= S.DayStart + 24 * 3600) {
+		// Days can be 23 or 25 hours long when daylight saving changes, so recompute the start of day
+		time_t dayStart = EnergyCounter::StartOfDay(t);
+		if (dayStart != S.DayStart) {
+			S.PrevDayEFC    = S.DayEFC;
+			S.PrevDayCycles = S.DayCycles;
+			S.DayEFC        = 0;
+			S.DayCycles     = 0;
+			S.DayStart      = dayStart;
+			dayEnded        = true;
+		}
+	}
+
+	if (S.StackSize == 0) {
+		Push(soc);
+		S.Extreme = soc;
+		S.Dir     = 0;
+		return dayEnded;
+	}
+
+	float last = S.Stack[S.StackSize - 1];
+	if (S.Dir == 0) {
+		if (fabs(soc - last) >= Hysteresis) {
+			S.Dir     = soc > last ? 1 : -1;
+			S.Extreme = soc;
+		}
+	} else if ((soc - S.Extreme) * S.Dir >= 0) {
+		// Still moving in the same direction
+		S.Extreme = soc;
+	} else if (fabs(soc - S.Extreme) >= Hysteresis) {
+		// Reversed, so Extreme is a turning point
+		Push(S.Extreme);
+		S.Dir     = -S.Dir;
+		S.Extreme = soc;
+	}
+	return dayEnded;
+}
+
+void RainflowCounter::Push(float v) {
+	if (S.StackSize == MaxStack) {
+		Count(fabs(S.Stack[1] - S.Stack[0]), 0.5);
+		RemoveAt(0, 1);
+	}
+	S.Stack[S.StackSize++] = v;
+
+	while (S.StackSize >= 3) {
+		int   n = S.StackSize;
+		float x = fabs(S.Stack[n - 1] - S.Stack[n - 2]);
+		float y = fabs(S.Stack[n - 2] - S.Stack[n - 3]);
+		if (x < y)
+			break;
+		if (n == 3) {
+			// y contains the starting point, so it's a half cycle
+			Count(y, 0.5);
+			RemoveAt(0, 1);
+		} else {
+			Count(y, 1);
+			RemoveAt(n - 3, 2);
+		}
+	}
+}
+
+// range is the depth of the cycle, in percent of SOC
+void RainflowCounter::Count(float range, double cycles) {
+	int bin = min((int) (range * NumBins / 100), NumBins - 1);
+	S.Histogram[bin] += cycles;
+	double efc = cycles * range / 100;
+	S.TotalEFC += efc;
+	S.DayEFC += efc;
+	S.DayCycles += cycles;
+}
+
+// Remove n points from the stack, starting at i
+void RainflowCounter::RemoveAt(int i, int n) {
+	memmove(S.Stack + i, S.Stack + i + n, (S.StackSize - i - n) * sizeof(S.Stack[0]));
+	S.StackSize -= n;
+}
+
+void RainflowCounter::Print(FILE* f) const {
+	fprintf(f, "Battery cycles by depth:");
+	for (int i = 0; i < NumBins; i++)
+		fprintf(f, " %d-%d%%: %.1f", i * 100 / NumBins, (i + 1) * 100 / NumBins, S.Histogram[i]);
+	fprintf(f, ". Total %.1f equivalent full cycles\n", S.TotalEFC);
+}
+
+bool RainflowCounter::Save(const std::string& filename) const {
+	return SaveStateFile(filename, RainflowStateMagic, RainflowStateVersion, &S, sizeof(S));
+}
+
+bool RainflowCounter::Load(const std::string& filename) {
+	return LoadStateFile(filename, RainflowStateMagic, RainflowStateVersion, &S, sizeof(S));
+}
+
+} // namespace homepower
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+namespace homepower {
+
+// RainflowCounter counts battery charge/discharge cycles, and their depths, as the
+// state of charge arrives, so that we can see how hard we're working the battery.
+// We keep a stack of turning points (peaks and valleys), and apply the 3-point
+// rainflow rule (ASTM E1049) whenever a new turning point is confirmed. A cycle is
+// extracted as soon as it closes, so the stack only holds the residue of unclosed
+// half cycles. That residue is a sequence of ever-growing and then ever-shrinking
+// ranges, so on a 0..100 scale it stays small. If it ever does fill up, we count
+// the oldest range as a half cycle and drop it.
+// A turning point is only confirmed once the SOC has moved Hysteresis away from it,
+// so that flickering between two adjacent percentages isn't counted as cycles.
+class RainflowCounter {
+public:
+	static const int MaxStack = 64;
+	static const int NumBins  = 10; // Histogram bins of cycle depth, each 10% wide
+
+	// This is everything that we persist
+	struct State {
+		float    Stack[MaxStack];       // Confirmed turning points, oldest first
+		int32_t  StackSize;             // Number of points in Stack
+		int32_t  Dir;                   // +1 if we're rising from the last turning point, -1 if falling, 0 if we don't know yet
+		float    Extreme;               // Most extreme value since the last turning point
+		float    Padding;
+		double   Histogram[NumBins];    // Number of cycles of each depth, ever (half cycles count as 0.5)
+		double   TotalEFC;              // Equivalent full cycles, ever
+		double   DayEFC;                // Equivalent full cycles today
+		double   DayCycles;             // Number of cycles of any depth today
+		double   PrevDayEFC;            // Equivalent full cycles on the previous day
+		double   PrevDayCycles;         // Number of cycles of any depth on the previous day
+		int64_t  DayStart;              // Start of the day of DayEFC
+	};
+
+	float Hysteresis = 2; // SOC must move this far away from a peak or valley before we consider it a turning point
+
+	RainflowCounter();
+
+	// Add a new SOC (0..100) sample. Returns true if a day has ended, in which case PrevDayEFC and PrevDayCycles
+	// hold the totals of the day that ended.
+	bool Add(time_t t, float soc);
+
+	const State& Get() const { return S; }
+
+	void Print(FILE* f) const; // Print the histogram of cycle depths
+
+	bool Save(const std::string& filename) const;
+	bool Load(const std::string& filename);
+
+private:
+	State S;
+
+	void Push(float v);
+	void Count(float range, double cycles);
+	void RemoveAt(int i, int n);
+};
+
+} // namespace homepower
@@ -0,0 +1,83 @@
+#include "reading.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+void ComputeDerived(Reading& r, float heavyLoadW, bool hasGridPower) {
+	r.DeficitW   = max(0.0f, r.LoadW - r.PvW);
+	r.BatChargeW = r.BatV * r.BatChA;
+	// According to the protocol document, the field after the SCC battery voltage (Unknown1)
+	// is the battery discharge current.
+	r.BatDischargeW = r.BatV * r.Unknown2;
+	r.BatW          = r.BatChargeW - r.BatDischargeW;
+
+	r.HeavyGridW = 0;
+	if (!r.Heavy && hasGridPower)
+		r.HeavyGridW = heavyLoadW;
+
+	// Whatever the inverter puts out (into the loads and the battery), that didn't come from
+	// solar or the battery, must have come from the grid. This ignores the inverter's own losses,
+	// so it's an underestimate.
+	float inverterGridW = 0;
+	if (hasGridPower)
+		inverterGridW = max(0.0f, r.LoadW + r.BatChargeW - r.PvW - r.BatDischargeW);
+	r.GridW = inverterGridW + r.HeavyGridW;
+
+	r.EstimatedTotalLoadW = r.LoadW;
+	if (!r.Heavy)
+		r.EstimatedTotalLoadW += heavyLoadW;
+
+	float actualLoadW = r.LoadW + r.HeavyGridW;
+	if (actualLoadW > 0)
+		r.SelfConsumption = max(0.0f, min(1.0f, 1.0f - r.GridW / actualLoadW));
+	else
+		r.SelfConsumption = 1;
+}
+
+// The fields that ReadingAverage averages
+#define AVERAGED_MEMBER(member) &Reading::member,
+static float Reading::*const AveragedFields[] = {HOMEPOWER_AVERAGED_FIELDS(AVERAGED_MEMBER)};
+#undef AVERAGED_MEMBER
+
+void ReadingAverage::Add(const Reading& r) {
+	if (N == 0) {
+		Time = 0;
+		for (int i = 0; i < NumAveragedFields; i++)
+			Sums[i] = 0;
+	}
+	Time += r.Time;
+	for (int i = 0; i < NumAveragedFields; i++)
+		Sums[i] += r.*AveragedFields[i];
+	Last = r;
+	N++;
+}
+
+Reading ReadingAverage::Get() const {
+	Reading r = Last;
+	if (N == 0)
+		return r;
+	r.Time = Time / N;
+	for (int i = 0; i < NumAveragedFields; i++)
+		r.*AveragedFields[i] = (float) (Sums[i] / N);
+	return r;
+}
+
+void PackReading(const Reading& r, PackedReading& p) {
+	p      = PackedReading();
+	p.Time = r.Time;
+	for (int i = 0; i < NumAveragedFields; i++)
+		p.Values[i] = r.*AveragedFields[i];
+	p.Heavy = r.Heavy ? 1 : 0;
+}
+
+void UnpackReading(const PackedReading& p, Reading& r) {
+	r      = Reading();
+	r.Time = p.Time;
+	for (int i = 0; i < NumAveragedFields; i++)
+		r.*AveragedFields[i] = p.Values[i];
+	r.Heavy = p.Heavy != 0;
+}
+
+} // namespace homepower
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "inverter.h"
+
+namespace homepower {
+
+// A QPIGS record, extended with the values that we derive from it.
+// The derived values are computed once, by ComputeDerived(), as soon as the record has been
+// read from the inverter. Everything downstream (our stats, the energy counters, the DB,
+// the HTTP API, and the Controller) uses these, instead of computing its own.
+struct Reading : Inverter::Record_QPIGS {
+	float DeficitW            = 0; // Watts that we needed to draw from the battery or the grid to meet load: max(0, LoadW - PvW)
+	float BatChargeW          = 0; // Watts going into the battery
+	float BatDischargeW       = 0; // Watts coming out of the battery
+	float BatW                = 0; // Net battery power. Positive when charging, negative when discharging.
+	float HeavyGridW          = 0; // Estimated watts of the heavy loads, when they're on the grid
+	float GridW               = 0; // Estimated watts drawn from the grid, by the inverter and the heavy loads
+	float EstimatedTotalLoadW = 0; // LoadW, plus our estimate of the heavy loads if they're not on the inverter (whether they're on the grid, or off)
+	float SelfConsumption     = 0; // Fraction of our load that was met by solar and battery, instead of the grid (0..1)
+};
+
+// The numeric fields of a Reading, which ReadingAverage averages, and PackedReading keeps
+#define HOMEPOWER_AVERAGED_FIELDS(X) \
+	X(ACInV)                         \
+	X(ACInHz)                        \
+	X(ACOutV)                        \
+	X(ACOutHz)                       \
+	X(LoadVA)                        \
+	X(LoadW)                         \
+	X(LoadP)                         \
+	X(BatP)                          \
+	X(BatChA)                        \
+	X(BusV)                          \
+	X(BatV)                          \
+	X(Temp)                          \
+	X(PvA)                           \
+	X(PvV)                           \
+	X(PvW)                           \
+	X(Unknown1)                      \
+	X(DeficitW)                      \
+	X(BatChargeW)                    \
+	X(BatDischargeW)                 \
+	X(BatW)                          \
+	X(HeavyGridW)                    \
+	X(GridW)                         \
+	X(EstimatedTotalLoadW)           \
+	X(SelfConsumption)
+
+static const int NumAveragedFields = 0 HOMEPOWER_AVERAGED_FIELDS(HOMEPOWER_COUNT_1);
+
+// Compute the derived values of r. heavyLoadW is our estimate of the heavy load circuit
+// (see EstimateHeavyLoadWatts), and hasGridPower is whether the grid is on.
+void ComputeDerived(Reading& r, float heavyLoadW, bool hasGridPower);
+
+// ReadingAverage accumulates the readings between two DB saves. When we sample faster than
+// we save, the saved reading is the average of the burst, instead of whichever reading
+// happened to land closest to the save time, so the DB sees a uniform rate either way.
+// The numeric fields and Time are averaged. The text fields and Heavy come from the most
+// recent reading.
+class ReadingAverage {
+public:
+	void    Add(const Reading& r);
+	Reading Get() const;
+	void    Reset() { N = 0; }
+	int     Count() const { return N; }
+
+private:
+	int     N = 0;
+	double  Time;
+	double  Sums[NumAveragedFields];
+	Reading Last;
+};
+
+// PackedReading holds the numeric fields of a Reading, and Heavy, in a plain old struct
+// that can be written straight to disk. The text fields are not kept.
+struct PackedReading {
+	double  Time;
+	float   Values[NumAveragedFields]; // In the order of HOMEPOWER_AVERAGED_FIELDS
+	uint8_t Heavy;
+	uint8_t Padding[7];
+};
+
+void PackReading(const Reading& r, PackedReading& p);
+void UnpackReading(const PackedReading& p, Reading& r);
+
+} // namespace homepower
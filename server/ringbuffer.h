@@ -1,17 +1,87 @@
 #pragma once
 
 #include <assert.h>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
 
-// A fixed-size power-of-2 ring buffer.
+// A contiguous run of elements inside a RingBuffer
+template <typename T>
+struct RingSpan {
+	T*       Items = nullptr;
+	uint32_t Size  = 0;
+
+	T* begin() const { return Items; }
+	T* end() const { return Items + Size; }
+};
+
+// The contents of a RingBuffer, oldest first, as at most two contiguous runs.
+// Second is only non-empty when the contents wrap around the end of the buffer.
+template <typename T>
+struct RingSpans {
+	RingSpan<T> First;
+	RingSpan<T> Second;
+};
+
+// A fixed-size ring buffer.
 // Max elements in buffer is size - 1
+// The size is normally a power of 2, but any size can be used if you ask for it
+// at Initialize. There is no measurable performance difference, because we wrap
+// indices with a compare instead of a mask.
 template <typename T>
 class RingBuffer {
 public:
+	// Iterates from oldest to newest
+	template <typename BufferT, typename ItemT>
+	class Iterator {
+	public:
+		Iterator(BufferT* buf, uint32_t i) : Buf(buf), I(i) {}
+		ItemT&    operator*() const { return Buf->Items[Buf->Wrap(Buf->Tail + I)]; }
+		ItemT*    operator->() const { return &**this; }
+		Iterator& operator++() {
+			I++;
+			return *this;
+		}
+		bool operator==(const Iterator& b) const { return I == b.I; }
+		bool operator!=(const Iterator& b) const { return I != b.I; }
+
+	private:
+		BufferT* Buf;
+		uint32_t I;
+	};
+	typedef Iterator<RingBuffer, T>             iterator;
+	typedef Iterator<const RingBuffer, const T> const_iterator;
+
 	T*       Items = nullptr;
-	uint32_t Mask  = 0;
+	uint32_t Slots = 0; // Number of allocated items (capacity + 1)
 	uint32_t Tail  = 0;
 	uint32_t Head  = 0;
 
+	RingBuffer() {}
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	RingBuffer(RingBuffer&& b) {
+		*this = std::move(b);
+	}
+
+	RingBuffer& operator=(RingBuffer&& b) {
+		if (this != &b) {
+			Free();
+			Items   = b.Items;
+			Slots   = b.Slots;
+			Tail    = b.Tail;
+			Head    = b.Head;
+			b.Items = nullptr;
+			b.Slots = 0;
+			b.Tail  = 0;
+			b.Head  = 0;
+		}
+		return *this;
+	}
+
 	~RingBuffer() {
 		Free();
 	}
@@ -19,19 +89,19 @@ public:
 	void Free() {
 		delete[] Items;
 		Items = nullptr;
-		Mask  = 0;
+		Slots = 0;
 		Tail  = 0;
 		Head  = 0;
 	}
 
-	// Size must be a power of 2
-	void Initialize(uint32_t size) {
-		if ((size & (size - 1)) != 0 || size < 2) {
+	// Size must be a power of 2, unless allowAnySize is true
+	void Initialize(uint32_t size, bool allowAnySize = false) {
+		if (size < 2 || (!allowAnySize && (size & (size - 1)) != 0)) {
 			assert(false && "size must be a power of 2, and minimum 2");
 		}
 		Free();
 		Items = new T[size];
-		Mask  = size - 1;
+		Slots = size;
 	}
 
 	// Clears all items, but does not free memory
@@ -42,33 +112,144 @@ public:
 
 	// Returns the number of items in the buffer
 	uint32_t Size() const {
-		return (Head - Tail) & Mask;
+		return Head >= Tail ? Head - Tail : Head + Slots - Tail;
+	}
+
+	// Returns the maximum number of items that the buffer can hold
+	uint32_t Capacity() const {
+		return Slots == 0 ? 0 : Slots - 1;
 	}
 
 	// Returns true if the buffer is full
 	bool IsFull() const {
-		return Size() == Mask;
+		return Size() == Capacity();
 	}
 
 	// Peek returns the Tail+i element from the buffer.
 	const T& Peek(uint32_t i) const {
-		return Items[(Tail + i) & Mask];
+		return Items[Wrap(Tail + i)];
+	}
+
+	T& Peek(uint32_t i) {
+		return Items[Wrap(Tail + i)];
 	}
 
 	// Next returns the oldest element from the buffer, and pops it.
 	T Next() {
 		uint32_t t = Tail;
-		Tail       = (Tail + 1) & Mask;
-		return Items[t & Mask];
+		Tail       = Wrap(Tail + 1);
+		return std::move(Items[t]);
 	}
 
 	// Add an item.
 	// Pop the oldest item if the buffer is full.
 	void Add(const T& item) {
-		if (IsFull()) {
-			Next();
+		Slot() = item;
+	}
+
+	void Add(T&& item) {
+		Slot() = std::move(item);
+	}
+
+	// Assign a newly constructed item to the next slot, and return it.
+	// Pop the oldest item if the buffer is full.
+	template <typename... Args>
+	T& Emplace(Args&&... args) {
+		T& s = Slot();
+		s    = T{std::forward<Args>(args)...};
+		return s;
+	}
+
+	// Add n items, copying them one contiguous run at a time.
+	// If n is larger than our capacity, then only the last Capacity() items are kept.
+	// Use std::make_move_iterator to move instead of copy.
+	template <typename InputIt>
+	void AddRange(InputIt items, size_t n) {
+		uint32_t cap = Capacity();
+		if (n > cap) {
+			std::advance(items, n - cap);
+			n = cap;
+		}
+		uint32_t count = (uint32_t) n;
+		uint32_t free  = cap - Size();
+		if (count > free)
+			Tail = Wrap(Tail + (count - free));
+		while (count != 0) {
+			uint32_t run = std::min(count, Slots - Head);
+			for (uint32_t i = 0; i < run; i++, ++items)
+				Items[Head + i] = *items;
+			Head = Wrap(Head + run);
+			count -= run;
+		}
+	}
+
+	void AddRange(const T* items, size_t n) {
+		AddRange<const T*>(items, n);
+	}
+
+	// Move all of our items into dst (evicting dst's oldest items if necessary), and clear ourselves.
+	// Returns the number of items moved.
+	uint32_t DrainTo(RingBuffer& dst) {
+		uint32_t n = Size();
+		auto     s = Spans();
+		dst.AddRange(std::make_move_iterator(s.First.Items), s.First.Size);
+		dst.AddRange(std::make_move_iterator(s.Second.Items), s.Second.Size);
+		Clear();
+		return n;
+	}
+
+	// Move all of our items onto the end of dst, and clear ourselves.
+	// Returns the number of items moved.
+	uint32_t DrainTo(std::vector<T>& dst) {
+		uint32_t n = Size();
+		auto     s = Spans();
+		dst.reserve(dst.size() + n);
+		dst.insert(dst.end(), std::make_move_iterator(s.First.begin()), std::make_move_iterator(s.First.end()));
+		dst.insert(dst.end(), std::make_move_iterator(s.Second.begin()), std::make_move_iterator(s.Second.end()));
+		Clear();
+		return n;
+	}
+
+	// Returns our contents, oldest first, as one or two contiguous runs
+	RingSpans<T> Spans() {
+		return MakeSpans<T>(Items);
+	}
+
+	RingSpans<const T> Spans() const {
+		return MakeSpans<const T>(Items);
+	}
+
+	iterator       begin() { return iterator(this, 0); }
+	iterator       end() { return iterator(this, Size()); }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, Size()); }
+
+private:
+	// i must be less than 2 * Slots
+	uint32_t Wrap(uint32_t i) const {
+		return i >= Slots ? i - Slots : i;
+	}
+
+	// Returns the slot for a new item, popping the oldest item if the buffer is full
+	T& Slot() {
+		if (IsFull())
+			Tail = Wrap(Tail + 1);
+		T& s = Items[Head];
+		Head = Wrap(Head + 1);
+		return s;
+	}
+
+	template <typename U>
+	RingSpans<U> MakeSpans(U* items) const {
+		RingSpans<U> s;
+		s.First.Items = items + Tail;
+		if (Head >= Tail) {
+			s.First.Size = Head - Tail;
+		} else {
+			s.First.Size   = Slots - Tail;
+			s.Second.Items = items;
+			s.Second.Size  = Head;
 		}
-		Items[Head] = item;
-		Head        = (Head + 1) & Mask;
+		return s;
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,145 @@
+#include "rollup.h"
+#include "stateFile.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t RollupStateMagic   = 0x48505531; // HPU1
+static const uint32_t RollupStateVersion = 1;
+
+const int Rollup::TierSeconds[NumTiers] = {60, 3600};
+
+static const char* ColumnNames[RollupRow::NumColumns] = {
+    "acInV",
+    "acInHz",
+    "acOutV",
+    "acOutHz",
+    "loadVA",
+    "loadW",
+    "loadP",
+    "batV",
+    "batChA",
+    "batP",
+    "temp",
+    "pvA",
+    "pvV",
+    "pvW",
+    "heavy",
+    "deficitW",
+    "batW",
+    "gridW",
+    "totalLoadW",
+    "selfConsumption",
+};
+
+Rollup::Rollup() {
+	memset(&S, 0, sizeof(S));
+	for (int i = 0; i < NumTiers; i++)
+		S.Cur[i].Seconds = TierSeconds[i];
+}
+
+const char* Rollup::ColumnName(int i) {
+	return ColumnNames[i];
+}
+
+const char* Rollup::TableName(int seconds) {
+	return seconds == 60 ? "readings_1m" : "readings_1h";
+}
+
+void Rollup::Values(const Reading& r, float* v) {
+	int i  = 0;
+	v[i++] = r.ACInV;
+	v[i++] = r.ACInHz;
+	v[i++] = r.ACOutV;
+	v[i++] = r.ACOutHz;
+	v[i++] = r.LoadVA;
+	v[i++] = r.LoadW;
+	v[i++] = r.LoadP;
+	v[i++] = r.BatV;
+	v[i++] = r.BatChA;
+	v[i++] = r.BatP;
+	v[i++] = r.Temp;
+	v[i++] = r.PvA;
+	v[i++] = r.PvV;
+	v[i++] = r.PvW;
+	v[i++] = r.Heavy ? 1 : 0; // So the average is the fraction of the time that the heavy loads were on the inverter
+	v[i++] = r.DeficitW;
+	v[i++] = r.BatW;
+	v[i++] = r.GridW;
+	v[i++] = r.EstimatedTotalLoadW;
+	v[i++] = r.SelfConsumption;
+}
+
+time_t Rollup::BucketStart(time_t t, int seconds) {
+	tm lt;
+	localtime_r(&t, &lt);
+	time_t local = t + lt.tm_gmtoff;
+	return t - (local % seconds);
+}
+
+void Rollup::Add(const Reading& r, std::vector<RollupRow>& closed) {
+	float v[RollupRow::NumColumns];
+	Values(r, v);
+	Add(r.Time, v, closed);
+}
+
+void Rollup::Add(double t, const float* values, std::vector<RollupRow>& closed) {
+	for (int tier = 0; tier < NumTiers; tier++) {
+		RollupRow& cur  = S.Cur[tier];
+		double*    sums = S.Sums[tier];
+		if (cur.Count != 0 && t < cur.Start) {
+			// The clock went backwards, so throw away the bucket that we were busy with
+			cur.Count = 0;
+		}
+		FlushTier(tier, t, closed);
+		if (cur.Count == 0) {
+			cur.Start = BucketStart((time_t) floor(t), cur.Seconds);
+			for (int i = 0; i < RollupRow::NumColumns; i++) {
+				sums[i]            = 0;
+				cur.Columns[i].Min = values[i];
+				cur.Columns[i].Max = values[i];
+			}
+		}
+		for (int i = 0; i < RollupRow::NumColumns; i++) {
+			RollupStats& s = cur.Columns[i];
+			sums[i] += values[i];
+			s.Min  = min(s.Min, values[i]);
+			s.Max  = max(s.Max, values[i]);
+			s.Last = values[i];
+		}
+		cur.Count++;
+	}
+}
+
+void Rollup::Flush(double t, std::vector<RollupRow>& closed) {
+	for (int tier = 0; tier < NumTiers; tier++)
+		FlushTier(tier, t, closed);
+}
+
+void Rollup::FlushTier(int tier, double t, std::vector<RollupRow>& closed) {
+	RollupRow& cur = S.Cur[tier];
+	if (cur.Count == 0 || t < cur.Start + cur.Seconds)
+		return;
+	for (int i = 0; i < RollupRow::NumColumns; i++)
+		cur.Columns[i].Avg = (float) (S.Sums[tier][i] / cur.Count);
+	closed.push_back(cur);
+	cur.Count = 0;
+}
+
+bool Rollup::Save(const std::string& filename) const {
+	return SaveStateFile(filename, RollupStateMagic, RollupStateVersion, &S, sizeof(S));
+}
+
+bool Rollup::Load(const std::string& filename, time_t now, std::vector<RollupRow>& closed) {
+	if (!LoadStateFile(filename, RollupStateMagic, RollupStateVersion, &S, sizeof(S)))
+		return false;
+	// Close whatever has ended while we were down
+	Flush((double) now, closed);
+	return true;
+}
+
+} // namespace homepower
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "reading.h"
+
+namespace homepower {
+
+// The summary of one column of 'readings', over one bucket of time
+struct RollupStats {
+	float Avg;
+	float Min;
+	float Max;
+	float Last;
+};
+
+// One row of readings_1m or readings_1h
+struct RollupRow {
+	static const int NumColumns = 20;
+
+	int64_t     Start;               // Start of the bucket, in seconds since the unix epoch
+	int32_t     Seconds;             // Length of the bucket (60 or 3600)
+	int32_t     Count;               // Number of readings in the bucket
+	RollupStats Columns[NumColumns]; // In the order of Rollup::ColumnName
+};
+
+// Rollup summarizes the readings that we write to the DB into buckets of 1 minute and 1 hour,
+// with the average, min, max, and last value of every column. Long-range dashboards can query
+// the small rollup tables, instead of aggregating millions of rows of 'readings' on every refresh.
+// A row is emitted as soon as a reading arrives that is past the end of its bucket, so the cost
+// of a reading is O(number of columns), and we never need to look at a reading twice.
+// Buckets are aligned to local time, like our energy buckets, so that hours line up with the
+// clock, even in timezones that are not a whole number of hours from UTC.
+// We feed it the same readings that we write to 'readings', so the averages are over a uniform
+// sample rate, even when we're sampling the inverter in bursts.
+class Rollup {
+public:
+	static const int NumTiers = 2;
+	static const int TierSeconds[NumTiers]; // 60 and 3600
+
+	Rollup();
+
+	// Add a reading. Buckets that it closes are appended to 'closed'.
+	void Add(const Reading& r, std::vector<RollupRow>& closed);
+
+	// Add the values of the columns, in the order of ColumnName
+	void Add(double t, const float* values, std::vector<RollupRow>& closed);
+
+	// Close the buckets that end at or before t
+	void Flush(double t, std::vector<RollupRow>& closed);
+
+	bool Save(const std::string& filename) const;
+
+	// Load state written by Save. Buckets that have ended while we were down are appended to 'closed'.
+	bool Load(const std::string& filename, time_t now, std::vector<RollupRow>& closed);
+
+	// Name of column i of 'readings' that we summarize
+	static const char* ColumnName(int i);
+
+	// Extract the values of our columns from a reading, in the order of ColumnName
+	static void Values(const Reading& r, float* values);
+
+	// Name of the table of the tier with buckets of the given length (eg readings_1m)
+	static const char* TableName(int seconds);
+
+	// Start of the bucket of the given length that t falls into
+	static time_t BucketStart(time_t t, int seconds);
+
+private:
+	// This is everything that we persist
+	struct State {
+		RollupRow Cur[NumTiers];                         // The bucket that we're busy with, in each tier
+		double    Sums[NumTiers][RollupRow::NumColumns]; // Sums of the values in Cur
+	};
+	State S;
+
+	void FlushTier(int tier, double t, std::vector<RollupRow>& closed);
+};
+
+} // namespace homepower
@@ -0,0 +1,154 @@
+#include "seriesStore.h"
+#include "timeUtils.h"
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+// Samples are stored no closer together than this fraction of Period, so that a little jitter in
+// a steady stream of records doesn't merge them.
+static const double MinSpacing = 0.9;
+
+int SeriesStore::Add(const char* name, uint32_t capacity, Extractor extract, std::initializer_list<int> windows, int filterWindow, float filterMinDeviation) {
+	All.emplace_back();
+	Series& s = All.back();
+	s.Name    = name;
+	s.Extract = extract;
+	for (int w : windows) {
+		Window win;
+		win.Seconds = w;
+		s.Windows.push_back(win);
+		capacity = max(capacity, (uint32_t) ceil(w / (Period * MinSpacing)) + 1);
+	}
+	s.Samples.Initialize(capacity + 1, true);
+	sort(s.Windows.begin(), s.Windows.end(), [](const Window& a, const Window& b) { return a.Seconds < b.Seconds; });
+	if (filterWindow != 0) {
+		s.UseFilter = true;
+		s.Filter.Configure(name, filterWindow, filterMinDeviation);
+	}
+	return (int) All.size() - 1;
+}
+
+bool SeriesStore::Update(double now, const Reading& r) {
+	double start = MonotonicTime();
+	bool   store = now - LastStored >= Period * MinSpacing;
+	NPending++;
+	for (auto& s : All) {
+		float v = s.Extract(r);
+		if (s.UseFilter)
+			v = s.Filter.Filter(v);
+		s.Last = v;
+		s.Pending += v;
+		if (store) {
+			AddToWindows(now, s, (float) (s.Pending / (double) NPending));
+			s.Pending = 0;
+		}
+	}
+	if (store) {
+		NPending   = 0;
+		LastStored = now;
+	}
+	NUpdates++;
+	Seconds += MonotonicTime() - start;
+	return store;
+}
+
+void SeriesStore::Reload(int series) {
+	Series& s = All[series];
+	s.NAdded  = s.Samples.Size();
+	for (auto& win : s.Windows) {
+		win.Sum   = 0;
+		win.Count = 0;
+		win.MinQ.clear();
+		win.MaxQ.clear();
+		for (uint64_t seq = 0; seq < s.NAdded; seq++)
+			PushToWindow(s, win, seq);
+	}
+	if (s.NAdded != 0)
+		s.Last = s.Samples.Peek(s.Samples.Size() - 1).Value;
+}
+
+const History& SeriesStore::Sample(const Series& s, uint64_t seq) {
+	return s.Samples.Peek((uint32_t) (seq - (s.NAdded - s.Samples.Size())));
+}
+
+// Drop the oldest sample of the window
+void SeriesStore::Expire(Series& s, Window& win) {
+	uint64_t seq = s.NAdded - win.Count;
+	win.Sum -= Sample(s, seq).Value;
+	win.Count--;
+	if (win.MinQ.front() == seq)
+		win.MinQ.pop_front();
+	if (win.MaxQ.front() == seq)
+		win.MaxQ.pop_front();
+}
+
+// Add the sample with the given sequence number, which must be the newest sample, to the window
+void SeriesStore::PushToWindow(Series& s, Window& win, uint64_t seq) {
+	float v = Sample(s, seq).Value;
+	win.Sum += v;
+	win.Count++;
+	while (!win.MinQ.empty() && Sample(s, win.MinQ.back()).Value >= v)
+		win.MinQ.pop_back();
+	win.MinQ.push_back(seq);
+	while (!win.MaxQ.empty() && Sample(s, win.MaxQ.back()).Value <= v)
+		win.MaxQ.pop_back();
+	win.MaxQ.push_back(seq);
+}
+
+void SeriesStore::AddToWindows(double now, Series& s, float v) {
+	// If the buffer is full, the oldest sample is about to be overwritten, so it must leave
+	// the windows that still hold it (ie windows that reach back further than our capacity).
+	if (s.Samples.IsFull()) {
+		for (auto& win : s.Windows) {
+			if (win.Count == s.Samples.Size())
+				Expire(s, win);
+		}
+	}
+	uint64_t seq = s.NAdded;
+	s.Samples.Add({now, v});
+	s.NAdded++;
+
+	for (auto& win : s.Windows) {
+		PushToWindow(s, win, seq);
+
+		// The new sample is always inside the window, so this never empties it
+		while (Sample(s, s.NAdded - win.Count).Time < now - win.Seconds)
+			Expire(s, win);
+		if (win.Count == 1)
+			win.Sum = v; // Shed the rounding error that accumulates in the running sum
+
+		win.Avg = (float) (win.Sum / (double) win.Count);
+		win.Min = Sample(s, win.MinQ.front()).Value;
+		win.Max = Sample(s, win.MaxQ.front()).Value;
+	}
+}
+
+const SeriesStore::Window& SeriesStore::Agg(int series, int seconds) const {
+	for (const auto& w : All[series].Windows) {
+		if (w.Seconds == seconds)
+			return w;
+	}
+	assert(false && "Window was not declared");
+	static Window empty;
+	return empty;
+}
+
+void SeriesStore::PrintStats(FILE* f) const {
+	size_t totalBytes = 0;
+	fprintf(f, "%-10s %8s %8s %7s\n", "Series", "Capacity", "Bytes", "Windows");
+	for (const auto& s : All) {
+		size_t bytes = (s.Samples.Capacity() + 1) * sizeof(History) + sizeof(Series);
+		for (const auto& w : s.Windows)
+			bytes += sizeof(Window) + (w.MinQ.size() + w.MaxQ.size()) * sizeof(uint64_t);
+		totalBytes += bytes;
+		fprintf(f, "%-10s %8u %8u %7u\n", s.Name.c_str(), s.Samples.Capacity(), (unsigned) bytes, (unsigned) s.Windows.size());
+	}
+	double us = NUpdates == 0 ? 0 : 1e6 * Seconds / (double) NUpdates;
+	fprintf(f, "Total series memory: %u bytes. %llu updates, %.1f us/update\n", (unsigned) totalBytes, (unsigned long long) NUpdates, us);
+}
+
+} // namespace homepower
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <initializer_list>
+
+#include "ringbuffer.h"
+#include "monitorUtils.h"
+#include "glitchFilter.h"
+#include "reading.h"
+
+namespace homepower {
+
+// SeriesStore is a registry of History buffers, each of which is fed by one
+// field of the QPIGS record (or something derived from it).
+// Every series declares its capacity and the windows (in seconds) over which we want
+// aggregates. On every record, all series are updated, and all of their window
+// aggregates are brought up to date. Every window keeps a running sum, and a monotonic
+// queue of candidates for its min and max, so an update adds the new sample and drops
+// the samples that have fallen out of the window, instead of rescanning the window.
+// The cost per record is constant, no matter how long the windows are, or how fast we sample.
+// Samples are stored at most once per Period (give or take some jitter). Records that arrive
+// faster than that (eg during a burst of fast sampling) are averaged into the next sample, so
+// the windows always cover the time that they say they do.
+class SeriesStore {
+public:
+	typedef float (*Extractor)(const Reading& r);
+
+	// Aggregates over the most recent Seconds of a series
+	struct Window {
+		int      Seconds = 0;
+		float    Avg     = 0;        // 0 if there are no samples
+		float    Min     = FLT_MAX;  // FLT_MAX if there are no samples
+		float    Max     = -FLT_MAX; // -FLT_MAX if there are no samples
+		uint32_t Count   = 0;        // Number of samples in the window. These are the newest Count samples of the series.
+
+		double               Sum = 0; // Sum of the samples in the window
+		std::deque<uint64_t> MinQ;    // Sequence numbers of the samples that could still become the min, oldest first
+		std::deque<uint64_t> MaxQ;    // Sequence numbers of the samples that could still become the max, oldest first
+	};
+
+	struct Series {
+		std::string         Name;
+		Extractor           Extract = nullptr;
+		RingBuffer<History> Samples;
+		std::vector<Window> Windows; // Sorted by Seconds
+		bool                UseFilter = false;
+		GlitchFilter        Filter;
+		float               Last    = 0; // Most recent value (after filtering)
+		double              Pending = 0; // Sum of the values that have arrived since the last sample was stored
+		uint64_t            NAdded  = 0; // Number of samples ever added. This is the sequence number of the next sample.
+	};
+
+	double Period = 1; // Seconds between samples. Set this before adding series, because it decides their capacities.
+
+	// Add a series, and return its index.
+	// The capacity is raised if necessary, so that the longest window fits at one sample per Period.
+	// filterWindow = 0 disables the glitch filter. See GlitchFilter for the filter parameters.
+	int Add(const char* name, uint32_t capacity, Extractor extract, std::initializer_list<int> windows = {}, int filterWindow = 0, float filterMinDeviation = 0);
+
+	// Add a record to every series. Returns true if a sample was stored (see Period).
+	bool Update(double now, const Reading& r);
+
+	// Rebuild the windows of a series from its Samples, after they were filled from outside
+	// (eg restored from the history file). The windows are trimmed to length on the next Update.
+	void Reload(int series);
+
+	size_t        Size() const { return All.size(); }
+	Series&       Get(int series) { return All[series]; }
+	const Series& Get(int series) const { return All[series]; }
+
+	// Returns the aggregates over the given window, which must have been declared in Add()
+	const Window& Agg(int series, int seconds) const;
+
+	float Last(int series) const { return All[series].Last; }
+	float Average(int series, int seconds) const { return Agg(series, seconds).Avg; }
+	float Minimum(int series, int seconds) const { return Agg(series, seconds).Min; }
+	float Maximum(int series, int seconds) const { return Agg(series, seconds).Max; }
+
+	// Print memory and CPU usage of every series
+	void PrintStats(FILE* f) const;
+
+private:
+	std::vector<Series> All;
+	uint64_t            NUpdates   = 0;
+	double              Seconds    = 0;     // Total time spent in Update
+	uint32_t            NPending   = 0;     // Number of records in Series::Pending
+	double              LastStored = -1e30; // Time of the last sample that we stored
+
+	static void           AddToWindows(double now, Series& s, float v);
+	static void           PushToWindow(Series& s, Window& win, uint64_t seq);
+	static void           Expire(Series& s, Window& win);
+	static const History& Sample(const Series& s, uint64_t seq);
+};
+
+} // namespace homepower
@@ -37,7 +37,8 @@ int main(int argc, char** argv) {
 	bool enableAutoCharge = false;
 	bool debug            = false;
 	//bool               enablePowerSourceTimer     = false;
-	bool               showHelp = false;
+	bool               showHelp        = false;
+	bool               sqliteSpecified = false;
 	homepower::Monitor monitor;
 	int                defaultInverterWatts       = monitor.InverterSustainedW;
 	int                defaultBatteryWattHours    = monitor.BatteryWh;
@@ -77,6 +78,9 @@ int main(int argc, char** argv) {
 			i++;
 		} else if (i + 1 < argc && (equals(arg, "-p"))) {
 			auto parts = split(argv[i + 1], ':');
+			// A trailing empty password produces only 4 parts
+			if (parts.size() == 4)
+				parts.push_back("");
 			if (parts.size() != 5) {
 				fprintf(stderr, "Invalid Postgres specification. Must be in the form host:port:db:user:password\n");
 				return 1;
@@ -86,11 +90,50 @@ int main(int argc, char** argv) {
 			monitor.PostgresDB       = parts[2];
 			monitor.PostgresUsername = parts[3];
 			monitor.PostgresPassword = parts[4];
-			monitor.DBMode           = homepower::DBModes::Postgres;
+			monitor.UsePostgres      = true;
 			i++;
 		} else if (i + 1 < argc && (equals(arg, "-l"))) {
 			monitor.SQLiteFilename = argv[i + 1];
-			monitor.DBMode         = homepower::DBModes::SQLite;
+			sqliteSpecified        = true;
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--csv"))) {
+			monitor.CsvFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--archive"))) {
+			monitor.ArchiveFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--spool"))) {
+			monitor.SpoolDirectory = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--history"))) {
+			monitor.HistoryFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--energy"))) {
+			monitor.EnergyFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--quantiles"))) {
+			monitor.QuantilesFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--profile"))) {
+			monitor.ProfileFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--period"))) {
+			monitor.SamplePeriod = atof(argv[i + 1]);
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--fast-period"))) {
+			monitor.FastSamplePeriod = atof(argv[i + 1]);
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--save-period"))) {
+			monitor.SecondsBetweenSamples = atof(argv[i + 1]);
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--cycles"))) {
+			monitor.CyclesFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--appliances"))) {
+			monitor.AppliancesFilename = argv[i + 1];
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--rollups"))) {
+			monitor.RollupsFilename = argv[i + 1];
 			i++;
 		} else if (i + 1 < argc && (equals(arg, "--min1"))) {
 			minBatterySOC1 = atoi(argv[i + 1]);
@@ -100,11 +143,28 @@ int main(int argc, char** argv) {
 			i++;
 		} else if (i + 1 < argc && (equals(arg, "-s"))) {
 			monitor.SampleWriteInterval = atoi(argv[i + 1]);
-			if (monitor.SampleWriteInterval < 1 || monitor.SampleWriteInterval > 1000) {
-				fprintf(stderr, "Invalid sample write interval. Must be between 1 and 1000.\n");
+			if (monitor.SampleWriteInterval < 1 || monitor.SampleWriteInterval > 240) {
+				fprintf(stderr, "Invalid sample write interval. Must be between 1 and 240.\n");
+				return 1;
+			}
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--compress"))) {
+			bool ok;
+			monitor.Compressor.Mode = homepower::ReadingCompressor::ParseMode(argv[i + 1], ok);
+			if (!ok) {
+				fprintf(stderr, "Invalid compression mode '%s'. Must be none, deadband, or sdt\n", argv[i + 1]);
 				return 1;
 			}
 			i++;
+		} else if (i + 1 < argc && (equals(arg, "--max-error"))) {
+			if (!monitor.Compressor.ParseMaxErrors(argv[i + 1])) {
+				fprintf(stderr, "Invalid max errors '%s'. Must be in the form field=error,field=error (eg loadW=10,batV=0.05)\n", argv[i + 1]);
+				return 1;
+			}
+			i++;
+		} else if (i + 1 < argc && (equals(arg, "--write-budget"))) {
+			monitor.DailyWriteBudget = (uint64_t) (atof(argv[i + 1]) * 1024 * 1024);
+			i++;
 		} else if (i + 1 < argc && (equals(arg, "-u"))) {
 			monitor.Inverter.UsbRestartScript = argv[i + 1];
 			i++;
@@ -117,6 +177,10 @@ int main(int argc, char** argv) {
 		}
 	}
 
+	// -p used to switch from SQLite to Postgres, so unless SQLite is asked for too, keep it that way
+	if (monitor.UsePostgres && !sqliteSpecified)
+		monitor.SQLiteFilename = "";
+
 	if (minBatterySOC1 <= 0 || minBatterySOC1 >= 100) {
 		fprintf(stderr, "Invalid min1 battery SOC '%d'. Valid values are 0 < SOC < 90\n", minBatterySOC1);
 		return 1;
@@ -138,6 +202,11 @@ int main(int argc, char** argv) {
 		fprintf(stderr, "Invalid hours between equalization '%d'. Must be at least 1\n", hoursBetweenEqualize);
 		return 1;
 	}
+	if (!(monitor.SamplePeriod >= 0.01) || !(monitor.SecondsBetweenSamples >= 0.01)) {
+		// Our history is sized by the sample period, so zero would need infinite memory
+		fprintf(stderr, "Invalid period '%g' or save period '%g'. Must be at least 0.01\n", monitor.SamplePeriod, monitor.SecondsBetweenSamples);
+		return 1;
+	}
 
 	if (showHelp) {
 		fprintf(stderr, "server - Monitor Axpert/Voltronic inverter, and write stats to Postgres database\n");
@@ -155,8 +224,41 @@ int main(int argc, char** argv) {
 		fprintf(stderr, "                   eg /dev/hidraw0,/dev/ttyUSB0\n");
 		fprintf(stderr, "                   Default device %s\n", join(monitor.Inverter.Devices, ",").c_str());
 		fprintf(stderr, " -p <postgres>     Postgres connection string separated by colons host:port:db:user:password\n");
-		fprintf(stderr, " -l <sqlite>       Sqlite DB filename (specify /dev/null as SQLite filename to disable any DB writes)\n");
+		fprintf(stderr, "                   Leave the password empty to use PGPASSWORD or ~/.pgpass instead.\n");
+		fprintf(stderr, " -l <sqlite>       Sqlite DB filename (specify /dev/null as SQLite filename to disable it).\n");
+		fprintf(stderr, "                   Default %s, unless -p is given.\n", monitor.SQLiteFilename.c_str());
+		fprintf(stderr, " --csv <file>      Append readings to a CSV file.\n");
+		fprintf(stderr, " --archive <file>  Append readings to a compressed archive, which can be read with build/archive.\n");
+		fprintf(stderr, "                   -p, -l, --csv, and --archive can be combined, to write to several sinks at once.\n");
+		fprintf(stderr, " --spool <dir>     Directory where readings are kept while a DB is down. Default %s\n", monitor.SpoolDirectory.c_str());
+		fprintf(stderr, "                   Must be on persistent storage, so a directory on tmpfs is ignored. It is only\n");
+		fprintf(stderr, "                   written to while a DB is down. Specify an empty string to disable.\n");
+		fprintf(stderr, " --history <file>  Memory-mapped history file, for warm restarts. Default %s\n", monitor.HistoryFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --energy <file>   Persisted hourly/daily energy counters. Default %s\n", monitor.EnergyFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --quantiles <file> Persisted load and solar quantiles per hour of day. Default %s\n", monitor.QuantilesFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --profile <file>  Persisted time-of-day profile of load and solar. Default %s\n", monitor.ProfileFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --cycles <file>   Persisted battery cycle counter. Default %s\n", monitor.CyclesFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --appliances <file> Persisted table of appliances learned from load steps. Default %s\n", monitor.AppliancesFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --rollups <file>  Persisted state of the 1 minute and 1 hour rollups. Default %s\n", monitor.RollupsFilename.c_str());
+		fprintf(stderr, "                   Specify an empty string to disable.\n");
+		fprintf(stderr, " --period <sec>    Seconds between inverter reads when signals are flat. Default %.2f\n", monitor.SamplePeriod);
+		fprintf(stderr, " --fast-period <sec> Seconds between inverter reads when signals are changing. Default %.2f\n", monitor.FastSamplePeriod);
+		fprintf(stderr, "                   0 reads as fast as the link allows. Set equal to --period to disable.\n");
+		fprintf(stderr, " --save-period <sec> Seconds between readings saved to the DB. Can be less than 1. Default %.2f\n", monitor.SecondsBetweenSamples);
 		fprintf(stderr, " -s <samples>      Sample write interval. Can be raised to limit SSD writes. Default %d\n", defaultSampleWriteInterval);
+		fprintf(stderr, "                   This is the smallest batch. Batches grow when writes are slow.\n");
+		fprintf(stderr, " --compress <mode> Drop readings that can be reconstructed from the others. Default none.\n");
+		fprintf(stderr, "                   deadband: within the max error of the previous stored reading.\n");
+		fprintf(stderr, "                   sdt: within the max error of a line between stored readings (swinging door).\n");
+		fprintf(stderr, " --max-error <list> Max reconstruction error per field, eg loadW=10,batV=0.05\n");
+		fprintf(stderr, " --write-budget <MB> Megabytes per day that each DB may write, to spare its flash.\n");
+		fprintf(stderr, "                   Batches grow until our estimate of the writes fits. Default no limit.\n");
 		fprintf(stderr, " --min1 <soc>      Minimum battery SOC at start of day. Default %d\n", (int) homepower::Controller::DefaultMinBatterySOC1);
 		fprintf(stderr, " --min2 <soc>      Minimum battery SOC at end of day. Default %d\n", (int) homepower::Controller::DefaultMinBatterySOC2);
 		fprintf(stderr, " -e <hours>        Hours between equalization (battery at 100%%). Default %d\n", (int) homepower::Controller::DefaultHoursBetweenEqualize);
@@ -191,7 +293,7 @@ int main(int argc, char** argv) {
 		controller.HoursBetweenEqualize = hoursBetweenEqualize;
 		controller.SetHeavyLoadState(homepower::HeavyLoadState::Grid);
 		if (controller.Start()) {
-			ok = homepower::RunHttpServer(controller);
+			ok = homepower::RunHttpServer(controller, monitor);
 			controller.Stop();
 		} else {
 			ok = false;
@@ -230,7 +332,7 @@ Interpreted:
     "Raw": "(235.1 50.1 229.7 50.0 0620 0574 011 381 50.90 032 082 0046 09.0 273.8 00.00 00000 00010010 00 00 02431 010",
     "Temp": 46.0,
     "Unknown1": 0.0,
-    "Unknown2": "00000",
+    "Unknown2": 0.0,
     "Unknown3": "00010010",
     "Unknown4": "00",
     "Unknown5": "00",
@@ -0,0 +1,250 @@
+#include "sink.h"
+#include "timeUtils.h"
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+namespace homepower {
+
+// Readings that we hold in RAM, in each of the queue and the private batch. A reading is about
+// 300 bytes, so this is about 150kb per sink, for both.
+static const uint32_t QueueSize = 256;
+
+SinkWorker::SinkWorker(std::unique_ptr<Sink> sink) : TheSink(std::move(sink)) {
+	MustExit = false;
+	Queue.Initialize(QueueSize);
+}
+
+SinkWorker::~SinkWorker() {
+	Stop();
+}
+
+void SinkWorker::Start() {
+	MustExit = false;
+	Thread   = thread([this]() { Run(); });
+}
+
+void SinkWorker::Stop() {
+	if (!Thread.joinable())
+		return;
+	{
+		lock_guard<mutex> lock(Lock);
+		MustExit = true;
+	}
+	Wake.notify_one();
+	Thread.join();
+}
+
+void SinkWorker::Add(const Reading& r) {
+	lock_guard<mutex> lock(Lock);
+	if (Queue.IsFull())
+		NDropped++;
+	Queue.Add(r);
+	MaxQueued = max(MaxQueued, Queue.Size());
+	// Our thread needs to know when its MaxDelaySeconds deadline starts, and when the batch is full
+	if (FirstQueuedAt == 0 || Queue.Size() >= WakeSize)
+		Wake.notify_one();
+	if (FirstQueuedAt == 0)
+		FirstQueuedAt = MonotonicTime();
+}
+
+void SinkWorker::Add(const std::vector<EnergyBucket>& energy) {
+	lock_guard<mutex> lock(Lock);
+	EnergyQueue.insert(EnergyQueue.end(), energy.begin(), energy.end());
+	if (FirstQueuedAt == 0) {
+		FirstQueuedAt = MonotonicTime();
+		Wake.notify_one();
+	}
+}
+
+void SinkWorker::Add(const std::vector<RollupRow>& rollups) {
+	lock_guard<mutex> lock(Lock);
+	RollupQueue.insert(RollupQueue.end(), rollups.begin(), rollups.end());
+	if (FirstQueuedAt == 0) {
+		FirstQueuedAt = MonotonicTime();
+		Wake.notify_one();
+	}
+}
+
+int SinkWorker::ChooseBatchSize(double writeSeconds, double samplePeriod) const {
+	double n = MinBatchSize;
+	if (samplePeriod > 0) {
+		// A batch of n readings arrives every n * samplePeriod seconds, and takes writeSeconds to write
+		n = max(n, writeSeconds / (MaxBusyFraction * samplePeriod));
+		if (DailyWriteBudget != 0) {
+			// Solve for n: (perDay / n) * BatchWriteBytes + perDay * ReadingWriteBytes <= DailyWriteBudget
+			double perDay = 86400 / samplePeriod;
+			double spare  = (double) DailyWriteBudget - perDay * (double) ReadingWriteBytes;
+			n             = spare <= 0 ? MaxBatchSize : max(n, perDay * (double) BatchWriteBytes / spare);
+		}
+	}
+	return (int) min((double) MaxBatchSize, ceil(n));
+}
+
+// Move everything out of our queues, into the thread's private batch
+void SinkWorker::TakeQueued(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups) {
+	Lock.lock();
+	if (records.Size() + Queue.Size() > records.Capacity())
+		NDropped += records.Size() + Queue.Size() - records.Capacity();
+	Queue.DrainTo(records);
+	energy.insert(energy.end(), EnergyQueue.begin(), EnergyQueue.end());
+	rollups.insert(rollups.end(), RollupQueue.begin(), RollupQueue.end());
+	EnergyQueue.clear();
+	RollupQueue.clear();
+	FirstQueuedAt = 0;
+	Lock.unlock();
+
+	// There are only a handful of energy buckets and rollup rows per hour, so we don't bother
+	// limiting them as strictly as the readings. This is more than a week's worth.
+	if (energy.size() > 8192)
+		energy.erase(energy.begin(), energy.end() - 8192);
+	if (rollups.size() > 8192)
+		rollups.erase(rollups.begin(), rollups.end() - 8192);
+}
+
+// Write a batch to the sink. If adapt is true, then this is a regular batch (not a replay of
+// the spool), and we use its timing to choose the size of the next batch.
+bool SinkWorker::Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups, bool adapt) {
+	if (records.Size() == 0 && energy.size() == 0 && rollups.size() == 0)
+		return true;
+	double start = MonotonicTime();
+	if (!TheSink->Write(records, energy, rollups)) {
+		NFailures++;
+		RetryAt = MonotonicTime() + RetrySeconds;
+		return false;
+	}
+	NWritten += records.Size();
+	HasWritten = true;
+
+	int day = (int) (time(nullptr) / 86400);
+	if (day != BytesDay) {
+		BytesDay   = day;
+		BytesToday = 0;
+	}
+	BytesToday += BatchWriteBytes + records.Size() * ReadingWriteBytes;
+
+	if (adapt) {
+		double elapsed = MonotonicTime() - start;
+		WriteSeconds   = WriteSeconds == 0 ? elapsed : WriteSeconds * 0.8 + elapsed * 0.2;
+		if (records.Size() >= 2) {
+			double period = (records.Peek(records.Size() - 1).Time - records.Peek(0).Time) / (records.Size() - 1);
+			SamplePeriod  = SamplePeriod == 0 ? period : SamplePeriod * 0.8 + period * 0.2;
+		}
+		BatchSize = ChooseBatchSize(WriteSeconds, SamplePeriod);
+		// If our estimate of the writes was too optimistic, then hold back for the rest of the day
+		if (DailyWriteBudget != 0 && BytesToday > DailyWriteBudget)
+			BatchSize = MaxBatchSize;
+	}
+	return true;
+}
+
+// Write a batch to the sink, or if that fails, to the spool. Once anything is in the spool, new
+// batches go to the back of it, instead of straight to the sink, so that the energy and rollup
+// upserts (which overwrite each other) reach the sink in order.
+// Returns true if the batch has been consumed.
+bool SinkWorker::Flush(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups) {
+	if (records.Size() == 0 && energy.size() == 0 && rollups.size() == 0)
+		return true;
+	bool spooling = DBSpool.IsOpen() && !DBSpool.IsEmpty();
+	if ((!spooling && Write(records, energy, rollups, true)) || DBSpool.Append(records, energy, rollups)) {
+		records.Clear();
+		energy.clear();
+		rollups.clear();
+		return true;
+	}
+	RetryAt = MonotonicTime() + RetrySeconds;
+	return false;
+}
+
+void SinkWorker::Run() {
+	// Our private batch. The ring buffer will automatically eat into its tail
+	// if it gets too full, so if the sink is down, and we have no spool, we
+	// just drop the oldest readings.
+	RingBuffer<Reading> records;
+	records.Initialize(QueueSize);
+	vector<EnergyBucket> energy;
+	vector<RollupRow>    rollups;
+	double               nextStatsAt = MonotonicTime() + 24 * 60 * 60;
+	BatchSize                        = MinBatchSize;
+
+	// When the sink comes back after an outage, we replay the spool in batches of this size
+	RingBuffer<Reading> replayQueue;
+	replayQueue.Initialize(4096);
+	vector<EnergyBucket> replayEnergy;
+	vector<RollupRow>    replayRollups;
+
+	if (SpoolDirectory != "" && DBSpool.Open(SpoolDirectory) && !DBSpool.IsEmpty())
+		printf("Found %llu bytes of spooled readings for %s in %s\n", (unsigned long long) DBSpool.Bytes(), TheSink->Name(), SpoolDirectory.c_str());
+
+	while (!MustExit) {
+		// Sleep until the queue reaches our batch size, or until the next deadline. The deadlines are:
+		// the oldest queued record reaching MaxDelaySeconds, retrying a failed batch or the spool, and the daily stats.
+		// We try our first batch as soon as we have a single reading, so that a fresh start shows up straight away.
+		bool   pending = records.Size() != 0 || energy.size() != 0 || rollups.size() != 0;
+		double wakeAt  = pending || !DBSpool.IsEmpty() ? min(nextStatsAt, RetryAt) : nextStatsAt;
+		bool   due     = false;
+		{
+			unique_lock<mutex> lock(Lock);
+			WakeSize = HasWritten || RetryAt != 0 ? BatchSize : 1;
+			while (!MustExit) {
+				double now      = MonotonicTime();
+				double deadline = FirstQueuedAt == 0 ? wakeAt : min(wakeAt, FirstQueuedAt + MaxDelaySeconds);
+				due             = Queue.Size() >= WakeSize || (FirstQueuedAt != 0 && now >= FirstQueuedAt + MaxDelaySeconds);
+				if (due || now >= deadline)
+					break;
+				Wake.wait_for(lock, chrono::duration<double>(deadline - now));
+			}
+		}
+
+		double now = MonotonicTime();
+		if (due || MustExit || (pending && now >= RetryAt)) {
+			TakeQueued(records, energy, rollups);
+			Flush(records, energy, rollups);
+		}
+
+		// Drain the spool as fast as the sink will take it
+		while (!MustExit && MonotonicTime() >= RetryAt && DBSpool.Peek(replayQueue, replayEnergy, replayRollups)) {
+			if (!Write(replayQueue, replayEnergy, replayRollups, false))
+				break;
+			DBSpool.Pop();
+		}
+
+		if (now >= nextStatsAt) {
+			nextStatsAt = now + 24 * 60 * 60;
+			PrintStats(stderr);
+		}
+	}
+
+	// Don't lose a partial batch when we're shutting down
+	TakeQueued(records, energy, rollups);
+	Flush(records, energy, rollups);
+}
+
+void SinkWorker::PrintStats(FILE* f) {
+	uint64_t dropped;
+	uint32_t maxQueued;
+	{
+		lock_guard<mutex> lock(Lock);
+		dropped   = NDropped;
+		maxQueued = MaxQueued;
+		NDropped  = 0;
+		MaxQueued = 0;
+	}
+	fprintf(f, "Sink %s: %llu readings written, %llu failed writes, %llu readings dropped, at most %u readings queued\n",
+	        TheSink->Name(), (unsigned long long) NWritten, (unsigned long long) NFailures, (unsigned long long) dropped, maxQueued);
+	fprintf(f, "Sink %s: batches of %d readings, %.1f ms per write, about %.1f MB written today", TheSink->Name(), BatchSize,
+	        WriteSeconds * 1000, (double) BytesToday / (1024 * 1024));
+	if (DailyWriteBudget != 0)
+		fprintf(f, " (budget %.1f MB)", (double) DailyWriteBudget / (1024 * 1024));
+	fprintf(f, "\n");
+	NWritten  = 0;
+	NFailures = 0;
+	TheSink->PrintStats(f);
+	if (DBSpool.IsOpen())
+		DBSpool.PrintStats(f);
+}
+
+} // namespace homepower
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+#include "ringbuffer.h"
+#include "reading.h"
+#include "energy.h"
+#include "rollup.h"
+#include "spool.h"
+
+namespace homepower {
+
+// Sink is a destination for the readings, energy buckets, and rollup rows that we record (eg SQLite or Postgres).
+// A batch can be written more than once (eg when the spool is replayed after a crash), so Write must
+// ignore readings that it already has, and treat energy buckets and rollup rows as upserts.
+class Sink {
+public:
+	virtual ~Sink() {}
+
+	// Short name, for log messages, and for the sink's directory inside the spool directory
+	virtual const char* Name() const = 0;
+
+	// Write a batch. Returns false if the batch was not written, in which case it will be retried later.
+	virtual bool Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) = 0;
+
+	// Print and reset the sink's own statistics
+	virtual void PrintStats(FILE* f) = 0;
+};
+
+// SinkWorker feeds one Sink from its own thread, queue, and spool, so that a slow or dead sink
+// never holds up the monitor thread, or any other sink. The monitor thread only ever takes our
+// lock for long enough to add to the queue.
+// If the queue overflows because the sink is stuck in a Write, we drop the oldest readings,
+// and count them in NDropped. If a Write fails, the batch goes to the spool (see Spool), and
+// everything after it follows it there, until the sink catches up.
+//
+// Our thread sleeps on a condition variable until there is something to do, instead of polling.
+// A batch is written when BatchSize readings are queued, or when the oldest record in the queue
+// has waited MaxDelaySeconds, whichever comes first.
+// BatchSize adapts between MinBatchSize and MaxBatchSize. We measure how long a Write takes,
+// and grow the batches until the sink is busy for no more than MaxBusyFraction of the time.
+// If the sink's storage is flash, each commit costs a few pages of writes, however small it is,
+// so bigger batches are also kinder to the flash. Given a DailyWriteBudget, we estimate the bytes
+// written by a batch (BatchWriteBytes plus ReadingWriteBytes per reading), and make the batches
+// big enough to stay within the budget.
+class SinkWorker {
+public:
+	int         MinBatchSize      = 12;   // Don't write smaller batches than this, unless MaxDelaySeconds is reached
+	int         MaxBatchSize      = 240;  // Don't let batches grow bigger than this. Must be less than the size of our queue (256).
+	double      MaxDelaySeconds   = 60;   // Write what we have once the oldest record in the queue has waited this long
+	double      MaxBusyFraction   = 0.05; // Grow batches until the sink spends less than this fraction of the time in Write
+	double      RetrySeconds      = 5;    // After a failed Write, wait this long before trying the sink again
+	uint64_t    DailyWriteBudget  = 0;    // Bytes per day that we aim to write to the sink's storage. Zero for no budget.
+	uint64_t    BatchWriteBytes   = 8192; // Estimated bytes written per batch, regardless of its size (eg the pages touched by a commit)
+	uint64_t    ReadingWriteBytes = 128;  // Estimated bytes written per reading
+	std::string SpoolDirectory;           // Where to spool batches that fail to write. Empty to disable.
+	int         BatchSize         = 12;   // Current batch size, chosen by ChooseBatchSize. Only touched by our thread.
+	uint64_t    NWritten          = 0;    // Readings written since the last PrintStats. Only touched by our thread.
+	uint64_t    NFailures         = 0;    // Failed Writes since the last PrintStats. Only touched by our thread.
+	uint64_t    NDropped          = 0;    // Readings dropped from our queue since the last PrintStats. Guarded by Lock.
+	uint32_t    MaxQueued         = 0;    // Largest number of readings in our queue since the last PrintStats. Guarded by Lock.
+
+	SinkWorker(std::unique_ptr<Sink> sink);
+	~SinkWorker();
+
+	Sink* GetSink() { return TheSink.get(); }
+
+	void Start();
+	void Stop(); // Flush what is queued, to the sink, or to the spool, and join our thread
+
+	// Queue records to be written. These never wait for the sink.
+	void Add(const Reading& r);
+	void Add(const std::vector<EnergyBucket>& energy);
+	void Add(const std::vector<RollupRow>& rollups);
+
+	// Choose a batch size, given the seconds that a Write takes, and the seconds between readings
+	int ChooseBatchSize(double writeSeconds, double samplePeriod) const;
+
+private:
+	std::unique_ptr<Sink>     TheSink;
+	std::thread               Thread;
+	std::atomic<bool>         MustExit;
+	std::mutex                Lock;                  // Guards Queue, EnergyQueue, RollupQueue, and the members that say so
+	std::condition_variable   Wake;                  // Signalled when our thread has work to do
+	RingBuffer<Reading>       Queue;                 // Readings from the monitor thread. Guarded by Lock
+	std::vector<EnergyBucket> EnergyQueue;           // Energy buckets from the monitor thread. Guarded by Lock
+	std::vector<RollupRow>    RollupQueue;           // Rollup rows from the monitor thread. Guarded by Lock
+	double                    FirstQueuedAt = 0;     // MonotonicTime when the oldest record in the queues was added, or zero if they're empty. Guarded by Lock
+	uint32_t                  WakeSize      = 1;     // Signal Wake when the queue reaches this many readings. Guarded by Lock
+	Spool                     DBSpool;               // Only touched by our thread
+	bool                      HasWritten    = false; // True once we've written our first batch. Only touched by our thread.
+	double                    RetryAt       = 0;     // MonotonicTime when we may try the sink again after a failure. Only touched by our thread.
+	double                    WriteSeconds  = 0;     // Moving average of the time taken by a Write. Only touched by our thread.
+	double                    SamplePeriod  = 0;     // Moving average of the seconds between readings. Only touched by our thread.
+	uint64_t                  BytesToday    = 0;     // Estimated bytes written on BytesDay. Only touched by our thread.
+	int                       BytesDay      = 0;     // Day (since the unix epoch) of BytesToday
+
+	void Run();
+	void TakeQueued(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups);
+	bool Flush(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups);
+	bool Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups, bool adapt);
+	void PrintStats(FILE* f);
+};
+
+} // namespace homepower
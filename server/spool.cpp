@@ -0,0 +1,291 @@
+#include "spool.h"
+#include "crc32.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t SpoolRecordMagic = 0x48505331; // HPS1
+
+enum SpoolRecordType : uint16_t {
+	SpoolReading = 1, // PackedReading
+	SpoolEnergy  = 2, // EnergyBucket
+	SpoolRollup  = 3, // RollupRow
+};
+
+// Every record on disk is a header, followed by Size bytes of payload.
+// Like our state files, these are only read back by the same machine, so we don't worry about endianness.
+struct SpoolRecordHeader {
+	uint32_t Magic;
+	uint16_t Type;
+	uint16_t Size;
+	uint32_t Crc; // CRC of the payload
+};
+
+static void AddRecord(vector<uint8_t>& buf, uint16_t type, const void* payload, size_t size) {
+	SpoolRecordHeader h;
+	h.Magic  = SpoolRecordMagic;
+	h.Type   = type;
+	h.Size   = (uint16_t) size;
+	h.Crc    = Crc32(payload, size);
+	size_t n = buf.size();
+	buf.resize(n + sizeof(h) + size);
+	memcpy(&buf[n], &h, sizeof(h));
+	memcpy(&buf[n + sizeof(h)], payload, size);
+}
+
+// Read the record at the current position of f. Returns false at the end of the file, or if the
+// record is torn or corrupt.
+static bool ReadRecord(FILE* f, SpoolRecordHeader& h, uint8_t* payload, size_t maxSize) {
+	return fread(&h, sizeof(h), 1, f) == 1 && h.Magic == SpoolRecordMagic && h.Size <= maxSize &&
+	       fread(payload, h.Size, 1, f) == 1 && Crc32(payload, h.Size) == h.Crc;
+}
+
+static const size_t MaxReadingOrEnergy = sizeof(PackedReading) > sizeof(EnergyBucket) ? sizeof(PackedReading) : sizeof(EnergyBucket);
+static const size_t MaxPayload         = MaxReadingOrEnergy > sizeof(RollupRow) ? MaxReadingOrEnergy : sizeof(RollupRow);
+
+Spool::~Spool() {
+	Close();
+}
+
+std::string Spool::SegmentFilename(uint64_t seq) const {
+	char name[64];
+	snprintf(name, sizeof(name), "/spool-%08llu.bin", (unsigned long long) seq);
+	return Dir + name;
+}
+
+bool Spool::Open(const std::string& dir) {
+	Close();
+	// Create the parents first, eg /var/lib/homepower for /var/lib/homepower/spool/sqlite
+	for (size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1))
+		mkdir(dir.substr(0, slash).c_str(), 0755);
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create spool directory %s: %s\n", dir.c_str(), strerror(errno));
+		return false;
+	}
+	DIR* d = opendir(dir.c_str());
+	if (!d) {
+		fprintf(stderr, "Failed to open spool directory %s: %s\n", dir.c_str(), strerror(errno));
+		return false;
+	}
+	Dir = dir;
+	while (dirent* e = readdir(d)) {
+		unsigned long long seq;
+		char               ext[8];
+		if (sscanf(e->d_name, "spool-%llu.%7s", &seq, ext) != 2 || strcmp(ext, "bin") != 0)
+			continue;
+		struct stat st;
+		if (stat(SegmentFilename(seq).c_str(), &st) != 0)
+			continue;
+		Segments.push_back({(uint64_t) seq, (uint64_t) st.st_size});
+	}
+	closedir(d);
+	sort(Segments.begin(), Segments.end(), [](const Segment& a, const Segment& b) { return a.Seq < b.Seq; });
+	for (size_t i = Segments.size(); i-- != 0;) {
+		if (Segments[i].Size == 0)
+			DeleteSegment(i);
+	}
+	return true;
+}
+
+void Spool::Close() {
+	if (Writer)
+		fclose(Writer);
+	Writer = nullptr;
+	Dir    = "";
+	Segments.clear();
+	ReadOffset = 0;
+	HavePeek   = false;
+}
+
+uint64_t Spool::Bytes() const {
+	uint64_t total = 0;
+	for (const auto& s : Segments)
+		total += s.Size;
+	return total;
+}
+
+bool Spool::StartSegment() {
+	if (Writer)
+		fclose(Writer);
+	uint64_t seq = Segments.size() == 0 ? 1 : Segments.back().Seq + 1;
+	Writer       = fopen(SegmentFilename(seq).c_str(), "wb");
+	if (!Writer) {
+		fprintf(stderr, "Failed to create spool segment %s: %s\n", SegmentFilename(seq).c_str(), strerror(errno));
+		return false;
+	}
+	Segments.push_back({seq, 0});
+	return true;
+}
+
+bool Spool::Append(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) {
+	if (!IsOpen())
+		return false;
+	if (!Writer || Segments.back().Size >= SegmentBytes) {
+		if (!StartSegment())
+			return false;
+	}
+
+	vector<uint8_t> buf;
+	buf.reserve((records.Size() + energy.size() + rollups.size()) * (sizeof(SpoolRecordHeader) + MaxPayload));
+	for (uint32_t i = 0; i < records.Size(); i++) {
+		PackedReading p;
+		PackReading(records.Peek(i), p);
+		AddRecord(buf, SpoolReading, &p, sizeof(p));
+	}
+	for (const auto& e : energy)
+		AddRecord(buf, SpoolEnergy, &e, sizeof(e));
+	for (const auto& row : rollups)
+		AddRecord(buf, SpoolRollup, &row, sizeof(row));
+
+	// Flush all the way to the disk, because we're about to drop these from RAM
+	bool ok = fwrite(buf.data(), buf.size(), 1, Writer) == 1 && fflush(Writer) == 0 && fdatasync(fileno(Writer)) == 0;
+	if (!ok) {
+		// We may have left a partial record behind, so never append to this segment again
+		fprintf(stderr, "Failed to write to spool segment %s: %s\n", SegmentFilename(Segments.back().Seq).c_str(), strerror(errno));
+		fclose(Writer);
+		Writer = nullptr;
+		struct stat st;
+		if (stat(SegmentFilename(Segments.back().Seq).c_str(), &st) == 0)
+			Segments.back().Size = st.st_size;
+		return false;
+	}
+	Segments.back().Size += buf.size();
+	NAppended += records.Size();
+
+	while (Bytes() > MaxBytes && Segments.size() > 1)
+		DeleteOldest();
+	return true;
+}
+
+void Spool::DeleteSegment(size_t i) {
+	if (i == Segments.size() - 1 && Writer) {
+		fclose(Writer);
+		Writer = nullptr;
+	}
+	remove(SegmentFilename(Segments[i].Seq).c_str());
+	Segments.erase(Segments.begin() + i);
+}
+
+// Delete the oldest segment, to make space, counting the readings that we lose
+void Spool::DeleteOldest() {
+	FILE* f = fopen(SegmentFilename(Segments[0].Seq).c_str(), "rb");
+	if (f) {
+		SpoolRecordHeader h;
+		uint8_t           payload[MaxPayload];
+		fseek(f, (long) ReadOffset, SEEK_SET);
+		while (ReadRecord(f, h, payload, sizeof(payload))) {
+			if (h.Type == SpoolReading)
+				NDropped++;
+		}
+		fclose(f);
+	}
+	DeleteSegment(0);
+	ReadOffset = 0;
+	HavePeek   = false;
+}
+
+bool Spool::Peek(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups) {
+	records.Clear();
+	energy.clear();
+	rollups.clear();
+	HavePeek  = false;
+	PeekCount = 0;
+	if (IsEmpty())
+		return false;
+
+	SpoolRecordHeader h;
+	uint8_t           payload[MaxPayload];
+	size_t            seg    = 0;
+	uint64_t          offset = ReadOffset;
+	for (; seg < Segments.size(); seg++) {
+		offset  = seg == 0 ? ReadOffset : 0;
+		FILE* f = fopen(SegmentFilename(Segments[seg].Seq).c_str(), "rb");
+		if (!f) {
+			// Treat a missing segment as empty, so that Pop deletes it from our list
+			offset = Segments[seg].Size;
+		} else {
+			fseek(f, (long) offset, SEEK_SET);
+			while (offset < Segments[seg].Size && records.Size() < records.Capacity()) {
+				if (!ReadRecord(f, h, payload, sizeof(payload))) {
+					// A torn or corrupt record. We can't trust anything after it, so this is the end of the segment.
+					fprintf(stderr, "Spool segment %s is corrupt at offset %llu\n", SegmentFilename(Segments[seg].Seq).c_str(),
+					        (unsigned long long) offset);
+					NCorrupt++;
+					Segments[seg].Size = offset;
+					break;
+				}
+				offset += sizeof(h) + h.Size;
+				if (h.Type == SpoolReading && h.Size == sizeof(PackedReading)) {
+					PackedReading p;
+					Reading       r;
+					memcpy(&p, payload, sizeof(p));
+					UnpackReading(p, r);
+					records.Add(r);
+					PeekCount++;
+				} else if (h.Type == SpoolEnergy && h.Size == sizeof(EnergyBucket)) {
+					EnergyBucket e;
+					memcpy(&e, payload, sizeof(e));
+					energy.push_back(e);
+				} else if (h.Type == SpoolRollup && h.Size == sizeof(RollupRow)) {
+					RollupRow row;
+					memcpy(&row, payload, sizeof(row));
+					rollups.push_back(row);
+				}
+			}
+			fclose(f);
+		}
+		if (records.Size() == records.Capacity() || seg == Segments.size() - 1)
+			break;
+	}
+	HavePeek    = true;
+	PeekSegment = seg;
+	PeekOffset  = offset;
+	return true;
+}
+
+void Spool::Pop() {
+	if (!HavePeek)
+		return;
+	HavePeek = false;
+	NReplayed += PeekCount;
+	bool consumedLast = PeekOffset >= Segments[PeekSegment].Size;
+	for (size_t i = 0; i < PeekSegment + (consumedLast ? 1 : 0); i++)
+		DeleteSegment(0);
+	ReadOffset = consumedLast ? 0 : PeekOffset;
+}
+
+void Spool::PrintStats(FILE* f) {
+	fprintf(f, "Spool: %llu readings spooled, %llu replayed, %llu dropped, %llu corrupt records, %llu bytes on disk\n",
+	        (unsigned long long) NAppended, (unsigned long long) NReplayed, (unsigned long long) NDropped,
+	        (unsigned long long) NCorrupt, (unsigned long long) Bytes());
+	NAppended = 0;
+	NReplayed = 0;
+	NDropped  = 0;
+	NCorrupt  = 0;
+}
+
+bool IsVolatileDirectory(const std::string& path) {
+	const long TmpfsMagic = 0x01021994;
+	const long RamfsMagic = 0x858458f6;
+	string     dir        = path;
+	while (true) {
+		struct statfs st;
+		if (statfs(dir.c_str(), &st) == 0)
+			return (long) st.f_type == TmpfsMagic || (long) st.f_type == RamfsMagic;
+		size_t slash = dir.rfind('/');
+		if (errno != ENOENT || slash == string::npos)
+			return false;
+		dir = slash == 0 ? "/" : dir.substr(0, slash);
+	}
+}
+
+} // namespace homepower
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "ringbuffer.h"
+#include "reading.h"
+#include "energy.h"
+#include "rollup.h"
+
+namespace homepower {
+
+// Spool holds readings, energy buckets, and rollup rows on disk while the DB is unreachable, so that an outage
+// of hours doesn't cost us anything more than the RAM-only queues can hold.
+// The spool is a directory of segment files, which are named by an increasing sequence number.
+// Records are only ever appended to the newest segment, and each one carries a CRC, so if we
+// crash half way through an append, the torn record fails its CRC, and we stop reading that
+// segment there. After a restart we never append to an existing segment, so nothing good can
+// land behind a torn record.
+// Segments are deleted once everything in them has been written to the DB. If we crash between
+// the DB commit and the delete, the segment is replayed again, which is harmless, because the
+// readings are ignored as duplicates, and the energy buckets and rollup rows are upserts.
+// When the spool exceeds MaxBytes, we delete the oldest segments.
+// The spool must be on persistent storage. On tmpfs, fdatasync does nothing, and the spool is
+// lost on a reboot or power cut, which is exactly when we need it (see IsVolatileDirectory).
+// We only write to the spool while a sink is failing, so on flash storage, the cost is nothing
+// in normal operation, and about 120 bytes per reading, plus an fdatasync per batch, during an outage.
+// This is only used by the DB thread.
+class Spool {
+public:
+	uint64_t MaxBytes     = 64 * 1024 * 1024; // Delete the oldest segments when the spool grows bigger than this
+	uint64_t SegmentBytes = 1024 * 1024;      // Start a new segment when the current one reaches this size
+	uint64_t NAppended    = 0;                // Readings appended since the last PrintStats
+	uint64_t NReplayed    = 0;                // Readings replayed since the last PrintStats
+	uint64_t NDropped     = 0;                // Readings lost to MaxBytes since the last PrintStats
+	uint64_t NCorrupt     = 0;                // Records that failed their CRC since the last PrintStats
+
+	~Spool();
+
+	// Open the spool in the given directory, creating it (and its parents) if necessary, and find any existing segments
+	bool Open(const std::string& dir);
+	void Close();
+	bool IsOpen() const { return !Dir.empty(); }
+	bool IsEmpty() const { return Segments.size() == 0; }
+
+	uint64_t Bytes() const; // Total size of all segments
+
+	// Append a batch to the end of the spool, and flush it to disk
+	bool Append(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups);
+
+	// Read records from the front of the spool, without removing them, until 'records' is full.
+	// Returns false if the spool is empty. The batch can be empty if the front of the spool was corrupt,
+	// in which case Pop still makes progress.
+	bool Peek(RingBuffer<Reading>& records, std::vector<EnergyBucket>& energy, std::vector<RollupRow>& rollups);
+
+	// Remove the records returned by the most recent Peek, once they are safely in the DB.
+	// An Append between Peek and Pop may delete the oldest segments, in which case Pop does nothing.
+	void Pop();
+
+	void PrintStats(FILE* f);
+
+private:
+	struct Segment {
+		uint64_t Seq;
+		uint64_t Size;
+	};
+	std::string          Dir;
+	std::vector<Segment> Segments;              // Oldest first
+	FILE*                Writer      = nullptr; // Open on the newest segment, if we've appended to it since Open
+	uint64_t             ReadOffset  = 0;       // Offset into the oldest segment, of the first record that hasn't been popped
+	bool                 HavePeek    = false;   // True if Peek has returned records that haven't been popped
+	size_t               PeekSegment = 0;       // Index into Segments, where the most recent Peek stopped
+	uint64_t             PeekOffset  = 0;       // Offset into Segments[PeekSegment], where the most recent Peek stopped
+	uint64_t             PeekCount   = 0;       // Number of readings returned by the most recent Peek
+
+	std::string SegmentFilename(uint64_t seq) const;
+	bool        StartSegment();
+	void        DeleteOldest();
+	void        DeleteSegment(size_t i);
+};
+
+// Returns true if path, or its nearest existing parent, is on a filesystem that lives in RAM
+// (tmpfs or ramfs), so that nothing written there survives a reboot.
+bool IsVolatileDirectory(const std::string& path);
+
+} // namespace homepower
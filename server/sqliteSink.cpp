@@ -0,0 +1,409 @@
+#include "sqliteSink.h"
+#include "dbSchema.h"
+#include "timeUtils.h"
+#include <sqlite3.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+// Energy buckets can be written many times (the day buckets are updated every hour), so this is an upsert
+static const char* UpsertEnergySQL = "INSERT INTO energy (time,period,pvWh,loadWh,batChargeWh,batDischargeWh,heavyGridWh) VALUES (?,?,?,?,?,?,?) "
+                                     "ON CONFLICT(time, period) DO UPDATE SET pvWh = excluded.pvWh, loadWh = excluded.loadWh, "
+                                     "batChargeWh = excluded.batChargeWh, batDischargeWh = excluded.batDischargeWh, heavyGridWh = excluded.heavyGridWh";
+
+// Times are stored as seconds since the unix epoch, with millisecond precision
+static double RoundTime(double t) {
+	return floor(t * 1000 + 0.5) / 1000;
+}
+
+SQLiteSink::SQLiteSink() {
+	TransactionTime.Initialize(0.00001, 10, 61);
+	CommitTime.Initialize(0.00001, 10, 61);
+}
+
+SQLiteSink::~SQLiteSink() {
+	Close();
+}
+
+bool SQLiteSink::Open(const std::string& filename) {
+	Close();
+	Filename = filename;
+	if (sqlite3_open(filename.c_str(), &DB) != SQLITE_OK) {
+		fprintf(stderr, "Failed to open SQLite DB %s: %s\n", filename.c_str(), DB ? sqlite3_errmsg(DB) : "out of memory");
+		Close();
+		return false;
+	}
+	// Grafana reads from the DB while we're writing to it, so wait a little bit for its locks, instead of failing immediately
+	sqlite3_busy_timeout(DB, 2000);
+
+	// WAL lets readers carry on while we write, and with synchronous=NORMAL, a commit doesn't fsync.
+	// We can lose the most recent transactions in a power failure, but the DB stays consistent.
+	if (!Exec("PRAGMA journal_mode=WAL") || !Exec("PRAGMA synchronous=NORMAL") || !Exec(CreateEnergySQL)) {
+		Close();
+		return false;
+	}
+	for (int i = 0; i < Rollup::NumTiers; i++) {
+		string table = Rollup::TableName(Rollup::TierSeconds[i]);
+		string cols  = RollupColumnNames();
+		string sql   = "INSERT INTO " + table + " (" + cols + ") VALUES (?";
+		for (size_t c = 0; c < cols.size(); c++) {
+			if (cols[c] == ',')
+				sql += ",?";
+		}
+		sql += ")";
+		if (!Exec(CreateRollupSQL(table).c_str()) ||
+		    !Prepare((sql + RollupUpsertClause()).c_str(), &UpsertRollup[i]) ||
+		    !Prepare((sql + " ON CONFLICT(time) DO NOTHING").c_str(), &InsertMissingRollup[i])) {
+			Close();
+			return false;
+		}
+	}
+
+	if (!Prepare(UpsertEnergySQL, &UpsertEnergy) ||
+	    !Prepare("BEGIN", &Begin) ||
+	    !Prepare("COMMIT", &Commit) ||
+	    !Prepare("ROLLBACK", &Rollback) ||
+	    !LoadDays() ||
+	    !Backfill()) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool SQLiteSink::WriteRollups(const std::vector<RollupRow>& rollups, sqlite3_stmt* const* stmts) {
+	for (const auto& row : rollups) {
+		sqlite3_stmt* s = nullptr;
+		for (int i = 0; i < Rollup::NumTiers; i++) {
+			if (Rollup::TierSeconds[i] == row.Seconds)
+				s = stmts[i];
+		}
+		if (!s)
+			continue;
+		int c = 1;
+		sqlite3_bind_double(s, c++, (double) row.Start);
+		sqlite3_bind_int(s, c++, row.Count);
+		for (int i = 0; i < RollupRow::NumColumns; i++) {
+			sqlite3_bind_double(s, c++, row.Columns[i].Avg);
+			sqlite3_bind_double(s, c++, row.Columns[i].Min);
+			sqlite3_bind_double(s, c++, row.Columns[i].Max);
+			sqlite3_bind_double(s, c++, row.Columns[i].Last);
+		}
+		if (!Step(s))
+			return false;
+	}
+	return true;
+}
+
+// Compute the rollup rows that are missing, from the readings after the end of the rollup tables.
+// When the rollups are up to date, this only reads the most recent hour of readings.
+// The 1 minute rows of that hour were already written by the live rollups, from every sample,
+// whereas the readings may be compressed, so we only insert the buckets that don't exist yet.
+bool SQLiteSink::Backfill() {
+	double from = 0;
+	for (int i = 0; i < Rollup::NumTiers; i++) {
+		sqlite3_stmt* q   = nullptr;
+		string        sql = string("SELECT max(time) FROM ") + Rollup::TableName(Rollup::TierSeconds[i]);
+		if (!Prepare(sql.c_str(), &q))
+			return false;
+		double end = 0;
+		if (sqlite3_step(q) == SQLITE_ROW && sqlite3_column_type(q, 0) != SQLITE_NULL)
+			end = sqlite3_column_double(q, 0) + Rollup::TierSeconds[i];
+		sqlite3_finalize(q);
+		from = i == 0 ? end : min(from, end);
+	}
+
+	string sql = "SELECT time";
+	for (int i = 0; i < RollupRow::NumColumns; i++)
+		sql += string(",") + Rollup::ColumnName(i);
+	sql += " FROM readings WHERE time >= ? ORDER BY time";
+	sqlite3_stmt* q = nullptr;
+	if (!Prepare(sql.c_str(), &q))
+		return false;
+	sqlite3_bind_double(q, 1, from);
+	Rollup            rollup;
+	vector<RollupRow> rows;
+	float             values[RollupRow::NumColumns];
+	int               rc;
+	while ((rc = sqlite3_step(q)) == SQLITE_ROW) {
+		for (int i = 0; i < RollupRow::NumColumns; i++)
+			values[i] = (float) sqlite3_column_double(q, i + 1);
+		rollup.Add(sqlite3_column_double(q, 0), values, rows);
+	}
+	sqlite3_finalize(q);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "SQLite error in %s while backfilling rollups: %s\n", Filename.c_str(), sqlite3_errmsg(DB));
+		return false;
+	}
+	// Buckets that are still busy are left to the live rollups
+	rollup.Flush((double) time(nullptr), rows);
+	if (rows.size() == 0)
+		return true;
+
+	// Most of the rows usually exist already, so count the ones that we actually inserted
+	int  before = sqlite3_total_changes(DB);
+	bool ok     = Step(Begin) && WriteRollups(rows, InsertMissingRollup);
+	if (!ok) {
+		Step(Rollback);
+		return false;
+	}
+	if (!Step(Commit))
+		return false;
+	int inserted = sqlite3_total_changes(DB) - before;
+	if (inserted != 0)
+		printf("Backfilled %d rollup rows from the readings in %s\n", inserted, Filename.c_str());
+	return true;
+}
+
+std::string SQLiteSink::DayTable(int day) {
+	time_t t = (time_t) day * 86400;
+	tm     d;
+	gmtime_r(&t, &d);
+	char name[48];
+	snprintf(name, sizeof(name), "readings_%04d%02d%02d", d.tm_year + 1900, d.tm_mon + 1, d.tm_mday);
+	return name;
+}
+
+// Find our day tables, and move a 'readings' table from before we had day tables out of the way of our view
+bool SQLiteSink::LoadDays() {
+	Days.clear();
+	HaveLegacy        = false;
+	bool          old = false;
+	sqlite3_stmt* q   = nullptr;
+	if (!Prepare("SELECT name FROM sqlite_master WHERE type = 'table' AND name LIKE 'readings%'", &q))
+		return false;
+	while (sqlite3_step(q) == SQLITE_ROW) {
+		const char* name = (const char*) sqlite3_column_text(q, 0);
+		tm          d    = {};
+		if (strcmp(name, "readings") == 0) {
+			old = true;
+		} else if (strcmp(name, "readings_legacy") == 0) {
+			HaveLegacy = true;
+		} else if (sscanf(name, "readings_%4d%2d%2d", &d.tm_year, &d.tm_mon, &d.tm_mday) == 3) {
+			d.tm_year -= 1900;
+			d.tm_mon -= 1;
+			Days.push_back((int) (timegm(&d) / 86400));
+		}
+	}
+	sqlite3_finalize(q);
+	sort(Days.begin(), Days.end());
+
+	if (old && !HaveLegacy) {
+		// SQLite has no ADD COLUMN IF NOT EXISTS, so we try each column on its own, and ignore the
+		// failures of the columns that already exist. The view needs all of the columns.
+		for (int i = 0; i < NumReadingsAddedColumns; i++) {
+			string sql = string("ALTER TABLE readings ADD COLUMN ") + ReadingsAddedColumns[i] + " REAL";
+			sqlite3_exec(DB, sql.c_str(), nullptr, nullptr, nullptr);
+		}
+		if (!Exec("ALTER TABLE readings RENAME TO readings_legacy"))
+			return false;
+		HaveLegacy = true;
+	}
+	// The view needs at least one table
+	if (Days.size() == 0 && !HaveLegacy)
+		return PrepareInsert((int) (time(nullptr) / 86400));
+	return CreateView();
+}
+
+// Point the 'readings' view at our current set of tables
+bool SQLiteSink::CreateView() {
+	if (!Exec("DROP VIEW IF EXISTS readings"))
+		return false;
+	string sql = "CREATE VIEW readings AS ";
+	for (size_t i = 0; i < Days.size(); i++) {
+		if (i != 0)
+			sql += " UNION ALL ";
+		sql += string("SELECT ") + ReadingsColumnNames + " FROM " + DayTable(Days[i]);
+	}
+	if (HaveLegacy)
+		sql += string(Days.size() != 0 ? " UNION ALL " : "") + "SELECT " + ReadingsColumnNames + " FROM readings_legacy";
+	return Exec(sql.c_str());
+}
+
+// Create the table of 'day' if it doesn't exist yet, and point InsertReading at it
+bool SQLiteSink::PrepareInsert(int day) {
+	sqlite3_finalize(InsertReading);
+	InsertReading = nullptr;
+	InsertDay     = -1;
+	string table  = DayTable(day);
+	if (!binary_search(Days.begin(), Days.end(), day)) {
+		if (!Exec(CreateReadingsSQL(table).c_str()))
+			return false;
+		Days.insert(upper_bound(Days.begin(), Days.end(), day), day);
+		if (!CreateView())
+			return false;
+	}
+	string sql = "INSERT INTO " + table + " (" + ReadingsColumnNames + ") VALUES (" + ReadingsPlaceholders + ") ON CONFLICT(time) DO NOTHING";
+	if (!Prepare(sql.c_str(), &InsertReading))
+		return false;
+	InsertDay = day;
+	return true;
+}
+
+// Drop the tables of the days that have fallen out of the retention period. This is O(1) when there is nothing to drop.
+bool SQLiteSink::DropExpired(int today) {
+	int  oldest  = today - RetentionDays;
+	bool changed = false;
+	while (Days.size() != 0 && Days[0] < oldest) {
+		if (Days[0] == InsertDay) {
+			sqlite3_finalize(InsertReading);
+			InsertReading = nullptr;
+			InsertDay     = -1;
+		}
+		if (!Exec(("DROP TABLE " + DayTable(Days[0])).c_str()))
+			return false;
+		Days.erase(Days.begin());
+		changed = true;
+	}
+	if (changed) {
+		string sql = "DELETE FROM readings_1m WHERE time < " + to_string((int64_t) oldest * 86400);
+		if (!Exec(sql.c_str()))
+			return false;
+	}
+	if (HaveLegacy && (Days.size() == 0 || Days[0] >= oldest)) {
+		// The legacy table goes once its newest row has expired. The primary key makes max(time) cheap.
+		sqlite3_stmt* q = nullptr;
+		if (!Prepare("SELECT max(time) FROM readings_legacy", &q))
+			return false;
+		bool expired = sqlite3_step(q) == SQLITE_ROW && sqlite3_column_double(q, 0) < (double) oldest * 86400;
+		sqlite3_finalize(q);
+		if (expired) {
+			if (!Exec("DROP TABLE readings_legacy"))
+				return false;
+			HaveLegacy = false;
+			changed    = true;
+		}
+	}
+	return !changed || CreateView();
+}
+
+void SQLiteSink::Close() {
+	sqlite3_stmt** all[] = {&InsertReading, &UpsertEnergy, &Begin, &Commit, &Rollback};
+	for (auto stmt : all) {
+		sqlite3_finalize(*stmt);
+		*stmt = nullptr;
+	}
+	for (int i = 0; i < Rollup::NumTiers; i++) {
+		sqlite3_finalize(UpsertRollup[i]);
+		sqlite3_finalize(InsertMissingRollup[i]);
+		UpsertRollup[i]        = nullptr;
+		InsertMissingRollup[i] = nullptr;
+	}
+	if (DB)
+		sqlite3_close(DB);
+	DB        = nullptr;
+	InsertDay = -1;
+	Days.clear();
+}
+
+bool SQLiteSink::Exec(const char* sql) {
+	char* err = nullptr;
+	if (sqlite3_exec(DB, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+		fprintf(stderr, "SQLite error in %s: %s\n", Filename.c_str(), err ? err : "unknown");
+		sqlite3_free(err);
+		return false;
+	}
+	return true;
+}
+
+bool SQLiteSink::Prepare(const char* sql, sqlite3_stmt** stmt) {
+	if (sqlite3_prepare_v2(DB, sql, -1, stmt, nullptr) != SQLITE_OK) {
+		fprintf(stderr, "SQLite failed to prepare '%s': %s\n", sql, sqlite3_errmsg(DB));
+		return false;
+	}
+	return true;
+}
+
+// Run a prepared statement to completion, and reset it so that it can be bound again
+bool SQLiteSink::Step(sqlite3_stmt* stmt) {
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+		fprintf(stderr, "SQLite error in %s: %s\n", Filename.c_str(), sqlite3_errmsg(DB));
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return rc == SQLITE_DONE || rc == SQLITE_ROW;
+}
+
+bool SQLiteSink::Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) {
+	if (records.Size() == 0 && energy.size() == 0 && rollups.size() == 0)
+		return true;
+	if (!DB && !Open(Filename))
+		return false;
+
+	double start = MonotonicTime();
+	if (!Step(Begin)) {
+		Close();
+		return false;
+	}
+
+	int  today = (int) (time(nullptr) / 86400);
+	bool ok    = RetentionDays <= 0 || DropExpired(today);
+	for (uint32_t i = 0; i < records.Size() && ok; i++) {
+		const auto& r   = records.Peek(i);
+		double      t   = RoundTime(r.Time);
+		int         day = (int) floor(t / 86400);
+		if (RetentionDays > 0 && day < today - RetentionDays) {
+			// Too old to keep, which happens when the spool replays a long outage
+			continue;
+		}
+		if (day != InsertDay && !PrepareInsert(day)) {
+			ok = false;
+			break;
+		}
+		sqlite3_stmt* s = InsertReading;
+		int           c = 1;
+		sqlite3_bind_double(s, c++, t);
+#define BIND_REAL(column, member, maxError) sqlite3_bind_double(s, c++, r.member);
+#define BIND_BOOL(column, member) sqlite3_bind_int(s, c++, r.member ? 1 : 0);
+		HOMEPOWER_READINGS_COLUMNS(BIND_REAL, BIND_BOOL)
+#undef BIND_REAL
+#undef BIND_BOOL
+		ok = Step(s);
+	}
+
+	for (size_t i = 0; i < energy.size() && ok; i++) {
+		const auto&   e = energy[i];
+		sqlite3_stmt* s = UpsertEnergy;
+		int           c = 1;
+		sqlite3_bind_double(s, c++, (double) e.Start);
+		sqlite3_bind_text(s, c++, EnergyPeriodToString(e.Period), -1, SQLITE_STATIC);
+		sqlite3_bind_double(s, c++, e.Totals.PvWh);
+		sqlite3_bind_double(s, c++, e.Totals.LoadWh);
+		sqlite3_bind_double(s, c++, e.Totals.BatChargeWh);
+		sqlite3_bind_double(s, c++, e.Totals.BatDischargeWh);
+		sqlite3_bind_double(s, c++, e.Totals.HeavyGridWh);
+		ok = Step(s);
+	}
+
+	ok = ok && WriteRollups(rollups, UpsertRollup);
+
+	if (!ok) {
+		Step(Rollback);
+		Close();
+		return false;
+	}
+
+	double commitStart = MonotonicTime();
+	if (!Step(Commit)) {
+		Close();
+		return false;
+	}
+	double end = MonotonicTime();
+	TransactionTime.Add(end - start);
+	CommitTime.Add(end - commitStart);
+	return true;
+}
+
+void SQLiteSink::PrintStats(FILE* f) {
+	TransactionTime.Print(f, "SQLite transaction");
+	CommitTime.Print(f, "SQLite commit");
+	TransactionTime.Reset();
+	CommitTime.Reset();
+}
+
+} // namespace homepower
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "sink.h"
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace homepower {
+
+// SQLiteSink writes readings and energy buckets into an SQLite database.
+// We used to run the sqlite3 command line tool for every batch, which meant a fork and exec,
+// opening the DB, and parsing a big SQL string, every time. On a Raspberry Pi 1 that cost far
+// more than the insert itself. Instead, we keep one connection open for the life of the process,
+// with WAL journaling, and prepared statements that we bind each record to, inside a single
+// transaction per batch.
+// If anything goes wrong, we close the connection, and reopen it on the next Write.
+//
+// Readings are stored in one table per UTC day (readings_YYYYMMDD), and 'readings' is a view of
+// the UNION ALL of those tables, so queries against 'readings' (eg from Grafana) don't change.
+// Retention is a DROP TABLE of the oldest day, instead of a DELETE of old rows on every commit,
+// so its cost doesn't grow with the size of the table, and the pages of the dropped day are reused
+// by the new day, so the DB stays the same size, however long we run.
+// A 'readings' table from before we used day tables is renamed to readings_legacy, and kept in the
+// view until all of its rows have expired.
+// This is only used by the thread of its SinkWorker.
+class SQLiteSink : public Sink {
+public:
+	int       RetentionDays = 30; // Drop the tables of days older than this. We assume the DB is on a ramdisk, so we limit its size.
+	Histogram TransactionTime;    // Seconds per call to Write, from BEGIN to COMMIT
+	Histogram CommitTime;         // Seconds spent in COMMIT alone
+
+	SQLiteSink();
+	~SQLiteSink();
+
+	// Remember the DB filename, without opening it. Write opens it when it needs to.
+	void Configure(const std::string& filename) { Filename = filename; }
+
+	bool Open(const std::string& filename);
+	void Close();
+	const char* Name() const override { return "sqlite"; }
+	bool IsOpen() const { return DB != nullptr; }
+
+	// Write a batch of readings, energy buckets, and rollup rows in one transaction. Opens the DB if necessary.
+	bool Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>& energy, const std::vector<RollupRow>& rollups) override;
+
+	// Print the latency histograms, and reset them
+	void PrintStats(FILE* f) override;
+
+private:
+	std::string   Filename;
+	sqlite3*      DB            = nullptr;
+	sqlite3_stmt* InsertReading = nullptr;
+	sqlite3_stmt* UpsertEnergy  = nullptr;
+	sqlite3_stmt* Begin         = nullptr;
+	sqlite3_stmt* Commit        = nullptr;
+	sqlite3_stmt* Rollback      = nullptr;
+	sqlite3_stmt* UpsertRollup[Rollup::NumTiers]        = {};
+	sqlite3_stmt* InsertMissingRollup[Rollup::NumTiers] = {}; // Used by Backfill, which must not overwrite the live rollups
+
+	std::vector<int> Days;               // Days (since the unix epoch) that have a table, oldest first
+	int              InsertDay  = -1;    // The day that InsertReading inserts into
+	bool             HaveLegacy = false; // True if readings_legacy exists
+
+	bool Exec(const char* sql);
+	bool Prepare(const char* sql, sqlite3_stmt** stmt);
+	bool Step(sqlite3_stmt* stmt);
+	bool LoadDays();
+	bool PrepareInsert(int day);
+	bool DropExpired(int today);
+	bool CreateView();
+	bool WriteRollups(const std::vector<RollupRow>& rollups, sqlite3_stmt* const* stmts);
+	bool Backfill();
+
+	static std::string DayTable(int day);
+};
+
+} // namespace homepower
@@ -0,0 +1,48 @@
+#include "stateFile.h"
+#include "crc32.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace homepower {
+
+struct StateFileHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t Size;
+	uint32_t Crc; // CRC of the payload
+};
+
+bool SaveStateFile(const std::string& filename, uint32_t magic, uint32_t version, const void* data, size_t size) {
+	StateFileHeader h;
+	h.Magic   = magic;
+	h.Version = version;
+	h.Size    = (uint32_t) size;
+	h.Crc     = Crc32(data, size);
+
+	string tmp = filename + ".tmp";
+	FILE*  f   = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(data, size, 1, f) == 1;
+	ok      = fclose(f) == 0 && ok;
+	return ok && rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+bool LoadStateFile(const std::string& filename, uint32_t magic, uint32_t version, void* data, size_t size) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+		return false;
+	StateFileHeader h;
+	vector<uint8_t> buf(size);
+	bool            ok = fread(&h, sizeof(h), 1, f) == 1 && h.Magic == magic && h.Version == version && h.Size == size &&
+	          fread(buf.data(), size, 1, f) == 1 && Crc32(buf.data(), size) == h.Crc;
+	fclose(f);
+	if (ok)
+		memcpy(data, buf.data(), size);
+	return ok;
+}
+
+} // namespace homepower
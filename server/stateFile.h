@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+namespace homepower {
+
+// Save and load small blobs of state (such as our energy counters), so that they survive a restart.
+// The blob is prefixed with a header that holds the magic, version, size, and CRC of the payload.
+// Saving writes to a temp file and renames it, so we never leave a half-written file behind.
+// These files are only ever read back by the same machine, so we don't worry about endianness.
+bool SaveStateFile(const std::string& filename, uint32_t magic, uint32_t version, const void* data, size_t size);
+
+// Returns false if the file doesn't exist, or is corrupt, or has a different magic, version, or size
+bool LoadStateFile(const std::string& filename, uint32_t magic, uint32_t version, void* data, size_t size);
+
+} // namespace homepower
@@ -0,0 +1,182 @@
+#include "stepDetector.h"
+#include "stateFile.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace homepower {
+
+static const uint32_t StepDetectorStateMagic   = 0x48504131; // HPA1
+static const uint32_t StepDetectorStateVersion = 1;
+
+StepDetector::StepDetector() {
+	S    = State();
+	Last = Step();
+}
+
+static void MeanAndStdDev(const float* x, int n, float& mean, float& stdDev) {
+	double sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += x[i];
+	mean       = (float) (sum / n);
+	double var = 0;
+	for (int i = 0; i < n; i++)
+		var += (x[i] - mean) * (x[i] - mean);
+	stdDev = (float) sqrt(var / n);
+}
+
+bool StepDetector::Add(double t, float loadW, bool heavy) {
+	S.NSamples++;
+	if (heavy)
+		S.NSamplesHeavy++;
+
+	int w   = max(1, min(Window, (int) MaxWindow));
+	int cap = 2 * w + 1;
+	if (N == cap) {
+		memmove(Samples, Samples + 1, (cap - 1) * sizeof(Samples[0]));
+		memmove(Times, Times + 1, (cap - 1) * sizeof(Times[0]));
+		memmove(Heavy, Heavy + 1, (cap - 1) * sizeof(Heavy[0]));
+		N--;
+	}
+	Samples[N] = loadW;
+	Times[N]   = t;
+	Heavy[N]   = heavy;
+	N++;
+
+	if (Refractory > 0)
+		Refractory--;
+	if (N < cap || Refractory > 0)
+		return false;
+
+	float before, beforeDev, after, afterDev;
+	MeanAndStdDev(Samples, w, before, beforeDev);
+	MeanAndStdDev(Samples + w + 1, w, after, afterDev);
+	float delta = after - before;
+	float size  = fabs(delta);
+	if (size < MinStepW || beforeDev > MaxNoise * size || afterDev > MaxNoise * size)
+		return false;
+
+	Last.Time   = Times[w + 1];
+	Last.DeltaW = delta;
+	Last.Relay  = false;
+	for (int i = 1; i < cap; i++)
+		Last.Relay |= Heavy[i] != Heavy[0];
+
+	if (Last.Relay)
+		Last.Signature = FindSignature(size);
+	else if (delta > 0)
+		Last.Signature = Learn(Last.Time, size, Heavy[w + 1]);
+	else
+		Pair(Last.Time, size);
+
+	// Once the windows have slid past this step, they'd detect it again
+	Refractory = cap;
+	return true;
+}
+
+// Returns the signature whose StepW is closest to stepW, within MatchTolerance, or -1
+int StepDetector::FindSignature(float stepW) const {
+	int   best     = -1;
+	float bestDiff = 0;
+	for (int i = 0; i < MaxSignatures; i++) {
+		const auto& sig  = S.Sigs[i];
+		float       diff = fabs(sig.StepW - stepW);
+		if (sig.NSteps != 0 && diff <= MatchTolerance * sig.StepW && (best == -1 || diff < bestDiff)) {
+			best     = i;
+			bestDiff = diff;
+		}
+	}
+	return best;
+}
+
+// An appliance switched on
+int StepDetector::Learn(double t, float stepW, bool heavy) {
+	int i = FindSignature(stepW);
+	if (i == -1) {
+		// Replace the signature that we've seen the least, and of those, the one that we saw longest ago
+		i = 0;
+		for (int j = 1; j < MaxSignatures; j++) {
+			const auto& a = S.Sigs[j];
+			const auto& b = S.Sigs[i];
+			if (a.NSteps < b.NSteps || (a.NSteps == b.NSteps && a.LastSeenAt < b.LastSeenAt))
+				i = j;
+		}
+		S.Sigs[i]       = ApplianceSignature();
+		S.Sigs[i].StepW = stepW;
+	}
+	auto& sig = S.Sigs[i];
+	sig.NSteps++;
+	// Average over the first 20 steps, and thereafter an exponentially weighted average, so that we can follow drift
+	sig.StepW += (stepW - sig.StepW) / (float) min(sig.NSteps, 20u);
+	if (heavy)
+		sig.NStepsHeavy++;
+	time_t tt = (time_t) t;
+	tm     lt;
+	localtime_r(&tt, &lt);
+	sig.HourCounts[lt.tm_hour]++;
+	sig.LastSeenAt = (int64_t) t;
+
+	if (NOpen == MaxOpen) {
+		memmove(Open, Open + 1, (MaxOpen - 1) * sizeof(Open[0]));
+		NOpen--;
+	}
+	Last.Signature = i;
+	Open[NOpen++]  = Last;
+	return i;
+}
+
+// An appliance switched off. Pair it with the most recent upward step of a similar size.
+void StepDetector::Pair(double t, float stepW) {
+	Last.Signature = FindSignature(stepW);
+	for (int i = NOpen - 1; i >= 0; i--) {
+		float onW = Open[i].DeltaW;
+		if (fabs(onW - stepW) <= MatchTolerance * max(onW, stepW)) {
+			auto& sig = S.Sigs[Open[i].Signature];
+			sig.NCycles++;
+			sig.OnSeconds += ((float) (t - Open[i].Time) - sig.OnSeconds) / (float) min(sig.NCycles, 20u);
+			Last.Signature = Open[i].Signature;
+			memmove(Open + i, Open + i + 1, (NOpen - i - 1) * sizeof(Open[0]));
+			NOpen--;
+			return;
+		}
+	}
+}
+
+bool StepDetector::IsHeavyAppliance(int i) const {
+	if (i < 0 || i >= MaxSignatures || S.NSamples == 0)
+		return false;
+	const auto& sig = S.Sigs[i];
+	// If this was an ordinary appliance, then this is how many times we'd expect to have seen it
+	// switch on while the heavy loads were off the inverter.
+	double lightFraction = 1 - S.NSamplesHeavy / S.NSamples;
+	double expectedLight = sig.NSteps * lightFraction;
+	return expectedLight >= 3 && sig.NSteps - sig.NStepsHeavy <= sig.NSteps / 20;
+}
+
+void StepDetector::Print(FILE* f) const {
+	int order[MaxSignatures];
+	for (int i = 0; i < MaxSignatures; i++)
+		order[i] = i;
+	sort(order, order + MaxSignatures, [&](int a, int b) { return S.Sigs[a].NSteps > S.Sigs[b].NSteps; });
+	for (int i = 0; i < MaxSignatures; i++) {
+		const auto& sig = S.Sigs[order[i]];
+		if (sig.NSteps == 0)
+			break;
+		int hour = (int) (max_element(sig.HourCounts, sig.HourCounts + 24) - sig.HourCounts);
+		fprintf(f, "Appliance %5.0f W: on %u times, off %u times, on for %.0f seconds, mostly at %02d:00%s\n",
+		        sig.StepW, sig.NSteps, sig.NCycles, sig.OnSeconds, hour, IsHeavyAppliance(order[i]) ? ", heavy load circuit" : "");
+	}
+}
+
+bool StepDetector::Save(const std::string& filename) const {
+	return SaveStateFile(filename, StepDetectorStateMagic, StepDetectorStateVersion, &S, sizeof(S));
+}
+
+bool StepDetector::Load(const std::string& filename) {
+	return LoadStateFile(filename, StepDetectorStateMagic, StepDetectorStateVersion, &S, sizeof(S));
+}
+
+} // namespace homepower
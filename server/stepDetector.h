@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace homepower {
+
+// What we've learned about one appliance, from the steps that it makes in LoadW
+struct ApplianceSignature {
+	float    StepW;          // Average size of the step when it switches on (always positive)
+	float    OnSeconds;      // Average time between switching on and switching off. Zero until we've seen it switch off.
+	uint32_t NSteps;         // Number of times that we've seen it switch on
+	uint32_t NCycles;        // Number of times that we've seen it switch on, and then off again
+	uint32_t NStepsHeavy;    // Number of times that it switched on while the heavy loads were on the inverter
+	uint32_t HourCounts[24]; // Number of times that it switched on, in each hour of the local day
+	int64_t  LastSeenAt;     // Time when it last switched on
+};
+
+// StepDetector finds step changes in LoadW, as appliances switch on and off, and learns
+// a small table of recurring appliances from them.
+// We compare the mean of the most recent Window samples with the mean of the Window samples
+// before that, skipping one sample in between, because the inverter often reports a value
+// half way through a transition. If the means differ by at least MinStepW, and both windows
+// are flat compared to the size of the step, then it's a step.
+// An upward step is matched to the signature with the closest StepW, or it creates a new one.
+// A downward step is paired with the most recent unpaired upward step of a similar size,
+// which tells us how long that appliance stays on.
+// Appliances on the heavy load circuit are only visible to the inverter while the heavy loads
+// are on the inverter. Any other appliance will show up regardless of the heavy load state.
+// So if an appliance has had plenty of opportunity to show up while the heavy loads were off
+// the inverter, and never did, then we conclude that it's on the heavy load circuit.
+// Steps that happen while we're switching the heavy loads themselves are not learned from,
+// because AnalyzeRecentReadings takes care of those.
+class StepDetector {
+public:
+	static const int MaxWindow     = 8;
+	static const int MaxSignatures = 16;
+	static const int MaxOpen       = 8;
+
+	struct Step {
+		double Time;      // Time of the first sample after the step
+		float  DeltaW;    // Size of the step. Positive when switching on.
+		int    Signature; // Index of the matching signature, or -1
+		bool   Relay;     // True if the heavy load state changed during the step
+	};
+
+	int   Window         = 3;     // Number of samples on either side of the step. At most MaxWindow.
+	float MinStepW       = 150;   // Ignore steps smaller than this
+	float MaxNoise       = 0.25f; // The standard deviation of each window must be less than this fraction of the step
+	float MatchTolerance = 0.15f; // Steps within this fraction of each other are considered the same appliance
+
+	StepDetector();
+
+	// Add a LoadW sample. heavy is whether the heavy loads are on the inverter.
+	// Returns true if a step was detected, in which case LastStep() describes it.
+	bool Add(double t, float loadW, bool heavy);
+
+	const Step&               LastStep() const { return Last; }
+	const ApplianceSignature& Signature(int i) const { return S.Sigs[i]; }
+	bool                      IsHeavyAppliance(int i) const;
+
+	void Print(FILE* f) const; // Print the table of appliances
+
+	bool Save(const std::string& filename) const;
+	bool Load(const std::string& filename);
+
+private:
+	// This is everything that we persist
+	struct State {
+		ApplianceSignature Sigs[MaxSignatures];
+		double             NSamples;      // Number of samples that we've seen
+		double             NSamplesHeavy; // Number of samples that we've seen while the heavy loads were on the inverter
+	};
+	State S;
+
+	float  Samples[2 * MaxWindow + 1]; // The most recent samples, oldest first
+	double Times[2 * MaxWindow + 1];
+	bool   Heavy[2 * MaxWindow + 1];
+	int    N          = 0; // Number of valid entries in Samples
+	int    Refractory = 0; // Don't detect another step until this many more samples have arrived
+	Step   Open[MaxOpen];  // Upward steps that haven't been paired with a downward step, oldest first
+	int    NOpen = 0;
+	Step   Last;
+
+	int  FindSignature(float stepW) const;
+	int  Learn(double t, float stepW, bool heavy);
+	void Pair(double t, float stepW);
+};
+
+} // namespace homepower
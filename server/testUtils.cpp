@@ -1,15 +1,47 @@
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <functional>
 #include "controllerUtils.h"
 #include "ringbuffer.h"
 #include "monitorUtils.h"
+#include "historyFile.h"
+#include "glitchFilter.h"
+#include "energy.h"
+#include "seriesStore.h"
+#include "reading.h"
+#include "quantileSketch.h"
+#include "profileModel.h"
+#include "rainflow.h"
+#include "stateFile.h"
+#include "histogram.h"
+#include "adaptiveSampler.h"
+#include "gridLossDetector.h"
+#include "stepDetector.h"
+#include "sqliteSink.h"
+#include "dbSchema.h"
+#include "postgresSink.h"
+#include "spool.h"
+#include "rollup.h"
+#include "sink.h"
+#include "csvSink.h"
+#include "archive.h"
+#include "archiveSink.h"
+#include "compressor.h"
+#include "encoders.h"
+#include "fields.h"
+#include "../json.hpp"
+#include <sqlite3.h>
+#include "timeUtils.h"
 
 // For debugging:
-// clang -g -o testUtils server/testUtils.cpp server/monitorUtils.cpp -std=c++11 -lstdc++ && ./testUtils
+// clang -g -o testUtils server/testUtils.cpp server/monitorUtils.cpp server/historyFile.cpp server/energy.cpp server/stateFile.cpp server/profileModel.cpp server/rainflow.cpp server/reading.cpp server/seriesStore.cpp server/adaptiveSampler.cpp server/stepDetector.cpp server/dbSchema.cpp server/sqliteSink.cpp server/postgresSink.cpp server/spool.cpp server/rollup.cpp server/sink.cpp server/csvSink.cpp server/compressor.cpp server/archive.cpp server/archiveSink.cpp server/encoders.cpp server/fastFormat.cpp server/inverter.cpp -std=c++11 $(pkg-config --cflags libpq) -lstdc++ -lsqlite3 -lpq && ./testUtils
 
 // For benchmarking:
-// clang -O2 -o testUtils server/testUtils.cpp server/monitorUtils.cpp -std=c++11 -lstdc++ && ./testUtils
+// clang -O2 -o testUtils server/testUtils.cpp server/monitorUtils.cpp server/historyFile.cpp server/energy.cpp server/stateFile.cpp server/profileModel.cpp server/rainflow.cpp server/reading.cpp server/seriesStore.cpp server/adaptiveSampler.cpp server/stepDetector.cpp server/dbSchema.cpp server/sqliteSink.cpp server/postgresSink.cpp server/spool.cpp server/rollup.cpp server/sink.cpp server/csvSink.cpp server/compressor.cpp server/archive.cpp server/archiveSink.cpp server/encoders.cpp server/fastFormat.cpp server/inverter.cpp -std=c++11 $(pkg-config --cflags libpq) -lstdc++ -lsqlite3 -lpq && ./testUtils
 
 using namespace std;
 using namespace homepower;
@@ -150,6 +182,449 @@ void TestHeavyPowerEstimate() {
 	}
 }
 
+void TestRingBuffer() {
+	// Non power of 2, with wraparound
+	RingBuffer<int> a;
+	a.Initialize(5, true);
+	AssertEqual(4u, a.Capacity());
+	for (int i = 0; i < 6; i++)
+		a.Add(i);
+	AssertEqual(4u, a.Size());
+	AssertEqual(2, a.Peek(0));
+	AssertEqual(5, a.Peek(3));
+
+	// Spans must cover exactly the contents, oldest first
+	auto spans = a.Spans();
+	AssertEqual(4u, spans.First.Size + spans.Second.Size);
+	int expect = 2;
+	for (int v : spans.First)
+		AssertEqual(expect++, v);
+	for (int v : spans.Second)
+		AssertEqual(expect++, v);
+
+	// Range-for
+	expect = 2;
+	for (int v : a)
+		AssertEqual(expect++, v);
+
+	// AddRange bigger than capacity keeps only the newest items
+	int many[7] = {10, 11, 12, 13, 14, 15, 16};
+	a.AddRange(many, 7);
+	AssertEqual(4u, a.Size());
+	AssertEqual(13, a.Peek(0));
+	AssertEqual(16, a.Peek(3));
+
+	// AddRange that evicts some of the existing items
+	a.AddRange(many, 2);
+	AssertEqual(4u, a.Size());
+	AssertEqual(15, a.Peek(0));
+	AssertEqual(11, a.Peek(3));
+
+	// DrainTo moves everything, and leaves us empty
+	RingBuffer<string> src, dst;
+	src.Initialize(8);
+	dst.Initialize(4);
+	dst.Emplace("old");
+	for (int i = 0; i < 5; i++)
+		src.Emplace(to_string(i));
+	AssertEqual(5u, src.DrainTo(dst));
+	AssertEqual(0u, src.Size());
+	AssertEqual(3u, dst.Size());
+	AssertEqual(string("2"), dst.Peek(0));
+	AssertEqual(string("2"), dst.Next());
+
+	vector<string> all;
+	dst.DrainTo(all);
+	AssertEqual((size_t) 2, all.size());
+	AssertEqual(string("3"), all[0]);
+	AssertEqual(0u, dst.Size());
+}
+
+void TestHistoryFile() {
+	const char*                    filename = "/tmp/homepower-test-history.bin";
+	vector<HistoryFile::SeriesDef> defs     = {{"A", 7}, {"B", 3}};
+	remove(filename);
+	{
+		HistoryFile f;
+		assert(f.Open(filename, defs));
+		// Sub-second timestamps survive the round trip
+		for (int i = 0; i < 10; i++) {
+			f.Write(0, {1000 + i * 0.25, (float) i});
+			f.Write(1, {1000 + i * 0.25, (float) -i});
+		}
+	}
+	{
+		// Reattach, and get back the most recent samples, oldest first
+		HistoryFile         f;
+		RingBuffer<History> a, b;
+		a.Initialize(16);
+		b.Initialize(16);
+		assert(f.Open(filename, defs));
+		AssertEqual(7u, f.Restore(0, 0, 2000, a));
+		AssertEqual(3u, f.Restore(1, 0, 2000, b));
+		AssertEqual(1000.75, a.Peek(0).Time);
+		AssertEqual(9.0f, a.Peek(6).Value);
+		AssertEqual(-7.0f, b.Peek(0).Value);
+
+		// Samples that are too old are not restored
+		a.Clear();
+		AssertEqual(2u, f.Restore(0, 1002, 2000, a));
+
+		// Writing continues after the newest sample
+		f.Write(1, {1010, -10});
+		b.Clear();
+		AssertEqual(3u, f.Restore(1, 0, 2000, b));
+		AssertEqual(-8.0f, b.Peek(0).Value);
+		AssertEqual(-10.0f, b.Peek(2).Value);
+	}
+	{
+		// A torn/corrupt slot is dropped, but its neighbours survive
+		FILE* fp = fopen(filename, "r+b");
+		fseek(fp, 16 + 16 * 2 + 4, SEEK_SET);
+		fputc(0x55, fp);
+		fclose(fp);
+		HistoryFile         f;
+		RingBuffer<History> a;
+		a.Initialize(16);
+		assert(f.Open(filename, defs));
+		AssertEqual(6u, f.Restore(0, 0, 2000, a));
+	}
+	{
+		// A different layout wipes the file
+		HistoryFile         f;
+		RingBuffer<History> a;
+		a.Initialize(16);
+		assert(f.Open(filename, {{"A", 8}, {"B", 3}}));
+		AssertEqual(0u, f.Restore(0, 0, 2000, a));
+	}
+	remove(filename);
+}
+
+void TestGlitchFilter() {
+	{
+		// Flat signal with a single zero, and then a double zero
+		GlitchFilter f("BatP", 5, 5);
+		float        in[]  = {85, 85, 85, 85, 85, 0, 85, 85, 85, 85, 0, 0, 85, 84, 84};
+		float        out[] = {85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 84, 84};
+		for (int i = 0; i < 15; i++)
+			AssertEqual(out[i], f.Filter(in[i]));
+		AssertEqual((uint64_t) 3, f.NRejected);
+	}
+	{
+		// A genuine drop gets through on the 3rd sample
+		GlitchFilter f("GridV", 5, 20);
+		float        in[]  = {230, 231, 229, 230, 232, 0, 0, 0, 0};
+		float        out[] = {230, 231, 229, 230, 232, 230, 229, 0, 0};
+		for (int i = 0; i < 9; i++)
+			AssertEqual(out[i], f.Filter(in[i]));
+	}
+	{
+		// A noisy signal is left alone, unless a sample is way out of line
+		GlitchFilter f("LoadW", 5, 0);
+		float        in[]  = {500, 540, 470, 520, 480, 530, 5000, 490};
+		float        out[] = {500, 540, 470, 520, 480, 530, 520, 490};
+		for (int i = 0; i < 8; i++)
+			AssertEqual(out[i], f.Filter(in[i]));
+	}
+}
+
+void TestQuantileSketch() {
+	{
+		// Until we've seen enough samples to fill the markers, the quantiles are exact
+		QuantileSketch q;
+		q.Reset({0.5f, 0.95f, 0.99f});
+		AssertEqual(0.0f, q.Quantile(0.5f));
+		float in[] = {30, 10, 50, 20, 40};
+		for (int i = 0; i < 5; i++)
+			q.Add(in[i]);
+		AssertEqual(30.0f, q.Quantile(0.5f));
+		AssertEqual(10.0f, q.Min());
+		AssertEqual(50.0f, q.Max());
+	}
+	{
+		// Uniform distribution from 0 to 1000
+		QuantileSketch q;
+		q.Reset({0.5f, 0.95f, 0.99f});
+		uint32_t rng = 1;
+		for (int i = 0; i < 100000; i++) {
+			rng = rng * 1664525 + 1013904223;
+			q.Add((float) (rng >> 8) * 1000.0f / (float) (1 << 24));
+		}
+		AssertEqualPrecision(500.0f, q.Quantile(0.5f), 10.0f);
+		AssertEqualPrecision(950.0f, q.Quantile(0.95f), 5.0f);
+		AssertEqualPrecision(990.0f, q.Quantile(0.99f), 2.0f);
+		AssertEqualPrecision(0.0f, q.Min(), 1.0f);
+		AssertEqualPrecision(1000.0f, q.Max(), 1.0f);
+	}
+	{
+		// A household load: mostly a low base load, with an occasional kettle
+		HourlyQuantiles q;
+		q.Reset({0.5f, 0.95f, 0.99f});
+		for (int i = 0; i < 20000; i++)
+			q.Add(7, i % 50 == 0 ? 2500.0f : 300.0f + (float) (i % 100));
+		AssertEqualPrecision(350.0f, q.Quantile(7, 0.5f), 10.0f);
+		AssertEqualPrecision(2500.0f, q.Quantile(7, 0.99f), 1.0f);
+		AssertEqual(0.0f, q.Quantile(8, 0.5f));
+
+		// Round trip through a state file
+		const char* filename = "/tmp/homepower-test-quantiles.bin";
+		HourlyQuantiles restored;
+		assert(SaveStateFile(filename, 1, 1, &q, sizeof(q)));
+		assert(!LoadStateFile(filename, 1, 2, &restored, sizeof(restored)));
+		assert(LoadStateFile(filename, 1, 1, &restored, sizeof(restored)));
+		AssertEqual(q.Quantile(7, 0.95f), restored.Quantile(7, 0.95f));
+		remove(filename);
+	}
+}
+
+void TestProfileModel() {
+	// Local midnight at the start of Monday 2 January 2023
+	tm start       = {};
+	start.tm_year  = 2023 - 1900;
+	start.tm_mon   = 0;
+	start.tm_mday  = 2;
+	start.tm_isdst = -1;
+	time_t monday  = mktime(&start);
+
+	// Two weekdays of 1000W solar from 6am to 6pm, and a constant 500W load
+	ProfileModel m;
+	for (time_t t = monday; t < monday + 2 * 86400 + 600; t += 10) {
+		int   hour      = (int) ((t - monday) % 86400) / 3600;
+		float values[3] = {500, hour >= 6 && hour < 18 ? 1000.0f : 0.0f, 0};
+		m.Add(t, values);
+	}
+	time_t wednesday = monday + 2 * 86400;
+	AssertEqualPrecision(12000.0, m.ExpectedWh(ProfileSeries::PvW, wednesday, 24), 0.1);
+	AssertEqualPrecision(3000.0, m.ExpectedWh(ProfileSeries::PvW, wednesday + 12 * 3600, 3), 0.1);
+	AssertEqualPrecision(12000.0, m.ExpectedWh(ProfileSeries::LoadW, wednesday, 24), 0.1);
+	AssertEqual((uint32_t) 2, m.Slot(false, ProfileSeries::PvW, 12 * 12).NDays);
+	AssertEqual(0.0f, m.Slot(false, ProfileSeries::PvW, 12 * 12).Var);
+
+	// We haven't seen a weekend yet, so from Friday noon, we only expect Friday's solar
+	time_t friday = monday + 4 * 86400;
+	AssertEqualPrecision(6000.0, m.ExpectedWh(ProfileSeries::PvW, friday + 12 * 3600, 24), 0.1);
+
+	const char*  filename = "/tmp/homepower-test-profile.bin";
+	ProfileModel restored;
+	assert(m.Save(filename));
+	assert(restored.Load(filename));
+	AssertEqualPrecision(12000.0, restored.ExpectedWh(ProfileSeries::PvW, wednesday, 24), 0.1);
+	remove(filename);
+}
+
+void TestRainflow() {
+	time_t t0 = EnergyCounter::StartOfDay(time(nullptr)) - 2 * 86400 + 3600;
+	{
+		// 50 -> 90 -> 60 -> 80 -> 20 contains a full cycle of 20% (60..80), and a half cycle of 40% (50..90).
+		// 90..20 remains as residue.
+		RainflowCounter c;
+		float           in[] = {50, 90, 60, 80, 20, 30};
+		for (int i = 0; i < 6; i++) {
+			// Ramp between turning points, to make sure that intermediate samples don't matter
+			float prev = i == 0 ? in[0] : in[i - 1];
+			for (int j = 1; j <= 4; j++)
+				c.Add(t0 + i * 10 + j, prev + (in[i] - prev) * j / 4);
+		}
+		const auto& s = c.Get();
+		AssertEqual(1.0, s.Histogram[2]);
+		AssertEqual(0.5, s.Histogram[4]);
+		AssertEqualPrecision(0.4, s.TotalEFC, 0.0001);
+		AssertEqual(2, s.StackSize);
+	}
+	{
+		// Flicker between adjacent percentages is not counted
+		RainflowCounter c;
+		for (int i = 0; i < 1000; i++)
+			c.Add(t0 + i, 80 + (i & 1));
+		AssertEqual(1, c.Get().StackSize);
+		AssertEqual(0.0, c.Get().TotalEFC);
+	}
+	{
+		// Two days of cycling between 40 and 90 every 2 hours
+		RainflowCounter c;
+		bool            dayEnded = false;
+		for (int i = 0; i < 48 * 3600; i += 60) {
+			float phase = (float) (i % 7200) / 3600.0f;
+			float soc   = phase < 1 ? 90 - 50 * phase : 40 + 50 * (phase - 1);
+			dayEnded |= c.Add(t0 + i, soc);
+		}
+		AssertEqual(true, dayEnded);
+		AssertEqualPrecision(24.0, c.Get().Histogram[5], 1.0);
+		AssertEqualPrecision(6.0, c.Get().PrevDayEFC, 0.6);
+		AssertEqualPrecision(12.0, c.Get().TotalEFC, 1.1);
+
+		const char*     filename = "/tmp/homepower-test-cycles.bin";
+		RainflowCounter restored;
+		assert(c.Save(filename));
+		assert(restored.Load(filename));
+		AssertEqual(c.Get().TotalEFC, restored.Get().TotalEFC);
+		remove(filename);
+	}
+}
+
+void TestEnergyCounter() {
+	EnergyPower p1000;
+	p1000.PvW   = 1000;
+	p1000.LoadW = 500;
+	EnergyPower p0;
+
+	// Start exactly on an hour boundary, and run at 1000W for an hour and a half
+	EnergyCounter        c;
+	vector<EnergyBucket> closed;
+	time_t               t0 = EnergyCounter::StartOfHour(time(nullptr)) - 7200;
+	for (int i = 0; i <= 5400; i += 3)
+		c.Add(t0 + i, p1000, closed);
+	AssertEqual((size_t) 2, closed.size()); // hour, and day-so-far
+	AssertEqual(EnergyPeriod::Hour == closed[0].Period, true);
+	AssertEqualPrecision(1000.0, closed[0].Totals.PvWh, 0.01);
+	AssertEqualPrecision(500.0, closed[0].Totals.LoadWh, 0.01);
+	AssertEqualPrecision(500.0, c.Hour.PvWh, 0.01);
+
+	// Ramp down to zero across the hour boundary. The interval is split at the boundary,
+	// and each half gets its share of the trapezoid.
+	closed.clear();
+	c.MaxGapSeconds = 3600;
+	c.Add(t0 + 7200 + 1800, p0, closed);
+	c.MaxGapSeconds = 60;
+	AssertEqual((size_t) 2, closed.size());
+	AssertEqualPrecision(500.0 + 375.0, closed[0].Totals.PvWh, 0.01);
+	AssertEqualPrecision(125.0, c.Hour.PvWh, 0.01);
+
+	// Gaps longer than MaxGapSeconds are not integrated
+	c.Add(t0 + 7200 + 1900, p1000, closed);
+	AssertEqualPrecision(125.0, c.Hour.PvWh, 0.01);
+
+	// Save and restore
+	const char* filename = "/tmp/homepower-test-energy.bin";
+	assert(c.Save(filename));
+	EnergyCounter restored;
+	closed.clear();
+	assert(restored.Load(filename, t0 + 7200 + 1900, closed));
+	AssertEqual((size_t) 0, closed.size());
+	AssertEqualPrecision(125.0, restored.Hour.PvWh, 0.01);
+	AssertEqualPrecision(c.Day.PvWh, restored.Day.PvWh, 0.01);
+
+	// Restoring after the hour has ended emits the buckets that we missed
+	EnergyCounter late;
+	assert(late.Load(filename, t0 + 3 * 3600 + 10, closed));
+	AssertEqual((size_t) 2, closed.size());
+	AssertEqualPrecision(125.0, closed[0].Totals.PvWh, 0.01);
+	AssertEqualPrecision(0.0, late.Hour.PvWh, 0.01);
+	remove(filename);
+}
+
+void TestSeriesStore() {
+	typedef Reading R;
+	SeriesStore store;
+	int         load    = store.Add("LoadW", 100, [](const R& r) { return r.LoadW; }, {10, 3});
+	int         deficit = store.Add("DeficitW", 5, [](const R& r) { return std::max(0.0f, r.LoadW - r.PvW); }, {60});
+	R           r;
+	r.PvW = 100;
+	for (int i = 0; i < 20; i++) {
+		r.LoadW = (float) i * 10;
+		store.Update(1000 + i, r);
+	}
+	// Windows must agree with the standalone functions
+	for (int w : {3, 10}) {
+		AssertEqualPrecision<float>(Average(1019 - w, store.Get(load).Samples), store.Average(load, w), 0.001f);
+		AssertEqual(Minimum(1019 - w, store.Get(load).Samples), store.Minimum(load, w));
+		AssertEqual(Maximum(1019 - w, store.Get(load).Samples), store.Maximum(load, w));
+	}
+	AssertEqual(4u, store.Agg(load, 3).Count);
+	AssertEqual(190.0f, store.Last(load));
+
+	// The capacity grows to fit the window, and a window that is longer than our history covers whatever we have
+	AssertEqual(68u, store.Get(deficit).Samples.Capacity());
+	AssertEqual(20u, store.Agg(deficit, 60).Count);
+	AssertEqualPrecision<float>(22.5f, store.Average(deficit, 60), 0.001f);
+
+	// Capacities grow to fit the windows at the sample period
+	SeriesStore fast;
+	fast.Period = 0.25;
+	AssertEqual(1335u, fast.Get(fast.Add("LoadW", 100, [](const R& r) { return r.LoadW; }, {300, 3})).Samples.Capacity());
+	AssertEqual(100u, fast.Get(fast.Add("BatV", 100, [](const R& r) { return r.BatV; })).Samples.Capacity());
+
+	// The running aggregates agree with a full scan, with irregular sampling, and after the buffer wraps
+	SeriesStore random;
+	random.Period = 0.01;
+	int    noisy  = random.Add("Noisy", 50, [](const R& r) { return r.LoadW; }, {1, 5, 30});
+	double t      = 1000;
+	srand(3);
+	for (int i = 0; i < 10000; i++) {
+		t += 0.01 + (rand() % 100) * 0.01;
+		r.LoadW = (float) (rand() % 1000);
+		random.Update(t, r);
+		for (int w : {1, 5, 30}) {
+			const auto& samples = random.Get(noisy).Samples;
+			AssertEqualPrecision<float>(Average(t - w, samples), random.Average(noisy, w), 0.01f);
+			AssertEqual(Minimum(t - w, samples), random.Minimum(noisy, w));
+			AssertEqual(Maximum(t - w, samples), random.Maximum(noisy, w));
+		}
+	}
+	assert(random.Get(noisy).Samples.IsFull());
+
+	// Records that arrive faster than Period are averaged into one sample
+	SeriesStore averaged;
+	int         avgLoad = averaged.Add("LoadW", 16, [](const R& r) { return r.LoadW; }, {3});
+	for (int i = 0; i < 40; i++) {
+		r.LoadW = (float) i;
+		AssertEqual(i % 4 == 0, averaged.Update(1000 + i * 0.25, r));
+	}
+	AssertEqual(10u, averaged.Get(avgLoad).Samples.Size());
+	AssertEqual(39.0f, averaged.Last(avgLoad));
+	AssertEqual(4u, averaged.Agg(avgLoad, 3).Count);
+	AssertEqual(28.5f, averaged.Average(avgLoad, 3));
+	AssertEqual(34.5f, averaged.Maximum(avgLoad, 3));
+
+	// Samples that are restored from outside (eg the history file) are picked up by Reload
+	SeriesStore restored;
+	int         restoredLoad = restored.Add("LoadW", 100, [](const R& r) { return r.LoadW; }, {10, 3});
+	for (int i = 0; i < 19; i++)
+		restored.Get(restoredLoad).Samples.Add({1000.0 + i, (float) i * 10});
+	restored.Reload(restoredLoad);
+	AssertEqual(180.0f, restored.Last(restoredLoad));
+	r.LoadW = 190;
+	restored.Update(1019, r);
+	for (int w : {3, 10}) {
+		AssertEqual(store.Average(load, w), restored.Average(restoredLoad, w));
+		AssertEqual(store.Minimum(load, w), restored.Minimum(restoredLoad, w));
+		AssertEqual(store.Maximum(load, w), restored.Maximum(restoredLoad, w));
+		AssertEqual(store.Agg(load, w).Count, restored.Agg(restoredLoad, w).Count);
+	}
+}
+
+void TestComputeDerived() {
+	Reading r;
+	r.LoadW    = 1500;
+	r.PvW      = 1000;
+	r.BatV     = 50;
+	r.BatChA   = 0;
+	r.Unknown2 = 10;
+	r.Heavy    = false;
+
+	// Off grid: the deficit comes from the battery, and the heavy loads are off
+	ComputeDerived(r, 2000, false);
+	AssertEqual(500.0f, r.DeficitW);
+	AssertEqual(500.0f, r.BatDischargeW);
+	AssertEqual(-500.0f, r.BatW);
+	AssertEqual(0.0f, r.GridW);
+	AssertEqual(3500.0f, r.EstimatedTotalLoadW);
+	AssertEqual(1.0f, r.SelfConsumption);
+
+	// On grid, with the battery idle: the deficit and the heavy loads come from the grid
+	r.Unknown2 = 0;
+	ComputeDerived(r, 2000, true);
+	AssertEqual(2000.0f, r.HeavyGridW);
+	AssertEqual(2500.0f, r.GridW);
+	AssertEqualPrecision(1.0f / 3.5f, r.SelfConsumption, 0.0001f);
+
+	// Heavy loads on the inverter are already part of LoadW
+	r.Heavy = true;
+	ComputeDerived(r, 2000, true);
+	AssertEqual(1500.0f, r.EstimatedTotalLoadW);
+	AssertEqual(500.0f, r.GridW);
+}
+
 //static int OptBreaker;
 
 void PrintBenchmark(const char* operation, int n, clock_t start, int optimizeBreaker) {
@@ -174,7 +649,7 @@ void BenchmarkRingBuffer() {
 	RingBuffer<History> buffer;
 	buffer.Initialize(size);
 	for (int i = 0; i < size; i++) {
-		buffer.Add({i + 100, (float) i});
+		buffer.Add({(double) (i + 100), (float) i});
 	}
 
 	auto   start = clock();
@@ -186,9 +661,1454 @@ void BenchmarkRingBuffer() {
 	PrintBenchmark("Average of 1024 samples", n, start, (int) avg);
 }
 
+void TestHistogram() {
+	Histogram h(0.001, 10, 41); // 10 bins per decade
+	for (int i = 1; i <= 1000; i++)
+		h.Add(i * 0.001); // 1ms .. 1000ms
+	assert(h.Count == 1000);
+	AssertEqualPrecision(0.5005, h.Mean(), 1e-9);
+	AssertEqual(0.001, h.Min);
+	AssertEqual(1.0, h.Max);
+	// Bins are 26% wide, so quantiles are only that precise
+	AssertEqualPrecision(0.5, h.Quantile(0.5), 0.5 * 0.26);
+	AssertEqualPrecision(0.9, h.Quantile(0.9), 0.9 * 0.26);
+	AssertEqual(1.0, h.Quantile(1));
+	h.Add(1000);
+	AssertEqual(1000.0, h.Quantile(1));
+	h.Reset();
+	assert(h.Count == 0);
+	AssertEqual(0.0, h.Quantile(0.5));
+}
+
+void TestTripLatch() {
+	TripLatch t;
+	int64_t   latency = 0;
+
+	// A trip latches, and a second one while it's pending doesn't replace it
+	assert(t.Request(100));
+	assert(!t.Request(200));
+	AssertEqual((int64_t) 100, t.Pending());
+
+	// The fast path claims the actuator and switches
+	assert(t.TryClaim());
+	t.Tripped(1, 15000);
+	t.Release();
+
+	// The controller picks up the switch, and acknowledging clears the trip
+	t.Claim();
+	AssertEqual(1, t.TakeTripped(latency));
+	AssertEqual((int64_t) 15000, latency);
+	AssertEqual(-1, t.TakeTripped(latency));
+	t.Release();
+	t.Acknowledge(100);
+	AssertEqual((int64_t) 0, t.Pending());
+
+	// A trip that arrives while the controller holds the actuator stays latched, for the controller to handle
+	t.Claim();
+	assert(t.Request(300));
+	assert(!t.TryClaim());
+	t.Release();
+	AssertEqual((int64_t) 300, t.Pending());
+	t.Claim();
+	AssertEqual(-1, t.TakeTripped(latency));
+	t.Release();
+
+	// Acknowledging a stale trip doesn't clear the pending one
+	t.Acknowledge(100);
+	AssertEqual((int64_t) 300, t.Pending());
+	t.Acknowledge(300);
+	AssertEqual((int64_t) 0, t.Pending());
+
+	// The two threads racing: every trip is either switched by the fast path, or left latched for the controller
+	std::atomic<bool> done(false);
+	int               handled        = 0;
+	auto              controllerLoop = [&]() {
+		while (!done || t.Pending() != 0) {
+			int64_t at = t.Pending();
+			if (at == 0)
+				continue;
+			t.Claim();
+			int64_t lat = 0;
+			t.TakeTripped(lat);
+			t.Release();
+			t.Acknowledge(at);
+			handled++;
+		}
+	};
+	std::thread controller(controllerLoop);
+	int requested = 0;
+	for (int i = 1; i <= 10000; i++) {
+		if (!t.Request(i))
+			continue;
+		requested++;
+		if (t.TryClaim()) {
+			t.Tripped(1, 0);
+			t.Release();
+		}
+	}
+	done = true;
+	controller.join();
+	AssertEqual(requested, handled);
+	AssertEqual((int64_t) 0, t.Pending());
+}
+
+void TestDeadline() {
+	Deadline d;
+	d.Start(0.5, 100);
+	// On time
+	AssertEqual(0, (int) d.Advance(100.1));
+	AssertEqual(100.5, d.Next);
+	// We took 0.3 seconds, but we're not late
+	AssertEqual(0, (int) d.Advance(100.8));
+	AssertEqual(101.0, d.Next);
+	// A slow reading, which started at 101.0 and overran the deadlines at 101.5 and 102.0.
+	// We run again immediately, for the 102.0 deadline, but 101.5 is skipped, instead of
+	// running a burst to catch up.
+	AssertEqual(1, (int) d.Advance(102.2));
+	AssertEqual(102.0, d.Next);
+	AssertEqual(1, (int) d.Missed);
+	AssertEqual(3, (int) d.Ticks);
+	// Late again, but by less than a period, so nothing is skipped
+	AssertEqual(0, (int) d.Advance(102.7));
+	AssertEqual(102.5, d.Next);
+	// Back on schedule
+	AssertEqual(0, (int) d.Advance(102.8));
+	AssertEqual(103.0, d.Next);
+	AssertEqual(1, (int) d.Missed);
+
+	// Zero period
+	d.Start(0, 100);
+	d.Advance(100.3);
+	AssertEqual(100.3, d.Next);
+	AssertEqual(0, (int) d.Missed);
+
+	// Make sure that we really do sleep until the deadline
+	d.Start(0.01);
+	double start = MonotonicTime();
+	for (int i = 0; i < 5; i++)
+		assert(d.Wait());
+	assert(MonotonicTime() - start >= 0.05 - 1e-6);
+}
+
+void TestAdaptiveSampler() {
+	AdaptiveSampler s;
+	s.FastPeriod     = 0.1;
+	s.IdlePeriod     = 1;
+	s.HoldSeconds    = 10;
+	s.DecaySeconds   = 10;
+	s.LoadWPerSecond = 500;
+	double t         = 1000;
+	AssertEqual(1.0, s.Update(t, 500, 230, 0, false));
+	// Flat signals, with a bit of noise
+	for (int i = 0; i < 10; i++) {
+		t += 1;
+		AssertEqual(1.0, s.Update(t, 500 + (i % 2) * 50, 230, 0, false));
+	}
+	assert(s.NBursts == 0);
+	// A kettle switches on
+	t += 1;
+	AssertEqual(0.1, s.Update(t, 2500, 230, 0, false));
+	assert(s.NBursts == 1);
+	// Hold the fast rate, then decay back to idle
+	double activeAt = t;
+	for (int i = 1; i < 100; i++) {
+		t = activeAt + i * 0.1;
+		AssertEqual(0.1, s.Update(t, 2500, 230, 0, false));
+	}
+	t = activeAt + 10.1;
+	AssertEqualPrecision(0.109, s.Update(t, 2500, 230, 0, false), 1e-9);
+	t = activeAt + 15;
+	AssertEqualPrecision(0.55, s.Update(t, 2500, 230, 0, false), 1e-9);
+	t = activeAt + 25;
+	AssertEqual(1.0, s.Update(t, 2500, 230, 0, false));
+	assert(s.NBursts == 1);
+	AssertEqualPrecision(10.1, s.FastSeconds, 1e-6);
+
+	// A heavy load switch, and a grid failure, also count as activity
+	t += 1;
+	AssertEqual(0.1, s.Update(t, 2500, 230, 0, true));
+	t += 30;
+	AssertEqual(1.0, s.Update(t, 2500, 230, 0, true));
+	t += 1;
+	AssertEqual(0.1, s.Update(t, 2500, 0, 0, true));
+	assert(s.NBursts == 3);
+
+	// The same absolute change is not activity if it happens slowly
+	t += 30;
+	s.Update(t, 2500, 0, 0, true);
+	t += 10;
+	AssertEqual(1.0, s.Update(t, 4000, 0, 0, true));
+
+	// At the fast rate, the threshold doesn't shrink with the period, so noise doesn't hold the burst open
+	t += 1;
+	AssertEqual(0.1, s.Update(t, 1000, 0, 0, true));
+	activeAt = t;
+	for (int i = 1; i <= 250; i++) {
+		t = activeAt + i * 0.1;
+		s.Update(t, 1000 + (i % 2) * 100, 0, 0, true);
+	}
+	AssertEqual(1.0, s.Period());
+	assert(s.NBursts == 4);
+
+	// But a step, or a steady climb, is still seen between readings that are 0.1 seconds apart
+	t += 0.1;
+	AssertEqual(1.0, s.Update(t, 1200, 0, 0, true));
+	t += 0.1;
+	AssertEqual(0.1, s.Update(t, 1700, 0, 0, true));
+	for (int i = 1; i <= 250; i++) {
+		t += 0.1;
+		s.Update(t, 1700, 0, 0, true);
+	}
+	AssertEqual(1.0, s.Period());
+	for (int i = 1; i <= 20; i++) {
+		t += 0.1;
+		s.Update(t, 1700 + i * 60, 0, 0, true);
+	}
+	AssertEqual(0.1, s.Period());
+	assert(s.NBursts == 6);
+}
+
+void TestReadingAverage() {
+	ReadingAverage avg;
+	Reading        r;
+	r.Time  = 100;
+	r.LoadW = 1000;
+	r.BatP  = 50;
+	r.Heavy = false;
+	avg.Add(r);
+	r.Time  = 100.5;
+	r.LoadW = 3000;
+	r.BatP  = 51;
+	r.Heavy = true;
+	avg.Add(r);
+	assert(avg.Count() == 2);
+	Reading a = avg.Get();
+	AssertEqual(100.25, a.Time);
+	AssertEqual(2000.0f, a.LoadW);
+	AssertEqual(50.5f, a.BatP);
+	assert(a.Heavy);
+	avg.Reset();
+	r.LoadW = 10;
+	avg.Add(r);
+	AssertEqual(10.0f, avg.Get().LoadW);
+}
+
+void TestGridLossDetector() {
+	GridLossDetector g;
+	double           t = 100;
+	for (int i = 0; i < 5; i++)
+		assert(!g.Add(t++, 230));
+	assert(g.HasGrid() && !g.WantRePoll());
+
+	// A single sample blip
+	assert(!g.Add(t++, 0));
+	assert(g.HasGrid() && g.WantRePoll());
+	assert(!g.Add(t++, 231));
+	assert(g.HasGrid() && !g.WantRePoll());
+	assert(g.NBlips == 1);
+
+	// A genuine loss, confirmed by the immediate re-poll
+	assert(!g.Add(200, 0));
+	assert(g.WantRePoll());
+	assert(g.Add(200.15, 0));
+	assert(!g.HasGrid() && !g.WantRePoll());
+	assert(g.NLosses == 1);
+	AssertEqualPrecision(0.15, g.LossDetectedAt - g.FirstLowAt, 1e-9);
+
+	// The grid comes back, but flickers, so we wait for 3 good readings in a row
+	t = 201;
+	assert(!g.Add(t++, 230));
+	assert(!g.Add(t++, 230));
+	assert(!g.Add(t++, 0));
+	assert(!g.Add(t++, 230));
+	assert(!g.Add(t++, 230));
+	assert(!g.HasGrid());
+	assert(g.Add(t++, 230));
+	assert(g.HasGrid());
+	assert(g.NLosses == 1);
+}
+
+void TestStepDetector() {
+	StepDetector d;
+	double       t     = 1000000;
+	int          steps = 0;
+	auto         feed  = [&](float loadW, bool heavy, int n) {
+		for (int i = 0; i < n; i++) {
+			// A little bit of noise, and a glitch that must not be mistaken for a step
+			float noise = (float) ((i * 7) % 5) * 10 - 20;
+			if (d.Add(t, i == 4 ? 0 : loadW + noise, heavy))
+				steps++;
+			t += 1;
+		}
+	};
+
+	// A 2000W kettle, which switches on for 90 seconds, 5 times. The heavy loads are on the grid.
+	for (int i = 0; i < 5; i++) {
+		feed(400, false, 60);
+		int before = steps;
+		feed(2400, false, 90);
+		assert(steps == before + 1);
+		assert(d.LastStep().DeltaW > 1900 && !d.LastStep().Relay);
+		feed(400, false, 60);
+		assert(steps == before + 2);
+		assert(d.LastStep().DeltaW < -1900);
+	}
+	int kettle = d.LastStep().Signature;
+	assert(kettle != -1);
+	AssertEqualPrecision(2000.0f, d.Signature(kettle).StepW, 30.0f);
+	assert(d.Signature(kettle).NSteps == 5);
+	assert(d.Signature(kettle).NCycles == 5);
+	AssertEqualPrecision(90.0f, d.Signature(kettle).OnSeconds, 1.5f);
+	assert(!d.IsHeavyAppliance(kettle));
+
+	// A 1200W aircon, which we only ever see while the heavy loads are on the inverter
+	for (int i = 0; i < 8; i++) {
+		feed(400, true, 60);
+		feed(1600, true, 60);
+		feed(400, true, 60);
+	}
+	int aircon = d.LastStep().Signature;
+	assert(aircon != -1 && aircon != kettle);
+	assert(d.Signature(aircon).NSteps == 8);
+	assert(d.IsHeavyAppliance(aircon));
+
+	// Switching the heavy loads between grid and inverter is not an appliance
+	feed(400, false, 60);
+	feed(1600, true, 60);
+	assert(d.LastStep().Relay);
+	assert(d.Signature(aircon).NSteps == 8);
+
+	const char* filename = "/tmp/homepower-test-appliances.bin";
+	assert(d.Save(filename));
+	StepDetector d2;
+	assert(d2.Load(filename));
+	assert(d2.Signature(kettle).NSteps == 5);
+	assert(d2.IsHeavyAppliance(aircon));
+	remove(filename);
+}
+
+static int64_t QueryInt(const char* filename, const char* sql) {
+	sqlite3*      db = nullptr;
+	sqlite3_stmt* stmt;
+	sqlite3_open(filename, &db);
+	sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+	int64_t v = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return v;
+}
+
+void TestSQLiteSink() {
+	const char* filename = "/tmp/homepower-test.sqlite";
+	remove(filename);
+	remove("/tmp/homepower-test.sqlite-wal");
+	remove("/tmp/homepower-test.sqlite-shm");
+
+	double              now = (double) time(nullptr);
+	RingBuffer<Reading> records;
+	records.Initialize(16);
+	vector<EnergyBucket> energy;
+
+	char       sql[200];
+	SQLiteSink sink;
+	assert(sink.Open(filename));
+	int nBatches = 100;
+	for (int batch = 0; batch < nBatches; batch++) {
+		records.Clear();
+		for (int i = 0; i < 12; i++) {
+			Reading r;
+			r.Time  = now - 3600 + (batch * 12 + i) * 0.1;
+			r.LoadW = (float) i;
+			r.Heavy = i % 2 == 0;
+			records.Add(r);
+		}
+		energy.clear();
+		if (batch == 0 || batch == 1) {
+			// The same bucket twice, which must be an upsert
+			EnergyBucket e = {};
+			e.Start        = (time_t) now - 3600;
+			e.Period       = EnergyPeriod::Hour;
+			e.Totals.PvWh  = (float) (batch + 1);
+			energy.push_back(e);
+		}
+		assert(sink.Write(records, energy, vector<RollupRow>()));
+	}
+	// Duplicate times are ignored
+	assert(sink.Write(records, energy, vector<RollupRow>()));
+
+	// Readings older than the retention period are not kept
+	records.Clear();
+	Reading old;
+	old.Time = now - 40 * 24 * 3600;
+	records.Add(old);
+	energy.clear();
+	assert(sink.Write(records, energy, vector<RollupRow>()));
+
+	assert(QueryInt(filename, "SELECT COUNT(*) FROM readings") == nBatches * 12);
+	assert(QueryInt(filename, "SELECT SUM(heavy) FROM readings") == nBatches * 6);
+	assert(QueryInt(filename, "SELECT COUNT(*) FROM energy") == 1);
+	assert(QueryInt(filename, "SELECT pvWh FROM energy") == 2);
+	printf("SQLite sink: %.1f microseconds per reading, in batches of 12 (median transaction %.3f ms)\n",
+	       sink.TransactionTime.Mean() / 12 * 1e6, sink.TransactionTime.Quantile(0.5) * 1000);
+
+	// Rollups are backfilled from the readings when we open the DB. All of our readings are
+	// more than a minute old, so every one of their 1 minute buckets is complete.
+	sink.Close();
+	assert(sink.Open(filename));
+	AssertEqual(QueryInt(filename, "SELECT SUM(count) FROM readings_1m"), (int64_t) (nBatches * 12));
+	AssertEqual(QueryInt(filename, "SELECT MAX(loadW_max) FROM readings_1m"), (int64_t) 11);
+	AssertEqual(QueryInt(filename, "SELECT MIN(heavy_min) FROM readings_1m"), (int64_t) 0);
+	int64_t n1m = QueryInt(filename, "SELECT COUNT(*) FROM readings_1m");
+	sink.Close();
+	assert(sink.Open(filename));
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM readings_1m"), n1m);
+
+	// Rollup rows are upserts
+	RollupRow row = {};
+	row.Start     = (int64_t) now - 7200;
+	row.Seconds   = 3600;
+	row.Count     = 7;
+	records.Clear();
+	assert(sink.Write(records, energy, vector<RollupRow>(1, row)));
+	row.Count = 8;
+	assert(sink.Write(records, energy, vector<RollupRow>(1, row)));
+	snprintf(sql, sizeof(sql), "SELECT count FROM readings_1h WHERE time = %lld", (long long) row.Start);
+	AssertEqual(QueryInt(filename, sql), (int64_t) 8);
+
+	// Each day has its own table, and old days are dropped whole
+	int64_t nReadings = QueryInt(filename, "SELECT COUNT(*) FROM readings");
+	sink.RetentionDays = 5;
+	records.Clear();
+	for (int day = 1; day <= 3; day++) {
+		Reading r;
+		r.Time = now - day * 24 * 3600;
+		records.Add(r);
+	}
+	assert(sink.Write(records, energy, vector<RollupRow>()));
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM readings"), nReadings + 3);
+	int64_t nTables = QueryInt(filename, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name LIKE 'readings_2%'");
+	assert(nTables >= 4);
+	sink.RetentionDays = 1;
+	records.Clear();
+	assert(sink.Write(records, vector<EnergyBucket>(1, EnergyBucket()), vector<RollupRow>()));
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name LIKE 'readings_2%'"), nTables - 2);
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM readings"), nReadings + 1);
+	sink.Close();
+	remove(filename);
+	remove("/tmp/homepower-test.sqlite-wal");
+	remove("/tmp/homepower-test.sqlite-shm");
+
+	// A 'readings' table from before we had day tables stays visible through the view, until it expires
+	sqlite3* db = nullptr;
+	sqlite3_open(filename, &db);
+	snprintf(sql, sizeof(sql), "INSERT INTO readings (time, loadW) VALUES (%.0f, 5)", now - 3600);
+	assert(sqlite3_exec(db, CreateReadingsSQL("readings").c_str(), nullptr, nullptr, nullptr) == SQLITE_OK);
+	assert(sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK);
+	sqlite3_close(db);
+	assert(sink.Open(filename));
+	records.Clear();
+	Reading r;
+	r.Time  = now;
+	r.LoadW = 1;
+	records.Add(r);
+	assert(sink.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM readings"), (int64_t) 2);
+	AssertEqual(QueryInt(filename, "SELECT SUM(loadW) FROM readings"), (int64_t) 6);
+	sink.RetentionDays = 0; // Disabled
+	assert(sink.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	AssertEqual(QueryInt(filename, "SELECT COUNT(*) FROM readings_legacy"), (int64_t) 1);
+	sink.Close();
+	remove(filename);
+	remove("/tmp/homepower-test.sqlite-wal");
+	remove("/tmp/homepower-test.sqlite-shm");
+
+	// With compression on, the readings are a subset of the samples that the live rollups saw,
+	// so the backfill on Open must not overwrite the live rollup rows.
+	assert(sink.Open(filename));
+	time_t hour = Rollup::BucketStart((time_t) now - 7200, 3600);
+	records.Clear();
+	for (int i = 0; i < 4; i++) {
+		Reading c;
+		c.Time  = (double) hour + i * 30;
+		c.LoadW = 100;
+		records.Add(c);
+	}
+	RollupRow live       = {};
+	live.Start           = hour;
+	live.Seconds         = 60;
+	live.Count           = 60;
+	live.Columns[5].Avg  = 75;
+	live.Columns[5].Min  = 50;
+	live.Columns[5].Max  = 100;
+	live.Columns[5].Last = 100;
+	assert(sink.Write(records, vector<EnergyBucket>(), vector<RollupRow>(1, live)));
+	sink.Close();
+	assert(sink.Open(filename));
+	snprintf(sql, sizeof(sql), "SELECT count FROM readings_1m WHERE time = %lld", (long long) hour);
+	AssertEqual(QueryInt(filename, sql), (int64_t) 60);
+	snprintf(sql, sizeof(sql), "SELECT loadW_min FROM readings_1m WHERE time = %lld", (long long) hour);
+	AssertEqual(QueryInt(filename, sql), (int64_t) 50);
+	// The buckets that were missing are still filled in
+	snprintf(sql, sizeof(sql), "SELECT count FROM readings_1m WHERE time = %lld", (long long) hour + 60);
+	AssertEqual(QueryInt(filename, sql), (int64_t) 2);
+	snprintf(sql, sizeof(sql), "SELECT count FROM readings_1h WHERE time = %lld", (long long) hour);
+	AssertEqual(QueryInt(filename, sql), (int64_t) 4);
+	sink.Close();
+	remove(filename);
+	remove("/tmp/homepower-test.sqlite-wal");
+	remove("/tmp/homepower-test.sqlite-shm");
+}
+
+// To benchmark against a real DB, set HOMEPOWER_TEST_POSTGRES=host:port:db:user:password.
+// The test writes into the 'readings' and 'energy' tables of that DB, so don't point it at your real one.
+void TestPostgresSink() {
+	RingBuffer<Reading> records;
+	records.Initialize(16);
+	Reading r;
+	r.Time  = 946684800.5; // 2000-01-01 00:00:00.5 UTC
+	r.ACInV = 230;
+	r.Heavy = true;
+	records.Add(r);
+	records.Add(r);
+
+	string buf;
+	PostgresSink::EncodeReadings(records, buf);
+	// 19 byte header, 187 bytes per tuple (23 fields of which 21 are REAL), 2 byte trailer
+	AssertEqual(buf.size(), (size_t) (19 + 2 * 187 + 2));
+	assert(memcmp(buf.data(), "PGCOPY\n\377\r\n\0", 11) == 0);
+	const uint8_t* t = (const uint8_t*) buf.data() + 19;
+	AssertEqual((t[0] << 8) | t[1], 23);
+	AssertEqual((int) t[5], 8);
+	AssertEqual(((int) t[11] << 16) | ((int) t[12] << 8) | t[13], 500000); // microseconds since the Postgres epoch
+	uint32_t acInV = ((uint32_t) t[18] << 24) | ((uint32_t) t[19] << 16) | ((uint32_t) t[20] << 8) | t[21];
+	float    acInVf;
+	memcpy(&acInVf, &acInV, 4);
+	AssertEqual(acInVf, 230.0f);
+	AssertEqual((uint8_t) buf[buf.size() - 2], (uint8_t) 0xff);
+
+	// A failed connection backs off, instead of trying again immediately
+	PostgresSink dead;
+	assert(!dead.Open("127.0.0.1", "1", "power", "pi", ""));
+	AssertEqual(dead.NFailures, (uint64_t) 1);
+	assert(!dead.Open("127.0.0.1", "1", "power", "pi", ""));
+	AssertEqual(dead.NFailures, (uint64_t) 1);
+	assert(!dead.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	AssertEqual(dead.NFailures, (uint64_t) 1);
+
+	const char* spec = getenv("HOMEPOWER_TEST_POSTGRES");
+	if (spec == nullptr)
+		return;
+	vector<string> parts;
+	string         part;
+	for (const char* c = spec;; c++) {
+		if (*c == ':' || *c == 0) {
+			parts.push_back(part);
+			part = "";
+			if (*c == 0)
+				break;
+		} else {
+			part += *c;
+		}
+	}
+	assert(parts.size() == 5);
+	PostgresSink sink;
+	assert(sink.Open(parts[0], parts[1], parts[2], parts[3], parts[4]));
+	double now      = (double) time(nullptr);
+	int    nBatches = 100;
+	for (int batch = 0; batch < nBatches; batch++) {
+		records.Clear();
+		for (int i = 0; i < 12; i++) {
+			r.Time  = now - 3600 + (batch * 12 + i) * 0.1;
+			r.LoadW = (float) i;
+			records.Add(r);
+		}
+		assert(sink.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	}
+	printf("Postgres sink: %.1f microseconds per reading, in batches of 12 (median transaction %.3f ms)\n",
+	       sink.TransactionTime.Mean() / 12 * 1e6, sink.TransactionTime.Quantile(0.5) * 1000);
+}
+
+void TestRollup() {
+	// Two minutes of readings, one per second, starting at the top of an hour
+	time_t t0 = Rollup::BucketStart(1700000000, 3600);
+	float  v[RollupRow::NumColumns];
+	memset(v, 0, sizeof(v));
+	Rollup            rollup;
+	vector<RollupRow> closed;
+	for (int i = 0; i < 120; i++) {
+		v[5] = (float) (i % 60); // loadW
+		v[7] = (float) i;        // batV
+		rollup.Add(t0 + i, v, closed);
+	}
+	AssertEqual(closed.size(), (size_t) 1);
+	AssertEqual(closed[0].Seconds, 60);
+	AssertEqual(closed[0].Start, (int64_t) t0);
+	AssertEqual(closed[0].Count, 60);
+	AssertEqual(closed[0].Columns[5].Avg, 29.5f);
+	AssertEqual(closed[0].Columns[5].Min, 0.0f);
+	AssertEqual(closed[0].Columns[5].Max, 59.0f);
+	AssertEqual(closed[0].Columns[5].Last, 59.0f);
+	AssertEqual(closed[0].Columns[7].Last, 59.0f);
+	AssertEqual(string(Rollup::ColumnName(5)), string("loadW"));
+
+	// The open buckets survive a restart, and the ones that ended while we were down are closed on Load
+	const char* filename = "/tmp/homepower-test-rollups.bin";
+	assert(rollup.Save(filename));
+	Rollup restored;
+	closed.clear();
+	assert(restored.Load(filename, t0 + 3600, closed));
+	AssertEqual(closed.size(), (size_t) 2);
+	AssertEqual(closed[0].Seconds, 60);
+	AssertEqual(closed[0].Start, (int64_t) t0 + 60);
+	AssertEqual(closed[0].Columns[7].Min, 60.0f);
+	AssertEqual(closed[1].Seconds, 3600);
+	AssertEqual(closed[1].Start, (int64_t) t0);
+	AssertEqual(closed[1].Count, 120);
+	AssertEqual(closed[1].Columns[7].Avg, 59.5f);
+	AssertEqual(closed[1].Columns[7].Max, 119.0f);
+	remove(filename);
+}
+
+static void MakeSpoolBatch(int batch, RingBuffer<Reading>& records, vector<EnergyBucket>& energy, vector<RollupRow>& rollups) {
+	records.Clear();
+	energy.clear();
+	rollups.clear();
+	for (int i = 0; i < 10; i++) {
+		Reading r;
+		r.Time  = batch * 10 + i;
+		r.LoadW = (float) i;
+		r.Heavy = i % 2 == 0;
+		records.Add(r);
+	}
+	EnergyBucket e = {};
+	e.Start        = batch;
+	e.Period       = EnergyPeriod::Day;
+	energy.push_back(e);
+	RollupRow row = {};
+	row.Start     = batch * 60;
+	row.Seconds   = 60;
+	rollups.push_back(row);
+}
+
+void TestSpool() {
+	const char* dir = "/tmp/homepower-test-spool";
+	system("rm -rf /tmp/homepower-test-spool");
+
+	RingBuffer<Reading> records;
+	records.Initialize(16);
+	vector<EnergyBucket> energy;
+	vector<RollupRow>    rollups;
+
+	{
+		Spool s;
+		s.SegmentBytes = 4000; // A few batches per segment
+		assert(s.Open(dir));
+		assert(s.IsEmpty());
+		for (int batch = 0; batch < 20; batch++) {
+			MakeSpoolBatch(batch, records, energy, rollups);
+			assert(s.Append(records, energy, rollups));
+		}
+		AssertEqual(s.NAppended, (uint64_t) 200);
+	}
+
+	// The parents of the spool directory are created too
+	{
+		Spool nested;
+		system("rm -rf /tmp/homepower-test-spool-parent");
+		assert(nested.Open("/tmp/homepower-test-spool-parent/a/b"));
+		system("rm -rf /tmp/homepower-test-spool-parent");
+	}
+
+	// A spool in RAM wouldn't survive the reboot that it's meant to protect us from
+	if (access("/dev/shm", F_OK) == 0)
+		assert(IsVolatileDirectory("/dev/shm/homepower-test/spool"));
+
+	// Reopen, as if we had restarted, and replay in batches that don't line up with the appends
+	Spool s;
+	s.SegmentBytes = 4000;
+	assert(s.Open(dir));
+	assert(!s.IsEmpty());
+	RingBuffer<Reading> replay;
+	replay.Initialize(32);
+	vector<EnergyBucket> replayEnergy;
+	vector<RollupRow>    replayRollups;
+	double               nextTime = 0;
+	int                  nEnergy  = 0;
+	int                  nRollups = 0;
+	while (s.Peek(replay, replayEnergy, replayRollups)) {
+		for (uint32_t i = 0; i < replay.Size(); i++) {
+			AssertEqual(replay.Peek(i).Time, nextTime);
+			AssertEqual(replay.Peek(i).LoadW, (float) ((int) nextTime % 10));
+			AssertEqual(replay.Peek(i).Heavy, (int) nextTime % 2 == 0);
+			nextTime++;
+		}
+		for (const auto& e : replayEnergy)
+			AssertEqual(e.Start, (time_t) nEnergy++);
+		for (const auto& row : replayRollups)
+			AssertEqual(row.Start, (int64_t) (nRollups++ * 60));
+		s.Pop();
+	}
+	AssertEqual(nextTime, 200.0);
+	AssertEqual(nEnergy, 20);
+	AssertEqual(nRollups, 20);
+	AssertEqual(s.Bytes(), (uint64_t) 0);
+
+	// A Peek that isn't popped is returned again
+	MakeSpoolBatch(0, records, energy, rollups);
+	assert(s.Append(records, energy, rollups));
+	assert(s.Peek(replay, replayEnergy, replayRollups));
+	assert(s.Peek(replay, replayEnergy, replayRollups));
+	AssertEqual(replay.Size(), (uint32_t) 10);
+	s.Pop();
+	assert(s.IsEmpty());
+
+	// A torn record ends its segment, but the segments after it are still read
+	s.SegmentBytes = 1; // One batch per segment
+	for (int batch = 0; batch < 3; batch++) {
+		MakeSpoolBatch(batch, records, energy, rollups);
+		assert(s.Append(records, energy, rollups));
+	}
+	s.Close();
+	system("truncate -s -450 /tmp/homepower-test-spool/spool-00000002.bin"); // The energy and rollup records, and part of the last reading
+	assert(s.Open(dir));
+	MakeSpoolBatch(3, records, energy, rollups);
+	assert(s.Append(records, energy, rollups));
+	int nRead = 0;
+	while (s.Peek(replay, replayEnergy, replayRollups)) {
+		nRead += replay.Size();
+		s.Pop();
+	}
+	AssertEqual(nRead, 40 - 1);
+	AssertEqual(s.NCorrupt, (uint64_t) 1);
+
+	// The oldest segments are deleted when the spool grows too big
+	s.MaxBytes = 10000;
+	for (int batch = 0; batch < 20; batch++) {
+		MakeSpoolBatch(batch, records, energy, rollups);
+		assert(s.Append(records, energy, rollups));
+	}
+	assert(s.Bytes() <= s.MaxBytes);
+	assert(s.NDropped > 0);
+	nRead = 0;
+	while (s.Peek(replay, replayEnergy, replayRollups)) {
+		nRead += replay.Size();
+		s.Pop();
+	}
+	AssertEqual((uint64_t) nRead + s.NDropped, (uint64_t) 200);
+	s.Close();
+	system("rm -rf /tmp/homepower-test-spool");
+}
+
+// A sink that can be told to fail, or to hang
+class TestSink : public Sink {
+public:
+	std::atomic<bool>     Fail;
+	std::atomic<bool>     Hang;
+	std::atomic<uint32_t> NReadings;
+	std::atomic<uint32_t> NRollups;
+	double                LastTime = 0;
+
+	TestSink() {
+		Fail      = false;
+		Hang      = false;
+		NReadings = 0;
+		NRollups  = 0;
+	}
+	const char* Name() const override { return "test"; }
+	bool        Write(const RingBuffer<Reading>& records, const std::vector<EnergyBucket>&, const std::vector<RollupRow>& rollups) override {
+		while (Hang)
+			usleep(1000);
+		if (Fail)
+			return false;
+		for (uint32_t i = 0; i < records.Size(); i++) {
+			// Like our real sinks, ignore duplicates
+			if (records.Peek(i).Time > LastTime) {
+				LastTime = records.Peek(i).Time;
+				NReadings++;
+			}
+		}
+		NRollups += (uint32_t) rollups.size();
+		return true;
+	}
+	void PrintStats(FILE*) override {}
+};
+
+static bool WaitFor(std::function<bool()> done) {
+	for (int i = 0; i < 1000 && !done(); i++)
+		usleep(10000);
+	return done();
+}
+
+void TestSinkWorker() {
+	system("rm -rf /tmp/homepower-test-sinks");
+	system("mkdir -p /tmp/homepower-test-sinks");
+
+	// A sink that is down, and a sink that hangs, must not hold up a sink that is working
+	TestSink*   good  = new TestSink();
+	TestSink*   down  = new TestSink();
+	TestSink*   hung  = new TestSink();
+	SinkWorker* wGood = new SinkWorker(unique_ptr<Sink>(good));
+	SinkWorker* wDown = new SinkWorker(unique_ptr<Sink>(down));
+	SinkWorker* wHung = new SinkWorker(unique_ptr<Sink>(hung));
+	down->Fail        = true;
+	hung->Hang        = true;
+
+	wDown->SpoolDirectory = "/tmp/homepower-test-sinks/down";
+	for (auto w : {wGood, wDown, wHung}) {
+		w->MinBatchSize = 10;
+		w->RetrySeconds = 0.1;
+		w->Start();
+	}
+	for (auto w : {wGood, wDown, wHung})
+		w->Add(vector<RollupRow>(1, RollupRow()));
+	for (int i = 0; i < 600; i++) {
+		Reading r;
+		r.Time = 1000 + i;
+		for (auto w : {wGood, wDown, wHung})
+			w->Add(r);
+		// Don't add faster than the other sinks can take them
+		if (i % 100 == 99)
+			assert(WaitFor([&]() { return good->NReadings == (uint32_t) i + 1; }));
+	}
+	AssertEqual((uint32_t) good->NRollups, (uint32_t) 1);
+	AssertEqual(wGood->NDropped, (uint64_t) 0);
+
+	// The hung sink's queue overflowed, and it dropped the oldest readings
+	hung->Hang = false;
+	wHung->Stop();
+	assert(wHung->NDropped > 0);
+	AssertEqual(hung->NReadings + wHung->NDropped, (uint64_t) 600);
+
+	// The sink that was down gets everything from its spool when it comes back
+	assert(WaitFor([&]() { return wDown->NFailures != 0; }));
+	down->Fail = false;
+	assert(WaitFor([&]() { return down->NReadings == 600 && down->NRollups == 1; }));
+
+	delete wGood;
+	delete wDown;
+	delete wHung;
+
+	// A batch smaller than BatchSize is written once its oldest reading has waited MaxDelaySeconds
+	good                   = new TestSink();
+	wGood                  = new SinkWorker(unique_ptr<Sink>(good));
+	wGood->MaxDelaySeconds = 0.2;
+	wGood->Start();
+	Reading r;
+	r.Time = 1000;
+	wGood->Add(r);
+	assert(WaitFor([&]() { return good->NReadings == 1; })); // The first reading is written straight away
+	for (int i = 1; i <= 3; i++) {
+		r.Time = 1000 + i;
+		wGood->Add(r);
+	}
+	usleep(20000);
+	AssertEqual((uint32_t) good->NReadings, (uint32_t) 1);
+	assert(WaitFor([&]() { return good->NReadings == 4; }));
+	delete wGood;
+
+	// Batches grow when writes are slow, or when the write budget demands it
+	SinkWorker w(unique_ptr<Sink>(new TestSink()));
+	AssertEqual(w.ChooseBatchSize(0.001, 1), 12);
+	AssertEqual(w.ChooseBatchSize(1, 1), 20);
+	AssertEqual(w.ChooseBatchSize(1, 0.5), 40);
+	AssertEqual(w.ChooseBatchSize(100, 1), 240);
+	w.DailyWriteBudget = 50 * 1024 * 1024;
+	AssertEqual(w.ChooseBatchSize(0.001, 1), 18);
+	w.DailyWriteBudget = 10 * 1024 * 1024; // Less than the readings alone
+	AssertEqual(w.ChooseBatchSize(0.001, 1), 240);
+
+	// CSV files pick up where they left off, and skip readings that they already have
+	const char* csv = "/tmp/homepower-test-sinks/readings.csv";
+	RingBuffer<Reading> records;
+	records.Initialize(16);
+	for (int i = 0; i < 10; i++) {
+		Reading r;
+		r.Time  = 1000 + i;
+		r.LoadW = (float) i;
+		records.Add(r);
+	}
+	{
+		CsvSink s(csv);
+		assert(s.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	}
+	{
+		CsvSink s(csv);
+		assert(s.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	}
+	FILE* f = fopen(csv, "r");
+	char  line[1000];
+	int   nLines = 0;
+	while (fgets(line, sizeof(line), f))
+		nLines++;
+	fclose(f);
+	AssertEqual(nLines, 11);
+
+	// A partial line from a failed write is cut off, instead of having the next line glued onto it
+	f = fopen(csv, "a");
+	fputs("1010,12", f);
+	fclose(f);
+	records.Clear();
+	for (int i = 0; i < 5; i++) {
+		Reading r;
+		r.Time = 1010 + i;
+		records.Add(r);
+	}
+	{
+		CsvSink s(csv);
+		assert(s.Write(records, vector<EnergyBucket>(), vector<RollupRow>()));
+	}
+	f       = fopen(csv, "r");
+	nLines  = 0;
+	int cols = -1;
+	while (fgets(line, sizeof(line), f)) {
+		int n = (int) count(line, line + strlen(line), ',');
+		if (cols == -1)
+			cols = n;
+		AssertEqual(n, cols);
+		nLines++;
+	}
+	fclose(f);
+	AssertEqual(nLines, 16);
+	system("rm -rf /tmp/homepower-test-sinks");
+}
+
+// Reconstruct every reading from the ones that the compressor kept, and return the largest error,
+// relative to MaxError, over all fields
+static double CompressionError(const ReadingCompressor& c, const vector<Reading>& all, const vector<Reading>& kept) {
+	double worst = 0;
+	size_t k     = 0;
+	for (const auto& r : all) {
+		while (k + 1 < kept.size() && kept[k + 1].Time <= r.Time)
+			k++;
+		const Reading& a = kept[k];
+		const Reading& b = kept[min(k + 1, kept.size() - 1)];
+		for (int i = 0; i < ReadingCompressor::NumFields; i++) {
+			double va = ReadingCompressor::FieldValue(a, i);
+			double vb = ReadingCompressor::FieldValue(b, i);
+			double v  = va;
+			if (c.Mode == CompressionModes::SwingingDoor && b.Time > a.Time)
+				v = va + (vb - va) * (r.Time - a.Time) / (b.Time - a.Time);
+			double err = fabs(v - ReadingCompressor::FieldValue(r, i));
+			worst      = max(worst, c.MaxError[i] == 0 ? (err > 1e-6 ? 1e9 : 0) : err / c.MaxError[i]);
+		}
+	}
+	return worst;
+}
+
+void TestCompressor() {
+	// An hour of noisy readings, with a ramp of solar, and a heavy load switching on and off
+	vector<Reading> all;
+	srand(1);
+	for (int i = 0; i < 3600; i++) {
+		Reading r;
+		r.Time                = 1000 + i;
+		r.ACInV               = 230 + (float) (rand() % 3 - 1) * 0.5f;
+		r.ACInHz              = 50;
+		r.ACOutV              = 230;
+		r.ACOutHz             = 50;
+		r.LoadVA              = 300;
+		r.LoadW               = (i / 600) % 2 == 0 ? 250 : 1200;
+		r.LoadP               = 5;
+		r.BusV                = 390;
+		r.BatV                = 52 + i * 0.0002f;
+		r.BatChA              = 10;
+		r.BatP                = 80;
+		r.Temp                = 40;
+		r.PvA                 = 5;
+		r.PvV                 = 300;
+		r.PvW                 = i * 0.5f + (float) (rand() % 5);
+		r.Unknown1            = 0;
+		r.Heavy               = (i / 900) % 2 == 1;
+		r.DeficitW            = 0;
+		r.BatW                = 100;
+		r.GridW               = 0;
+		r.EstimatedTotalLoadW = r.LoadW;
+		r.SelfConsumption     = 1;
+		all.push_back(r);
+	}
+
+	for (auto mode : {CompressionModes::Deadband, CompressionModes::SwingingDoor}) {
+		ReadingCompressor c;
+		c.Mode = mode;
+		vector<Reading> kept;
+		for (const auto& r : all)
+			c.Add(r, kept);
+		c.Flush(kept);
+		AssertEqual(c.NOut, (uint64_t) kept.size());
+		AssertEqual(kept.front().Time, all.front().Time);
+		AssertEqual(kept.back().Time, all.back().Time);
+		assert(CompressionError(c, all, kept) <= 1.0001);
+		// The ramp of solar costs deadband a reading every 40 seconds, but a line follows it for free
+		printf("Compression %s: ratio %.1f\n", ReadingCompressor::ModeName(mode), c.Ratio());
+		assert(c.Ratio() >= (mode == CompressionModes::Deadband ? 5 : 10));
+		for (size_t i = 1; i < kept.size(); i++)
+			assert(kept[i].Time - kept[i - 1].Time <= c.MaxGapSeconds);
+	}
+
+	// Compression off keeps everything
+	ReadingCompressor off;
+	vector<Reading>   kept;
+	for (const auto& r : all)
+		off.Add(r, kept);
+	AssertEqual(kept.size(), all.size());
+
+	assert(off.ParseMaxErrors("loadW=10,batV=0.05"));
+	AssertEqual(off.MaxError[5], 10.0f);
+	assert(!off.ParseMaxErrors("nope=1"));
+}
+
+// Synthetic readings with the shape of real ones: jittered 1 Hz timestamps, noisy power, and slow drifts
+static void MakeArchiveSample(int i, double& t, float* v) {
+	t = 1600000000 + i + (rand() % 20) * 0.001;
+	for (int j = 0; j < ReadingCompressor::NumFields; j++)
+		v[j] = 0;
+	v[0]  = 230 + (float) (rand() % 5) * 0.5f;                 // acInV
+	v[1]  = 50;                                                // acInHz
+	v[2]  = 230;                                               // acOutV
+	v[3]  = 50;                                                // acOutHz
+	v[5]  = 300 + (float) (rand() % 200);                      // loadW
+	v[8]  = 52 + (float) ((i / 60) % 100) * 0.01f;             // batV
+	v[14] = (float) ((i % 86400) / 40) + (float) (rand() % 8); // pvW
+	v[16] = (i / 900) % 2 == 0 ? 1 : 0;                        // heavy
+}
+
+void TestArchive() {
+	system("rm -f /tmp/homepower-test-archive*");
+	string         file = "/tmp/homepower-test-archive.bin";
+	vector<string> cols = ArchiveSink::ColumnNames();
+	int            nc   = (int) cols.size();
+	srand(1);
+
+	// 3.5 hours, with a close and reopen in the middle of a block
+	vector<double>        times;
+	vector<vector<float>> values;
+	for (int i = 0; i < 3 * 3600 + 1800; i++) {
+		double        t;
+		vector<float> v(nc);
+		MakeArchiveSample(i, t, v.data());
+		times.push_back(llround(t * 1000) * 0.001);
+		values.push_back(v);
+	}
+	{
+		ArchiveWriter w;
+		assert(w.Open(file, cols));
+		for (size_t i = 0; i < times.size(); i++) {
+			assert(w.Add(times[i], values[i].data()));
+			if (i % 100 == 99)
+				assert(w.Commit());
+			if (i == 5000) {
+				w.Close();
+				assert(w.Open(file, cols));
+			}
+		}
+		// Old readings, such as a spool replay, are ignored
+		assert(w.Add(times[10], values[10].data()));
+		AssertEqual(w.LastTime(), times.back());
+	}
+	vector<int> all;
+	for (int i = 0; i < nc; i++)
+		all.push_back(i);
+	auto readAll = [&](ArchiveReader& r, double start, double end, vector<double>& t, vector<vector<float>>& v) {
+		t.clear();
+		v.clear();
+		r.Read(start, end, all, [&](const ArchiveSamples& s) {
+			for (size_t i = 0; i < s.Times.size(); i++) {
+				t.push_back(s.Times[i]);
+				vector<float> row;
+				for (int j = 0; j < nc; j++)
+					row.push_back(s.Values[j][i]);
+				v.push_back(row);
+			}
+			return true;
+		});
+	};
+	{
+		// Every sample comes back exactly, from the sealed blocks and the journal of the open block
+		ArchiveReader r;
+		assert(r.Open(file));
+		assert(r.Columns == cols);
+		AssertEqual(r.Blocks.size(), (size_t) 3);
+		assert(r.Tail.Times.size() > 0);
+		vector<double>        t;
+		vector<vector<float>> v;
+		readAll(r, 0, 1e18, t, v);
+		assert(t == times);
+		assert(v == values);
+
+		// A range that starts and ends inside blocks
+		readAll(r, times[1000], times[9000], t, v);
+		AssertEqual(t.size(), (size_t) 8000);
+		AssertEqual(t.front(), times[1000]);
+		AssertEqual(v.back()[5], values[8999][5]);
+
+		// Min and max come from the index
+		AssertEqual(r.Blocks[0].Columns[1].Min, 50.0f);
+		AssertEqual(r.Blocks[0].Columns[16].Max, 1.0f);
+		double bytes = 0;
+		for (const auto& b : r.Blocks)
+			bytes += b.DiskBytes();
+		printf("Archive: %.1f bytes per sample\n", bytes / (3 * 3600));
+		assert(bytes / (3 * 3600) < 20);
+	}
+
+	// Lose the index, and add garbage to the end of the archive, as if we crashed halfway through writing a block
+	remove((file + ".idx").c_str());
+	FILE* f = fopen(file.c_str(), "ab");
+	fwrite("HPB1garbage", 11, 1, f);
+	fclose(f);
+	{
+		ArchiveReader r;
+		assert(r.Open(file));
+		AssertEqual(r.Blocks.size(), (size_t) 3);
+		ArchiveWriter w;
+		assert(w.Open(file, cols));
+		assert(w.Seal());
+	}
+	{
+		ArchiveReader r;
+		assert(r.Open(file));
+		AssertEqual(r.Blocks.size(), (size_t) 4);
+		AssertEqual(r.Tail.Times.size(), (size_t) 0);
+		vector<double>        t;
+		vector<vector<float>> v;
+		readAll(r, 0, 1e18, t, v);
+		assert(t == times);
+	}
+
+	// A corrupt block is skipped, and the others still read
+	f = fopen(file.c_str(), "r+b");
+	{
+		ArchiveReader r;
+		assert(r.Open(file));
+		fseek(f, (long) (r.Blocks[1].Offset + r.Blocks[1].DiskBytes() - 10), SEEK_SET);
+		fputc(0x55, f);
+		fclose(f);
+		vector<double>        t;
+		vector<vector<float>> v;
+		readAll(r, 0, 1e18, t, v);
+		AssertEqual(r.NCorrupt, (uint64_t) 1);
+		AssertEqual(t.size(), times.size() - r.Blocks[1].Header.Count);
+	}
+
+	// The sink writes the columns of 'readings'
+	{
+		ArchiveSink         sink(file + "2");
+		RingBuffer<Reading> records;
+		Reading             r;
+		records.Initialize(16);
+		r.Time  = 1600000000.5;
+		r.LoadW = 345;
+		r.Heavy = true;
+		records.Add(r);
+		assert(sink.Write(records, {}, {}));
+		assert(sink.Write(records, {}, {}));
+		ArchiveReader rd;
+		assert(rd.Open(file + "2"));
+		AssertEqual(rd.Tail.Times.size(), (size_t) 1);
+		AssertEqual(rd.Tail.Values[rd.ColumnIndex("loadW")][0], 345.0f);
+		AssertEqual(rd.Tail.Values[rd.ColumnIndex("heavy")][0], 1.0f);
+	}
+
+	// Decode speed, with a week of 1 Hz readings
+	system("rm -f /tmp/homepower-test-archive*");
+	{
+		ArchiveWriter w;
+		assert(w.Open(file, cols));
+		float v[ReadingCompressor::NumFields];
+		for (int i = 0; i < 7 * 86400; i++) {
+			double t;
+			MakeArchiveSample(i, t, v);
+			w.Add(t, v);
+		}
+		w.Seal();
+	}
+	ArchiveReader r;
+	assert(r.Open(file));
+	double   start = MonotonicTime();
+	uint64_t n     = 0;
+	r.Read(0, 1e18, all, [&](const ArchiveSamples& s) {
+		n += s.Times.size();
+		return true;
+	});
+	double elapsed = MonotonicTime() - start;
+	AssertEqual(n, (uint64_t) 7 * 86400);
+	printf("Archive: decoded a week of 1 Hz readings in %.0f ms (a month in %.0f ms)\n", elapsed * 1000, elapsed * 1000 * 30 / 7);
+	system("rm -f /tmp/homepower-test-archive*");
+}
+
+static const char* TestQPIGSResponses[] = {
+    "(248.4 50.0 230.6 50.0 0414 0339 013 427 27.00 000 085 0030 00.9 254.7 00.00 00003 10010000 00 00 00229 010",
+    "(235.1 50.1 229.7 50.0 0620 0574 011 381 50.90 032 082 0046 09.0 273.8 00.00 00000 00010010 00 00 02431 010",
+    "(000.0 00.0 228.2 50.0 0346 0337 011 429 27.00 000 095 0038 01.3 248.1 00.00 00001 10010000 00 00 00336 010",
+};
+
+// This is how Inverter::Interpret used to parse QPIGS, before the fields were generated from fields.h
+static bool InterpretQPIGSWithSscanf(const std::string& resp, Inverter::Record_QPIGS& out) {
+	double acInV, acInHz, acOutV, acOutHz, loadVA, loadW, loadP, busV, batV, batChA, batP, temp, pvA, pvV, pvW;
+	double n[2] = {0};
+	char   s[4][40];
+	int    tok = sscanf(resp.c_str() + 1, "%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %s %s %s %lf %s",
+	                    &acInV, &acInHz, &acOutV, &acOutHz, &loadVA, &loadW, &loadP, &busV, &batV, &batChA, &batP, &temp, &pvA, &pvV,
+	                    n + 0, n + 1, (char*) (s + 0), (char*) (s + 1), (char*) (s + 2), &pvW, (char*) (s + 3));
+	if (tok != 21)
+		return false;
+	out.Raw      = resp;
+	out.ACInV    = acInV;
+	out.ACInHz   = acInHz;
+	out.ACOutV   = acOutV;
+	out.ACOutHz  = acOutHz;
+	out.LoadVA   = loadVA;
+	out.LoadW    = loadW;
+	out.LoadP    = loadP;
+	out.BusV     = busV;
+	out.BatP     = batP;
+	out.BatChA   = batChA;
+	out.BatV     = batV;
+	out.Temp     = temp;
+	out.PvA      = pvA;
+	out.PvV      = pvV;
+	out.PvW      = pvW;
+	out.Unknown1 = n[0];
+	out.Unknown2 = n[1];
+	out.Unknown3 = s[0];
+	out.Unknown4 = s[1];
+	out.Unknown5 = s[2];
+	out.Unknown6 = s[3];
+	return true;
+}
+
+// This is how CsvSink used to write a line
+static int EncodeReadingCSVWithPrintf(char* buf, size_t size, const Reading& r) {
+	return snprintf(buf, size, "%.3f,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%d,%g,%g,%g,%g,%g\n", r.Time, r.ACInV, r.ACInHz, r.ACOutV,
+	                r.ACOutHz, r.LoadVA, r.LoadW, r.LoadP, r.BusV, r.BatV, r.BatChA, r.BatP, r.Temp, r.PvA, r.PvV, r.PvW, r.Unknown1,
+	                r.Heavy ? 1 : 0, r.DeficitW, r.BatW, r.GridW, r.EstimatedTotalLoadW, r.SelfConsumption);
+}
+
+// This is how query.cpp used to encode a QPIGS record
+static nlohmann::json Record_QPIGS_ToJSON(const Inverter::Record_QPIGS& r) {
+	return nlohmann::json({
+	    {"Raw", r.Raw},
+	    {"ACInV", r.ACInV},
+	    {"ACInHz", r.ACInHz},
+	    {"ACOutV", r.ACOutV},
+	    {"ACOutHz", r.ACOutHz},
+	    {"LoadVA", r.LoadVA},
+	    {"LoadW", r.LoadW},
+	    {"LoadP", r.LoadP},
+	    {"BusV", r.BusV},
+	    {"BatV", r.BatV},
+	    {"BatChA", r.BatChA},
+	    {"BatP", r.BatP},
+	    {"Temp", r.Temp},
+	    {"PvA", r.PvA},
+	    {"PvV", r.PvV},
+	    {"PvW", r.PvW},
+	    {"Unknown1", r.Unknown1},
+	    {"Unknown2", r.Unknown2},
+	    {"Unknown3", r.Unknown3},
+	    {"Unknown4", r.Unknown4},
+	    {"Unknown5", r.Unknown5},
+	    {"Unknown6", r.Unknown6},
+	});
+}
+
+static Reading MakeEncoderReading(int i) {
+	Reading r;
+	r.Time                = 1600000000.123 + i * 1.001;
+	r.ACInV               = 230 + (float) (rand() % 100) * 0.1f;
+	r.ACInHz              = 50;
+	r.ACOutV              = 229.7f;
+	r.ACOutHz             = 50;
+	r.LoadVA              = (float) (rand() % 5000);
+	r.LoadW               = (float) (rand() % 5000);
+	r.LoadP               = 11;
+	r.BusV                = 381;
+	r.BatV                = 50 + (float) (rand() % 1000) * 0.01f;
+	r.BatChA              = (float) (rand() % 100);
+	r.BatP                = 82;
+	r.Temp                = 46;
+	r.PvA                 = (float) (rand() % 200) * 0.1f;
+	r.PvV                 = 273.8f;
+	r.PvW                 = (float) (rand() % 5000);
+	r.Unknown1            = 0;
+	r.Heavy               = i % 2 == 0;
+	r.DeficitW            = (float) (rand() % 1000) - 0.5f;
+	r.BatW                = -(float) (rand() % 3000) * 0.37f;
+	r.GridW               = 0;
+	r.EstimatedTotalLoadW = r.LoadW + 1234.5f;
+	r.SelfConsumption     = (float) (rand() % 1000) / 999.0f;
+	return r;
+}
+
+void TestEncoders() {
+	// Numbers come out exactly as printf writes them
+	srand(1);
+	for (int i = 0; i < 100000; i++) {
+		float  v = (float) (rand() % 2000000 - 1000000) * (i % 2 == 0 ? 0.001f : 1.7f);
+		char   a[64], b[64];
+		char*  end = FormatFloat(a, v);
+		*end       = 0;
+		snprintf(b, sizeof(b), "%g", v);
+		AssertEqual(string(a), string(b));
+		double t = 1600000000 + (rand() % 100000) * 0.0005;
+		end      = FormatFixed3(a, t);
+		*end     = 0;
+		snprintf(b, sizeof(b), "%.3f", t);
+		AssertEqual(string(a), string(b));
+	}
+	for (double v : {0.0, -0.0, 1e-5, 0.0001, 9.9999996, 999999.4, 999999.6, 1e20, -3e-7}) {
+		char  a[64], b[64];
+		char* end = FormatFloat(a, v);
+		*end      = 0;
+		snprintf(b, sizeof(b), "%g", v);
+		AssertEqual(string(a), string(b));
+	}
+
+	// The generated parser agrees with the sscanf that it replaced
+	Inverter inv;
+	for (const char* resp : TestQPIGSResponses) {
+		Inverter::Record_QPIGS a, b;
+		assert(inv.Interpret(resp, a));
+		assert(InterpretQPIGSWithSscanf(resp, b));
+		AssertEqual(a.Raw, b.Raw);
+#define CHECK_NUM(member) AssertEqual(a.member, b.member);
+#define CHECK_TEXT(member) AssertEqual(a.member, b.member);
+		HOMEPOWER_QPIGS_FIELDS(CHECK_NUM, CHECK_TEXT)
+#undef CHECK_NUM
+#undef CHECK_TEXT
+	}
+	Inverter::Record_QPIGS q;
+	assert(inv.Interpret(TestQPIGSResponses[0], q));
+	AssertEqual(q.ACInV, 248.4f);
+	AssertEqual(q.BatV, 27.0f);
+	AssertEqual(q.PvW, 229.0f);
+	AssertEqual(q.Unknown2, 3.0f);
+	AssertEqual(q.Unknown6, string("010"));
+	assert(!inv.Interpret("(248.4 50.0 230.6", q));
+	assert(!inv.Interpret("(248.4 50.0 abc 50.0 0414 0339 013 427 27.00 000 085 0030 00.9 254.7 00.00 00003 10010000 00 00 00229 010", q));
+
+	// JSON has every field, and escapes what it must
+	q.Unknown3 = "a\"b\\c\r";
+	string json;
+	AppendQPIGSJSON(json, q, false);
+	auto parsed = nlohmann::json::parse(json);
+	AssertEqual(parsed["Raw"].get<string>(), q.Raw);
+	AssertEqual(parsed["Unknown3"].get<string>(), q.Unknown3);
+	AssertEqual(parsed["ACInV"].get<float>(), 248.4f);
+	AssertEqual(parsed.size(), (size_t) (1 + NumQPIGSFields));
+	string pretty;
+	AppendQPIGSJSON(pretty, q, true);
+	assert(nlohmann::json::parse(pretty) == parsed);
+
+	// CSV lines are the same as they were with printf, and match the columns of 'readings'
+	char csv[MaxReadingCSVBytes];
+	char old[1000];
+	for (int i = 0; i < 1000; i++) {
+		Reading r   = MakeEncoderReading(i);
+		char*   end = EncodeReadingCSV(csv, r);
+		int     n   = EncodeReadingCSVWithPrintf(old, sizeof(old), r);
+		AssertEqual(string(csv, end - csv), string(old, n));
+	}
+	AssertEqual((int) count(ReadingsColumnNames, ReadingsColumnNames + strlen(ReadingsColumnNames), ','), NumReadingsColumns);
+
+	// dbcreate.sql is written by hand, so check that it agrees with the schema that we generate.
+	// It lives in the repo root, which is the parent of the directory of this file.
+	string dir = __FILE__;
+	dir        = dir.find('/') == string::npos ? "." : dir.substr(0, dir.rfind('/'));
+	FILE* f    = fopen("dbcreate.sql", "rb");
+	if (!f)
+		f = fopen((dir + "/../dbcreate.sql").c_str(), "rb");
+	assert(f);
+	string sql;
+	char   buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+		sql.append(buf, n);
+	fclose(f);
+	assert(sql.find(CreateReadingsSQL("readings")) != string::npos);
+	assert(sql.find(CreateRollupSQL("readings_1m")) != string::npos);
+}
+
+void BenchmarkEncoders() {
+	int             n = 20000;
+	vector<Reading> readings;
+	srand(2);
+	for (int i = 0; i < 1000; i++)
+		readings.push_back(MakeEncoderReading(i));
+
+	char    buf[1000];
+	int     total = 0;
+	clock_t start = clock();
+	for (int i = 0; i < n; i++)
+		total += EncodeReadingCSVWithPrintf(buf, sizeof(buf), readings[i % readings.size()]);
+	clock_t printfTime = clock() - start;
+	PrintBenchmark("CSV line with printf", n, start, total);
+	start = clock();
+	for (int i = 0; i < n; i++)
+		total += (int) (EncodeReadingCSV(buf, readings[i % readings.size()]) - buf);
+	clock_t fastTime = clock() - start;
+	PrintBenchmark("CSV line with EncodeReadingCSV", n, start, total);
+	assert(fastTime < printfTime);
+
+	Inverter               inv;
+	Inverter::Record_QPIGS q;
+	start = clock();
+	for (int i = 0; i < n; i++)
+		total += InterpretQPIGSWithSscanf(TestQPIGSResponses[i % 3], q) ? 1 : 0;
+	clock_t sscanfTime = clock() - start;
+	PrintBenchmark("Parse QPIGS with sscanf", n, start, total);
+	start = clock();
+	for (int i = 0; i < n; i++)
+		total += inv.Interpret(TestQPIGSResponses[i % 3], q) ? 1 : 0;
+	fastTime = clock() - start;
+	PrintBenchmark("Parse QPIGS with Interpret", n, start, total);
+	assert(fastTime < sscanfTime);
+
+	start = clock();
+	for (int i = 0; i < n; i++)
+		total += (int) Record_QPIGS_ToJSON(q).dump().size();
+	clock_t jsonTime = clock() - start;
+	PrintBenchmark("QPIGS JSON with nlohmann::json", n, start, total);
+	string json;
+	start = clock();
+	for (int i = 0; i < n; i++) {
+		json.clear();
+		AppendQPIGSJSON(json, q, false);
+		total += (int) json.size();
+	}
+	fastTime = clock() - start;
+	PrintBenchmark("QPIGS JSON with AppendQPIGSJSON", n, start, total);
+	assert(fastTime < jsonTime);
+}
+
 int main(int argc, char** argv) {
+	TestRingBuffer();
 	TestHeavyPowerEstimate();
+	TestHistoryFile();
+	TestGlitchFilter();
+	TestEnergyCounter();
+	TestQuantileSketch();
+	TestProfileModel();
+	TestRainflow();
+	TestSeriesStore();
+	TestComputeDerived();
+	TestHistogram();
+	TestTripLatch();
+	TestDeadline();
+	TestAdaptiveSampler();
+	TestReadingAverage();
+	TestGridLossDetector();
+	TestStepDetector();
+	TestSQLiteSink();
+	TestPostgresSink();
+	TestRollup();
+	TestSpool();
+	TestSinkWorker();
+	TestCompressor();
+	TestArchive();
+	TestEncoders();
 	BenchmarkRingBuffer();
+	BenchmarkEncoders();
 	TestTimeInterpolate();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+namespace homepower {
+
+// Returns the wall clock time in seconds since the unix epoch, with sub-second precision.
+// All of our timestamps are in these units, so that we can sample faster than once per second.
+inline double WallTime() {
+	timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+// Returns seconds on the monotonic clock, for measuring intervals
+inline double MonotonicTime() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+// Deadline drives a periodic loop from absolute deadlines on the monotonic clock.
+// If you sleep for a fixed time after doing your work, then your real period is the sleep
+// plus the time that the work took, and it drifts. Sleeping until an absolute deadline
+// means that the work time is absorbed by the sleep.
+// If the work overruns by more than a whole period, then the missed deadlines are skipped
+// (and counted), instead of running a burst of back-to-back iterations to catch up.
+class Deadline {
+public:
+	double   Period = 0; // Seconds. Zero means don't sleep at all.
+	double   Next   = 0; // Monotonic time of the next deadline
+	uint64_t Ticks  = 0; // Number of deadlines that we've waited for
+	uint64_t Missed = 0; // Number of deadlines that we skipped, because we were too late for them
+
+	void Start(double period, double now = MonotonicTime()) {
+		Period = period;
+		Next   = now;
+		Ticks  = 0;
+		Missed = 0;
+	}
+
+	// Move on to the next deadline, skipping any that are already more than a period in the past.
+	// Returns the number of deadlines skipped.
+	uint64_t Advance(double now) {
+		Ticks++;
+		if (Period <= 0) {
+			Next = now;
+			return 0;
+		}
+		Next += Period;
+		if (now - Next < Period)
+			return 0;
+		uint64_t skip = (uint64_t) floor((now - Next) / Period);
+		Next += (double) skip * Period;
+		Missed += skip;
+		return skip;
+	}
+
+	// Advance, and sleep until the next deadline.
+	// Returns false if the sleep failed for any reason other than a signal, in which case we
+	// return straight away, so the caller must not loop on us without some other delay.
+	bool Wait() {
+		Advance(MonotonicTime());
+		if (Period <= 0)
+			return true;
+		timespec t;
+		t.tv_sec  = (time_t) Next;
+		t.tv_nsec = (long) ((Next - (double) t.tv_sec) * 1e9);
+		if (t.tv_nsec >= 1000000000) {
+			// Rounding can push us up to a whole second, which clock_nanosleep rejects
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		int err;
+		while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, nullptr)) == EINTR) {
+			// Interrupted by a signal
+		}
+		if (err != 0) {
+			fprintf(stderr, "Deadline: clock_nanosleep failed: %s\n", strerror(err));
+			return false;
+		}
+		return true;
+	}
+};
+
+} // namespace homepower